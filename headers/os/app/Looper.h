@@ -147,6 +147,7 @@ private:
 			BMessage*		ReadMessageFromPort(
 								bigtime_t timeout = B_INFINITE_TIMEOUT);
 	virtual	BMessage*		ConvertToMessage(void* raw, int32 code);
+			void			_DrainPort(bigtime_t timeout);
 	virtual	void			task_looper();
 			void			_QuitRequested(BMessage* msg);
 			bool			AssertLocked() const;
@@ -541,6 +541,14 @@ private:
 									bool isFixedSize, field_header** _result);
 			status_t			_RemoveField(field_header* field);
 
+			field_header*		_AllocateFields(uint32 count);
+			uint8*				_AllocateData(size_t size);
+			status_t			_ReallocateFields(uint32 count);
+			status_t			_ReallocateData(size_t size);
+			void				_UseInlineStorage();
+			void				_FreeFields();
+			void				_FreeData();
+
 			void				_PrintToStream(const char* indent) const;
 
 private:
@@ -584,7 +592,8 @@ private:
 
 			void*				fArchivingPointer;
 
-			uint32				fReserved[8];
+			uint32				fStorageFlags;
+			uint32				fReserved[7];
 
 			enum				{ sNumReplyPorts = 3 };
 	static	port_id				sReplyPorts[sNumReplyPorts];
@@ -349,6 +349,12 @@ extern status_t		on_exit_thread(void (*callback)(void *), void *data);
 
 extern thread_id 	find_thread(const char *name);
 
+/* CPU affinity, bit n of the mask stands for the CPU n */
+extern status_t		get_thread_affinity(thread_id thread, void *mask,
+						size_t maskSize);
+extern status_t		set_thread_affinity(thread_id thread, const void *mask,
+						size_t maskSize);
+
 extern status_t		send_data(thread_id thread, int32 code, const void *buffer,
 						size_t bufferSize);
 extern int32		receive_data(thread_id *sender, void *buffer,
@@ -82,6 +82,18 @@ struct BMessage::message_header {
 } _PACKED;
 
 
+// Counters of the allocations done for building messages, see
+// BPrivate::get_message_allocation_stats().
+struct message_allocation_stats {
+	int64		objects_allocated;
+	int64		object_pool_hits;
+	int64		blocks_allocated;
+	int64		block_pool_hits;
+	int64		heap_allocations;
+	int64		reply_ports_created;
+};
+
+
 class BMessage::Private {
 	public:
 		Private(BMessage *msg)
@@ -243,4 +255,11 @@ class BMessage::Private {
 		BMessage* fMessage;
 };
 
+
+namespace BPrivate {
+
+void get_message_allocation_stats(message_allocation_stats* stats);
+
+}	// namespace BPrivate
+
 #endif	// _MESSAGE_PRIVATE_H_
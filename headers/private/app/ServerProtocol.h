@@ -373,6 +373,9 @@ enum {
 	// Internal messages
 	AS_COLOR_MAP_UPDATED,
 
+	// debugging helper, appended to keep the codes above stable
+	AS_DUMP_FONT_CACHE,
+
 	AS_LAST_CODE
 };
 
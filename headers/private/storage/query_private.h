@@ -7,4 +7,10 @@
 // notifications if the entry stays in the query.
 #define B_ATTR_CHANGE_NOTIFICATION		0x0000F000
 
+#ifdef __VOS__
+// The Linux dirent has no room for the parent, the query results carry
+// its inode in d_off; the device is the one of the query.
+#	define QUERY_ENTRY_DIRECTORY(entry)	((ino_t)(entry)->d_off)
+#endif
+
 #endif
@@ -0,0 +1,47 @@
+/*
+ * Copyright 2019, Dario Casalinuovo. All rights reserved.
+ * Distributed under the terms of the MIT License.
+ */
+#ifndef _SYSTEM_OBJECT_STATS_H
+#define _SYSTEM_OBJECT_STATS_H
+
+
+#include <OS.h>
+
+
+/* Counters kept for every port and semaphore in the shared object tables.
+   They are reset when the object is created and never otherwise, readers
+   are expected to diff two samples. */
+
+typedef struct port_stats {
+	port_id		port;
+	team_id		owner;
+	char		name[B_OS_NAME_LENGTH];
+	int32		capacity;
+	int32		queue_count;
+	int32		queue_high_water;
+	uint64		messages_written;
+	uint64		bytes_written;
+	uint64		messages_read;
+	uint64		bytes_read;
+	bigtime_t	read_blocked_time;
+	bigtime_t	write_blocked_time;
+} port_stats;
+
+
+/* wait times are binned by decade: < 10us, < 100us, ... < 10s, longer */
+#define SEM_WAIT_HISTOGRAM_SIZE	8
+
+typedef struct sem_stats {
+	sem_id		sem;
+	team_id		owner;
+	char		name[B_OS_NAME_LENGTH];
+	int32		count;
+	uint64		acquires;
+	uint64		contentions;
+	bigtime_t	wait_time;
+	uint32		wait_histogram[SEM_WAIT_HISTOGRAM_SIZE];
+} sem_stats;
+
+
+#endif	/* _SYSTEM_OBJECT_STATS_H */
@@ -0,0 +1,25 @@
+/*
+ * Copyright 2019, Dario Casalinuovo. All rights reserved.
+ * Distributed under the terms of the MIT License.
+ */
+#ifndef _SYSTEM_PORT_DEFS_H
+#define _SYSTEM_PORT_DEFS_H
+
+
+#include <SupportDefs.h>
+
+
+/* the records _kern_read_port_batch() fills in, 8 byte aligned */
+struct port_message_record {
+	int32	code;
+	uint32	size;
+	/* followed by size bytes of message data */
+};
+
+#define PORT_MESSAGE_RECORD_ALIGN	8
+#define PORT_MESSAGE_RECORD_SIZE(size) \
+	((sizeof(struct port_message_record) + (size) \
+		+ PORT_MESSAGE_RECORD_ALIGN - 1) & ~(PORT_MESSAGE_RECORD_ALIGN - 1))
+
+
+#endif	/* _SYSTEM_PORT_DEFS_H */
@@ -25,13 +25,16 @@ struct attr_info;
 struct dirent;
 struct fd_info;
 struct fs_info;
+struct index_info;
 struct iovec;
 struct msqid_ds;
 struct net_stat;
 struct pollfd;
+struct port_stats;
 struct rlimit;
 struct scheduling_analysis;
 struct _sem_t;
+struct sem_stats;
 struct sembuf;
 union semun;
 struct sigaction;
@@ -100,6 +103,8 @@ extern status_t		_kern_get_sem_info(sem_id semaphore, struct sem_info *info,
 extern status_t		_kern_get_next_sem_info(team_id team, int32 *cookie,
 						struct sem_info *info, size_t size);
 extern status_t		_kern_set_sem_owner(sem_id id, team_id proc);
+extern status_t		_kern_get_next_sem_stats(int32 *cookie,
+						struct sem_stats *stats);
 
 /* POSIX realtime sem syscalls */
 extern status_t		_kern_realtime_sem_open(const char* name,
@@ -158,6 +163,10 @@ extern status_t		_kern_resume_thread(thread_id thread);
 extern status_t		_kern_rename_thread(thread_id thread, const char *newName);
 extern status_t		_kern_set_thread_priority(thread_id thread,
 						int32 newPriority);
+extern status_t		_kern_get_thread_affinity(thread_id thread, void *mask,
+						size_t maskSize);
+extern status_t		_kern_set_thread_affinity(thread_id thread,
+						const void *mask, size_t maskSize);
 extern status_t		_kern_kill_thread(thread_id thread);
 extern void			_kern_exit_thread(status_t returnValue);
 extern status_t		_kern_cancel_thread(thread_id threadID,
@@ -300,11 +309,16 @@ extern int			_kern_open_attr(int fd, const char* path, const char *name,
 extern status_t		_kern_remove_attr(int fd, const char *name);
 extern status_t		_kern_rename_attr(int fromFile, const char *fromName,
 						int toFile, const char *toName);
+extern ssize_t		_kern_read_attrs(int fd, const char *path,
+						bool traverseLeafLink, void *buffer,
+						size_t bufferSize);
 extern int			_kern_open_index_dir(dev_t device);
 extern status_t		_kern_create_index(dev_t device, const char *name,
 						uint32 type, uint32 flags);
 extern status_t		_kern_read_index_stat(dev_t device, const char *name,
 						struct stat *stat);
+extern status_t		_kern_stat_index(dev_t device, const char *name,
+						struct index_info *info);
 extern status_t		_kern_remove_index(dev_t device, const char *name);
 extern status_t		_kern_getcwd(char *buffer, size_t size);
 extern status_t		_kern_setcwd(int fd, const char *path);
@@ -324,6 +338,9 @@ extern ssize_t		_kern_writev(int fd, off_t pos, const struct iovec *vecs,
 extern status_t		_kern_ioctl(int fd, uint32 cmd, void *data, size_t length);
 extern ssize_t		_kern_read_dir(int fd, struct dirent *buffer,
 						size_t bufferSize, uint32 maxCount);
+extern ssize_t		_kern_read_dir_stat(int fd, struct dirent *buffer,
+						size_t bufferSize, uint32 maxCount,
+						struct stat *stats);
 extern status_t		_kern_rewind_dir(int fd);
 extern status_t		_kern_read_stat(int fd, const char *path, bool traverseLink,
 						struct stat *stat, size_t statSize);
@@ -454,12 +471,16 @@ extern port_id		_kern_find_port(const char *port_name);
 extern status_t		_kern_get_port_info(port_id id, struct port_info *info);
 extern status_t		_kern_get_next_port_info(team_id team, int32 *cookie,
 						struct port_info *info);
+extern status_t		_kern_get_next_port_stats(int32 *cookie,
+						struct port_stats *stats);
 extern ssize_t		_kern_port_buffer_size_etc(port_id port, uint32 flags,
 						bigtime_t timeout);
 extern int32		_kern_port_count(port_id port);
 extern ssize_t		_kern_read_port_etc(port_id port, int32 *msgCode,
 						void *msgBuffer, size_t bufferSize, uint32 flags,
 						bigtime_t timeout);
+extern ssize_t		_kern_read_port_batch(port_id port, void *buffer,
+						size_t bufferSize, uint32 flags, bigtime_t timeout);
 extern status_t		_kern_set_port_owner(port_id port, team_id team);
 extern status_t		_kern_write_port_etc(port_id port, int32 msgCode,
 						const void *msgBuffer, size_t bufferSize, uint32 flags,
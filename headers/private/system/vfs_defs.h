@@ -24,6 +24,25 @@ struct fd_info {
 };
 
 
+/* the records _kern_read_attrs() fills in, 8 byte aligned */
+struct attr_record {
+	uint32	record_size;
+	uint32	type;
+	uint32	size;
+		/* of the data, which follows the name */
+	uint32	name_length;
+		/* including the terminating null */
+	char	name[];
+};
+
+
+static inline const void*
+attr_record_data(const struct attr_record* record)
+{
+	return record->name + record->name_length;
+}
+
+
 /* maximum write size to a pipe/FIFO that is guaranteed not to be interleaved
    with other writes (aka {PIPE_BUF}; must be >= _POSIX_PIPE_BUF) */
 #define VFS_FIFO_ATOMIC_WRITE_SIZE	PIPE_BUF
@@ -0,0 +1,451 @@
+/*
+ * Copyright 2019, Dario Casalinuovo. All rights reserved.
+ * Distributed under the terms of the MIT License.
+ */
+
+/** Shows the busiest ports and semaphores of the system, and the memory
+ *	the teams have in areas, sampled from the kernel object statistics.
+ */
+
+
+#include <OS.h>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <object_stats.h>
+#include <syscalls.h>
+
+
+typedef struct port_sample {
+	port_stats	stats;
+	double		messages_per_second;
+	double		bytes_per_second;
+	double		blocked_percent;
+} port_sample;
+
+typedef struct sem_sample {
+	sem_stats	stats;
+	double		acquires_per_second;
+	double		contentions_per_second;
+	bigtime_t	average_wait;
+} sem_sample;
+
+typedef struct team_areas {
+	team_id		team;
+	char		name[B_OS_NAME_LENGTH];
+	int32		count;
+	size_t		size;
+	size_t		ram_size;
+} team_areas;
+
+typedef struct snapshot {
+	bigtime_t	time;
+	port_stats*	ports;
+	int32		port_count;
+	sem_stats*	sems;
+	int32		sem_count;
+} snapshot;
+
+
+static const char* kUsage =
+	"usage: %s [-1] [-i <seconds>] [-n <count>]\n"
+	"Shows the busiest ports and semaphores, and the area usage of the "
+	"teams.\n"
+	"  -1  print a single sample and exit\n"
+	"  -i  seconds between two samples (default 1)\n"
+	"  -n  number of entries shown per table (default 10)\n";
+
+static const char* kHistogramLabels[SEM_WAIT_HISTOGRAM_SIZE] = {
+	"<10us", "<100us", "<1ms", "<10ms", "<100ms", "<1s", "<10s", ">=10s"
+};
+
+
+static int
+compare_port_ids(const void* _a, const void* _b)
+{
+	port_id a = ((const port_stats*)_a)->port;
+	port_id b = ((const port_stats*)_b)->port;
+	return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+
+static int
+compare_sem_ids(const void* _a, const void* _b)
+{
+	sem_id a = ((const sem_stats*)_a)->sem;
+	sem_id b = ((const sem_stats*)_b)->sem;
+	return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+
+static void*
+grow_array(void* array, int32* capacity, size_t elementSize)
+{
+	int32 newCapacity = *capacity > 0 ? *capacity * 2 : 64;
+	void* newArray = realloc(array, newCapacity * elementSize);
+	if (newArray == NULL) {
+		fprintf(stderr, "ipcstat: out of memory\n");
+		exit(1);
+	}
+
+	*capacity = newCapacity;
+	return newArray;
+}
+
+
+static void
+take_snapshot(snapshot* shot)
+{
+	int32 capacity = 0;
+	int32 cookie = 0;
+	port_stats portStats;
+	sem_stats semStats;
+
+	shot->time = system_time();
+
+	shot->ports = NULL;
+	shot->port_count = 0;
+	while (_kern_get_next_port_stats(&cookie, &portStats) == B_OK) {
+		if (shot->port_count == capacity) {
+			shot->ports = (port_stats*)grow_array(shot->ports, &capacity,
+				sizeof(port_stats));
+		}
+		shot->ports[shot->port_count++] = portStats;
+	}
+
+	capacity = 0;
+	cookie = 0;
+	shot->sems = NULL;
+	shot->sem_count = 0;
+	while (_kern_get_next_sem_stats(&cookie, &semStats) == B_OK) {
+		if (shot->sem_count == capacity) {
+			shot->sems = (sem_stats*)grow_array(shot->sems, &capacity,
+				sizeof(sem_stats));
+		}
+		shot->sems[shot->sem_count++] = semStats;
+	}
+
+	if (shot->ports != NULL) {
+		qsort(shot->ports, shot->port_count, sizeof(port_stats),
+			compare_port_ids);
+	}
+	if (shot->sems != NULL)
+		qsort(shot->sems, shot->sem_count, sizeof(sem_stats), compare_sem_ids);
+}
+
+
+static void
+free_snapshot(snapshot* shot)
+{
+	free(shot->ports);
+	free(shot->sems);
+	shot->ports = NULL;
+	shot->sems = NULL;
+}
+
+
+/*!	Slots can be reused between two samples, so entries are matched by id.
+	The snapshots are sorted by id for this.
+*/
+static const port_stats*
+find_port_stats(const snapshot* shot, port_id id)
+{
+	port_stats key;
+	key.port = id;
+	return (const port_stats*)bsearch(&key, shot->ports, shot->port_count,
+		sizeof(port_stats), compare_port_ids);
+}
+
+
+static const sem_stats*
+find_sem_stats(const snapshot* shot, sem_id id)
+{
+	sem_stats key;
+	key.sem = id;
+	return (const sem_stats*)bsearch(&key, shot->sems, shot->sem_count,
+		sizeof(sem_stats), compare_sem_ids);
+}
+
+
+static int
+compare_ports(const void* _a, const void* _b)
+{
+	const port_sample* a = (const port_sample*)_a;
+	const port_sample* b = (const port_sample*)_b;
+
+	if (a->messages_per_second != b->messages_per_second)
+		return a->messages_per_second < b->messages_per_second ? 1 : -1;
+	return a->stats.queue_high_water < b->stats.queue_high_water ? 1 : -1;
+}
+
+
+static int
+compare_sems(const void* _a, const void* _b)
+{
+	const sem_sample* a = (const sem_sample*)_a;
+	const sem_sample* b = (const sem_sample*)_b;
+
+	if (a->contentions_per_second != b->contentions_per_second)
+		return a->contentions_per_second < b->contentions_per_second ? 1 : -1;
+	if (a->acquires_per_second != b->acquires_per_second)
+		return a->acquires_per_second < b->acquires_per_second ? 1 : -1;
+	return 0;
+}
+
+
+static int
+compare_teams(const void* _a, const void* _b)
+{
+	const team_areas* a = (const team_areas*)_a;
+	const team_areas* b = (const team_areas*)_b;
+
+	if (a->size != b->size)
+		return a->size < b->size ? 1 : -1;
+	return 0;
+}
+
+
+static void
+show_ports(const snapshot* previous, const snapshot* current, int32 count)
+{
+	double seconds = (current->time - previous->time) / 1000000.0;
+	port_sample* samples;
+	int32 i;
+
+	if (current->port_count == 0)
+		return;
+
+	samples = (port_sample*)malloc(current->port_count * sizeof(port_sample));
+	if (samples == NULL)
+		return;
+
+	for (i = 0; i < current->port_count; i++) {
+		const port_stats* now = &current->ports[i];
+		const port_stats* before = find_port_stats(previous, now->port);
+		uint64 messages = now->messages_written;
+		uint64 bytes = now->bytes_written;
+		bigtime_t blocked = now->read_blocked_time + now->write_blocked_time;
+
+		if (before != NULL) {
+			messages -= before->messages_written;
+			bytes -= before->bytes_written;
+			blocked -= before->read_blocked_time + before->write_blocked_time;
+		}
+
+		samples[i].stats = *now;
+		samples[i].messages_per_second = seconds > 0 ? messages / seconds : 0;
+		samples[i].bytes_per_second = seconds > 0 ? bytes / seconds : 0;
+		samples[i].blocked_percent = seconds > 0
+			? blocked / (seconds * 10000.0) : 0;
+	}
+
+	qsort(samples, current->port_count, sizeof(port_sample), compare_ports);
+
+	printf("\n    port  team                             name  queue  high "
+		"     msg/s       KB/s  blocked\n");
+	printf("----------------------------------------------------------------"
+		"-------------------------\n");
+
+	for (i = 0; i < current->port_count && i < count; i++) {
+		printf("%8" B_PRId32 " %5" B_PRId32 " %32s %3" B_PRId32 "/%-3" B_PRId32
+			" %4" B_PRId32 " %10.1f %10.1f %7.1f%%\n",
+			samples[i].stats.port, samples[i].stats.owner,
+			samples[i].stats.name, samples[i].stats.queue_count,
+			samples[i].stats.capacity, samples[i].stats.queue_high_water,
+			samples[i].messages_per_second,
+			samples[i].bytes_per_second / 1024,
+			samples[i].blocked_percent);
+	}
+
+	free(samples);
+}
+
+
+static void
+show_sems(const snapshot* previous, const snapshot* current, int32 count)
+{
+	double seconds = (current->time - previous->time) / 1000000.0;
+	sem_sample* samples;
+	int32 i, j;
+
+	if (current->sem_count == 0)
+		return;
+
+	samples = (sem_sample*)malloc(current->sem_count * sizeof(sem_sample));
+	if (samples == NULL)
+		return;
+
+	for (i = 0; i < current->sem_count; i++) {
+		const sem_stats* now = &current->sems[i];
+		const sem_stats* before = find_sem_stats(previous, now->sem);
+		uint64 acquires = now->acquires;
+		uint64 contentions = now->contentions;
+		bigtime_t waitTime = now->wait_time;
+
+		samples[i].stats = *now;
+		if (before != NULL) {
+			acquires -= before->acquires;
+			contentions -= before->contentions;
+			waitTime -= before->wait_time;
+			for (j = 0; j < SEM_WAIT_HISTOGRAM_SIZE; j++) {
+				samples[i].stats.wait_histogram[j]
+					-= before->wait_histogram[j];
+			}
+		}
+
+		samples[i].acquires_per_second = seconds > 0 ? acquires / seconds : 0;
+		samples[i].contentions_per_second
+			= seconds > 0 ? contentions / seconds : 0;
+		samples[i].average_wait = contentions > 0 ? waitTime / contentions : 0;
+	}
+
+	qsort(samples, current->sem_count, sizeof(sem_sample), compare_sems);
+
+	printf("\n     sem  team                             name  count "
+		"   acquire/s    contend/s  avg wait  waits\n");
+	printf("----------------------------------------------------------------"
+		"-------------------------------\n");
+
+	for (i = 0; i < current->sem_count && i < count; i++) {
+		printf("%8" B_PRId32 " %5" B_PRId32 " %32s %6" B_PRId32
+			" %12.1f %12.1f %7" B_PRIdBIGTIME "us ",
+			samples[i].stats.sem, samples[i].stats.owner,
+			samples[i].stats.name, samples[i].stats.count,
+			samples[i].acquires_per_second,
+			samples[i].contentions_per_second,
+			samples[i].average_wait);
+
+		// the histogram of this interval, empty buckets left out
+		for (j = 0; j < SEM_WAIT_HISTOGRAM_SIZE; j++) {
+			if (samples[i].stats.wait_histogram[j] != 0) {
+				printf(" %s:%" B_PRIu32, kHistogramLabels[j],
+					samples[i].stats.wait_histogram[j]);
+			}
+		}
+		printf("\n");
+	}
+
+	free(samples);
+}
+
+
+static void
+show_areas(int32 count)
+{
+	team_areas* teams = NULL;
+	int32 capacity = 0;
+	int32 teamCount = 0;
+	int32 cookie = 0;
+	team_info teamInfo;
+	int32 i;
+
+	while (get_next_team_info(&cookie, &teamInfo) >= B_OK) {
+		ssize_t areaCookie = 0;
+		area_info areaInfo;
+		team_areas* team;
+
+		if (teamCount == capacity) {
+			teams = (team_areas*)grow_array(teams, &capacity,
+				sizeof(team_areas));
+		}
+
+		team = &teams[teamCount++];
+		team->team = teamInfo.team;
+		strlcpy(team->name, teamInfo.args, sizeof(team->name));
+		team->count = 0;
+		team->size = 0;
+		team->ram_size = 0;
+
+		while (get_next_area_info(teamInfo.team, &areaCookie, &areaInfo)
+				== B_OK) {
+			team->count++;
+			team->size += areaInfo.size;
+			team->ram_size += areaInfo.ram_size;
+		}
+	}
+
+	if (teamCount == 0)
+		return;
+
+	qsort(teams, teamCount, sizeof(team_areas), compare_teams);
+
+	printf("\n    team                             name  areas        size "
+		"     in RAM\n");
+	printf("----------------------------------------------------------------"
+		"-----------\n");
+
+	for (i = 0; i < teamCount && i < count; i++) {
+		printf("%8" B_PRId32 " %32s %6" B_PRId32 " %9" B_PRIuSIZE "KB %9"
+			B_PRIuSIZE "KB\n", teams[i].team, teams[i].name, teams[i].count,
+			teams[i].size / 1024, teams[i].ram_size / 1024);
+	}
+
+	free(teams);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	bool once = false;
+	bigtime_t interval = 1000000;
+	int32 count = 10;
+	bool interactive = isatty(STDOUT_FILENO);
+	snapshot previous;
+	snapshot current;
+	int option;
+
+	while ((option = getopt(argc, argv, "1i:n:h")) != -1) {
+		switch (option) {
+			case '1':
+				once = true;
+				break;
+			case 'i':
+				interval = (bigtime_t)(atof(optarg) * 1000000);
+				break;
+			case 'n':
+				count = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, kUsage, argv[0]);
+				return option == 'h' ? 0 : 1;
+		}
+	}
+
+	if (interval <= 0 || count <= 0) {
+		fprintf(stderr, kUsage, argv[0]);
+		return 1;
+	}
+
+	take_snapshot(&previous);
+
+	while (true) {
+		snooze(interval);
+		take_snapshot(&current);
+
+		if (interactive && !once)
+			printf("\033[H\033[2J");
+
+		printf("ports: %" B_PRId32 ", semaphores: %" B_PRId32 ", interval: "
+			"%.1fs\n", current.port_count, current.sem_count,
+			(current.time - previous.time) / 1000000.0);
+
+		show_ports(&previous, &current, count);
+		show_sems(&previous, &current, count);
+		show_areas(count);
+		fflush(stdout);
+
+		free_snapshot(&previous);
+		previous = current;
+
+		if (once)
+			break;
+	}
+
+	free_snapshot(&previous);
+	return 0;
+}
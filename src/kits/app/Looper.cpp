@@ -32,6 +32,8 @@
 #include <LooperList.h>
 #include <MessagePrivate.h>
 #include <TokenSpace.h>
+#include <port_defs.h>
+#include <syscalls.h>
 
 
 // debugging
@@ -54,6 +56,13 @@ static BLocker sDebugPrintLocker("BLooper debug print");
 #define FILTER_LIST_BLOCK_SIZE	5
 #define DATA_BLOCK_SIZE			5
 
+// Port messages are read in batches into a receive buffer of this size,
+// bigger ones are read one by one.
+#define RECEIVE_BUFFER_SIZE		(64 * 1024)
+// Limits how many messages are read per wakeup, so that a busy port
+// can't keep the looper from dispatching.
+#define MAX_DRAINED_MESSAGES	256
+
 
 using BPrivate::gDefaultTokens;
 using BPrivate::gLooperList;
@@ -104,6 +113,63 @@ struct _loop_data_ {
 };
 
 
+// Every looper has its own thread, so the buffers it reads its port
+// messages into are kept per thread.
+struct receive_buffer {
+	receive_buffer()
+		:
+		data(NULL)
+	{
+	}
+
+	~receive_buffer()
+	{
+		free(data);
+	}
+
+	uint8*	data;
+	BList	messages;
+};
+
+static thread_local receive_buffer sReceiveBuffer;
+
+
+/*!	Returns whether \a message is a B_MOUSE_MOVED message that may be
+	replaced by a later one.
+*/
+static bool
+is_coalescable_mouse_moved(const BMessage* message)
+{
+	if (message->what != B_MOUSE_MOVED || message->IsSourceWaiting())
+		return false;
+
+	// messages for more than one target, see BWindow::_UnpackMessage()
+	return !message->HasInt32("_token");
+}
+
+
+/*!	Two mouse moved messages can only be coalesced if they have the same
+	target, and neither the view under the mouse nor the buttons changed
+	in between, or transit and button changes would get lost.
+*/
+static bool
+can_coalesce(BMessage* older, BMessage* newer)
+{
+	BMessage::Private olderPrivate(older);
+	BMessage::Private newerPrivate(newer);
+
+	if (olderPrivate.UsePreferredTarget() != newerPrivate.UsePreferredTarget())
+		return false;
+	if (!olderPrivate.UsePreferredTarget()
+		&& olderPrivate.GetTarget() != newerPrivate.GetTarget())
+		return false;
+
+	return older->GetInt32("buttons", 0) == newer->GetInt32("buttons", 0)
+		&& older->GetInt32("_view_token", -1)
+			== newer->GetInt32("_view_token", -1);
+}
+
+
 //	#pragma mark -
 
 
@@ -1120,6 +1186,96 @@ BLooper::ConvertToMessage(void* buffer, int32 code)
 }
 
 
+/*!	Reads the messages pending on the port into the message queue, waiting
+	up to \a timeout for the first one.
+	The messages are read in batches into the receive buffer of the looper
+	thread, and each batch is added to the queue under a single lock.
+	Consecutive B_MOUSE_MOVED messages only carrying a new position are
+	coalesced into the last one.
+*/
+void
+BLooper::_DrainPort(bigtime_t timeout)
+{
+	receive_buffer& receiveBuffer = sReceiveBuffer;
+	if (receiveBuffer.data == NULL)
+		receiveBuffer.data = (uint8*)malloc(RECEIVE_BUFFER_SIZE);
+
+	if (receiveBuffer.data == NULL) {
+		// read them one by one then
+		BMessage* message = MessageFromPort(timeout);
+		if (message != NULL)
+			_AddMessagePriv(message);
+		for (int32 count = port_count(fMsgPort); count > 0; count--) {
+			message = MessageFromPort(0);
+			if (message != NULL)
+				_AddMessagePriv(message);
+		}
+		return;
+	}
+
+	BList& messages = receiveBuffer.messages;
+	int32 drained = 0;
+
+	while (drained < MAX_DRAINED_MESSAGES) {
+		ssize_t count;
+		do {
+			count = _kern_read_port_batch(fMsgPort, receiveBuffer.data,
+				RECEIVE_BUFFER_SIZE, B_RELATIVE_TIMEOUT, timeout);
+		} while (count == B_INTERRUPTED);
+
+		if (count == B_BUFFER_OVERFLOW) {
+			// the next message doesn't fit into the receive buffer
+			BMessage* message = ReadMessageFromPort(0);
+			if (message != NULL)
+				messages.AddItem(message);
+			count = 1;
+		} else if (count <= 0)
+			break;
+		else {
+			const uint8* record = receiveBuffer.data;
+			for (ssize_t i = 0; i < count; i++) {
+				const port_message_record* header
+					= (const port_message_record*)record;
+				record += PORT_MESSAGE_RECORD_SIZE(header->size);
+
+				// empty messages are just there to wake us up
+				if (header->size == 0)
+					continue;
+
+				BMessage* message = ConvertToMessage((void*)(header + 1),
+					header->code);
+				if (message == NULL)
+					continue;
+
+				BMessage* last = (BMessage*)messages.LastItem();
+				if (last != NULL && is_coalescable_mouse_moved(last)
+					&& is_coalescable_mouse_moved(message)
+					&& can_coalesce(last, message)) {
+					messages.RemoveItem(messages.CountItems() - 1);
+					delete last;
+				}
+
+				messages.AddItem(message);
+			}
+		}
+
+		drained += count;
+		timeout = 0;
+	}
+
+	if (messages.IsEmpty())
+		return;
+
+	BMessageQueue* queue = fDirectTarget->Queue();
+	queue->Lock();
+	for (int32 i = 0; i < messages.CountItems(); i++)
+		_AddMessagePriv((BMessage*)messages.ItemAtFast(i));
+	queue->Unlock();
+
+	messages.MakeEmpty();
+}
+
+
 void
 BLooper::task_looper()
 {
@@ -1137,24 +1293,10 @@ BLooper::task_looper()
 		PRINT(("LOOPER: outer loop\n"));
 		// TODO: timeout determination algo
 		//	Read from message port (how do we determine what the timeout is?)
-		PRINT(("LOOPER: MessageFromPort()...\n"));
-		BMessage* msg = MessageFromPort();
+		PRINT(("LOOPER: _DrainPort()...\n"));
+		_DrainPort(B_INFINITE_TIMEOUT);
 		PRINT(("LOOPER: ...done\n"));
 
-		//	Did we get a message?
-		if (msg)
-			_AddMessagePriv(msg);
-
-		// Get message count from port
-		int32 msgCount = port_count(fMsgPort);
-		for (int32 i = 0; i < msgCount; ++i) {
-			// Read 'count' messages from port (so we will not block)
-			// We use zero as our timeout since we know there is stuff there
-			msg = MessageFromPort(0);
-			if (msg)
-				_AddMessagePriv(msg);
-		}
-
 		// loop: As long as there are messages in the queue and the port is
 		//		 empty... and we are not terminating, of course.
 		bool dispatchNextMessage = true;
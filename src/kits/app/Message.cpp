@@ -84,6 +84,179 @@ port_id BMessage::sReplyPorts[sNumReplyPorts];
 int32 BMessage::sReplyPortInUse[sNumReplyPorts];
 
 
+// A message header is always allocated as part of a block that also has
+// room for a few fields and some data, so that small messages need no further
+// allocations until they outgrow it.
+#define MESSAGE_BLOCK_SIZE			1024
+#define MESSAGE_INLINE_FIELDS		12
+#define MESSAGE_HEADER_BLOCK_SIZE	((sizeof(BMessage::message_header) + 7) & ~7)
+#define MESSAGE_INLINE_FIELDS_SIZE	\
+	(MESSAGE_INLINE_FIELDS * sizeof(BMessage::field_header))
+#define MESSAGE_INLINE_DATA_SIZE	\
+	(MESSAGE_BLOCK_SIZE - MESSAGE_HEADER_BLOCK_SIZE - MESSAGE_INLINE_FIELDS_SIZE)
+
+enum {
+	MESSAGE_STORAGE_INLINE_FIELDS = 0x01,
+	MESSAGE_STORAGE_INLINE_DATA = 0x02
+};
+
+static const int32 kMaxPooledBlocks = 32;
+static const int32 kMaxPooledObjects = 32;
+
+
+// Message blocks and BMessage objects are recycled per thread, so that
+// building and deleting a message does neither take a lock nor call into
+// the allocator.
+struct message_pool {
+	message_pool()
+		:
+		block_count(0),
+		object_count(0),
+		closed(false)
+	{
+	}
+
+	~message_pool()
+	{
+		while (block_count > 0)
+			free(blocks[--block_count]);
+
+		// the objects come from sMsgCache, which allocates them with new[]
+		while (object_count > 0)
+			operator delete[](objects[--object_count]);
+
+		// messages deleted later on during thread exit bypass the pool
+		closed = true;
+	}
+
+	void*	blocks[kMaxPooledBlocks];
+	int32	block_count;
+	void*	objects[kMaxPooledObjects];
+	int32	object_count;
+	bool	closed;
+};
+
+static thread_local message_pool sMessagePool;
+static message_allocation_stats sAllocationStats;
+
+
+static inline BMessage::field_header*
+inline_fields(BMessage::message_header* header)
+{
+	return (BMessage::field_header*)((uint8*)header
+		+ MESSAGE_HEADER_BLOCK_SIZE);
+}
+
+
+static inline uint8*
+inline_data(BMessage::message_header* header)
+{
+	return (uint8*)header + MESSAGE_HEADER_BLOCK_SIZE
+		+ MESSAGE_INLINE_FIELDS_SIZE;
+}
+
+
+static BMessage::message_header*
+allocate_message_block()
+{
+	message_pool& pool = sMessagePool;
+	if (pool.block_count > 0) {
+		atomic_add64(&sAllocationStats.block_pool_hits, 1);
+		return (BMessage::message_header*)pool.blocks[--pool.block_count];
+	}
+
+	atomic_add64(&sAllocationStats.blocks_allocated, 1);
+	return (BMessage::message_header*)malloc(MESSAGE_BLOCK_SIZE);
+}
+
+
+static void
+free_message_block(BMessage::message_header* header)
+{
+	message_pool& pool = sMessagePool;
+	if (!pool.closed && pool.block_count < kMaxPooledBlocks)
+		pool.blocks[pool.block_count++] = header;
+	else
+		free(header);
+}
+
+
+// Every thread keeps a reply port for synchronous sends, it is only ever used
+// by one send at a time.
+struct thread_reply_port {
+	thread_reply_port()
+		:
+		port(-1),
+		team(-1),
+		in_use(false)
+	{
+	}
+
+	~thread_reply_port()
+	{
+		if (port >= 0 && team == BPrivate::current_team())
+			delete_port(port);
+	}
+
+	port_id	port;
+	team_id	team;
+	bool	in_use;
+};
+
+static thread_local thread_reply_port sThreadReplyPort;
+
+
+/*!	Returns the reply port of the current thread, or an error if it is
+	already in use.
+*/
+static port_id
+acquire_thread_reply_port()
+{
+	thread_reply_port& cache = sThreadReplyPort;
+	if (cache.in_use)
+		return B_BUSY;
+
+	// a forked child inherits the port ID, but not the port
+	team_id team = BPrivate::current_team();
+	if (cache.port < 0 || cache.team != team) {
+		cache.port = create_port(1, "tmp_reply_port");
+		if (cache.port < 0)
+			return cache.port;
+
+		cache.team = team;
+		atomic_add64(&sAllocationStats.reply_ports_created, 1);
+	}
+
+	cache.in_use = true;
+	return cache.port;
+}
+
+
+static void
+release_thread_reply_port(bool recreate)
+{
+	thread_reply_port& cache = sThreadReplyPort;
+	if (recreate) {
+		delete_port(cache.port);
+		cache.port = -1;
+	}
+
+	cache.in_use = false;
+}
+
+
+void
+BPrivate::get_message_allocation_stats(message_allocation_stats* stats)
+{
+	int64* counters = (int64*)&sAllocationStats;
+	int64* values = (int64*)stats;
+	for (size_t i = 0; i < sizeof(message_allocation_stats) / sizeof(int64);
+			i++) {
+		values[i] = atomic_get64(&counters[i]);
+	}
+}
+
+
 template<typename Type>
 static void
 print_to_stream_type(uint8* pointer)
@@ -195,7 +368,7 @@ BMessage::operator=(const BMessage& other)
 
 	_Clear();
 
-	fHeader = (message_header*)malloc(sizeof(message_header));
+	fHeader = allocate_message_block();
 	if (fHeader == NULL)
 		return *this;
 
@@ -214,7 +387,7 @@ BMessage::operator=(const BMessage& other)
 	if (fHeader->field_count > 0) {
 		size_t fieldsSize = fHeader->field_count * sizeof(field_header);
 		if (other.fFields != NULL)
-			fFields = (field_header*)malloc(fieldsSize);
+			fFields = _AllocateFields(fHeader->field_count);
 
 		if (fFields == NULL) {
 			fHeader->field_count = 0;
@@ -225,20 +398,18 @@ BMessage::operator=(const BMessage& other)
 
 	if (fHeader->data_size > 0) {
 		if (other.fData != NULL)
-			fData = (uint8*)malloc(fHeader->data_size);
+			fData = _AllocateData(fHeader->data_size);
 
 		if (fData == NULL) {
 			fHeader->field_count = 0;
-			free(fFields);
-			fFields = NULL;
+			_FreeFields();
 		} else if (other.fData != NULL)
 			memcpy(fData, other.fData, fHeader->data_size);
 	}
 
 	fHeader->what = what = other.what;
 	fHeader->message_area = -1;
-	fFieldsAvailable = 0;
-	fDataAvailable = 0;
+	_UseInlineStorage();
 
 	return *this;
 }
@@ -248,6 +419,13 @@ void*
 BMessage::operator new(size_t size)
 {
 	DEBUG_FUNCTION_ENTER2;
+	message_pool& pool = sMessagePool;
+	if (size == sizeof(BMessage) && pool.object_count > 0) {
+		atomic_add64(&sAllocationStats.object_pool_hits, 1);
+		return pool.objects[--pool.object_count];
+	}
+
+	atomic_add64(&sAllocationStats.objects_allocated, 1);
 	return sMsgCache->Get(size);
 }
 
@@ -256,7 +434,7 @@ void*
 BMessage::operator new(size_t size, const std::nothrow_t& noThrow)
 {
 	DEBUG_FUNCTION_ENTER2;
-	return sMsgCache->Get(size);
+	return operator new(size);
 }
 
 
@@ -274,6 +452,14 @@ BMessage::operator delete(void* pointer, size_t size)
 	DEBUG_FUNCTION_ENTER2;
 	if (pointer == NULL)
 		return;
+
+	message_pool& pool = sMessagePool;
+	if (size == sizeof(BMessage) && !pool.closed
+		&& pool.object_count < kMaxPooledObjects) {
+		pool.objects[pool.object_count++] = pointer;
+		return;
+	}
+
 	sMsgCache->Save(pointer, size);
 }
 
@@ -351,6 +537,7 @@ BMessage::_InitCommon(bool initHeader)
 	fHeader = NULL;
 	fFields = NULL;
 	fData = NULL;
+	fStorageFlags = 0;
 
 	fFieldsAvailable = 0;
 	fDataAvailable = 0;
@@ -372,7 +559,7 @@ BMessage::_InitHeader()
 {
 	DEBUG_FUNCTION_ENTER;
 	if (fHeader == NULL) {
-		fHeader = (message_header*)malloc(sizeof(message_header));
+		fHeader = allocate_message_block();
 		if (fHeader == NULL)
 			return B_NO_MEMORY;
 	}
@@ -393,6 +580,8 @@ BMessage::_InitHeader()
 	// initializing the hash table to -1 because 0 is a valid index
 	fHeader->hash_table_size = MESSAGE_BODY_HASH_TABLE_SIZE;
 	memset(&fHeader->hash_table, 255, sizeof(fHeader->hash_table));
+
+	_UseInlineStorage();
 	return B_OK;
 }
 
@@ -410,16 +599,16 @@ BMessage::_Clear()
 
 		if (fHeader->message_area >= 0)
 			_Dereference();
+	}
+
+	_FreeFields();
+	_FreeData();
 
-		free(fHeader);
+	if (fHeader != NULL) {
+		free_message_block(fHeader);
 		fHeader = NULL;
 	}
 
-	free(fFields);
-	fFields = NULL;
-	free(fData);
-	fData = NULL;
-
 	fArchivingPointer = NULL;
 
 	fFieldsAvailable = 0;
@@ -1187,6 +1376,9 @@ BMessage::_Reference()
 
 	uint8* address = (uint8*)areaInfo.address;
 
+	_FreeFields();
+	_FreeData();
+
 	fFields = (field_header*)address;
 	fData = address + fHeader->field_count * sizeof(field_header);
 	return B_OK;
@@ -1215,32 +1407,22 @@ BMessage::_CopyForWrite()
 	if (fHeader == NULL)
 		return B_NO_INIT;
 
-	field_header* newFields = NULL;
-	uint8* newData = NULL;
-
-	if (fHeader->field_count > 0) {
-		size_t fieldsSize = fHeader->field_count * sizeof(field_header);
-		newFields = (field_header*)malloc(fieldsSize);
-		if (newFields == NULL)
-			return B_NO_MEMORY;
-
-		memcpy(newFields, fFields, fieldsSize);
-	}
+	field_header* newFields = _AllocateFields(fHeader->field_count);
+	if (newFields == NULL)
+		return B_NO_MEMORY;
 
-	if (fHeader->data_size > 0) {
-		newData = (uint8*)malloc(fHeader->data_size);
-		if (newData == NULL) {
+	uint8* newData = _AllocateData(fHeader->data_size);
+	if (newData == NULL) {
+		if ((fStorageFlags & MESSAGE_STORAGE_INLINE_FIELDS) == 0)
 			free(newFields);
-			return B_NO_MEMORY;
-		}
-
-		memcpy(newData, fData, fHeader->data_size);
+		fStorageFlags &= ~MESSAGE_STORAGE_INLINE_FIELDS;
+		return B_NO_MEMORY;
 	}
 
-	_Dereference();
+	memcpy(newFields, fFields, fHeader->field_count * sizeof(field_header));
+	memcpy(newData, fData, fHeader->data_size);
 
-	fFieldsAvailable = 0;
-	fDataAvailable = 0;
+	_Dereference();
 
 	fFields = newFields;
 	fData = newData;
@@ -1309,7 +1491,7 @@ BMessage::Unflatten(BDataIO* stream)
 
 	_Clear();
 
-	fHeader = (message_header*)malloc(sizeof(message_header));
+	fHeader = allocate_message_block();
 	if (fHeader == NULL)
 		return B_NO_MEMORY;
 
@@ -1337,7 +1519,7 @@ BMessage::Unflatten(BDataIO* stream)
 
 		if (fHeader->field_count > 0) {
 			ssize_t fieldsSize = fHeader->field_count * sizeof(field_header);
-			fFields = (field_header*)malloc(fieldsSize);
+			fFields = _AllocateFields(fHeader->field_count);
 			if (fFields == NULL) {
 				_InitHeader();
 				return B_NO_MEMORY;
@@ -1349,10 +1531,9 @@ BMessage::Unflatten(BDataIO* stream)
 		}
 
 		if (fHeader->data_size > 0) {
-			fData = (uint8*)malloc(fHeader->data_size);
+			fData = _AllocateData(fHeader->data_size);
 			if (fData == NULL) {
-				free(fFields);
-				fFields = NULL;
+				_FreeFields();
 				_InitHeader();
 				return B_NO_MEMORY;
 			}
@@ -1361,6 +1542,8 @@ BMessage::Unflatten(BDataIO* stream)
 			if (result != (ssize_t)fHeader->data_size)
 				return result < 0 ? result : B_BAD_VALUE;
 		}
+
+		_UseInlineStorage();
 	}
 
 	return _ValidateMessage();
@@ -1579,11 +1762,9 @@ BMessage::_ResizeData(uint32 offset, int32 change)
 		size = min_c(size, fHeader->data_size + MAX_DATA_PREALLOCATION);
 		size = max_c(size, fHeader->data_size + change);
 
-		uint8* newData = (uint8*)realloc(fData, size);
-		if (size > 0 && newData == NULL)
+		if (_ReallocateData(size) != B_OK)
 			return B_NO_MEMORY;
 
-		fData = newData;
 		if (offset < fHeader->data_size) {
 			memmove(fData + offset + change, fData + offset,
 				fHeader->data_size - offset);
@@ -1603,14 +1784,12 @@ BMessage::_ResizeData(uint32 offset, int32 change)
 		if (fDataAvailable > MAX_DATA_PREALLOCATION) {
 			ssize_t available = MAX_DATA_PREALLOCATION / 2;
 			ssize_t size = fHeader->data_size + available;
-			uint8* newData = (uint8*)realloc(fData, size);
-			if (size > 0 && newData == NULL) {
+			if (_ReallocateData(size) != B_OK) {
 				// this is strange, but not really fatal
 				_UpdateOffsets(offset, change);
 				return B_OK;
 			}
 
-			fData = newData;
 			fDataAvailable = available;
 		}
 	}
@@ -1620,9 +1799,14 @@ BMessage::_ResizeData(uint32 offset, int32 change)
 }
 
 
-uint32
-BMessage::_HashName(const char* name) const
+/*!	Hashes \a name and returns its length including the terminating null in
+	\a _length. The hash must not be changed, as the hash table is part of
+	the flattened message format.
+*/
+static inline uint32
+hash_name(const char* name, size_t& _length)
 {
+	const char* start = name;
 	char ch;
 	uint32 result = 0;
 
@@ -1631,11 +1815,20 @@ BMessage::_HashName(const char* name) const
 		result ^= ch;
 	}
 
+	_length = name - start;
 	result ^= result << 12;
 	return result;
 }
 
 
+uint32
+BMessage::_HashName(const char* name) const
+{
+	size_t length;
+	return hash_name(name, length);
+}
+
+
 status_t
 BMessage::_FindField(const char* name, type_code type, field_header** result)
 	const
@@ -1649,7 +1842,10 @@ BMessage::_FindField(const char* name, type_code type, field_header** result)
 	if (fHeader->field_count == 0 || fFields == NULL || fData == NULL)
 		return B_NAME_NOT_FOUND;
 
-	uint32 hash = _HashName(name) % fHeader->hash_table_size;
+	// the stored names include their terminating null, so names of a
+	// different length can be skipped without comparing them
+	size_t nameLength;
+	uint32 hash = hash_name(name, nameLength) % fHeader->hash_table_size;
 	int32 nextField = fHeader->hash_table[hash];
 
 	while (nextField >= 0) {
@@ -1657,8 +1853,8 @@ BMessage::_FindField(const char* name, type_code type, field_header** result)
 		if ((field->flags & FIELD_FLAG_VALID) == 0)
 			break;
 
-		if (strncmp((const char*)(fData + field->offset), name,
-			field->name_length) == 0) {
+		if (field->name_length == nameLength
+			&& memcmp(fData + field->offset, name, nameLength) == 0) {
 			if (type != B_ANY_TYPE && field->type != type)
 				return B_BAD_TYPE;
 
@@ -1684,16 +1880,14 @@ BMessage::_AddField(const char* name, type_code type, bool isFixedSize,
 		uint32 count = fHeader->field_count * 2 + 1;
 		count = min_c(count, fHeader->field_count + MAX_FIELD_PREALLOCATION);
 
-		field_header* newFields = (field_header*)realloc(fFields,
-			count * sizeof(field_header));
-		if (count > 0 && newFields == NULL)
+		if (_ReallocateFields(count) != B_OK)
 			return B_NO_MEMORY;
 
-		fFields = newFields;
 		fFieldsAvailable = count - fHeader->field_count;
 	}
 
-	uint32 hash = _HashName(name) % fHeader->hash_table_size;
+	size_t nameLength;
+	uint32 hash = hash_name(name, nameLength) % fHeader->hash_table_size;
 	int32* nextField = &fHeader->hash_table[hash];
 	while (*nextField >= 0)
 		nextField = &fFields[*nextField].next_field;
@@ -1705,7 +1899,7 @@ BMessage::_AddField(const char* name, type_code type, bool isFixedSize,
 	field->data_size = 0;
 	field->next_field = -1;
 	field->offset = fHeader->data_size;
-	field->name_length = strlen(name) + 1;
+	field->name_length = nameLength;
 	status_t status = _ResizeData(field->offset, field->name_length);
 	if (status != B_OK)
 		return status;
@@ -1758,14 +1952,11 @@ BMessage::_RemoveField(field_header* field)
 
 	if (fFieldsAvailable > MAX_FIELD_PREALLOCATION) {
 		ssize_t available = MAX_FIELD_PREALLOCATION / 2;
-		size = (fHeader->field_count + available) * sizeof(field_header);
-		field_header* newFields = (field_header*)realloc(fFields, size);
-		if (size > 0 && newFields == NULL) {
+		if (_ReallocateFields(fHeader->field_count + available) != B_OK) {
 			// this is strange, but not really fatal
 			return B_OK;
 		}
 
-		fFields = newFields;
 		fFieldsAvailable = available;
 	}
 
@@ -1773,6 +1964,144 @@ BMessage::_RemoveField(field_header* field)
 }
 
 
+/*!	Returns storage for \a count fields, inside the message block if they fit
+	there, and updates fFieldsAvailable accordingly.
+*/
+BMessage::field_header*
+BMessage::_AllocateFields(uint32 count)
+{
+	if (count <= MESSAGE_INLINE_FIELDS) {
+		fStorageFlags |= MESSAGE_STORAGE_INLINE_FIELDS;
+		fFieldsAvailable = MESSAGE_INLINE_FIELDS - count;
+		return inline_fields(fHeader);
+	}
+
+	fStorageFlags &= ~MESSAGE_STORAGE_INLINE_FIELDS;
+	fFieldsAvailable = 0;
+	atomic_add64(&sAllocationStats.heap_allocations, 1);
+	return (field_header*)malloc(count * sizeof(field_header));
+}
+
+
+/*!	Returns storage for \a size bytes of data, inside the message block if
+	they fit there, and updates fDataAvailable accordingly.
+*/
+uint8*
+BMessage::_AllocateData(size_t size)
+{
+	if (size <= MESSAGE_INLINE_DATA_SIZE) {
+		fStorageFlags |= MESSAGE_STORAGE_INLINE_DATA;
+		fDataAvailable = MESSAGE_INLINE_DATA_SIZE - size;
+		return inline_data(fHeader);
+	}
+
+	fStorageFlags &= ~MESSAGE_STORAGE_INLINE_DATA;
+	fDataAvailable = 0;
+	atomic_add64(&sAllocationStats.heap_allocations, 1);
+	return (uint8*)malloc(size);
+}
+
+
+/*!	Resizes the field storage to \a count fields, moving the fields out of
+	the message block once they no longer fit into it. Leaves updating
+	fFieldsAvailable to the caller.
+*/
+status_t
+BMessage::_ReallocateFields(uint32 count)
+{
+	if ((fStorageFlags & MESSAGE_STORAGE_INLINE_FIELDS) != 0) {
+		if (count <= MESSAGE_INLINE_FIELDS)
+			return B_OK;
+
+		field_header* newFields
+			= (field_header*)malloc(count * sizeof(field_header));
+		if (newFields == NULL)
+			return B_NO_MEMORY;
+
+		memcpy(newFields, fFields, fHeader->field_count * sizeof(field_header));
+		fStorageFlags &= ~MESSAGE_STORAGE_INLINE_FIELDS;
+		fFields = newFields;
+	} else {
+		field_header* newFields = (field_header*)realloc(fFields,
+			count * sizeof(field_header));
+		if (count > 0 && newFields == NULL)
+			return B_NO_MEMORY;
+
+		fFields = newFields;
+	}
+
+	atomic_add64(&sAllocationStats.heap_allocations, 1);
+	return B_OK;
+}
+
+
+/*!	Resizes the data storage to \a size bytes, moving the data out of the
+	message block once it no longer fits into it. Leaves updating
+	fDataAvailable to the caller.
+*/
+status_t
+BMessage::_ReallocateData(size_t size)
+{
+	if ((fStorageFlags & MESSAGE_STORAGE_INLINE_DATA) != 0) {
+		if (size <= MESSAGE_INLINE_DATA_SIZE)
+			return B_OK;
+
+		uint8* newData = (uint8*)malloc(size);
+		if (newData == NULL)
+			return B_NO_MEMORY;
+
+		memcpy(newData, fData, fHeader->data_size);
+		fStorageFlags &= ~MESSAGE_STORAGE_INLINE_DATA;
+		fData = newData;
+	} else {
+		uint8* newData = (uint8*)realloc(fData, size);
+		if (size > 0 && newData == NULL)
+			return B_NO_MEMORY;
+
+		fData = newData;
+	}
+
+	atomic_add64(&sAllocationStats.heap_allocations, 1);
+	return B_OK;
+}
+
+
+//!	Lets an empty field list or data section use the message block.
+void
+BMessage::_UseInlineStorage()
+{
+	if (fHeader == NULL || fHeader->message_area >= 0)
+		return;
+
+	if (fFields == NULL && fHeader->field_count == 0)
+		fFields = _AllocateFields(0);
+	if (fData == NULL && fHeader->data_size == 0)
+		fData = _AllocateData(0);
+}
+
+
+void
+BMessage::_FreeFields()
+{
+	if ((fStorageFlags & MESSAGE_STORAGE_INLINE_FIELDS) == 0)
+		free(fFields);
+
+	fStorageFlags &= ~MESSAGE_STORAGE_INLINE_FIELDS;
+	fFields = NULL;
+}
+
+
+void
+BMessage::_FreeData()
+{
+	if ((fStorageFlags & MESSAGE_STORAGE_INLINE_DATA) == 0)
+		free(fData);
+
+	fStorageFlags &= ~MESSAGE_STORAGE_INLINE_DATA;
+	fData = NULL;
+}
+
+
 status_t
 BMessage::AddData(const char* name, type_code type, const void* data,
 	ssize_t numBytes, bool isFixedSize, int32 count)
@@ -2042,9 +2371,10 @@ void
 BMessage::_StaticInit()
 {
 	DEBUG_FUNCTION_ENTER2;
-	sReplyPorts[0] = create_port(1, "tmp_rport0");
-	sReplyPorts[1] = create_port(1, "tmp_rport1");
-	sReplyPorts[2] = create_port(1, "tmp_rport2");
+	// reply ports are cached per thread, see acquire_thread_reply_port()
+	sReplyPorts[0] = -1;
+	sReplyPorts[1] = -1;
+	sReplyPorts[2] = -1;
 
 	sReplyPortInUse[0] = 0;
 	sReplyPortInUse[1] = 0;
@@ -2059,11 +2389,8 @@ BMessage::_StaticReInitForkedChild()
 {
 	DEBUG_FUNCTION_ENTER2;
 
-	// overwrite the inherited ports with a set of our own
-	sReplyPorts[0] = create_port(1, "tmp_rport0");
-	sReplyPorts[1] = create_port(1, "tmp_rport1");
-	sReplyPorts[2] = create_port(1, "tmp_rport2");
-
+	// The forking thread's reply port is replaced on its next use, as it
+	// belongs to the parent team.
 	sReplyPortInUse[0] = 0;
 	sReplyPortInUse[1] = 0;
 	sReplyPortInUse[2] = 0;
@@ -2092,6 +2419,7 @@ BMessage::_StaticCacheCleanup()
 }
 
 
+//!	Unused, kept for binary compatibility.
 int32
 BMessage::_StaticGetCachedReplyPort()
 {
@@ -2271,18 +2599,15 @@ BMessage::_SendMessage(port_id port, team_id portOwner, int32 token,
 	}
 
 	DEBUG_FUNCTION_ENTER;
-	const int32 cachedReplyPort = _StaticGetCachedReplyPort();
-	port_id replyPort = B_BAD_PORT_ID;
+	port_id replyPort = acquire_thread_reply_port();
+	const bool cachedReplyPort = replyPort >= 0;
 	status_t result = B_OK;
 
-	if (cachedReplyPort < 0) {
-		// All the cached reply ports are in use; create a new one
+	if (!cachedReplyPort) {
+		// The reply port of this thread is in use; create a new one
 		replyPort = create_port(1 /* for one message */, "tmp_reply_port");
 		if (replyPort < 0)
 			return replyPort;
-	} else {
-		assert(cachedReplyPort < sNumReplyPorts);
-		replyPort = sReplyPorts[cachedReplyPort];
 	}
 
 	bool recreateCachedPort = false;
@@ -2354,20 +2679,18 @@ BMessage::_SendMessage(port_id port, team_id portOwner, int32 token,
 
 	int32 code;
 	result = handle_reply(replyPort, &code, replyTimeout, reply);
-	if (result != B_OK && cachedReplyPort >= 0) {
-		delete_port(replyPort);
+	if (result != B_OK) {
+		// a late reply must not end up in the next synchronous send
 		recreateCachedPort = true;
 	}
 
 error:
-	if (cachedReplyPort >= 0) {
+	if (cachedReplyPort) {
 		// Reclaim ownership of cached port, if possible
-		if (!recreateCachedPort && set_port_owner(replyPort, team) == B_OK) {
-			// Flag as available
-			atomic_add(&sReplyPortInUse[cachedReplyPort], -1);
-		} else
-			sReplyPorts[cachedReplyPort] = create_port(1, "tmp_rport");
+		if (!recreateCachedPort && set_port_owner(replyPort, team) != B_OK)
+			recreateCachedPort = true;
 
+		release_thread_reply_port(recreateCachedPort);
 		return result;
 	}
 
@@ -388,6 +388,18 @@ BDirectory::GetNextDirents(dirent* buf, size_t bufSize, int32 count)
 }
 
 
+int32
+BDirectory::GetNextDirentsAndStats(dirent* buf, size_t bufSize,
+	struct stat* stats, int32 count)
+{
+	if (buf == NULL || stats == NULL || count <= 0)
+		return B_BAD_VALUE;
+	if (InitCheck() != B_OK)
+		return B_FILE_ERROR;
+	return _kern_read_dir_stat(fDirFd, buf, bufSize, count, stats);
+}
+
+
 status_t
 BDirectory::Rewind()
 {
@@ -404,12 +416,20 @@ BDirectory::CountEntries()
 	if (error != B_OK)
 		return error;
 	int32 count = 0;
-	BPrivate::Storage::LongDirEntry entry;
+	char buffer[4096];
 	while (error == B_OK) {
-		if (GetNextDirents(&entry, sizeof(entry), 1) != 1)
+		int32 read = GetNextDirents((dirent*)buffer, sizeof(buffer));
+		if (read <= 0)
 			break;
-		if (strcmp(entry.d_name, ".") != 0 && strcmp(entry.d_name, "..") != 0)
-			count++;
+
+		dirent* entry = (dirent*)buffer;
+		for (int32 i = 0; i < read; i++) {
+			if (strcmp(entry->d_name, ".") != 0
+				&& strcmp(entry->d_name, "..") != 0) {
+				count++;
+			}
+			entry = (dirent*)((char*)entry + entry->d_reclen);
+		}
 	}
 	Rewind();
 	return (error == B_OK ? count : error);
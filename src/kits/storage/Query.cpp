@@ -363,7 +363,8 @@ BQuery::GetNextRef(entry_ref* ref)
 			ref->device = entry.d_pdev;
 			ref->directory = entry.d_pino;
 			#else
-			UNIMPLEMENTED();
+			ref->device = fDevice;
+			ref->directory = QUERY_ENTRY_DIRECTORY(&entry);
 			#endif
 			error = ref->set_name(entry.d_name);
 		}
@@ -63,6 +63,11 @@ All rights reserved.
 #include <Volume.h>
 #include <VolumeRoster.h>
 
+#include <syscalls.h>
+#include <vfs_defs.h>
+
+#include <algorithm>
+
 #include "Attributes.h"
 #include "Bitmaps.h"
 #include "FindPanel.h"
@@ -113,7 +118,9 @@ Model::Model()
 	fNode(NULL),
 	fStatus(B_NO_INIT),
 	fHasLocalizedName(false),
-	fLocalizedNameIsCached(false)
+	fLocalizedNameIsCached(false),
+	fAttributes(NULL),
+	fAttributesSize(-1)
 {
 }
 
@@ -129,7 +136,9 @@ Model::Model(const Model& other)
 	fNode(NULL),
 	fLocalizedName(other.fLocalizedName),
 	fHasLocalizedName(other.fHasLocalizedName),
-	fLocalizedNameIsCached(other.fLocalizedNameIsCached)
+	fLocalizedNameIsCached(other.fLocalizedNameIsCached),
+	fAttributes(NULL),
+	fAttributesSize(-1)
 {
 	fStatBuf.st_dev = other.NodeRef()->device;
 	fStatBuf.st_ino = other.NodeRef()->node;
@@ -156,7 +165,9 @@ Model::Model(const node_ref* dirNode, const node_ref* node, const char* name,
 	fWritable(false),
 	fNode(NULL),
 	fHasLocalizedName(false),
-	fLocalizedNameIsCached(false)
+	fLocalizedNameIsCached(false),
+	fAttributes(NULL),
+	fAttributesSize(-1)
 {
 	SetTo(dirNode, node, name, open, writable);
 }
@@ -168,7 +179,9 @@ Model::Model(const BEntry* entry, bool open, bool writable)
 	fWritable(false),
 	fNode(NULL),
 	fHasLocalizedName(false),
-	fLocalizedNameIsCached(false)
+	fLocalizedNameIsCached(false),
+	fAttributes(NULL),
+	fAttributesSize(-1)
 {
 	SetTo(entry, open, writable);
 }
@@ -182,7 +195,9 @@ Model::Model(const entry_ref* ref, bool traverse, bool open, bool writable)
 	fWritable(false),
 	fNode(NULL),
 	fHasLocalizedName(false),
-	fLocalizedNameIsCached(false)
+	fLocalizedNameIsCached(false),
+	fAttributes(NULL),
+	fAttributesSize(-1)
 {
 	BEntry entry(ref, traverse);
 	fStatus = entry.InitCheck();
@@ -230,6 +245,7 @@ Model::~Model()
 #endif
 
 	delete fNode;
+	FlushAttributes();
 }
 
 
@@ -239,6 +255,7 @@ Model::SetTo(const BEntry* entry, bool open, bool writable)
 	delete fNode;
 	fNode = NULL;
 	DeletePreferredAppVolumeNameLinkTo();
+	FlushAttributes();
 	fIconFrom = kUnknownSource;
 	fBaseType = kUnknownNode;
 	fMimeType = "";
@@ -265,6 +282,7 @@ Model::SetTo(const entry_ref* newRef, bool traverse, bool open, bool writable)
 	delete fNode;
 	fNode = NULL;
 	DeletePreferredAppVolumeNameLinkTo();
+	FlushAttributes();
 	fIconFrom = kUnknownSource;
 	fBaseType = kUnknownNode;
 	fMimeType = "";
@@ -298,6 +316,7 @@ Model::SetTo(const node_ref* dirNode, const node_ref* nodeRef,
 	delete fNode;
 	fNode = NULL;
 	DeletePreferredAppVolumeNameLinkTo();
+	FlushAttributes();
 	fIconFrom = kUnknownSource;
 	fBaseType = kUnknownNode;
 	fMimeType = "";
@@ -878,6 +897,7 @@ Model::AttrChanged(const char* attrName)
 	// return true if icon needs updating
 
 	ASSERT(IsNodeOpen());
+	FlushAttributes();
 	if (attrName != NULL
 		&& (strcmp(attrName, kAttrIcon) == 0
 			|| strcmp(attrName, kAttrMiniIcon) == 0
@@ -923,6 +943,7 @@ bool
 Model::StatChanged()
 {
 	ASSERT(IsNodeOpen());
+	FlushAttributes();
 	mode_t oldMode = fStatBuf.st_mode;
 	fStatus = fNode->GetStat(&fStatBuf);
 
@@ -939,6 +960,114 @@ Model::StatChanged()
 }
 
 
+ssize_t
+Model::ReadAttr(const char* name, type_code type, off_t offset,
+	void* buffer, size_t size) const
+{
+	const attr_record* record = FindAttribute(name);
+	if (record != NULL) {
+		if (offset < 0)
+			return B_BAD_VALUE;
+		if (offset >= record->size)
+			return 0;
+
+		size = std::min(size, (size_t)(record->size - offset));
+		memcpy(buffer, (const char*)attr_record_data(record) + offset, size);
+		return size;
+	}
+	if (fAttributesSize >= 0)
+		return B_ENTRY_NOT_FOUND;
+
+	BModelOpener opener(const_cast<Model*>(this));
+	if (fNode == NULL)
+		return B_NO_INIT;
+
+	return fNode->ReadAttr(name, type, offset, buffer, size);
+}
+
+
+status_t
+Model::GetAttrInfo(const char* name, attr_info* info) const
+{
+	const attr_record* record = FindAttribute(name);
+	if (record != NULL) {
+		info->type = record->type;
+		info->size = record->size;
+		return B_OK;
+	}
+	if (fAttributesSize >= 0)
+		return B_ENTRY_NOT_FOUND;
+
+	BModelOpener opener(const_cast<Model*>(this));
+	if (fNode == NULL)
+		return B_NO_INIT;
+
+	return fNode->GetAttrInfo(name, info);
+}
+
+
+const attr_record*
+Model::FindAttribute(const char* name) const
+{
+#ifdef __VOS__
+	if (fAttributesSize < 0) {
+		// one call for all the attribute columns of the pose
+		BPath path(&fEntryRef);
+		if (path.InitCheck() != B_OK)
+			return NULL;
+
+		char stackBuffer[2048];
+		char* buffer = stackBuffer;
+		ssize_t bufferSize = sizeof(stackBuffer);
+		ssize_t size;
+		while ((size = _kern_read_attrs(-1, path.Path(), false, buffer,
+				bufferSize)) > bufferSize) {
+			// they grew in between
+			if (buffer != stackBuffer)
+				free(buffer);
+			buffer = (char*)malloc(size);
+			if (buffer == NULL)
+				return NULL;
+			bufferSize = size;
+		}
+
+		if (size >= 0 && buffer == stackBuffer) {
+			buffer = (char*)malloc(std::max(size, (ssize_t)1));
+			if (buffer != NULL)
+				memcpy(buffer, stackBuffer, size);
+		}
+		if (size < 0 || buffer == NULL) {
+			if (buffer != stackBuffer)
+				free(buffer);
+			return NULL;
+		}
+
+		fAttributes = buffer;
+		fAttributesSize = size;
+	}
+
+	for (ssize_t offset = 0; offset < fAttributesSize;) {
+		const attr_record* record
+			= (const attr_record*)(fAttributes + offset);
+		if (strcmp(record->name, name) == 0)
+			return record;
+		offset += record->record_size;
+	}
+#endif
+
+	return NULL;
+}
+
+
+void
+Model::FlushAttributes() const
+{
+	free(fAttributes);
+	fAttributes = NULL;
+	fAttributesSize = -1;
+}
+
+
 //	#pragma mark - Mime handling methods
 
 
@@ -51,6 +51,8 @@ class BPath;
 class BHandler;
 class BEntry;
 class BQuery;
+struct attr_info;
+struct attr_record;
 
 
 #if __GNUC__ && __GNUC__ < 3
@@ -118,6 +120,14 @@ public:
 
 	BNode* Node() const;
 		// returns NULL if not open
+
+	// attribute reads for the attribute columns, these don't need the
+	// node to be open; on V/OS all the attributes are read in one go
+	// and kept until they change
+	ssize_t ReadAttr(const char* name, type_code type, off_t offset,
+		void* buffer, size_t size) const;
+	status_t GetAttrInfo(const char* name, attr_info* info) const;
+
 	void GetPath(BPath*) const;
 	void GetEntry(BEntry*) const;
 
@@ -215,6 +225,9 @@ private:
 	void DeletePreferredAppVolumeNameLinkTo();
 	void CacheLocalizedName();
 
+	const attr_record* FindAttribute(const char* name) const;
+	void FlushAttributes() const;
+
 	status_t FetchOneQuery(const BQuery*, BHandler* target,
 		BObjectList<BQuery>*, BVolume*);
 
@@ -262,6 +275,10 @@ private:
 	BString fLocalizedName;
 	bool fHasLocalizedName;
 	bool fLocalizedNameIsCached;
+
+	mutable char* fAttributes;
+	mutable ssize_t fAttributesSize;
+		// negative until the attributes are read
 };
 
 
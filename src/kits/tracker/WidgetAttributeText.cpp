@@ -1305,22 +1305,18 @@ GenericAttributeText::PreferredWidth(const BPoseView* pose) const
 void
 GenericAttributeText::ReadValue(BString* outString)
 {
-	BModelOpener opener(const_cast<Model*>(fModel));
-
 	ssize_t length = 0;
 	fFullValueText = "-";
 	fValue.int64t = 0;
 	fValueIsDefined = false;
 	fValueDirty = false;
 
-	if (!fModel->Node())
-		return;
-
+	// the model opens the node if it needs to
 	switch (fColumn->AttrType()) {
 		case B_STRING_TYPE:
 		{
 			char buffer[kGenericReadBufferSize];
-			length = fModel->Node()->ReadAttr(fColumn->AttrName(),
+			length = fModel->ReadAttr(fColumn->AttrName(),
 				fColumn->AttrType(), 0, buffer, kGenericReadBufferSize - 1);
 
 			if (length > 0) {
@@ -1355,10 +1351,9 @@ GenericAttributeText::ReadValue(BString* outString)
 			// with a type, depending on the bytes that could be read
 			attr_info info;
 			GenericValueStruct tmp;
-			if (fModel->Node()->GetAttrInfo(fColumn->AttrName(), &info)
-					== B_OK) {
+			if (fModel->GetAttrInfo(fColumn->AttrName(), &info) == B_OK) {
 				if (info.size && info.size <= (off_t)sizeof(int64)) {
-					length = fModel->Node()->ReadAttr(fColumn->AttrName(),
+					length = fModel->ReadAttr(fColumn->AttrName(),
 						fColumn->AttrType(), 0, &tmp, (size_t)info.size);
 				}
 
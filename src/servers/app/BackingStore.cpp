@@ -0,0 +1,240 @@
+/*
+ * Copyright 2019, Dario Casalinuovo. All rights reserved.
+ * Distributed under the terms of the MIT License.
+ */
+
+
+#include "BackingStore.h"
+
+#include <new>
+
+#include "DrawingEngine.h"
+#include "ServerBitmap.h"
+
+
+int64 BackingStore::sTotalMemoryUsage = 0;
+
+
+BackingStore::BackingStore()
+	:
+	fBitmap(NULL),
+	fWidth(0),
+	fHeight(0),
+	fOnScreen(),
+	fOnScreenOrigin(0, 0),
+	fValid(),
+	fRestorable(),
+	fSaveCount(0),
+	fLastVisible(system_time())
+{
+}
+
+
+BackingStore::~BackingStore()
+{
+	Flush();
+}
+
+
+/*!	Called whenever the clipping of the window has been rebuilt, before
+	anything is drawn into the new clipping. The parts that were on screen
+	before, but are not visible anymore, are saved from the screen; the parts
+	that become visible again are remembered for Restore().
+	\a dirty contains the parts of the window that don't have valid contents
+	on screen, in screen coordinates at the new \a origin.
+*/
+void
+BackingStore::SetVisibleRegion(DrawingEngine* engine,
+	const BRegion& visibleContent, const BRegion& dirty, BPoint origin,
+	int32 width, int32 height)
+{
+	if (fWidth != width || fHeight != height) {
+		// the contents will be redrawn by the client anyway
+		Flush();
+		ForgetScreen();
+		fWidth = width;
+		fHeight = height;
+	}
+
+	BRegion visible(visibleContent);
+	visible.OffsetBy(-(int32)origin.x, -(int32)origin.y);
+
+	BRegion covered(fOnScreen);
+	covered.Exclude(&visible);
+	if (covered.CountRects() > 0) {
+		BRegion dirtyLocal(dirty);
+		dirtyLocal.OffsetBy(-(int32)origin.x, -(int32)origin.y);
+		covered.Exclude(&dirtyLocal);
+
+		if (covered.CountRects() > 0 && _Allocate()
+			&& _Save(engine, covered, fOnScreenOrigin)) {
+			fValid.Include(&covered);
+		}
+	}
+
+	// only the parts that were not on screen before need to be restored,
+	// the others are still there, or have been moved along by the desktop
+	BRegion exposed(visible);
+	exposed.Exclude(&fOnScreen);
+	exposed.IntersectWith(&fValid);
+
+	fRestorable.IntersectWith(&visible);
+	fRestorable.Include(&exposed);
+
+	// anything visible can be drawn to, and is therefore no longer kept
+	fValid.Exclude(&visible);
+
+	fOnScreen = visible;
+	fOnScreenOrigin = origin;
+
+	if (visible.CountRects() > 0)
+		fLastVisible = system_time();
+}
+
+
+/*!	Saves everything that is currently on screen, since the window is going
+	to be hidden, or is leaving the workspace.
+*/
+void
+BackingStore::LeaveScreen(DrawingEngine* engine, const BRegion& dirty)
+{
+	BRegion saved(fOnScreen);
+	BRegion dirtyLocal(dirty);
+	dirtyLocal.OffsetBy(-(int32)fOnScreenOrigin.x,
+		-(int32)fOnScreenOrigin.y);
+	saved.Exclude(&dirtyLocal);
+
+	if (saved.CountRects() > 0 && _Allocate()
+		&& _Save(engine, saved, fOnScreenOrigin)) {
+		fValid.Include(&saved);
+	}
+
+	ForgetScreen();
+	fLastVisible = system_time();
+}
+
+
+/*!	Forgets what is on screen without saving anything, used when the screen
+	contents could have been changed behind our back.
+*/
+void
+BackingStore::ForgetScreen()
+{
+	fOnScreen.MakeEmpty();
+	fRestorable.MakeEmpty();
+}
+
+
+//!	Drops the saved contents of the given region, because they are outdated.
+void
+BackingStore::Invalidate(const BRegion& regionOnScreen, BPoint origin)
+{
+	if (fValid.CountRects() == 0 && fRestorable.CountRects() == 0)
+		return;
+
+	BRegion region(regionOnScreen);
+	region.OffsetBy(-(int32)origin.x, -(int32)origin.y);
+	fValid.Exclude(&region);
+	fRestorable.Exclude(&region);
+}
+
+
+/*!	Blits the parts of \a regionOnScreen that became visible since the last
+	clipping update, and have been saved before. On return, \a regionOnScreen
+	contains the region that has been restored.
+*/
+void
+BackingStore::Restore(DrawingEngine* engine, BRegion& regionOnScreen,
+	BPoint origin)
+{
+	if (fRestorable.CountRects() == 0 || fBitmap == NULL) {
+		regionOnScreen.MakeEmpty();
+		return;
+	}
+
+	BRegion restore(fRestorable);
+	restore.OffsetBy((int32)origin.x, (int32)origin.y);
+	restore.IntersectWith(&regionOnScreen);
+
+	if (restore.CountRects() > 0 && engine->LockParallelAccess()) {
+		engine->CopyBitmapToRegion(fBitmap, restore, (int32)origin.x,
+			(int32)origin.y);
+		engine->UnlockParallelAccess();
+	} else
+		restore.MakeEmpty();
+
+	// anything not restored now will be redrawn by the client
+	fRestorable.MakeEmpty();
+	regionOnScreen = restore;
+}
+
+
+/*!	Frees all saved contents. What is on screen is still remembered, so
+	that it can be saved again when it gets covered.
+*/
+void
+BackingStore::Flush()
+{
+	if (fBitmap != NULL) {
+		atomic_add64(&sTotalMemoryUsage, -(int64)fBitmap->BitsLength());
+		fBitmap->ReleaseReference();
+		fBitmap = NULL;
+	}
+
+	fValid.MakeEmpty();
+	fRestorable.MakeEmpty();
+}
+
+
+size_t
+BackingStore::MemoryUsage() const
+{
+	return fBitmap != NULL ? fBitmap->BitsLength() : 0;
+}
+
+
+/*static*/ int64
+BackingStore::TotalMemoryUsage()
+{
+	return atomic_get64(&sTotalMemoryUsage);
+}
+
+
+bool
+BackingStore::_Allocate()
+{
+	if (fBitmap != NULL)
+		return true;
+
+	fBitmap = new(std::nothrow) UtilityBitmap(BRect(0, 0, fWidth - 1,
+		fHeight - 1), B_RGB32, 0);
+	if (fBitmap == NULL)
+		return false;
+	if (!fBitmap->IsValid()) {
+		fBitmap->ReleaseReference();
+		fBitmap = NULL;
+		return false;
+	}
+
+	atomic_add64(&sTotalMemoryUsage, fBitmap->BitsLength());
+	return true;
+}
+
+
+bool
+BackingStore::_Save(DrawingEngine* engine, const BRegion& region,
+	BPoint origin)
+{
+	BRegion regionOnScreen(region);
+	regionOnScreen.OffsetBy((int32)origin.x, (int32)origin.y);
+
+	if (!engine->LockParallelAccess())
+		return false;
+
+	engine->CopyRegionToBitmap(regionOnScreen, fBitmap, (int32)origin.x,
+		(int32)origin.y);
+	engine->UnlockParallelAccess();
+
+	fSaveCount++;
+	return true;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright 2019, Dario Casalinuovo. All rights reserved.
+ * Distributed under the terms of the MIT License.
+ */
+#ifndef BACKING_STORE_H
+#define BACKING_STORE_H
+
+
+#include <OS.h>
+#include <Point.h>
+#include <Region.h>
+
+
+class DrawingEngine;
+class UtilityBitmap;
+
+
+/*!	\class BackingStore BackingStore.h
+	\brief Keeps the hidden parts of a window's contents.
+
+	Whenever parts of the window content get covered or leave the screen,
+	their pixels are saved from the screen, so that they can be blitted back
+	when they become visible again instead of asking the client for a redraw.
+	All regions are kept in window coordinates, ie. relative to the left top
+	of the window frame.
+
+	All methods that touch the screen require the drawing engine to be
+	unlocked, they lock it themselves.
+*/
+class BackingStore {
+public:
+								BackingStore();
+								~BackingStore();
+
+			void				SetVisibleRegion(DrawingEngine* engine,
+									const BRegion& visibleContent,
+									const BRegion& dirty, BPoint origin,
+									int32 width, int32 height);
+			void				LeaveScreen(DrawingEngine* engine,
+									const BRegion& dirty);
+			void				ForgetScreen();
+
+			void				Invalidate(const BRegion& regionOnScreen,
+									BPoint origin);
+			void				Restore(DrawingEngine* engine,
+									BRegion& regionOnScreen, BPoint origin);
+
+			void				Flush();
+
+			bool				IsEmpty() const
+									{ return fValid.CountRects() == 0
+										&& fRestorable.CountRects() == 0; }
+			uint32				SaveCount() const
+									{ return fSaveCount; }
+			bigtime_t			LastVisibleTime() const
+									{ return fLastVisible; }
+			size_t				MemoryUsage() const;
+
+	static	int64				TotalMemoryUsage();
+
+private:
+			bool				_Allocate();
+			bool				_Save(DrawingEngine* engine,
+									const BRegion& region, BPoint origin);
+
+private:
+			UtilityBitmap*		fBitmap;
+			int32				fWidth;
+			int32				fHeight;
+
+			BRegion				fOnScreen;
+			BPoint				fOnScreenOrigin;
+			BRegion				fValid;
+			BRegion				fRestorable;
+
+			uint32				fSaveCount;
+			bigtime_t			fLastVisible;
+
+	static	int64				sTotalMemoryUsage;
+};
+
+
+#endif	// BACKING_STORE_H
@@ -40,10 +40,12 @@
 #include <WindowInfo.h>
 
 #include "AppServer.h"
+#include "BackingStore.h"
 #include "ClickTarget.h"
 #include "DecorManager.h"
 #include "DesktopSettingsPrivate.h"
 #include "DrawingEngine.h"
+#include "FontCache.h"
 #include "FontManager.h"
 #include "HWInterface.h"
 #include "InputManager.h"
@@ -71,6 +73,11 @@
 #endif
 
 
+// window backing stores are dropped after the window has been hidden for
+// this long, even when they are within the budget
+static const bigtime_t kBackingStoreTimeout = 10 * 60 * 1000000LL;
+
+
 static inline float
 square_vector_length(float x, float y)
 {
@@ -423,6 +430,7 @@ Desktop::Desktop(uid_t userID, const char* targetScreen)
 	fDirectScreenTeam(-1),
 	fCurrentWorkspace(0),
 	fPreviousWorkspace(0),
+	fClippingGeneration(0),
 	fAllWindows(kAllWindowList),
 	fSubsetWindows(kSubsetList),
 	fFocusList(kFocusList),
@@ -2137,6 +2145,8 @@ Desktop::RedrawBackground()
 			view = view->NextSibling();
 		}
 
+		// the hidden parts of the desktop have the old color
+		window->FlushBackingStore();
 		window->ProcessDirtyRegion(redraw);
 	} else {
 		redraw = BackgroundRegion();
@@ -2659,6 +2669,10 @@ Desktop::_DispatchMessage(int32 code, BPrivate::LinkReceiver& link)
 			break;
 		}
 
+		case AS_DUMP_FONT_CACHE:
+			FontCache::Default()->Dump();
+			break;
+
 		case AS_EVENT_STREAM_CLOSED:
 			_LaunchInputServer();
 			break;
@@ -3097,6 +3111,8 @@ Desktop::_HideWindow(Window* window)
 	// clipping calculation, but anyways)
 	BRegion dirty(window->VisibleRegion());
 
+	window->SaveToBackingStore();
+
 	BRegion background;
 	_RebuildClippingForAllWindows(background);
 	_SetBackground(background);
@@ -3360,6 +3376,8 @@ Desktop::_RebuildClippingForAllWindows(BRegion& stillAvailableOnScreen)
 	// figure out what the entire screen area is
 	stillAvailableOnScreen = fScreenRegion;
 
+	fClippingGeneration++;
+
 	// set clipping of each window
 	for (Window* window = CurrentWindows().LastWindow(); window != NULL;
 			window = window->PreviousWindow(fCurrentWorkspace)) {
@@ -3376,6 +3394,8 @@ Desktop::_RebuildClippingForAllWindows(BRegion& stillAvailableOnScreen)
 			stillAvailableOnScreen.Exclude(&window->VisibleRegion());
 		}
 	}
+
+	_PruneBackingStores();
 }
 
 
@@ -3417,6 +3437,42 @@ Desktop::_SetBackground(BRegion& background)
 }
 
 
+/*!	Drops the backing stores of windows that have been hidden for a long
+	time, and then those of the windows that have been hidden the longest
+	until the total memory used is within the budget.
+*/
+void
+Desktop::_PruneBackingStores()
+{
+	int64 budget = (int64)fSettings->BackingStoreBudget() * 1024 * 1024;
+	bigtime_t now = system_time();
+
+	for (Window* window = fAllWindows.FirstWindow(); window != NULL;
+			window = window->NextWindow(kAllWindowList)) {
+		BackingStore* store = window->GetBackingStore();
+		if (store != NULL && store->MemoryUsage() > 0
+			&& now - store->LastVisibleTime() > kBackingStoreTimeout)
+			store->Flush();
+	}
+
+	while (BackingStore::TotalMemoryUsage() > budget) {
+		BackingStore* oldest = NULL;
+		for (Window* window = fAllWindows.FirstWindow(); window != NULL;
+				window = window->NextWindow(kAllWindowList)) {
+			BackingStore* store = window->GetBackingStore();
+			if (store != NULL && store->MemoryUsage() > 0
+				&& (oldest == NULL
+					|| store->LastVisibleTime() < oldest->LastVisibleTime()))
+				oldest = store;
+		}
+		if (oldest == NULL)
+			break;
+
+		oldest->Flush();
+	}
+}
+
+
 //!	The all window lock must be held when calling this function.
 void
 Desktop::RebuildAndRedrawAfterWindowChange(Window* changedWindow,
@@ -3433,6 +3489,8 @@ Desktop::RebuildAndRedrawAfterWindowChange(Window* changedWindow,
 	// figure out what the entire screen area is
 	BRegion stillAvailableOnScreen(fScreenRegion);
 
+	fClippingGeneration++;
+
 	// set clipping of each window
 	for (Window* window = CurrentWindows().LastWindow(); window != NULL;
 			window = window->PreviousWindow(fCurrentWorkspace)) {
@@ -3519,6 +3577,10 @@ Desktop::_ScreenChanged(Screen* screen)
 	fScreenRegion.Set(screen->Frame());
 	gInputManager->UpdateScreenBounds(screen->Frame());
 
+	// skip a clipping generation, so that the windows forget what
+	// they had on the old buffer
+	fClippingGeneration++;
+
 	BRegion background;
 	_RebuildClippingForAllWindows(background);
 
@@ -3702,6 +3764,7 @@ Desktop::_SetWorkspace(int32 index, bool moveFocusWindow)
 		if (!window->IsHidden()) {
 			// this window will no longer be visible
 			dirty.Include(&window->VisibleRegion());
+			window->SaveToBackingStore();
 		}
 
 		window->SetCurrentWorkspace(-1);
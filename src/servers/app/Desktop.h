@@ -141,6 +141,8 @@ public:
 									Window* window, BRegion& dirty);
 									// the window lock must be held when calling
 									// this function
+			int32				ClippingGeneration() const
+									{ return fClippingGeneration; }
 
 	// ScreenOwner implementation
 	virtual	void				ScreenRemoved(Screen* screen) {}
@@ -306,6 +308,7 @@ private:
 			void				_TriggerWindowRedrawing(
 									BRegion& newDirtyRegion);
 			void				_SetBackground(BRegion& background);
+			void				_PruneBackingStores();
 
 			status_t			_ActivateApp(team_id team);
 
@@ -342,6 +345,7 @@ private:
 			team_id				fDirectScreenTeam;
 			int32				fCurrentWorkspace;
 			int32				fPreviousWorkspace;
+			int32				fClippingGeneration;
 
 			WindowList			fAllWindows;
 			WindowList			fSubsetWindows;
@@ -79,6 +79,9 @@ DesktopSettingsPrivate::_SetDefaults()
 	fWorkspacesColumns = 2;
 	fWorkspacesRows = 2;
 
+	// window backing stores are off by default
+	fBackingStoreBudget = 0;
+
 	memcpy(fShared.colors, BPrivate::kDefaultColors,
 		sizeof(rgb_color) * kColorWhichCount);
 
@@ -298,6 +301,12 @@ DesktopSettingsPrivate::_Load()
 				fControlLook = controlLook;
 			}
 
+			int32 backingStoreBudget;
+			if (settings.FindInt32("backing store budget", &backingStoreBudget)
+					== B_OK && backingStoreBudget >= 0) {
+				fBackingStoreBudget = backingStoreBudget;
+			}
+
 			// colors
 			for (int32 i = 0; i < kColorWhichCount; i++) {
 				char colorName[12];
@@ -449,6 +458,8 @@ DesktopSettingsPrivate::Save(uint32 mask)
 
 			settings.AddString("control look", fControlLook);
 
+			settings.AddInt32("backing store budget", fBackingStoreBudget);
+
 			for (int32 i = 0; i < kColorWhichCount; i++) {
 				char colorName[12];
 				snprintf(colorName, sizeof(colorName), "color%" B_PRId32,
@@ -807,6 +818,21 @@ DesktopSettingsPrivate::ControlLook() const
 }
 
 
+void
+DesktopSettingsPrivate::SetBackingStoreBudget(int32 megabytes)
+{
+	fBackingStoreBudget = megabytes;
+	Save(kAppearanceSettings);
+}
+
+
+int32
+DesktopSettingsPrivate::BackingStoreBudget() const
+{
+	return fBackingStoreBudget;
+}
+
+
 void
 DesktopSettingsPrivate::_ValidateWorkspacesLayout(int32& columns,
 	int32& rows) const
@@ -968,6 +994,13 @@ DesktopSettings::ControlLook() const
 	return fSettings->ControlLook();
 }
 
+
+int32
+DesktopSettings::BackingStoreBudget() const
+{
+	return fSettings->BackingStoreBudget();
+}
+
 //	#pragma mark - write access
 
 
@@ -1095,3 +1128,10 @@ LockedDesktopSettings::SetControlLook(const char* path)
 	return fSettings->SetControlLook(path);
 }
 
+
+void
+LockedDesktopSettings::SetBackingStoreBudget(int32 megabytes)
+{
+	fSettings->SetBackingStoreBudget(megabytes);
+}
+
@@ -78,6 +78,8 @@ public:
 
 			const BString&		ControlLook() const;
 
+			int32				BackingStoreBudget() const;
+
 protected:
 			DesktopSettingsPrivate*	fSettings;
 };
@@ -113,6 +115,8 @@ public:
 
 			status_t			SetControlLook(const char* path);
 
+			void				SetBackingStoreBudget(int32 megabytes);
+
 private:
 			Desktop*			fDesktop;
 };
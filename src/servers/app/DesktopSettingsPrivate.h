@@ -95,6 +95,9 @@ public:
 			status_t			SetControlLook(const char* path);
 			const BString&		ControlLook() const;
 
+			void				SetBackingStoreBudget(int32 megabytes);
+			int32				BackingStoreBudget() const;
+
 private:
 			void				_SetDefaults();
 			status_t			_Load();
@@ -116,6 +119,7 @@ private:
 			int32				fWorkspacesRows;
 			BMessage			fWorkspaceMessages[kMaxWorkspaces];
 			BString				fControlLook;
+			int32				fBackingStoreBudget;
 
 			server_read_only_memory& fShared;
 };
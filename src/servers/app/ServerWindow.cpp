@@ -2465,6 +2465,11 @@ void
 ServerWindow::_DispatchViewDrawingMessage(int32 code,
 	BPrivate::LinkReceiver &link)
 {
+	// whatever is drawn, or can't be drawn because the window is hidden,
+	// makes the saved contents outdated
+	if (fCurrentView->IsVisible())
+		fWindow->InvalidateBackingStore(fCurrentView);
+
 	if (!fCurrentView->IsVisible() || !fWindow->IsVisible()) {
 		if (link.NeedsReply()) {
 			debug_printf("ServerWindow::DispatchViewDrawingMessage() got "
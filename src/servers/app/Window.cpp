@@ -25,10 +25,12 @@
 #include <ViewPrivate.h>
 #include <WindowPrivate.h>
 
+#include "BackingStore.h"
 #include "ClickTarget.h"
 #include "Decorator.h"
 #include "DecorManager.h"
 #include "Desktop.h"
+#include "DesktopSettings.h"
 #include "DrawingEngine.h"
 #include "HWInterface.h"
 #include "MessagePrivate.h"
@@ -90,6 +92,11 @@ Window::Window(const BRect& frame, const char *name,
 
 	fRegionPool(),
 
+	fBackingStore(NULL),
+	fClippingGeneration(0),
+	fBackingStoreView(NULL),
+	fBackingStoreSaveCount(0),
+
 	fWindowBehaviour(NULL),
 	fTopView(NULL),
 	fWindow(window),
@@ -139,9 +146,14 @@ Window::Window(const BRect& frame, const char *name,
 				&fMaxHeight);
 		}
 	}
-	if (fFeel != kOffscreenWindowFeel)
+	if (fFeel != kOffscreenWindowFeel) {
 		fWindowBehaviour = gDecorManager.AllocateWindowBehaviour(this);
 
+		DesktopSettings settings(fDesktop);
+		if (settings.BackingStoreBudget() > 0)
+			fBackingStore = new(nothrow) BackingStore();
+	}
+
 	// do we need to change our size to let the decorator fit?
 	// _ResizeBy() will adapt the frame for validity before resizing
 	if (feel == kDesktopWindowFeel) {
@@ -177,6 +189,7 @@ Window::~Window()
 	DetachFromWindowStack(false);
 
 	delete fWindowBehaviour;
+	delete fBackingStore;
 	delete fDrawingEngine;
 
 	gDecorManager.CleanupForWindow(this);
@@ -206,6 +219,37 @@ Window::SetClipping(BRegion* stillAvailableOnScreen)
 
 	fVisibleContentRegionValid = false;
 	fEffectiveDrawingRegionValid = false;
+
+	if (fBackingStore == NULL)
+		return;
+
+	int32 generation = fDesktop->ClippingGeneration();
+	if (generation != fClippingGeneration + 1) {
+		// we missed a clipping update, so we have not been on screen in
+		// between, and what we remember to be there might be gone
+		fBackingStore->ForgetScreen();
+	}
+	fClippingGeneration = generation;
+
+	if ((fFlags & kWindowScreenFlag) != 0
+		|| fWindow->HasDirectFrameBufferAccess()) {
+		// the client draws behind our back
+		fBackingStore->Flush();
+		return;
+	}
+
+	BRegion* dirty = fRegionPool.GetRegion();
+	if (dirty == NULL) {
+		fBackingStore->Flush();
+		return;
+	}
+	_GetAllDirtyRegions(*dirty);
+
+	fBackingStore->SetVisibleRegion(fDrawingEngine, VisibleContentRegion(),
+		*dirty, fFrame.LeftTop(), fFrame.IntegerWidth() + 1,
+		fFrame.IntegerHeight() + 1);
+
+	fRegionPool.Recycle(dirty);
 }
 
 
@@ -414,6 +458,13 @@ Window::ScrollViewBy(View* view, int32 dx, int32 dy)
 
 	view->ScrollBy(dx, dy, dirty);
 
+	if (fBackingStore != NULL) {
+		// the hidden parts of the view have not been scrolled along
+		if (!fContentRegionValid)
+			_UpdateContentRegion();
+		_InvalidateBackingStore(view->ScreenAndUserClipping(&fContentRegion));
+	}
+
 //fDrawingEngine->FillRegion(*dirty, (rgb_color){ 255, 0, 255, 255 });
 //snooze(20000);
 
@@ -431,6 +482,18 @@ void
 Window::CopyContents(BRegion* region, int32 xOffset, int32 yOffset)
 {
 	// executed in ServerWindow thread with the read lock held
+	if (fBackingStore != NULL) {
+		// only the visible part is copied, anything hidden at the
+		// destination is outdated now
+		BRegion* destination = fRegionPool.GetRegion(*region);
+		if (destination != NULL) {
+			destination->OffsetBy(xOffset, yOffset);
+			_InvalidateBackingStore(*destination);
+			fRegionPool.Recycle(destination);
+		} else
+			fBackingStore->Flush();
+	}
+
 	if (!IsVisible())
 		return;
 
@@ -711,6 +774,38 @@ Window::ProcessDirtyRegion(BRegion& region)
 	// have the read lock and the desktop thread
 	// is blocking to get the write lock. IAW, this
 	// is only executed in one thread.
+	BRegion* restored = NULL;
+	if (fBackingStore != NULL) {
+		// blit back what we saved when it was hidden, the region passed
+		// in may be shared with other windows and is not changed
+		restored = fRegionPool.GetRegion(VisibleContentRegion());
+		if (restored != NULL) {
+			restored->IntersectWith(&region);
+			restored->Exclude(&fDirtyRegion);
+			fBackingStore->Restore(fDrawingEngine, *restored,
+				fFrame.LeftTop());
+			if (restored->CountRects() == 0) {
+				fRegionPool.Recycle(restored);
+				restored = NULL;
+			}
+		}
+	}
+
+	BRegion* dirty = &region;
+	if (restored != NULL) {
+		dirty = fRegionPool.GetRegion(region);
+		if (dirty == NULL)
+			dirty = &region;
+		else
+			dirty->Exclude(restored);
+		fRegionPool.Recycle(restored);
+
+		if (dirty->CountRects() == 0) {
+			fRegionPool.Recycle(dirty);
+			return;
+		}
+	}
+
 	if (fDirtyRegion.CountRects() == 0) {
 		// the window needs to be informed
 		// when the dirty region was empty.
@@ -725,8 +820,11 @@ Window::ProcessDirtyRegion(BRegion& region)
 		ServerWindow()->RequestRedraw();
 	}
 
-	fDirtyRegion.Include(&region);
+	fDirtyRegion.Include(dirty);
 	fDirtyCause |= UPDATE_EXPOSE;
+
+	if (dirty != &region)
+		fRegionPool.Recycle(dirty);
 }
 
 
@@ -783,6 +881,8 @@ Window::MarkContentDirty(BRegion& regionOnScreen)
 	// since this won't affect other windows, read locking
 	// is sufficient. If there was no dirty region before,
 	// an update message is triggered
+	_InvalidateBackingStore(regionOnScreen);
+
 	if (fHidden || IsOffscreenWindow())
 		return;
 
@@ -796,6 +896,8 @@ void
 Window::MarkContentDirtyAsync(BRegion& regionOnScreen)
 {
 	// NOTE: see comments in ProcessDirtyRegion()
+	_InvalidateBackingStore(regionOnScreen);
+
 	if (fHidden || IsOffscreenWindow())
 		return;
 
@@ -813,6 +915,16 @@ Window::MarkContentDirtyAsync(BRegion& regionOnScreen)
 void
 Window::InvalidateView(View* view, BRegion& viewRegion)
 {
+	if (view != NULL && fBackingStore != NULL && view->IsVisible()) {
+		BRegion* region = fRegionPool.GetRegion(viewRegion);
+		if (region != NULL) {
+			view->LocalToScreenTransform().Apply(region);
+			_InvalidateBackingStore(*region);
+			fRegionPool.Recycle(region);
+		} else
+			fBackingStore->Flush();
+	}
+
 	if (view && IsVisible() && view->IsVisible()) {
 		if (!fContentRegionValid)
 			_UpdateContentRegion();
@@ -831,6 +943,67 @@ Window::InvalidateView(View* view, BRegion& viewRegion)
 	}
 }
 
+void
+Window::SaveToBackingStore()
+{
+	// this function is only called from the Desktop thread, before the
+	// window leaves the screen
+	if (fBackingStore == NULL)
+		return;
+
+	if (fClippingGeneration != fDesktop->ClippingGeneration()) {
+		// we are not on screen anyway
+		fBackingStore->ForgetScreen();
+		return;
+	}
+
+	BRegion* dirty = fRegionPool.GetRegion();
+	if (dirty == NULL) {
+		fBackingStore->Flush();
+		return;
+	}
+	_GetAllDirtyRegions(*dirty);
+
+	fBackingStore->LeaveScreen(fDrawingEngine, *dirty);
+
+	fRegionPool.Recycle(dirty);
+}
+
+
+/*!	Drops the saved contents of the view, since the client is drawing
+	into it. This is executed in the ServerWindow thread with the read lock
+	held, for every drawing command, so it avoids doing the work again
+	as long as nothing has been saved in between.
+*/
+void
+Window::InvalidateBackingStore(View* view)
+{
+	if (fBackingStore == NULL || fBackingStore->IsEmpty())
+		return;
+
+	if (view == fBackingStoreView
+		&& fBackingStore->SaveCount() == fBackingStoreSaveCount
+		&& !DrawingRegionChanged(view))
+		return;
+
+	if (!fContentRegionValid)
+		_UpdateContentRegion();
+
+	_InvalidateBackingStore(view->ScreenAndUserClipping(&fContentRegion));
+
+	fBackingStoreView = view;
+	fBackingStoreSaveCount = fBackingStore->SaveCount();
+}
+
+
+void
+Window::FlushBackingStore()
+{
+	if (fBackingStore != NULL)
+		fBackingStore->Flush();
+}
+
+
 // DisableUpdateRequests
 void
 Window::DisableUpdateRequests()
@@ -2011,6 +2184,26 @@ Window::_UpdateContentRegion()
 }
 
 
+//!	Collects everything that still has to be drawn, in screen coordinates.
+void
+Window::_GetAllDirtyRegions(BRegion& region)
+{
+	region = fDirtyRegion;
+	if (fPendingUpdateSession->IsUsed())
+		region.Include(&fPendingUpdateSession->DirtyRegion());
+	if (fCurrentUpdateSession->IsUsed())
+		region.Include(&fCurrentUpdateSession->DirtyRegion());
+}
+
+
+void
+Window::_InvalidateBackingStore(const BRegion& regionOnScreen)
+{
+	if (fBackingStore != NULL)
+		fBackingStore->Invalidate(regionOnScreen, fFrame.LeftTop());
+}
+
+
 void
 Window::_ObeySizeLimits()
 {
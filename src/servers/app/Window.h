@@ -64,6 +64,7 @@ namespace BPrivate {
 	class PortLink;
 };
 
+class BackingStore;
 class ClickTarget;
 class ClientLooper;
 class Decorator;
@@ -155,6 +156,13 @@ public:
 			// shortcut for invalidating just one view
 			void				InvalidateView(View* view, BRegion& viewRegion);
 
+			// the backing store is NULL unless enabled in the settings
+			BackingStore*		GetBackingStore() const
+									{ return fBackingStore; }
+			void				SaveToBackingStore();
+			void				InvalidateBackingStore(View* view);
+			void				FlushBackingStore();
+
 			void				DisableUpdateRequests();
 			void				EnableUpdateRequests();
 
@@ -326,6 +334,10 @@ protected:
 
 			void				_UpdateContentRegion();
 
+			void				_GetAllDirtyRegions(BRegion& region);
+			void				_InvalidateBackingStore(
+									const BRegion& regionOnScreen);
+
 			void				_ObeySizeLimits();
 			void				_PropagatePosition();
 
@@ -362,6 +374,15 @@ protected:
 
 			BObjectList<Window> fSubsets;
 
+			// the hidden parts of the contents, and the clipping generation
+			// of the Desktop it was last updated with
+			BackingStore*		fBackingStore;
+			int32				fClippingGeneration;
+			// the view drawn to last, which has already been invalidated
+			// in the backing store
+			View*				fBackingStoreView;
+			uint32				fBackingStoreSaveCount;
+
 			WindowBehaviour*	fWindowBehaviour;
 			View*				fTopView;
 			::ServerWindow*		fWindow;
@@ -597,6 +597,38 @@ DrawingEngine::CopyRegion(/*const*/ BRegion* region, int32 xOffset,
 }
 
 
+void
+DrawingEngine::CopyRegionToBitmap(const BRegion& region, ServerBitmap* bitmap,
+	int32 left, int32 top)
+{
+	ASSERT_PARALLEL_LOCKED();
+
+	AutoFloatingOverlaysHider _(fGraphicsCard, region.Frame());
+
+	int32 count = region.CountRects();
+	for (int32 i = 0; i < count; i++)
+		_CopyBitmapRect(bitmap, region.RectAt(i), left, top, true);
+}
+
+
+void
+DrawingEngine::CopyBitmapToRegion(ServerBitmap* bitmap, const BRegion& region,
+	int32 left, int32 top)
+{
+	ASSERT_PARALLEL_LOCKED();
+
+	AutoFloatingOverlaysHider _(fGraphicsCard, region.Frame());
+
+	int32 count = region.CountRects();
+	for (int32 i = 0; i < count; i++) {
+		BRect touched = _CopyBitmapRect(bitmap, region.RectAt(i), left, top,
+			false);
+		if (touched.IsValid())
+			fGraphicsCard->Invalidate(touched);
+	}
+}
+
+
 void
 DrawingEngine::InvertRect(BRect r)
 {
@@ -1602,6 +1634,45 @@ DrawingEngine::CopyRect(BRect src, int32 xOffset, int32 yOffset) const
 }
 
 
+BRect
+DrawingEngine::_CopyBitmapRect(ServerBitmap* bitmap, BRect rect, int32 left,
+	int32 top, bool toBitmap) const
+{
+	// TODO: assumes drawing buffer is 32 bits (which it currently always is)
+	RenderingBuffer* buffer = fGraphicsCard->DrawingBuffer();
+	if (buffer == NULL || bitmap->ColorSpace() != B_RGB32)
+		return BRect();
+
+	BRect clip(0, 0, buffer->Width() - 1, buffer->Height() - 1);
+	BRect bitmapClip(left, top, left + bitmap->Width() - 1,
+		top + bitmap->Height() - 1);
+	rect = rect & clip & bitmapClip;
+	if (!rect.IsValid())
+		return rect;
+
+	uint32 bytesPerRow = buffer->BytesPerRow();
+	uint32 bitmapBytesPerRow = bitmap->BytesPerRow();
+	uint8* bits = (uint8*)buffer->Bits()
+		+ (ssize_t)rect.left * 4 + (ssize_t)rect.top * bytesPerRow;
+	uint8* bitmapBits = bitmap->Bits()
+		+ ((ssize_t)rect.left - left) * 4
+		+ ((ssize_t)rect.top - top) * bitmapBytesPerRow;
+
+	int32 numBytes = (rect.IntegerWidth() + 1) * 4;
+	int32 height = rect.IntegerHeight() + 1;
+	for (int32 y = 0; y < height; y++) {
+		if (toBitmap)
+			gfxcpy32(bitmapBits, bits, numBytes);
+		else
+			gfxcpy32(bits, bitmapBits, numBytes);
+		bits += bytesPerRow;
+		bitmapBits += bitmapBytesPerRow;
+	}
+
+	return rect;
+}
+
+
 void
 DrawingEngine::SetRendererOffset(int32 offsetX, int32 offsetY)
 {
@@ -95,6 +95,13 @@ public:
 	virtual	void			CopyRegion(/*const*/ BRegion* region,
 								int32 xOffset, int32 yOffset);
 
+	// copy between the drawing buffer and a B_RGB32 bitmap whose origin
+	// is at (left, top) on screen, used for window backing stores
+			void			CopyRegionToBitmap(const BRegion& region,
+								ServerBitmap* bitmap, int32 left, int32 top);
+			void			CopyBitmapToRegion(ServerBitmap* bitmap,
+								const BRegion& region, int32 left, int32 top);
+
 	virtual	void			InvertRect(BRect r);
 
 	virtual	void			DrawBitmap(ServerBitmap* bitmap,
@@ -202,6 +209,9 @@ private:
 			void			_CopyRect(uint8* bits, uint32 width,
 								uint32 height, uint32 bytesPerRow,
 								int32 xOffset, int32 yOffset) const;
+			BRect			_CopyBitmapRect(ServerBitmap* bitmap,
+								BRect rect, int32 left, int32 top,
+								bool toBitmap) const;
 
 	inline	void			_CopyToFront(const BRect& frame);
 
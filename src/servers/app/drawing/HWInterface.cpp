@@ -355,20 +355,16 @@ status_t
 HWInterface::Invalidate(const BRect& frame)
 {
 	if (IsDoubleBuffered()) {
-#if 0
-// NOTE: The UpdateQueue works perfectly fine, but it screws the
-// flicker-free-ness of the double buffered rendering. The problem being the
-// asynchronous nature. The UpdateQueue will transfer regions of the screen
-// which have been clean at the time we are in this function, but which have
-// been damaged meanwhile by drawing into them again. All in all, the
-// UpdateQueue is good for reducing the number of times that the transfer
-// is performed, and makes it happen during refresh only, but until there
-// is a smarter way to synchronize this all better, I've disabled it.
+// NOTE: The UpdateQueue makes the transfer happen during refresh only, and
+// reduces the number of times that it is performed. But because of its
+// asynchronous nature, it may transfer regions of the screen which have been
+// clean at the time we are in this function, but which have been damaged
+// meanwhile by drawing into them again. It is therefore only used by the
+// interfaces which explicitly enable it, see SetAsyncDoubleBuffered().
 		if (fUpdateExecutor != NULL) {
 			fUpdateExecutor->AddRect(frame);
 			return B_OK;
 		}
-#endif
 		return CopyBackToFront(frame);
 	}
 	return B_OK;
@@ -172,6 +172,9 @@ public:
 	// while as CopyBackToFront() actually performs the operation
 	// either directly or asynchronously by the UpdateQueue thread
 	virtual	status_t			CopyBackToFront(const BRect& frame);
+	// called by the UpdateQueue after it transferred a batch of updates,
+	// interfaces flipping between front buffers make the new one visible
+	virtual	void				PresentFrontBuffer() {}
 
 protected:
 	virtual	void				_CopyBackToFront(/*const*/ BRegion& region);
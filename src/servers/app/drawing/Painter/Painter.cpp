@@ -54,11 +54,13 @@
 #include <View.h>
 
 #include "AlphaMask.h"
+#include "BlendKernels.h"
 #include "BitmapPainter.h"
 #include "DrawingMode.h"
 #include "GlobalSubpixelSettings.h"
 #include "PatternHandler.h"
 #include "RenderingBuffer.h"
+#include "RenderThreadPool.h"
 #include "ServerBitmap.h"
 #include "ServerFont.h"
 #include "SystemPalette.h"
@@ -84,6 +86,25 @@ using std::nothrow;
 #endif
 
 
+// A rect fill that is split into bands by the RenderThreadPool
+struct Painter::RectFillJob {
+	enum {
+		kFillSolid,
+		kFillVerticalGradient,
+		kBlend
+	};
+
+	int32					mode;
+	agg::rendering_buffer*	buffer;
+	const BRegion*			region;
+	clipping_rect			rect;
+	uint32					color;
+	const uint32*			colors;
+		// one color per row, starting at rect.top
+	rgb_color				blendColor;
+};
+
+
 #define CHECK_CLIPPING	if (!fValidClipping) return BRect(0, 0, -1, -1);
 #define CHECK_CLIPPING_NO_RETURN	if (!fValidClipping) return;
 
@@ -110,6 +131,7 @@ using std::nothrow;
 static uint32 detect_simd();
 
 uint32 gSIMDFlags = detect_simd();
+const blend_kernels* gBlendKernels = select_blend_kernels(gSIMDFlags);
 
 
 /*!	Detect SIMD flags for use in AppServer. Checks all CPUs in the system
@@ -163,6 +185,8 @@ detect_simd()
 				cpuSIMD |= APPSERVER_SIMD_MMX;
 			if (edx & (1 << 25))
 				cpuSIMD |= APPSERVER_SIMD_SSE;
+			if (edx & (1 << 26))
+				cpuSIMD |= APPSERVER_SIMD_SSE2;
 		} else {
 			// no flags can be identified
 			cpuSIMD = 0;
@@ -170,7 +194,17 @@ detect_simd()
 		systemSIMD &= cpuSIMD;
 	}
 	return systemSIMD;
-#else	// !__i386__
+#elif defined(__x86_64__)
+	// SSE2 is part of x86_64. The kernel layer doesn't implement
+	// get_cpuid(), so use the compiler's check, which also makes sure the OS
+	// saves the AVX registers. MMX and SSE are left out on purpose, as the
+	// routines using them are 32 bit only.
+	uint32 systemSIMD = APPSERVER_SIMD_SSE2;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		systemSIMD |= APPSERVER_SIMD_AVX2;
+	return systemSIMD;
+#else
 	return 0;
 #endif
 }
@@ -195,6 +229,7 @@ Painter::Painter()
 	fLineCapMode(B_BUTT_CAP),
 	fLineJoinMode(B_MITER_JOIN),
 	fMiterLimit(B_DEFAULT_MITER_LIMIT),
+	fFillRule(agg::fill_non_zero),
 
 	fPatternHandler(),
 	fTextRenderer(fSubpixRenderer, fRenderer, fRendererBin, fUnpackedScanline,
@@ -428,11 +463,11 @@ Painter::SetStrokeMode(cap_mode lineCap, join_mode joinMode, float miterLimit)
 void
 Painter::SetFillRule(int32 fillRule)
 {
-	agg::filling_rule_e aggFillRule = fillRule == B_EVEN_ODD
+	fFillRule = fillRule == B_EVEN_ODD
 		? agg::fill_even_odd : agg::fill_non_zero;
 
-	fRasterizer.filling_rule(aggFillRule);
-	fSubpixRasterizer.filling_rule(aggFillRule);
+	fRasterizer.filling_rule(fFillRule);
+	fSubpixRasterizer.filling_rule(fFillRule);
 }
 
 
@@ -974,36 +1009,17 @@ Painter::FillRect(const BRect& r, const rgb_color& c) const
 	if (!fValidClipping)
 		return;
 
-	uint8* dst = fBuffer.row_ptr(0);
-	uint32 bpr = fBuffer.stride();
-	int32 left = (int32)r.left;
-	int32 top = (int32)r.top;
-	int32 right = (int32)r.right;
-	int32 bottom = (int32)r.bottom;
 	// get a 32 bit pixel ready with the color
 	pixel32 color;
 	color.data8[0] = c.blue;
 	color.data8[1] = c.green;
 	color.data8[2] = c.red;
 	color.data8[3] = c.alpha;
-	// fill rects, iterate over clipping boxes
-	fBaseRenderer.first_clip_box();
-	do {
-		int32 x1 = max_c(fBaseRenderer.xmin(), left);
-		int32 x2 = min_c(fBaseRenderer.xmax(), right);
-		if (x1 <= x2) {
-			int32 y1 = max_c(fBaseRenderer.ymin(), top);
-			int32 y2 = min_c(fBaseRenderer.ymax(), bottom);
-			uint8* offset = dst + x1 * 4;
-			for (; y1 <= y2; y1++) {
-//					uint32* handle = (uint32*)(offset + y1 * bpr);
-//					for (int32 x = x1; x <= x2; x++) {
-//						*handle++ = color.data32;
-//					}
-				gfxset32(offset + y1 * bpr, color.data32, (x2 - x1 + 1) * 4);
-			}
-		}
-	} while (fBaseRenderer.next_clip_box());
+
+	RectFillJob job;
+	job.mode = RectFillJob::kFillSolid;
+	job.color = color.data32;
+	_RunRectFillJob(job, r);
 }
 
 
@@ -1032,31 +1048,10 @@ Painter::FillRectVerticalGradient(BRect r,
 	_MakeGradient(gradient, colorCount, gradientArray,
 		gradientTop - (int32)r.top, gradientArraySize);
 
-	uint8* dst = fBuffer.row_ptr(0);
-	uint32 bpr = fBuffer.stride();
-	int32 left = (int32)r.left;
-	int32 top = (int32)r.top;
-	int32 right = (int32)r.right;
-	int32 bottom = (int32)r.bottom;
-	// fill rects, iterate over clipping boxes
-	fBaseRenderer.first_clip_box();
-	do {
-		int32 x1 = max_c(fBaseRenderer.xmin(), left);
-		int32 x2 = min_c(fBaseRenderer.xmax(), right);
-		if (x1 <= x2) {
-			int32 y1 = max_c(fBaseRenderer.ymin(), top);
-			int32 y2 = min_c(fBaseRenderer.ymax(), bottom);
-			uint8* offset = dst + x1 * 4;
-			for (; y1 <= y2; y1++) {
-//					uint32* handle = (uint32*)(offset + y1 * bpr);
-//					for (int32 x = x1; x <= x2; x++) {
-//						*handle++ = gradientArray[y1 - top];
-//					}
-				gfxset32(offset + y1 * bpr, gradientArray[y1 - top],
-					(x2 - x1 + 1) * 4);
-			}
-		}
-	} while (fBaseRenderer.next_clip_box());
+	RectFillJob job;
+	job.mode = RectFillJob::kFillVerticalGradient;
+	job.colors = gradientArray;
+	_RunRectFillJob(job, r);
 }
 
 
@@ -1720,31 +1715,81 @@ Painter::_BlendRect32(const BRect& r, const rgb_color& c) const
 	if (!fValidClipping)
 		return;
 
-	uint8* dst = fBuffer.row_ptr(0);
-	uint32 bpr = fBuffer.stride();
+	RectFillJob job;
+	job.mode = RectFillJob::kBlend;
+	job.blendColor = c;
+	_RunRectFillJob(job, r);
+}
+
+
+// _RunRectFillJob
+void
+Painter::_RunRectFillJob(RectFillJob& job, const BRect& r) const
+{
+	job.buffer = &fBuffer;
+	job.region = fClippingRegion;
+	job.rect.left = (int32)r.left;
+	job.rect.top = (int32)r.top;
+	job.rect.right = (int32)r.right;
+	job.rect.bottom = (int32)r.bottom;
+
+	clipping_rect area = fClippingRegion->FrameInt();
+	area.left = max_c(area.left, job.rect.left);
+	area.top = max_c(area.top, job.rect.top);
+	area.right = min_c(area.right, job.rect.right);
+	area.bottom = min_c(area.bottom, job.rect.bottom);
+	if (area.left > area.right || area.top > area.bottom)
+		return;
+
+	RenderThreadPool::Default()->RunBands(&_FillRectBand, &job, area);
+}
+
+
+/*!	Fills the rows \a bandTop to \a bandBottom of a RectFillJob, iterating
+	over the clipping rects directly, since the clip box iteration of the
+	base renderer can't be shared between threads.
+*/
+/*static*/ void
+Painter::_FillRectBand(void* cookie, int32 bandTop, int32 bandBottom)
+{
+	const RectFillJob& job = *(const RectFillJob*)cookie;
+	const clipping_rect& rect = job.rect;
+	uint32 bpr = job.buffer->stride();
+
+	int32 count = job.region->CountRects();
+	for (int32 i = 0; i < count; i++) {
+		clipping_rect box = job.region->RectAtInt(i);
+		if (box.top > bandBottom) {
+			// the rects are sorted from top to bottom
+			break;
+		}
 
-	int32 left = (int32)r.left;
-	int32 top = (int32)r.top;
-	int32 right = (int32)r.right;
-	int32 bottom = (int32)r.bottom;
-
-	// fill rects, iterate over clipping boxes
-	fBaseRenderer.first_clip_box();
-	do {
-		int32 x1 = max_c(fBaseRenderer.xmin(), left);
-		int32 x2 = min_c(fBaseRenderer.xmax(), right);
-		if (x1 <= x2) {
-			int32 y1 = max_c(fBaseRenderer.ymin(), top);
-			int32 y2 = min_c(fBaseRenderer.ymax(), bottom);
-
-			uint8* offset = dst + x1 * 4 + y1 * bpr;
-			for (; y1 <= y2; y1++) {
-				blend_line32(offset, x2 - x1 + 1, c.red, c.green, c.blue,
-					c.alpha);
-				offset += bpr;
+		int32 x1 = max_c(box.left, rect.left);
+		int32 x2 = min_c(box.right, rect.right);
+		int32 y1 = max_c(max_c(box.top, rect.top), bandTop);
+		int32 y2 = min_c(min_c(box.bottom, rect.bottom), bandBottom);
+		if (x1 > x2 || y1 > y2)
+			continue;
+
+		uint8* offset = job.buffer->row_ptr(y1) + x1 * 4;
+		for (; y1 <= y2; y1++) {
+			switch (job.mode) {
+				case RectFillJob::kFillSolid:
+					gfxset32(offset, job.color, (x2 - x1 + 1) * 4);
+					break;
+				case RectFillJob::kFillVerticalGradient:
+					gfxset32(offset, job.colors[y1 - rect.top],
+						(x2 - x1 + 1) * 4);
+					break;
+				case RectFillJob::kBlend:
+					blend_line32(offset, x2 - x1 + 1, job.blendColor.red,
+						job.blendColor.green, job.blendColor.blue,
+						job.blendColor.alpha);
+					break;
 			}
+			offset += bpr;
 		}
-	} while (fBaseRenderer.next_clip_box());
+	}
 }
 
 
@@ -2097,6 +2142,75 @@ Painter::_MakeGradient(Array& array, const BGradient& gradient) const
 }
 
 
+// A gradient fill that is split into bands by the RenderThreadPool
+template<class SpanGradient>
+struct GradientFillJob {
+	const agg::path_storage*	path;
+	pixfmt*						pixelFormat;
+	const BRegion*				region;
+	int							offsetX;
+	int							offsetY;
+	agg::filling_rule_e			fillRule;
+	const typename SpanGradient::interpolator_type* interpolator;
+	const SpanGradient*			spanGradient;
+};
+
+
+/*!	Renders the rows \a bandTop to \a bandBottom of a GradientFillJob.
+	Everything that the scanline rendering changes, the rasterizer, the
+	scanline, the clip box iteration of the base renderer and the position of
+	the span interpolator, is set up per band, only the pixel format and the
+	gradient colors are shared.
+*/
+template<class SpanGradient>
+static void
+fill_gradient_band(void* cookie, int32 bandTop, int32 bandBottom)
+{
+	typedef typename SpanGradient::interpolator_type interpolator_type;
+	typedef agg::span_allocator<agg::rgba8> span_allocator_type;
+	typedef agg::renderer_scanline_aa<renderer_base, span_allocator_type,
+				SpanGradient> renderer_gradient_type;
+
+	const GradientFillJob<SpanGradient>& job
+		= *(const GradientFillJob<SpanGradient>*)cookie;
+
+	clipping_rect frame = job.region->FrameInt();
+	BRegion bandRegion(BRect(frame.left, bandTop, frame.right, bandBottom));
+	bandRegion.IntersectWith(job.region);
+
+	renderer_base baseRenderer(*job.pixelFormat);
+	baseRenderer.set_clipping_region(&bandRegion);
+	baseRenderer.set_offset(job.offsetX, job.offsetY);
+
+	interpolator_type spanInterpolator(*job.interpolator);
+	SpanGradient spanGradient(spanInterpolator,
+		job.spanGradient->gradient_function(),
+		job.spanGradient->color_function(), job.spanGradient->d1(),
+		job.spanGradient->d2());
+	span_allocator_type spanAllocator;
+	renderer_gradient_type gradientRenderer(baseRenderer, spanAllocator,
+		spanGradient);
+
+	rasterizer_type rasterizer;
+#if ALIASED_DRAWING
+	rasterizer.gamma(agg::gamma_threshold(0.5));
+#endif
+	rasterizer.filling_rule(job.fillRule);
+	rasterizer.clip_box(frame.left, bandTop, frame.right + 1, bandBottom + 1);
+
+	unsigned count = job.path->total_vertices();
+	for (unsigned i = 0; i < count; i++) {
+		double x;
+		double y;
+		unsigned command = job.path->vertex(i, &x, &y);
+		rasterizer.add_vertex(x, y, command);
+	}
+
+	scanline_unpacked_type scanline;
+	agg::render_scanlines(rasterizer, scanline, gradientRenderer);
+}
+
+
 template<class VertexSource, typename GradientFunction>
 void
 Painter::_RasterizePath(VertexSource& path, const BGradient& gradient,
@@ -2122,6 +2236,37 @@ Painter::_RasterizePath(VertexSource& path, const BGradient& gradient,
 	span_gradient_type spanGradient(spanInterpolator, function, colorArray,
 		0, gradientStop);
 
+	if (fMaskedUnpackedScanline == NULL) {
+		clipping_rect area = fClippingRegion->FrameInt();
+		BRect bounds = _BoundingBox(path);
+		area.left = max_c(area.left, (int32)floorf(bounds.left));
+		area.top = max_c(area.top, (int32)floorf(bounds.top));
+		area.right = min_c(area.right, (int32)ceilf(bounds.right));
+		area.bottom = min_c(area.bottom, (int32)ceilf(bounds.bottom));
+
+		RenderThreadPool* pool = RenderThreadPool::Default();
+		if (area.left <= area.right && area.top <= area.bottom
+			&& pool->ShouldSplit(area)) {
+			// the vertex source can only be iterated by one thread
+			agg::path_storage flattenedPath;
+			flattenedPath.concat_path(path);
+
+			GradientFillJob<span_gradient_type> job;
+			job.path = &flattenedPath;
+			job.pixelFormat = &fPixelFormat;
+			job.region = fClippingRegion;
+			job.offsetX = fBaseRenderer.offset_x();
+			job.offsetY = fBaseRenderer.offset_y();
+			job.fillRule = fFillRule;
+			job.interpolator = &spanInterpolator;
+			job.spanGradient = &spanGradient;
+
+			pool->RunBands(&fill_gradient_band<span_gradient_type>, &job,
+				area);
+			return;
+		}
+	}
+
 	renderer_gradient_type gradientRenderer(fBaseRenderer, spanAllocator,
 		spanGradient);
 
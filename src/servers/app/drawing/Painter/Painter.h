@@ -46,6 +46,8 @@ class ServerFont;
 // Defines for SIMD support.
 #define APPSERVER_SIMD_MMX	(1 << 0)
 #define APPSERVER_SIMD_SSE	(1 << 1)
+#define APPSERVER_SIMD_SSE2	(1 << 2)
+#define APPSERVER_SIMD_AVX2	(1 << 3)
 
 
 class Painter {
@@ -284,6 +286,12 @@ private:
 			void				_BlendRect32(const BRect& r,
 									const rgb_color& c) const;
 
+			struct RectFillJob;
+			void				_RunRectFillJob(RectFillJob& job,
+									const BRect& r) const;
+	static	void				_FillRectBand(void* cookie, int32 bandTop,
+									int32 bandBottom);
+
 
 			template<class VertexSource>
 			BRect				_BoundingBox(VertexSource& path) const;
@@ -351,6 +359,7 @@ private:
 			cap_mode			fLineCapMode;
 			join_mode			fLineJoinMode;
 			float				fMiterLimit;
+			agg::filling_rule_e	fFillRule;
 
 			PatternHandler		fPatternHandler;
 
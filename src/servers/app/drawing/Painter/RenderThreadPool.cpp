@@ -0,0 +1,228 @@
+/*
+ * Copyright 2019, Dario Casalinuovo. All rights reserved.
+ * Distributed under the terms of the MIT License.
+ */
+
+
+#include "RenderThreadPool.h"
+
+#include <stdio.h>
+
+
+// Areas smaller than this are not worth the synchronization overhead.
+static const int64 kMinParallelPixels = 256 * 256;
+// Bands are never made smaller than this, to keep the scanlines of a band
+// in the cache of one CPU.
+static const int32 kMinBandHeight = 16;
+
+
+struct RenderThreadPool::Job {
+	RenderThreadPool::band_function function;
+	void*				cookie;
+	int32				top;
+	int32				bottom;
+	int32				bandHeight;
+	int32				bandCount;
+	int32				nextBand;
+		// protected by fLock
+	int32				pendingBands;
+	sem_id				doneSem;
+	Job*				next;
+};
+
+
+RenderThreadPool::RenderThreadPool()
+	:
+	fLock("render thread pool"),
+	fFirstJob(NULL),
+	fWorkSem(-1),
+	fThreadCount(0),
+	fQuitting(false)
+{
+	system_info info;
+	if (get_system_info(&info) != B_OK || info.cpu_count < 2)
+		return;
+
+	fWorkSem = create_sem(0, "render thread pool work");
+	if (fWorkSem < 0)
+		return;
+
+	// the thread that draws takes part in the rendering, too
+	int32 threadCount = min_c((int32)info.cpu_count - 1, kMaxThreads);
+	for (int32 i = 0; i < threadCount; i++) {
+		char name[B_OS_NAME_LENGTH];
+		snprintf(name, sizeof(name), "render worker %" B_PRId32, i);
+
+		thread_id thread = spawn_thread(&_WorkerEntry, name,
+			B_DISPLAY_PRIORITY, this);
+		if (thread < 0)
+			break;
+
+		fThreads[fThreadCount++] = thread;
+		resume_thread(thread);
+	}
+}
+
+
+RenderThreadPool::~RenderThreadPool()
+{
+	fQuitting = true;
+
+	if (fThreadCount > 0)
+		release_sem_etc(fWorkSem, fThreadCount, 0);
+
+	for (int32 i = 0; i < fThreadCount; i++) {
+		status_t exitValue;
+		wait_for_thread(fThreads[i], &exitValue);
+	}
+
+	if (fWorkSem >= 0)
+		delete_sem(fWorkSem);
+}
+
+
+/*static*/ RenderThreadPool*
+RenderThreadPool::Default()
+{
+	static RenderThreadPool sDefault;
+	return &sDefault;
+}
+
+
+/*!	Returns whether RunBands() would split \a area at all. Callers can use
+	this to avoid preparing for a parallel run when it doesn't happen anyway.
+*/
+bool
+RenderThreadPool::ShouldSplit(const clipping_rect& area) const
+{
+	int32 height = area.bottom - area.top + 1;
+	int64 pixels = (int64)(area.right - area.left + 1) * height;
+
+	return fThreadCount > 0 && pixels >= kMinParallelPixels
+		&& height >= 2 * kMinBandHeight;
+}
+
+
+/*!	Calls \a function for horizontal bands that cover \a area, and waits
+	until all of them are done.
+*/
+void
+RenderThreadPool::RunBands(band_function function, void* cookie,
+	const clipping_rect& area)
+{
+	int32 height = area.bottom - area.top + 1;
+
+	// more bands than threads even out the load when the bands are not
+	// equally expensive, for example for a complex clipping region
+	int32 bandCount = min_c((fThreadCount + 1) * 2, height / kMinBandHeight);
+
+	Job job;
+	job.doneSem = -1;
+	if (ShouldSplit(area))
+		job.doneSem = create_sem(0, "render bands");
+
+	if (job.doneSem < 0) {
+		function(cookie, area.top, area.bottom);
+		return;
+	}
+
+	job.function = function;
+	job.cookie = cookie;
+	job.top = area.top;
+	job.bottom = area.bottom;
+	job.bandHeight = (height + bandCount - 1) / bandCount;
+	job.bandCount = (height + job.bandHeight - 1) / job.bandHeight;
+	job.nextBand = 0;
+	job.pendingBands = job.bandCount;
+	job.next = NULL;
+
+	fLock.Lock();
+	Job** last = &fFirstJob;
+	while (*last != NULL)
+		last = &(*last)->next;
+	*last = &job;
+	fLock.Unlock();
+
+	release_sem_etc(fWorkSem, min_c(job.bandCount - 1, fThreadCount),
+		B_DO_NOT_RESCHEDULE);
+
+	while (_RunNextBand(&job))
+		;
+
+	while (acquire_sem(job.doneSem) == B_INTERRUPTED)
+		;
+	delete_sem(job.doneSem);
+}
+
+
+/*static*/ int32
+RenderThreadPool::_WorkerEntry(void* cookie)
+{
+	return ((RenderThreadPool*)cookie)->_Worker();
+}
+
+
+int32
+RenderThreadPool::_Worker()
+{
+	while (true) {
+		if (acquire_sem(fWorkSem) == B_INTERRUPTED)
+			continue;
+		if (fQuitting)
+			break;
+
+		// help with whatever is queued, there might be less bands left than
+		// the wake ups we got
+		while (_RunNextBand(NULL))
+			;
+	}
+
+	return 0;
+}
+
+
+/*!	Claims the next band of \a job, or of the first queued job if \a job
+	is \c NULL, and renders it. Returns \c false if there was nothing left
+	to do.
+*/
+bool
+RenderThreadPool::_RunNextBand(Job* job)
+{
+	fLock.Lock();
+
+	if (job == NULL)
+		job = fFirstJob;
+	if (job == NULL || job->nextBand >= job->bandCount) {
+		fLock.Unlock();
+		return false;
+	}
+
+	int32 band = job->nextBand++;
+	if (job->nextBand == job->bandCount) {
+		// all bands are taken, nobody else needs to see this job anymore
+		Job** previous = &fFirstJob;
+		while (*previous != job)
+			previous = &(*previous)->next;
+		*previous = job->next;
+	}
+
+	fLock.Unlock();
+
+	_RunBand(job, band);
+	return true;
+}
+
+
+void
+RenderThreadPool::_RunBand(Job* job, int32 band)
+{
+	int32 top = job->top + band * job->bandHeight;
+	int32 bottom = min_c(top + job->bandHeight - 1, job->bottom);
+
+	job->function(job->cookie, top, bottom);
+
+	// the job lives on the stack of the thread that waits for it, it must
+	// not be touched after the last band has been reported
+	if (atomic_add(&job->pendingBands, -1) == 1)
+		release_sem(job->doneSem);
+}
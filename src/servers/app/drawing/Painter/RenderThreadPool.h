@@ -0,0 +1,64 @@
+/*
+ * Copyright 2019, Dario Casalinuovo. All rights reserved.
+ * Distributed under the terms of the MIT License.
+ */
+#ifndef RENDER_THREAD_POOL_H
+#define RENDER_THREAD_POOL_H
+
+
+#include <Locker.h>
+#include <OS.h>
+#include <Region.h>
+
+
+/*!	\class RenderThreadPool RenderThreadPool.h
+	\brief Worker threads shared by all Painters to render large primitives.
+
+	RunBands() splits an area into horizontal bands, and renders them on the
+	workers and the calling thread at the same time. It only returns when all
+	bands are done, so the drawing order of the caller is kept. Small areas,
+	and all areas on single CPU systems, are rendered by the caller alone.
+
+	The band function must not touch any state that is shared between bands,
+	other than reading it, and writing the pixels inside its band.
+*/
+class RenderThreadPool {
+public:
+	typedef void (*band_function)(void* cookie, int32 top, int32 bottom);
+
+								RenderThreadPool();
+								~RenderThreadPool();
+
+	static	RenderThreadPool*	Default();
+
+			int32				CountThreads() const
+									{ return fThreadCount; }
+
+			bool				ShouldSplit(const clipping_rect& area) const;
+			void				RunBands(band_function function, void* cookie,
+									const clipping_rect& area);
+
+private:
+			struct Job;
+
+	static	int32				_WorkerEntry(void* cookie);
+			int32				_Worker();
+
+			bool				_RunNextBand(Job* job);
+			void				_RunBand(Job* job, int32 band);
+
+private:
+	enum {
+		kMaxThreads = 8
+	};
+
+			BLocker				fLock;
+			Job*				fFirstJob;
+			sem_id				fWorkSem;
+			thread_id			fThreads[kMaxThreads];
+			int32				fThreadCount;
+	volatile bool				fQuitting;
+};
+
+
+#endif	// RENDER_THREAD_POOL_H
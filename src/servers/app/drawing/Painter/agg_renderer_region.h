@@ -135,6 +135,9 @@ namespace agg
 			}
 		}
 
+		//--------------------------------------------------------------------
+		const BRegion* clipping_region() const { return m_region; }
+
 		//--------------------------------------------------------------------
 		void set_offset(int offset_x, int offset_y)
 		{
@@ -147,6 +150,9 @@ namespace agg
 			}
 		}
 
+		int offset_x() const { return m_offset_x; }
+		int offset_y() const { return m_offset_y; }
+
 		//--------------------------------------------------------------------
 		void translate_to_base_ren_x(int& x)
 		{
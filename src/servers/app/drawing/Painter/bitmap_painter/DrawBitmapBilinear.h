@@ -9,6 +9,7 @@
 #define DRAW_BITMAP_BILINEAR_H
 
 #include "Painter.h"
+#include "RenderThreadPool.h"
 
 #include <typeinfo>
 
@@ -52,28 +53,62 @@ struct DrawBitmapBilinearOptimized {
 		fWeightsX = filterData.fWeightsX;
 		fWeightsY = filterData.fWeightsY;
 
-		const int32 left = (int32)destinationRect.left;
-		const int32 top = (int32)destinationRect.top;
-		const int32 right = (int32)destinationRect.right;
-		const int32 bottom = (int32)destinationRect.bottom;
+		fBuffer = &aggInterface.fBuffer;
+		fClippingRegion = aggInterface.fBaseRenderer.clipping_region();
+		fFilterData = &filterData;
+		fDestinationRect.left = (int32)destinationRect.left;
+		fDestinationRect.top = (int32)destinationRect.top;
+		fDestinationRect.right = (int32)destinationRect.right;
+		fDestinationRect.bottom = (int32)destinationRect.bottom;
 
-		renderer_base& baseRenderer = aggInterface.fBaseRenderer;
+		if (fClippingRegion == NULL)
+			return;
+
+		clipping_rect area = fClippingRegion->FrameInt();
+		area.left = max_c(area.left, fDestinationRect.left);
+		area.top = max_c(area.top, fDestinationRect.top);
+		area.right = min_c(area.right, fDestinationRect.right);
+		area.bottom = min_c(area.bottom, fDestinationRect.bottom);
+		if (area.left > area.right || area.top > area.bottom)
+			return;
+
+		RenderThreadPool::Default()->RunBands(&_DrawBand, this, area);
+	}
+
+private:
+	static void _DrawBand(void* cookie, int32 bandTop, int32 bandBottom)
+	{
+		// DrawToClipRect() advances fDestination, so every band needs
+		// its own copy
+		OptimizedVersion painter(*static_cast<OptimizedVersion*>(
+			(DrawBitmapBilinearOptimized*)cookie));
+
+		const int32 left = painter.fDestinationRect.left;
+		const int32 top = painter.fDestinationRect.top;
+		const int32 right = painter.fDestinationRect.right;
+		const int32 bottom = min_c(painter.fDestinationRect.bottom,
+			bandBottom);
+		const FilterData& filterData = *painter.fFilterData;
 
 		// iterate over clipping boxes
-		baseRenderer.first_clip_box();
-		do {
-			const int32 x1 = max_c(baseRenderer.xmin(), left);
-			const int32 x2 = min_c(baseRenderer.xmax(), right);
+		int32 count = painter.fClippingRegion->CountRects();
+		for (int32 i = 0; i < count; i++) {
+			clipping_rect box = painter.fClippingRegion->RectAtInt(i);
+			if (box.top > bandBottom)
+				break;
+
+			const int32 x1 = max_c(box.left, left);
+			const int32 x2 = min_c(box.right, right);
 			if (x1 > x2)
 				continue;
 
-			int32 y1 = max_c(baseRenderer.ymin(), top);
-			int32 y2 = min_c(baseRenderer.ymax(), bottom);
+			int32 y1 = max_c(max_c(box.top, top), bandTop);
+			int32 y2 = min_c(box.bottom, bottom);
 			if (y1 > y2)
 				continue;
 
 			// buffer offset into destination
-			fDestination = aggInterface.fBuffer.row_ptr(y1) + x1 * 4;
+			painter.fDestination = painter.fBuffer->row_ptr(y1) + x1 * 4;
 
 			// x and y are needed as indices into the weight arrays, so the
 			// offset into the target buffer needs to be compensated
@@ -85,10 +120,8 @@ struct DrawBitmapBilinearOptimized {
 			//printf("x: %ld - %ld\n", xIndexL, xIndexR);
 			//printf("y: %ld - %ld\n", y1, y2);
 
-			static_cast<OptimizedVersion*>(this)->DrawToClipRect(
-				xIndexL, xIndexR, y1, y2);
-
-		} while (baseRenderer.next_clip_box());
+			painter.DrawToClipRect(xIndexL, xIndexR, y1, y2);
+		}
 	}
 
 protected:
@@ -98,6 +131,11 @@ protected:
 	uint32					fDestinationBytesPerRow;
 	FilterInfo*				fWeightsX;
 	FilterInfo*				fWeightsY;
+
+	agg::rendering_buffer*	fBuffer;
+	const BRegion*			fClippingRegion;
+	const FilterData*		fFilterData;
+	clipping_rect			fDestinationRect;
 };
 
 
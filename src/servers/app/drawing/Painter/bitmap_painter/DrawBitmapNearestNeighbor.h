@@ -9,6 +9,7 @@
 #define DRAW_BITMAP_NEAREST_NEIGHBOR_H
 
 #include "Painter.h"
+#include "RenderThreadPool.h"
 
 
 struct DrawBitmapNearestNeighborCopy {
@@ -84,57 +85,99 @@ struct DrawBitmapNearestNeighborCopy {
 		//	yIndices[0], yIndices[dstHeight - 2], yIndices[dstHeight - 1],
 		//	dstHeight, srcHeight * scaleY);
 
-		const int32 left = (int32)destinationRect.left;
-		const int32 top = (int32)destinationRect.top;
-		const int32 right = (int32)destinationRect.right;
-		const int32 bottom = (int32)destinationRect.bottom;
+		BandJob job;
+		job.source = &bitmap;
+		job.destination = &aggInterface.fBuffer;
+		job.clippingRegion = &clippingRegion;
+		job.xIndices = xIndices;
+		job.yIndices = yIndices;
+		job.xIndexOffset = filterWeightXIndexOffset;
+		job.yIndexOffset = filterWeightYIndexOffset;
+		job.rect.left = (int32)destinationRect.left;
+		job.rect.top = (int32)destinationRect.top;
+		job.rect.right = (int32)destinationRect.right;
+		job.rect.bottom = (int32)destinationRect.bottom;
+
+		clipping_rect area = clippingRegion.FrameInt();
+		area.left = max_c(area.left, job.rect.left);
+		area.top = max_c(area.top, job.rect.top);
+		area.right = min_c(area.right, job.rect.right);
+		area.bottom = min_c(area.bottom, job.rect.bottom);
+		if (area.left <= area.right && area.top <= area.bottom)
+			RenderThreadPool::Default()->RunBands(&_DrawBand, &job, area);
 
-		const uint32 dstBPR = aggInterface.fBuffer.stride();
+		//printf("draw bitmap %.5fx%.5f: %lld\n", xScale, yScale,
+		//	system_time() - now);
+	}
+
+private:
+	struct BandJob {
+		agg::rendering_buffer*	source;
+		agg::rendering_buffer*	destination;
+		const BRegion*			clippingRegion;
+		const uint16*			xIndices;
+		const uint16*			yIndices;
+		uint32					xIndexOffset;
+		uint32					yIndexOffset;
+		clipping_rect			rect;
+	};
+
+	static void
+	_DrawBand(void* cookie, int32 bandTop, int32 bandBottom)
+	{
+		const BandJob& job = *(const BandJob*)cookie;
+
+		const int32 left = job.rect.left;
+		const int32 top = job.rect.top;
+		const int32 right = job.rect.right;
+		const int32 bottom = min_c(job.rect.bottom, bandBottom);
 
-		renderer_base& baseRenderer = aggInterface.fBaseRenderer;
+		const uint32 dstBPR = job.destination->stride();
 
 		// iterate over clipping boxes
-		baseRenderer.first_clip_box();
-		do {
-			const int32 x1 = max_c(baseRenderer.xmin(), left);
-			const int32 x2 = min_c(baseRenderer.xmax(), right);
+		int32 count = job.clippingRegion->CountRects();
+		for (int32 i = 0; i < count; i++) {
+			clipping_rect box = job.clippingRegion->RectAtInt(i);
+			if (box.top > bandBottom)
+				break;
+
+			const int32 x1 = max_c(box.left, left);
+			const int32 x2 = min_c(box.right, right);
 			if (x1 > x2)
 				continue;
 
-			int32 y1 = max_c(baseRenderer.ymin(), top);
-			int32 y2 = min_c(baseRenderer.ymax(), bottom);
+			int32 y1 = max_c(max_c(box.top, top), bandTop);
+			int32 y2 = min_c(box.bottom, bottom);
 			if (y1 > y2)
 				continue;
 
 			// buffer offset into destination
-			uint8* dst = aggInterface.fBuffer.row_ptr(y1) + x1 * 4;
+			uint8* dst = job.destination->row_ptr(y1) + x1 * 4;
 
 			// x and y are needed as indeces into the wheight arrays, so the
 			// offset into the target buffer needs to be compensated
-			const int32 xIndexL = x1 - left - filterWeightXIndexOffset;
-			const int32 xIndexR = x2 - left - filterWeightXIndexOffset;
-			y1 -= top + filterWeightYIndexOffset;
-			y2 -= top + filterWeightYIndexOffset;
+			const int32 xIndexL = x1 - left - job.xIndexOffset;
+			const int32 xIndexR = x2 - left - job.xIndexOffset;
+			y1 -= top + job.yIndexOffset;
+			y2 -= top + job.yIndexOffset;
 
 		//printf("x: %ld - %ld\n", xIndexL, xIndexR);
 		//printf("y: %ld - %ld\n", y1, y2);
 
 			for (; y1 <= y2; y1++) {
 				// buffer offset into source (top row)
-				register const uint8* src = bitmap.row_ptr(yIndices[y1]);
+				register const uint8* src
+					= job.source->row_ptr(job.yIndices[y1]);
 				// buffer handle for destination to be incremented per pixel
 				register uint32* d = (uint32*)dst;
 
 				for (int32 x = xIndexL; x <= xIndexR; x++) {
-					*d = *(uint32*)(src + xIndices[x]);
+					*d = *(uint32*)(src + job.xIndices[x]);
 					d++;
 				}
 				dst += dstBPR;
 			}
-		} while (baseRenderer.next_clip_box());
-
-		//printf("draw bitmap %.5fx%.5f: %lld\n", xScale, yScale,
-		//	system_time() - now);
+		}
 	}
 };
 
@@ -0,0 +1,536 @@
+/*
+ * Copyright 2019, Dario Casalinuovo. All rights reserved.
+ * Distributed under the terms of the MIT License.
+ *
+ * Scalar and vectorized row kernels blending a solid color into B_RGBA32
+ * spans. The scalar kernels are built from the same macros as the drawing
+ * modes and serve as the reference; the vectorized ones compute the very
+ * same values, including the rounding of negative differences by the
+ * arithmetic shifts of the macros.
+ *
+ */
+
+#include "BlendKernels.h"
+
+#include <string.h>
+
+#include "DrawingMode.h"
+#include "Painter.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#	define BLEND_KERNELS_X86
+#	include <immintrin.h>
+#	define TARGET_SSE2	__attribute__((target("sse2")))
+#	define TARGET_AVX2	__attribute__((target("avx2")))
+#endif
+
+
+// #pragma mark - scalar
+
+
+// blend_covers_scalar
+static void
+blend_covers_scalar(uint8* p, unsigned len, uint32 color, const uint8* covers)
+{
+	const uint8* c = (const uint8*)&color;
+	for (; len > 0; len--, p += 4, covers++) {
+		if (*covers == 0)
+			continue;
+
+		if (*covers == 255)
+			memcpy(p, &color, 4);
+		else
+			BLEND(p, c[2], c[1], c[0], *covers);
+	}
+}
+
+// blend_covers16_scalar
+static void
+blend_covers16_scalar(uint8* p, unsigned len, uint32 color, uint8 alpha,
+	const uint8* covers)
+{
+	const uint8* c = (const uint8*)&color;
+	for (; len > 0; len--, p += 4, covers++) {
+		uint16 a = alpha * *covers;
+		if (a == 0)
+			continue;
+
+		if (a == 255 * 255)
+			memcpy(p, &color, 4);
+		else
+			BLEND16(p, c[2], c[1], c[0], a);
+	}
+}
+
+// blend_constant_scalar
+static void
+blend_constant_scalar(uint8* p, unsigned len, uint32 color, uint8 alpha)
+{
+	const uint8* c = (const uint8*)&color;
+	for (; len > 0; len--, p += 4)
+		BLEND(p, c[2], c[1], c[0], alpha);
+}
+
+// blend_subpix_scalar
+static void
+blend_subpix_scalar(uint8* p, unsigned len, uint32 color,
+	const uint8* covers, int blueIndex, int redIndex)
+{
+	const uint8* c = (const uint8*)&color;
+	for (; len >= 3; len -= 3, p += 4, covers += 3) {
+		BLEND_SUBPIX(p, c[2], c[1], c[0], covers[blueIndex], covers[1],
+			covers[redIndex]);
+	}
+}
+
+// blend_subpix16_scalar
+static void
+blend_subpix16_scalar(uint8* p, unsigned len, uint32 color, uint8 alpha,
+	const uint8* covers, int blueIndex, int redIndex)
+{
+	const uint8* c = (const uint8*)&color;
+	for (; len >= 3; len -= 3, p += 4, covers += 3) {
+		uint16 alphaBlue = alpha * covers[blueIndex];
+		uint16 alphaGreen = alpha * covers[1];
+		uint16 alphaRed = alpha * covers[redIndex];
+		BLEND16_SUBPIX(p, c[2], c[1], c[0], alphaBlue, alphaGreen, alphaRed);
+	}
+}
+
+
+const blend_kernels kScalarBlendKernels = {
+	blend_covers_scalar,
+	blend_covers16_scalar,
+	blend_constant_scalar,
+	blend_subpix_scalar,
+	blend_subpix16_scalar
+};
+
+
+#ifdef BLEND_KERNELS_X86
+
+
+// #pragma mark - SSE2
+
+
+// The blend functions work on pixels unpacked to 16 bit per channel and
+// compute d + (s - d) * a >> 8 (or >> 16), splitting the difference into
+// its positive and negative part, as the products don't fit signed 16 bit.
+// The negative part is rounded up, so that the result is rounded down like
+// the arithmetic shift of the scalar version.
+
+// blend8_sse2
+TARGET_SSE2 static inline __m128i
+blend8_sse2(__m128i dest, __m128i color, __m128i alpha)
+{
+	__m128i pos = _mm_subs_epu16(color, dest);
+	__m128i neg = _mm_subs_epu16(dest, color);
+	pos = _mm_srli_epi16(_mm_mullo_epi16(pos, alpha), 8);
+	neg = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(neg, alpha),
+		_mm_set1_epi16(255)), 8);
+	return _mm_sub_epi16(_mm_add_epi16(dest, pos), neg);
+}
+
+// blend16_sse2
+TARGET_SSE2 static inline __m128i
+blend16_sse2(__m128i dest, __m128i color, __m128i alpha)
+{
+	__m128i pos = _mm_subs_epu16(color, dest);
+	__m128i neg = _mm_subs_epu16(dest, color);
+	pos = _mm_mulhi_epu16(pos, alpha);
+	__m128i rest = _mm_mullo_epi16(neg, alpha);
+	neg = _mm_mulhi_epu16(neg, alpha);
+	neg = _mm_add_epi16(neg, _mm_andnot_si128(
+		_mm_cmpeq_epi16(rest, _mm_setzero_si128()), _mm_set1_epi16(1)));
+	return _mm_sub_epi16(_mm_add_epi16(dest, pos), neg);
+}
+
+// select_sse2
+TARGET_SSE2 static inline __m128i
+select_sse2(__m128i mask, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// blend_pixels8_sse2
+TARGET_SSE2 static inline __m128i
+blend_pixels8_sse2(__m128i dest, __m128i color16, __m128i alphaLow,
+	__m128i alphaHigh)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i low = blend8_sse2(_mm_unpacklo_epi8(dest, zero), color16,
+		alphaLow);
+	__m128i high = blend8_sse2(_mm_unpackhi_epi8(dest, zero), color16,
+		alphaHigh);
+	return _mm_or_si128(_mm_packus_epi16(low, high),
+		_mm_set1_epi32((int)0xff000000));
+}
+
+// blend_pixels16_sse2
+TARGET_SSE2 static inline __m128i
+blend_pixels16_sse2(__m128i dest, __m128i color16, __m128i alphaLow,
+	__m128i alphaHigh)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i low = blend16_sse2(_mm_unpacklo_epi8(dest, zero), color16,
+		alphaLow);
+	__m128i high = blend16_sse2(_mm_unpackhi_epi8(dest, zero), color16,
+		alphaHigh);
+	return _mm_or_si128(_mm_packus_epi16(low, high),
+		_mm_set1_epi32((int)0xff000000));
+}
+
+// blend_covers_sse2
+TARGET_SSE2 static void
+blend_covers_sse2(uint8* p, unsigned len, uint32 color, const uint8* covers)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i colorPixels = _mm_set1_epi32(color);
+	const __m128i color16 = _mm_unpacklo_epi8(colorPixels, zero);
+
+	for (; len >= 4; len -= 4, p += 16, covers += 4) {
+		uint32 cover4;
+		memcpy(&cover4, covers, 4);
+		if (cover4 == 0)
+			continue;
+		if (cover4 == 0xffffffff) {
+			_mm_storeu_si128((__m128i*)p, colorPixels);
+			continue;
+		}
+
+		// spread the cover of each pixel over its four bytes
+		__m128i alpha = _mm_cvtsi32_si128(cover4);
+		alpha = _mm_unpacklo_epi8(alpha, alpha);
+		alpha = _mm_unpacklo_epi16(alpha, alpha);
+
+		__m128i dest = _mm_loadu_si128((__m128i*)p);
+		__m128i result = blend_pixels8_sse2(dest, color16,
+			_mm_unpacklo_epi8(alpha, zero), _mm_unpackhi_epi8(alpha, zero));
+		result = select_sse2(_mm_cmpeq_epi8(alpha, _mm_set1_epi8(-1)),
+			colorPixels, result);
+		result = select_sse2(_mm_cmpeq_epi8(alpha, zero), dest, result);
+		_mm_storeu_si128((__m128i*)p, result);
+	}
+
+	blend_covers_scalar(p, len, color, covers);
+}
+
+// blend_covers16_sse2
+TARGET_SSE2 static void
+blend_covers16_sse2(uint8* p, unsigned len, uint32 color, uint8 alpha,
+	const uint8* covers)
+{
+	if (alpha == 0)
+		return;
+
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i opaque = _mm_set1_epi16((short)(255 * 255));
+	const __m128i alpha16 = _mm_set1_epi16(alpha);
+	const __m128i colorPixels = _mm_set1_epi32(color);
+	const __m128i color16 = _mm_unpacklo_epi8(colorPixels, zero);
+
+	for (; len >= 4; len -= 4, p += 16, covers += 4) {
+		uint32 cover4;
+		memcpy(&cover4, covers, 4);
+		if (cover4 == 0)
+			continue;
+		if (cover4 == 0xffffffff && alpha == 255) {
+			_mm_storeu_si128((__m128i*)p, colorPixels);
+			continue;
+		}
+
+		// alpha * cover of each pixel, spread over its four channels
+		__m128i a = _mm_unpacklo_epi8(_mm_cvtsi32_si128(cover4), zero);
+		a = _mm_mullo_epi16(a, alpha16);
+		a = _mm_unpacklo_epi16(a, a);
+		__m128i alphaLow = _mm_unpacklo_epi32(a, a);
+		__m128i alphaHigh = _mm_unpackhi_epi32(a, a);
+
+		__m128i dest = _mm_loadu_si128((__m128i*)p);
+		__m128i result = blend_pixels16_sse2(dest, color16, alphaLow,
+			alphaHigh);
+		result = select_sse2(_mm_packs_epi16(
+				_mm_cmpeq_epi16(alphaLow, opaque),
+				_mm_cmpeq_epi16(alphaHigh, opaque)),
+			colorPixels, result);
+		result = select_sse2(_mm_packs_epi16(
+				_mm_cmpeq_epi16(alphaLow, zero),
+				_mm_cmpeq_epi16(alphaHigh, zero)),
+			dest, result);
+		_mm_storeu_si128((__m128i*)p, result);
+	}
+
+	blend_covers16_scalar(p, len, color, alpha, covers);
+}
+
+// blend_constant_sse2
+TARGET_SSE2 static void
+blend_constant_sse2(uint8* p, unsigned len, uint32 color, uint8 alpha)
+{
+	const __m128i color16 = _mm_unpacklo_epi8(_mm_set1_epi32(color),
+		_mm_setzero_si128());
+	const __m128i alpha16 = _mm_set1_epi16(alpha);
+
+	for (; len >= 4; len -= 4, p += 16) {
+		__m128i dest = _mm_loadu_si128((__m128i*)p);
+		_mm_storeu_si128((__m128i*)p,
+			blend_pixels8_sse2(dest, color16, alpha16, alpha16));
+	}
+
+	blend_constant_scalar(p, len, color, alpha);
+}
+
+// subpix_alpha_sse2
+TARGET_SSE2 static inline __m128i
+subpix_alpha_sse2(const uint8* covers, int blueIndex, int redIndex)
+{
+	// the covers of two pixels, the alpha channel is not blended
+	return _mm_set_epi16(0, covers[3 + redIndex], covers[4],
+		covers[3 + blueIndex], 0, covers[redIndex], covers[1],
+		covers[blueIndex]);
+}
+
+// blend_subpix_sse2
+TARGET_SSE2 static void
+blend_subpix_sse2(uint8* p, unsigned len, uint32 color, const uint8* covers,
+	int blueIndex, int redIndex)
+{
+	const __m128i color16 = _mm_unpacklo_epi8(_mm_set1_epi32(color),
+		_mm_setzero_si128());
+
+	for (; len >= 12; len -= 12, p += 16, covers += 12) {
+		__m128i dest = _mm_loadu_si128((__m128i*)p);
+		_mm_storeu_si128((__m128i*)p, blend_pixels8_sse2(dest, color16,
+			subpix_alpha_sse2(covers, blueIndex, redIndex),
+			subpix_alpha_sse2(covers + 6, blueIndex, redIndex)));
+	}
+
+	blend_subpix_scalar(p, len, color, covers, blueIndex, redIndex);
+}
+
+// blend_subpix16_sse2
+TARGET_SSE2 static void
+blend_subpix16_sse2(uint8* p, unsigned len, uint32 color, uint8 alpha,
+	const uint8* covers, int blueIndex, int redIndex)
+{
+	const __m128i color16 = _mm_unpacklo_epi8(_mm_set1_epi32(color),
+		_mm_setzero_si128());
+	const __m128i alpha16 = _mm_set1_epi16(alpha);
+
+	for (; len >= 12; len -= 12, p += 16, covers += 12) {
+		__m128i dest = _mm_loadu_si128((__m128i*)p);
+		__m128i alphaLow = _mm_mullo_epi16(
+			subpix_alpha_sse2(covers, blueIndex, redIndex), alpha16);
+		__m128i alphaHigh = _mm_mullo_epi16(
+			subpix_alpha_sse2(covers + 6, blueIndex, redIndex), alpha16);
+		_mm_storeu_si128((__m128i*)p,
+			blend_pixels16_sse2(dest, color16, alphaLow, alphaHigh));
+	}
+
+	blend_subpix16_scalar(p, len, color, alpha, covers, blueIndex, redIndex);
+}
+
+
+static const blend_kernels kSSE2BlendKernels = {
+	blend_covers_sse2,
+	blend_covers16_sse2,
+	blend_constant_sse2,
+	blend_subpix_sse2,
+	blend_subpix16_sse2
+};
+
+
+// #pragma mark - AVX2
+
+
+// The 256 bit unpack and pack instructions work on each 128 bit half on
+// its own, so the low half of the unpacked pixels holds the pixels 0, 1
+// and 4, 5, and the high half the pixels 2, 3 and 6, 7.
+
+// blend8_avx2
+TARGET_AVX2 static inline __m256i
+blend8_avx2(__m256i dest, __m256i color, __m256i alpha)
+{
+	__m256i pos = _mm256_subs_epu16(color, dest);
+	__m256i neg = _mm256_subs_epu16(dest, color);
+	pos = _mm256_srli_epi16(_mm256_mullo_epi16(pos, alpha), 8);
+	neg = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(neg, alpha),
+		_mm256_set1_epi16(255)), 8);
+	return _mm256_sub_epi16(_mm256_add_epi16(dest, pos), neg);
+}
+
+// blend16_avx2
+TARGET_AVX2 static inline __m256i
+blend16_avx2(__m256i dest, __m256i color, __m256i alpha)
+{
+	__m256i pos = _mm256_subs_epu16(color, dest);
+	__m256i neg = _mm256_subs_epu16(dest, color);
+	pos = _mm256_mulhi_epu16(pos, alpha);
+	__m256i rest = _mm256_mullo_epi16(neg, alpha);
+	neg = _mm256_mulhi_epu16(neg, alpha);
+	neg = _mm256_add_epi16(neg, _mm256_andnot_si256(
+		_mm256_cmpeq_epi16(rest, _mm256_setzero_si256()),
+		_mm256_set1_epi16(1)));
+	return _mm256_sub_epi16(_mm256_add_epi16(dest, pos), neg);
+}
+
+// combine_avx2
+TARGET_AVX2 static inline __m256i
+combine_avx2(__m128i low, __m128i high)
+{
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+}
+
+// blend_covers_avx2
+TARGET_AVX2 static void
+blend_covers_avx2(uint8* p, unsigned len, uint32 color, const uint8* covers)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i opaque = _mm256_set1_epi32((int)0xff000000);
+	const __m256i colorPixels = _mm256_set1_epi32(color);
+	const __m256i color16 = _mm256_unpacklo_epi8(colorPixels, zero);
+
+	for (; len >= 8; len -= 8, p += 32, covers += 8) {
+		uint64 cover8;
+		memcpy(&cover8, covers, 8);
+		if (cover8 == 0)
+			continue;
+		if (cover8 == ~(uint64)0) {
+			_mm256_storeu_si256((__m256i*)p, colorPixels);
+			continue;
+		}
+
+		// spread the cover of each pixel over its four bytes
+		__m128i c = _mm_loadl_epi64((const __m128i*)covers);
+		c = _mm_unpacklo_epi8(c, c);
+		__m256i alpha = combine_avx2(_mm_unpacklo_epi16(c, c),
+			_mm_unpackhi_epi16(c, c));
+
+		__m256i dest = _mm256_loadu_si256((__m256i*)p);
+		__m256i low = blend8_avx2(_mm256_unpacklo_epi8(dest, zero), color16,
+			_mm256_unpacklo_epi8(alpha, zero));
+		__m256i high = blend8_avx2(_mm256_unpackhi_epi8(dest, zero), color16,
+			_mm256_unpackhi_epi8(alpha, zero));
+		__m256i result = _mm256_or_si256(_mm256_packus_epi16(low, high),
+			opaque);
+		result = _mm256_blendv_epi8(result, colorPixels,
+			_mm256_cmpeq_epi8(alpha, _mm256_set1_epi8(-1)));
+		result = _mm256_blendv_epi8(result, dest,
+			_mm256_cmpeq_epi8(alpha, zero));
+		_mm256_storeu_si256((__m256i*)p, result);
+	}
+
+	blend_covers_sse2(p, len, color, covers);
+}
+
+// blend_covers16_avx2
+TARGET_AVX2 static void
+blend_covers16_avx2(uint8* p, unsigned len, uint32 color, uint8 alpha,
+	const uint8* covers)
+{
+	if (alpha == 0)
+		return;
+
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i opaque = _mm256_set1_epi32((int)0xff000000);
+	const __m256i opaqueAlpha = _mm256_set1_epi16((short)(255 * 255));
+	const __m128i alpha16 = _mm_set1_epi16(alpha);
+	const __m256i colorPixels = _mm256_set1_epi32(color);
+	const __m256i color16 = _mm256_unpacklo_epi8(colorPixels, zero);
+
+	for (; len >= 8; len -= 8, p += 32, covers += 8) {
+		uint64 cover8;
+		memcpy(&cover8, covers, 8);
+		if (cover8 == 0)
+			continue;
+		if (cover8 == ~(uint64)0 && alpha == 255) {
+			_mm256_storeu_si256((__m256i*)p, colorPixels);
+			continue;
+		}
+
+		// alpha * cover of each pixel, spread over its four channels and
+		// ordered like the unpacked pixels
+		__m128i a = _mm_loadl_epi64((const __m128i*)covers);
+		a = _mm_mullo_epi16(_mm_unpacklo_epi8(a, _mm_setzero_si128()),
+			alpha16);
+		__m128i first = _mm_unpacklo_epi16(a, a);
+		__m128i second = _mm_unpackhi_epi16(a, a);
+		__m256i alphaLow = combine_avx2(_mm_unpacklo_epi32(first, first),
+			_mm_unpacklo_epi32(second, second));
+		__m256i alphaHigh = combine_avx2(_mm_unpackhi_epi32(first, first),
+			_mm_unpackhi_epi32(second, second));
+
+		__m256i dest = _mm256_loadu_si256((__m256i*)p);
+		__m256i low = blend16_avx2(_mm256_unpacklo_epi8(dest, zero), color16,
+			alphaLow);
+		__m256i high = blend16_avx2(_mm256_unpackhi_epi8(dest, zero), color16,
+			alphaHigh);
+		__m256i result = _mm256_or_si256(_mm256_packus_epi16(low, high),
+			opaque);
+		result = _mm256_blendv_epi8(result, colorPixels, _mm256_packs_epi16(
+			_mm256_cmpeq_epi16(alphaLow, opaqueAlpha),
+			_mm256_cmpeq_epi16(alphaHigh, opaqueAlpha)));
+		result = _mm256_blendv_epi8(result, dest, _mm256_packs_epi16(
+			_mm256_cmpeq_epi16(alphaLow, zero),
+			_mm256_cmpeq_epi16(alphaHigh, zero)));
+		_mm256_storeu_si256((__m256i*)p, result);
+	}
+
+	blend_covers16_sse2(p, len, color, alpha, covers);
+}
+
+// blend_constant_avx2
+TARGET_AVX2 static void
+blend_constant_avx2(uint8* p, unsigned len, uint32 color, uint8 alpha)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i opaque = _mm256_set1_epi32((int)0xff000000);
+	const __m256i color16 = _mm256_unpacklo_epi8(_mm256_set1_epi32(color),
+		zero);
+	const __m256i alpha16 = _mm256_set1_epi16(alpha);
+
+	for (; len >= 8; len -= 8, p += 32) {
+		__m256i dest = _mm256_loadu_si256((__m256i*)p);
+		__m256i low = blend8_avx2(_mm256_unpacklo_epi8(dest, zero), color16,
+			alpha16);
+		__m256i high = blend8_avx2(_mm256_unpackhi_epi8(dest, zero), color16,
+			alpha16);
+		_mm256_storeu_si256((__m256i*)p,
+			_mm256_or_si256(_mm256_packus_epi16(low, high), opaque));
+	}
+
+	blend_constant_sse2(p, len, color, alpha);
+}
+
+
+// The subpixel kernels are bound by gathering the covers, they don't gain
+// from the wider registers.
+static const blend_kernels kAVX2BlendKernels = {
+	blend_covers_avx2,
+	blend_covers16_avx2,
+	blend_constant_avx2,
+	blend_subpix_sse2,
+	blend_subpix16_sse2
+};
+
+
+#endif	// BLEND_KERNELS_X86
+
+
+// #pragma mark -
+
+
+/*!	Returns the fastest kernels supported by all CPUs as described by
+	\a simdFlags, or \c NULL if there are only the scalar ones.
+*/
+const blend_kernels*
+select_blend_kernels(uint32 simdFlags)
+{
+#ifdef BLEND_KERNELS_X86
+	if ((simdFlags & APPSERVER_SIMD_AVX2) != 0)
+		return &kAVX2BlendKernels;
+	if ((simdFlags & APPSERVER_SIMD_SSE2) != 0)
+		return &kSSE2BlendKernels;
+#endif
+	return NULL;
+}
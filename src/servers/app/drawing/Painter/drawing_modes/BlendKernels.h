@@ -0,0 +1,67 @@
+/*
+ * Copyright 2019, Dario Casalinuovo. All rights reserved.
+ * Distributed under the terms of the MIT License.
+ *
+ * Row kernels blending a solid color into B_RGBA32 spans, in a scalar
+ * version and vectorized versions selected by the detected SIMD support.
+ *
+ */
+
+#ifndef BLEND_KERNELS_H
+#define BLEND_KERNELS_H
+
+#include <SupportDefs.h>
+
+
+// All kernels take the color as a B_RGBA32 pixel, and produce exactly the
+// same results as the BLEND* macros in DrawingMode.h.
+struct blend_kernels {
+	// Blends with an alpha of covers[i]; a cover of 0 leaves the pixel
+	// alone, a cover of 255 assigns the color.
+	void	(*blend_covers)(uint8* p, unsigned len, uint32 color,
+				const uint8* covers);
+
+	// Blends with an alpha of alpha * covers[i] in 16 bit precision, with
+	// the same special cases as blend_covers().
+	void	(*blend_covers16)(uint8* p, unsigned len, uint32 color,
+				uint8 alpha, const uint8* covers);
+
+	// Blends all pixels with the constant alpha.
+	void	(*blend_constant)(uint8* p, unsigned len, uint32 color,
+				uint8 alpha);
+
+	// Blends with three covers per pixel, len is the number of covers.
+	// The covers at blueIndex and redIndex of each triplet are used for
+	// the blue and the red channel.
+	void	(*blend_subpix)(uint8* p, unsigned len, uint32 color,
+				const uint8* covers, int blueIndex, int redIndex);
+
+	// Like blend_subpix() with an alpha of alpha * cover in 16 bit
+	// precision.
+	void	(*blend_subpix16)(uint8* p, unsigned len, uint32 color,
+				uint8 alpha, const uint8* covers, int blueIndex,
+				int redIndex);
+};
+
+
+static inline uint32
+blend_kernel_color(uint8 red, uint8 green, uint8 blue)
+{
+	uint32 color;
+	uint8* p8 = (uint8*)&color;
+	p8[0] = blue;
+	p8[1] = green;
+	p8[2] = red;
+	p8[3] = 255;
+	return color;
+}
+
+
+extern const blend_kernels kScalarBlendKernels;
+
+const blend_kernels* select_blend_kernels(uint32 simdFlags);
+
+extern const blend_kernels* gBlendKernels;
+	// NULL if there are no vectorized kernels for this CPU
+
+#endif // BLEND_KERNELS_H
@@ -0,0 +1,150 @@
+/*
+ * Copyright 2019, Dario Casalinuovo. All rights reserved.
+ * Distributed under the terms of the MIT License.
+ *
+ * DrawingModes B_OP_OVER, B_OP_COPY and B_OP_ALPHA in overlay mode with
+ * solid patterns on B_RGBA32, using the vectorized kernels in gBlendKernels.
+ * The scalar versions in the other DrawingMode headers are the reference.
+ *
+ */
+
+#ifndef DRAWING_MODE_SOLID_SIMD_H
+#define DRAWING_MODE_SOLID_SIMD_H
+
+#include "BlendKernels.h"
+#include "DrawingModeCopySolid.h"
+#include "DrawingModeOverSolid.h"
+#include "GlobalSubpixelSettings.h"
+
+// blend_hline_over_solid_simd
+void
+blend_hline_over_solid_simd(int x, int y, unsigned len,
+	const color_type& c, uint8 cover, agg_buffer* buffer,
+	const PatternHandler* pattern)
+{
+	if (cover == 255) {
+		blend_hline_over_solid(x, y, len, c, cover, buffer, pattern);
+		return;
+	}
+
+	if (pattern->IsSolidLow())
+		return;
+
+	gBlendKernels->blend_constant(buffer->row_ptr(y) + (x << 2), len,
+		blend_kernel_color(c.r, c.g, c.b), cover);
+}
+
+// blend_solid_hspan_over_solid_simd
+void
+blend_solid_hspan_over_solid_simd(int x, int y, unsigned len,
+	const color_type& c, const uint8* covers, agg_buffer* buffer,
+	const PatternHandler* pattern)
+{
+	if (pattern->IsSolidLow())
+		return;
+
+	gBlendKernels->blend_covers(buffer->row_ptr(y) + (x << 2), len,
+		blend_kernel_color(c.r, c.g, c.b), covers);
+}
+
+// blend_solid_hspan_over_solid_subpix_simd
+void
+blend_solid_hspan_over_solid_subpix_simd(int x, int y, unsigned len,
+	const color_type& c, const uint8* covers, agg_buffer* buffer,
+	const PatternHandler* pattern)
+{
+	if (pattern->IsSolidLow())
+		return;
+
+	const int subpixelL = gSubpixelOrderingRGB ? 2 : 0;
+	const int subpixelR = gSubpixelOrderingRGB ? 0 : 2;
+	gBlendKernels->blend_subpix(buffer->row_ptr(y) + (x << 2), len,
+		blend_kernel_color(c.r, c.g, c.b), covers, subpixelL, subpixelR);
+}
+
+// blend_hline_copy_solid_simd
+void
+blend_hline_copy_solid_simd(int x, int y, unsigned len,
+	const color_type& c, uint8 cover, agg_buffer* buffer,
+	const PatternHandler* pattern)
+{
+	if (cover == 255) {
+		blend_hline_copy_solid(x, y, len, c, cover, buffer, pattern);
+		return;
+	}
+
+	gBlendKernels->blend_constant(buffer->row_ptr(y) + (x << 2), len,
+		blend_kernel_color(c.r, c.g, c.b), cover);
+}
+
+// blend_solid_hspan_copy_solid_simd
+void
+blend_solid_hspan_copy_solid_simd(int x, int y, unsigned len,
+	const color_type& c, const uint8* covers, agg_buffer* buffer,
+	const PatternHandler* pattern)
+{
+	gBlendKernels->blend_covers(buffer->row_ptr(y) + (x << 2), len,
+		blend_kernel_color(c.r, c.g, c.b), covers);
+}
+
+// blend_solid_hspan_copy_solid_subpix_simd
+void
+blend_solid_hspan_copy_solid_subpix_simd(int x, int y, unsigned len,
+	const color_type& c, const uint8* covers, agg_buffer* buffer,
+	const PatternHandler* pattern)
+{
+	const int subpixelL = gSubpixelOrderingRGB ? 2 : 0;
+	const int subpixelR = gSubpixelOrderingRGB ? 0 : 2;
+	gBlendKernels->blend_subpix(buffer->row_ptr(y) + (x << 2), len,
+		blend_kernel_color(c.r, c.g, c.b), covers, subpixelL, subpixelR);
+}
+
+// blend_solid_hspan_alpha_po_solid_simd
+void
+blend_solid_hspan_alpha_po_solid_simd(int x, int y, unsigned len,
+	const color_type& c, const uint8* covers, agg_buffer* buffer,
+	const PatternHandler* pattern)
+{
+	gBlendKernels->blend_covers16(buffer->row_ptr(y) + (x << 2), len,
+		blend_kernel_color(c.r, c.g, c.b), c.a, covers);
+}
+
+// blend_solid_hspan_alpha_po_solid_subpix_simd
+void
+blend_solid_hspan_alpha_po_solid_subpix_simd(int x, int y, unsigned len,
+	const color_type& c, const uint8* covers, agg_buffer* buffer,
+	const PatternHandler* pattern)
+{
+	// unlike B_OP_OVER, the alpha modes take the blue alpha from the right
+	// subpixel
+	const int subpixelL = gSubpixelOrderingRGB ? 2 : 0;
+	const int subpixelR = gSubpixelOrderingRGB ? 0 : 2;
+	gBlendKernels->blend_subpix16(buffer->row_ptr(y) + (x << 2), len,
+		blend_kernel_color(c.r, c.g, c.b), c.a, covers, subpixelR, subpixelL);
+}
+
+// blend_solid_hspan_alpha_co_solid_simd
+void
+blend_solid_hspan_alpha_co_solid_simd(int x, int y, unsigned len,
+	const color_type& c, const uint8* covers, agg_buffer* buffer,
+	const PatternHandler* pattern)
+{
+	gBlendKernels->blend_covers16(buffer->row_ptr(y) + (x << 2), len,
+		blend_kernel_color(c.r, c.g, c.b), pattern->HighColor().alpha,
+		covers);
+}
+
+// blend_solid_hspan_alpha_co_solid_subpix_simd
+void
+blend_solid_hspan_alpha_co_solid_subpix_simd(int x, int y, unsigned len,
+	const color_type& c, const uint8* covers, agg_buffer* buffer,
+	const PatternHandler* pattern)
+{
+	const int subpixelL = gSubpixelOrderingRGB ? 2 : 0;
+	const int subpixelR = gSubpixelOrderingRGB ? 0 : 2;
+	gBlendKernels->blend_subpix16(buffer->row_ptr(y) + (x << 2), len,
+		blend_kernel_color(c.r, c.g, c.b), pattern->HighColor().alpha,
+		covers, subpixelR, subpixelL);
+}
+
+#endif // DRAWING_MODE_SOLID_SIMD_H
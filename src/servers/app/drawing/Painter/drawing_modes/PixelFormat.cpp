@@ -54,6 +54,8 @@
 #include "DrawingModeSelectSUBPIX.h"
 #include "DrawingModeSubtractSUBPIX.h"
 
+#include "DrawingModeSolidSIMD.h"
+
 #include "PatternHandler.h"
 
 // blend_pixel_empty
@@ -169,6 +171,12 @@ PixelFormat::SetDrawingMode(drawing_mode mode, source_alpha alphaSrcMode,
 				fBlendSolidHSpan = blend_solid_hspan_over_solid;
 				fBlendSolidVSpan = blend_solid_vspan_over_solid;
 				fBlendSolidHSpanSubpix = blend_solid_hspan_over_solid_subpix;
+				if (gBlendKernels != NULL) {
+					fBlendHLine = blend_hline_over_solid_simd;
+					fBlendSolidHSpan = blend_solid_hspan_over_solid_simd;
+					fBlendSolidHSpanSubpix
+						= blend_solid_hspan_over_solid_subpix_simd;
+				}
 			} else {
 				fBlendPixel = blend_pixel_over;
 				fBlendHLine = blend_hline_over;
@@ -213,6 +221,12 @@ PixelFormat::SetDrawingMode(drawing_mode mode, source_alpha alphaSrcMode,
 				fBlendSolidHSpan = blend_solid_hspan_copy_solid;
 				fBlendSolidVSpan = blend_solid_vspan_copy_solid;
 				fBlendColorHSpan = blend_color_hspan_copy_solid;
+				if (gBlendKernels != NULL) {
+					fBlendHLine = blend_hline_copy_solid_simd;
+					fBlendSolidHSpan = blend_solid_hspan_copy_solid_simd;
+					fBlendSolidHSpanSubpix
+						= blend_solid_hspan_copy_solid_subpix_simd;
+				}
 			} else {
 				fBlendPixel = blend_pixel_copy;
 				fBlendHLine = blend_hline_copy;
@@ -280,6 +294,12 @@ PixelFormat::SetDrawingMode(drawing_mode mode, source_alpha alphaSrcMode,
 						fBlendSolidHSpanSubpix = blend_solid_hspan_alpha_co_solid_subpix;
 						fBlendSolidHSpan = blend_solid_hspan_alpha_co_solid;
 						fBlendSolidVSpan = blend_solid_vspan_alpha_co_solid;
+						if (gBlendKernels != NULL) {
+							fBlendSolidHSpanSubpix
+								= blend_solid_hspan_alpha_co_solid_subpix_simd;
+							fBlendSolidHSpan
+								= blend_solid_hspan_alpha_co_solid_simd;
+						}
 					} else {
 						fBlendPixel = blend_pixel_alpha_co;
 						fBlendHLine = blend_hline_alpha_co;
@@ -304,6 +324,12 @@ PixelFormat::SetDrawingMode(drawing_mode mode, source_alpha alphaSrcMode,
 						fBlendSolidHSpanSubpix = blend_solid_hspan_alpha_po_solid_subpix;
 						fBlendSolidHSpan = blend_solid_hspan_alpha_po_solid;
 						fBlendSolidVSpan = blend_solid_vspan_alpha_po_solid;
+						if (gBlendKernels != NULL) {
+							fBlendSolidHSpanSubpix
+								= blend_solid_hspan_alpha_po_solid_subpix_simd;
+							fBlendSolidHSpan
+								= blend_solid_hspan_alpha_po_solid_simd;
+						}
 					} else {
 						fBlendPixel = blend_pixel_alpha_po;
 						fBlendHLine = blend_hline_alpha_po;
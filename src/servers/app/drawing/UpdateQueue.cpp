@@ -157,6 +157,7 @@ UpdateQueue::_ExecuteUpdates()
 								fInterface->CopyBackToFront(
 									fUpdateRegion.RectAt(i));
 							fUpdateRegion.MakeEmpty();
+							fInterface->PresentFrontBuffer();
 						}
 						Unlock();
 					}
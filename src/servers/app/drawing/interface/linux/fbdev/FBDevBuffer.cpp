@@ -16,17 +16,22 @@ inline uint32_t pixel_color(uint8_t r, uint8_t g, uint8_t b, struct fb_var_scree
 
 FBDevBuffer::FBDevBuffer(int fd, struct fb_var_screeninfo vInfo,
 	struct fb_fix_screeninfo finfo)
+	:
+	fPage(0)
 {
 	fVInfo = vInfo;
 	fInfo = finfo;
-	fBuffer = mmap(0, fInfo.line_length * fVInfo.yres_virtual,
-		PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)0);
+	fLength = fInfo.line_length * fVInfo.yres_virtual;
+	fBuffer = (uint8_t*)mmap(0, fLength, PROT_READ | PROT_WRITE, MAP_SHARED,
+		fd, (off_t)0);
 }
 
 
 FBDevBuffer::~FBDevBuffer()
 {
 	CALLED();
+	if (fBuffer != MAP_FAILED)
+		munmap(fBuffer, fLength);
 }
 
 
@@ -53,7 +58,7 @@ void*
 FBDevBuffer::Bits() const
 {
 	CALLED();
-	return (void*)fBuffer;
+	return (void*)(fBuffer + fPage * fVInfo.yres * fInfo.line_length);
 }
 
 
@@ -79,3 +84,21 @@ FBDevBuffer::Height() const
 	CALLED();
 	return fVInfo.yres;
 }
+
+
+uint32
+FBDevBuffer::CountPages() const
+{
+	if (fVInfo.yres == 0)
+		return 0;
+
+	return fVInfo.yres_virtual / fVInfo.yres;
+}
+
+
+void
+FBDevBuffer::SetPage(uint32 page)
+{
+	if (page < CountPages())
+		fPage = page;
+}
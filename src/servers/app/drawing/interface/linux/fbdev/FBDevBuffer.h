@@ -34,8 +34,17 @@ public:
 	virtual	uint32				Width() const;
 	virtual	uint32				Height() const;
 
+			// The virtual resolution can hold more than one screen sized
+			// page, Bits() points to the current one.
+			uint32				CountPages() const;
+			uint32				Page() const
+									{ return fPage; }
+			void				SetPage(uint32 page);
+
 private:
 			uint8_t*			fBuffer;
+			size_t				fLength;
+			uint32				fPage;
 			struct fb_var_screeninfo fVInfo;
 			struct fb_fix_screeninfo fInfo;
 };
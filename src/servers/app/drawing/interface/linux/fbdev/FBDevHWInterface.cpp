@@ -6,36 +6,59 @@
 #include "FBDevHWInterface.h"
 
 #include "FBDevBuffer.h"
+#include "MallocBuffer.h"
 
+#include <errno.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 
 FBDevHWInterface::FBDevHWInterface()
 	:
-	HWInterface(false, false),
+	HWInterface(true, true),
+	fBackBuffer(NULL),
 	fFrontBuffer(NULL),
-	fBackBuffer(NULL)
+	fPageFlipping(false),
+	fRetraceSemaphore(B_UNSUPPORTED),
+	fRetraceThread(B_BAD_THREAD_ID),
+	fQuitting(false)
 {
 	fFrameBuffer = open("/dev/fb0", O_RDWR);
 
 	// Get screen informations
 	ioctl(fFrameBuffer, FBIOGET_VSCREENINFO, &fVInfo);
 
-	// Get fixed screen informations
-	ioctl(fFrameBuffer, FBIOGET_FSCREENINFO, &fInfo);
-
 	fVInfo.grayscale = 0;
 	fVInfo.bits_per_pixel = 32;
 	ioctl(fFrameBuffer, FBIOPUT_VSCREENINFO, &fVInfo);
 	ioctl(fFrameBuffer, FBIOGET_VSCREENINFO, &fVInfo);
 
+	// Ask for a second page to flip to, not all drivers have room for it
+	if (fVInfo.yres_virtual < fVInfo.yres * 2) {
+		struct fb_var_screeninfo vInfo = fVInfo;
+		vInfo.yres_virtual = fVInfo.yres * 2;
+		vInfo.yoffset = 0;
+		if (ioctl(fFrameBuffer, FBIOPUT_VSCREENINFO, &vInfo) == 0)
+			ioctl(fFrameBuffer, FBIOGET_VSCREENINFO, &fVInfo);
+	}
+
+	// Get fixed screen informations, they depend on the mode set above
+	ioctl(fFrameBuffer, FBIOGET_FSCREENINFO, &fInfo);
+
+	fPageFlipping = fVInfo.yres_virtual >= fVInfo.yres * 2
+		&& fInfo.ypanstep != 0 && fVInfo.yres % fInfo.ypanstep == 0
+		&& fInfo.smem_len >= fInfo.line_length * fVInfo.yres * 2;
+
 	fDisplayMode.virtual_width = fVInfo.xres_virtual;
-	fDisplayMode.virtual_height = fVInfo.yres_virtual;
+	fDisplayMode.virtual_height = fVInfo.yres;
 	fDisplayMode.space = B_RGB32;
 
 	fFrontBuffer = new FBDevBuffer(fFrameBuffer, fVInfo, fInfo);
-	//fBackBuffer = new FBDevBuffer(fFrameBuffer, fVInfo, fInfo);
+	// Everything is drawn into a buffer in normal memory, which is much
+	// faster to read from than the frame buffer.
+	fBackBuffer = new MallocBuffer(fVInfo.xres, fVInfo.yres);
 
 	fEventStream = new LibInputEventStream();
 }
@@ -44,6 +67,16 @@ FBDevHWInterface::FBDevHWInterface()
 FBDevHWInterface::~FBDevHWInterface()
 {
 	CALLED();
+
+	// stop the UpdateQueue before the buffers go away
+	SetAsyncDoubleBuffered(false);
+	_StopRetraceThread();
+
+	delete fBackBuffer;
+	delete fFrontBuffer;
+
+	if (fFrameBuffer >= 0)
+		close(fFrameBuffer);
 }
 
 
@@ -58,11 +91,61 @@ FBDevHWInterface::Initialize()
 	if (ret < B_OK)
 		return ret;
 
+	if (fBackBuffer->InitCheck() < B_OK) {
+		// draw into the frame buffer directly
+		delete fBackBuffer;
+		fBackBuffer = NULL;
+		fPageFlipping = false;
+	} else {
+		// clear out backbuffer, alpha is 255 this way
+		memset(fBackBuffer->Bits(), 255, fBackBuffer->BitsLength());
+
+		// Only the damage of the previous frame is copied to the page
+		// that is flipped to, so the pages need to start out the same.
+		uint32 pageCount = fPageFlipping ? 2 : 1;
+		for (uint32 page = 0; page < pageCount; page++) {
+			fFrontBuffer->SetPage(page);
+			_CopyToFront((uint8*)fBackBuffer->Bits(),
+				fBackBuffer->BytesPerRow(), 0, 0, fBackBuffer->Width() - 1,
+				fBackBuffer->Height() - 1);
+		}
+
+		if (fPageFlipping) {
+			fVInfo.xoffset = 0;
+			fVInfo.yoffset = 0;
+			if (ioctl(fFrameBuffer, FBIOPAN_DISPLAY, &fVInfo) < 0)
+				fPageFlipping = false;
+		}
+		// the front buffer is the page that is not displayed
+		fFrontBuffer->SetPage(fPageFlipping ? 1 : 0);
+	}
+
+	// There is no retrace semaphore in fbdev, we release one ourselves
+	// after each vertical sync
+	__u32 crtc = 0;
+	if (ioctl(fFrameBuffer, FBIO_WAITFORVSYNC, &crtc) == 0) {
+		fRetraceSemaphore = create_sem(0, "fbdev retrace");
+		if (fRetraceSemaphore >= B_OK) {
+			fQuitting = false;
+			fRetraceThread = spawn_thread(_RetraceThreadEntry, "fbdev retrace",
+				B_REAL_TIME_DISPLAY_PRIORITY, this);
+			if (fRetraceThread < B_OK
+				|| resume_thread(fRetraceThread) < B_OK) {
+				fRetraceThread = B_BAD_THREAD_ID;
+				delete_sem(fRetraceSemaphore);
+				fRetraceSemaphore = B_UNSUPPORTED;
+			}
+		} else
+			fRetraceSemaphore = B_UNSUPPORTED;
+	}
+
+	// starts the UpdateQueue
+	_NotifyFrameBufferChanged();
+
 	return B_OK;
 }
 
 
-
 EventStream*
 FBDevHWInterface::CreateEventStream()
 {
@@ -74,6 +157,7 @@ status_t
 FBDevHWInterface::Shutdown()
 {
 	CALLED();
+	_StopRetraceThread();
 	return B_OK;
 }
 
@@ -147,7 +231,7 @@ sem_id
 FBDevHWInterface::RetraceSemaphore()
 {
 	CALLED();
-	return B_UNSUPPORTED;
+	return fRetraceSemaphore;
 }
 
 
@@ -155,7 +239,11 @@ status_t
 FBDevHWInterface::WaitForRetrace(bigtime_t timeout)
 {
 	CALLED();
-	return B_UNSUPPORTED;
+	sem_id sem = RetraceSemaphore();
+	if (sem < 0)
+		return sem;
+
+	return acquire_sem_etc(sem, 1, B_RELATIVE_TIMEOUT, timeout);
 }
 
 
@@ -218,14 +306,98 @@ FBDevHWInterface::BackBuffer() const
 bool
 FBDevHWInterface::IsDoubleBuffered() const
 {
-	// TODO: This will be supported
-	return false;
+	return fBackBuffer != NULL;
 }
 
 
 status_t
 FBDevHWInterface::CopyBackToFront(const BRect& frame)
 {
-	CALLED();
-	return B_ERROR;
+	status_t status = HWInterface::CopyBackToFront(frame);
+	if (status == B_OK && fPageFlipping)
+		fFrameDamage.Include(frame);
+
+	return status;
+}
+
+
+/*!	Called by the UpdateQueue after each batch of CopyBackToFront(), which
+	went to the page that is not displayed. Brings that page up to date and
+	pans the display to it.
+*/
+void
+FBDevHWInterface::PresentFrontBuffer()
+{
+	if (!fPageFlipping)
+		return;
+
+	// the page still lacks what was updated on the other one last time
+	fPreviousFrameDamage.Exclude(&fFrameDamage);
+	int32 count = fPreviousFrameDamage.CountRects();
+	for (int32 i = 0; i < count; i++)
+		HWInterface::CopyBackToFront(fPreviousFrameDamage.RectAt(i));
+
+	if (!fFloatingOverlaysLock.Lock())
+		return;
+
+	uint32 page = fFrontBuffer->Page();
+	fVInfo.xoffset = 0;
+	fVInfo.yoffset = page * fVInfo.yres;
+	bool panned = ioctl(fFrameBuffer, FBIOPAN_DISPLAY, &fVInfo) == 0;
+	fFrontBuffer->SetPage(1 - page);
+
+	if (!panned) {
+		// go on with the displayed page only
+		fPageFlipping = false;
+		HWInterface::CopyBackToFront(fBackBuffer->Bounds());
+	}
+
+	fFloatingOverlaysLock.Unlock();
+
+	fPreviousFrameDamage = fFrameDamage;
+	fFrameDamage.MakeEmpty();
+}
+
+
+int32
+FBDevHWInterface::_RetraceThreadEntry(void* cookie)
+{
+	return ((FBDevHWInterface*)cookie)->_RetraceThread();
+}
+
+
+int32
+FBDevHWInterface::_RetraceThread()
+{
+	__u32 crtc = 0;
+	while (!fQuitting) {
+		if (ioctl(fFrameBuffer, FBIO_WAITFORVSYNC, &crtc) < 0) {
+			if (errno == EINTR)
+				continue;
+			// the waiters fall back to their timeouts
+			break;
+		}
+
+		// wake up everyone waiting for this retrace, like a driver does
+		release_sem_etc(fRetraceSemaphore, 0,
+			B_RELEASE_ALL | B_DO_NOT_RESCHEDULE);
+	}
+	return B_OK;
+}
+
+
+void
+FBDevHWInterface::_StopRetraceThread()
+{
+	if (fRetraceThread >= B_OK) {
+		fQuitting = true;
+		status_t exitValue;
+		wait_for_thread(fRetraceThread, &exitValue);
+		fRetraceThread = B_BAD_THREAD_ID;
+	}
+
+	if (fRetraceSemaphore >= B_OK) {
+		delete_sem(fRetraceSemaphore);
+		fRetraceSemaphore = B_UNSUPPORTED;
+	}
 }
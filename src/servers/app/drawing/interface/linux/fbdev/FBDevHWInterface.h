@@ -14,6 +14,7 @@
 
 
 class FBDevBuffer;
+class MallocBuffer;
 
 class FBDevHWInterface : public HWInterface {
 public:
@@ -59,10 +60,23 @@ public:
 	virtual	bool				IsDoubleBuffered() const;
 
 	virtual	status_t			CopyBackToFront(const BRect& frame);
+	virtual	void				PresentFrontBuffer();
 
 private:
-			FBDevBuffer*		fBackBuffer;
+	static	int32				_RetraceThreadEntry(void* cookie);
+			int32				_RetraceThread();
+			void				_StopRetraceThread();
+
+			MallocBuffer*		fBackBuffer;
 			FBDevBuffer*		fFrontBuffer;
+			bool				fPageFlipping;
+
+			BRegion				fFrameDamage;
+			BRegion				fPreviousFrameDamage;
+
+			sem_id				fRetraceSemaphore;
+			thread_id			fRetraceThread;
+	volatile bool				fQuitting;
 
 			display_mode		fDisplayMode;
 
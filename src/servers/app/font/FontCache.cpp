@@ -21,6 +21,19 @@
 using std::nothrow;
 
 
+// The glyph bitmaps and outlines of all entries are kept below this size.
+// The glyphs of an entry cannot be dropped one by one, since the glyph
+// pointers are handed out to the text renderers, so whole entries are
+// evicted instead.
+static const int64 kMemoryBudget = 8 * 1024 * 1024;
+// Every entry keeps a FreeType face open, which is not accounted for in
+// its memory usage, so the number of entries is limited as well.
+static const int32 kMaxEntryCount = 256;
+// Recycle() only looks for entries to evict when the cache has grown by
+// more than this since the last time.
+static const int64 kMemoryUsageSlack = 64 * 1024;
+
+
 FontCache
 FontCache::sDefaultInstance;
 
@@ -30,6 +43,10 @@ FontCache::sDefaultInstance;
 FontCache::FontCache()
 	: MultiLocker("FontCache lock")
 	, fFontCacheEntries()
+	, fConstrainedMemoryUsage(0)
+	, fEntryHits(0)
+	, fEntryMisses(0)
+	, fEntryEvictions(0)
 {
 }
 
@@ -64,6 +81,7 @@ FontCache::FontCacheEntryFor(const ServerFont& font, bool forceVector)
 	if (entry) {
 		// the entry was already there
 		entry->AcquireReference();
+		atomic_add64(&fEntryHits, 1);
 //printf("FontCacheEntryFor(%ld): %p\n", font.GetFamilyAndStyle(), entry);
 		return entry;
 	}
@@ -83,8 +101,10 @@ FontCache::FontCacheEntryFor(const ServerFont& font, bool forceVector)
 	entry = fFontCacheEntries.Get(signature);
 
 	if (!entry) {
-		// remove old entries, keep entries below certain count
-		_ConstrainEntryCount();
+		atomic_add64(&fEntryMisses, 1);
+
+		// remove old entries, keep the cache below its budget
+		_ConstrainMemoryUsage();
 		entry = new (nothrow) FontCacheEntry();
 		if (!entry || !entry->Init(font, forceVector)
 			|| fFontCacheEntries.Put(signature, entry) < B_OK) {
@@ -109,9 +129,55 @@ FontCache::Recycle(FontCacheEntry* entry)
 		return;
 	entry->UpdateUsage();
 	entry->ReleaseReference();
+
+	// entries only grow while they are used, so this is the place to notice
+	// that the cache has outgrown its budget
+	int64 memoryUsage = FontCacheEntry::TotalMemoryUsage();
+	if (memoryUsage <= kMemoryBudget
+		|| memoryUsage <= atomic_get64(&fConstrainedMemoryUsage)
+			+ kMemoryUsageSlack) {
+		return;
+	}
+
+	AutoWriteLocker locker(this);
+	if (locker.IsLocked())
+		_ConstrainMemoryUsage();
 }
 
-static const int32 kMaxEntryCount = 30;
+// GetStatistics
+void
+FontCache::GetStatistics(font_cache_statistics& statistics)
+{
+	AutoReadLocker locker(this);
+
+	statistics.entry_count = fFontCacheEntries.Size();
+	statistics.memory_usage = FontCacheEntry::TotalMemoryUsage();
+	statistics.entry_hits = atomic_get64(&fEntryHits);
+	statistics.entry_misses = atomic_get64(&fEntryMisses);
+	statistics.entry_evictions = atomic_get64(&fEntryEvictions);
+	FontCacheEntry::GetStatistics(statistics.glyph_hits,
+		statistics.glyph_misses, statistics.glyph_run_hits,
+		statistics.glyph_run_misses);
+}
+
+// Dump
+void
+FontCache::Dump()
+{
+	font_cache_statistics statistics;
+	GetStatistics(statistics);
+
+	debug_printf("FontCache: %" B_PRId32 " entries, %" B_PRId64 " bytes "
+		"(budget %" B_PRId64 ")\n", statistics.entry_count,
+		statistics.memory_usage, kMemoryBudget);
+	debug_printf("  entries: %" B_PRId64 " hits, %" B_PRId64 " misses, "
+		"%" B_PRId64 " evictions\n", statistics.entry_hits,
+		statistics.entry_misses, statistics.entry_evictions);
+	debug_printf("  glyphs: %" B_PRId64 " hits, %" B_PRId64 " misses\n",
+		statistics.glyph_hits, statistics.glyph_misses);
+	debug_printf("  glyph runs: %" B_PRId64 " hits, %" B_PRId64 " misses\n",
+		statistics.glyph_run_hits, statistics.glyph_run_misses);
+}
 
 static inline double
 usage_index(uint64 useCount, bigtime_t age)
@@ -119,44 +185,50 @@ usage_index(uint64 useCount, bigtime_t age)
 	return 100.0 * useCount / age;
 }
 
-// _ConstrainEntryCount
+// _ConstrainMemoryUsage
 void
-FontCache::_ConstrainEntryCount()
+FontCache::_ConstrainMemoryUsage()
 {
 	// this function is only ever called with the WriteLock held
-	if (fFontCacheEntries.Size() < kMaxEntryCount)
-		return;
-//printf("FontCache::_ConstrainEntryCount()\n");
+	bigtime_t now = system_time();
 
-	FontMap::Iterator iterator = fFontCacheEntries.GetIterator();
+	while (fFontCacheEntries.Size() > 1) {
+		// the memory usage of the entries still in use may change while
+		// we look at them, but that is good enough to decide on evicting
+		int64 memoryUsage = 0;
+		FontCacheEntry* leastUsedEntry = NULL;
+		double leastUsageIndex = 0.0;
 
-	// NOTE: if kMaxEntryCount has a sane value, there has got to be
-	// some entries, so using the iterator like that should be ok
-	FontCacheEntry* leastUsedEntry = iterator.Next().value;
-	bigtime_t now = system_time();
-	bigtime_t age = now - leastUsedEntry->LastUsed();
-	uint64 useCount = leastUsedEntry->UsedCount();
-	double leastUsageIndex = usage_index(useCount, age);
-//printf("  leastUsageIndex: %f\n", leastUsageIndex);
-
-	while (iterator.HasNext()) {
-		FontCacheEntry* entry = iterator.Next().value;
-		age = now - entry->LastUsed();
-		useCount = entry->UsedCount();
-		double usageIndex = usage_index(useCount, age);
+		FontMap::Iterator iterator = fFontCacheEntries.GetIterator();
+		while (iterator.HasNext()) {
+			FontCacheEntry* entry = iterator.Next().value;
+			memoryUsage += entry->MemoryUsage();
+
+			bigtime_t age = now - entry->LastUsed();
+			double usageIndex = usage_index(entry->UsedCount(), age);
 //printf("  usageIndex: %f\n", usageIndex);
-		if (usageIndex < leastUsageIndex) {
-			leastUsedEntry = entry;
-			leastUsageIndex = usageIndex;
+			if (leastUsedEntry == NULL || usageIndex < leastUsageIndex) {
+				leastUsedEntry = entry;
+				leastUsageIndex = usageIndex;
+			}
 		}
-	}
 
-	iterator = fFontCacheEntries.GetIterator();
-	while (iterator.HasNext()) {
-		if (iterator.Next().value == leastUsedEntry) {
-			fFontCacheEntries.Remove(iterator);
-			leastUsedEntry->ReleaseReference();
-			break;
+		atomic_set64(&fConstrainedMemoryUsage, memoryUsage);
+
+		if (memoryUsage <= kMemoryBudget
+			&& fFontCacheEntries.Size() < kMaxEntryCount) {
+			return;
+		}
+//printf("FontCache::_ConstrainMemoryUsage(): %lld bytes\n", memoryUsage);
+
+		iterator = fFontCacheEntries.GetIterator();
+		while (iterator.HasNext()) {
+			if (iterator.Next().value == leastUsedEntry) {
+				fFontCacheEntries.Remove(iterator);
+				leastUsedEntry->ReleaseReference();
+				atomic_add64(&fEntryEvictions, 1);
+				break;
+			}
 		}
 	}
 }
@@ -16,6 +16,19 @@
 #include "ServerFont.h"
 
 
+struct font_cache_statistics {
+	int32	entry_count;
+	int64	memory_usage;
+	int64	entry_hits;
+	int64	entry_misses;
+	int64	entry_evictions;
+	int64	glyph_hits;
+	int64	glyph_misses;
+	int64	glyph_run_hits;
+	int64	glyph_run_misses;
+};
+
+
 class FontCache : public MultiLocker {
  public:
 								FontCache();
@@ -28,14 +41,23 @@ class FontCache : public MultiLocker {
 									bool forceVector);
 			void				Recycle(FontCacheEntry* entry);
 
+			void				GetStatistics(
+									font_cache_statistics& statistics);
+			void				Dump();
+
  private:
-			void				_ConstrainEntryCount();
+			void				_ConstrainMemoryUsage();
 
 	static	FontCache			sDefaultInstance;
 
 	typedef HashMap<HashString, FontCacheEntry*> FontMap;
 
 			FontMap				fFontCacheEntries;
+			int64				fConstrainedMemoryUsage;
+
+			int64				fEntryHits;
+			int64				fEntryMisses;
+			int64				fEntryEvictions;
 };
 
 #endif // FONT_CACHE_H
@@ -40,6 +40,21 @@
 
 
 BLocker FontCacheEntry::sUsageUpdateLock("FontCacheEntry usage lock");
+int64 FontCacheEntry::sTotalMemoryUsage = 0;
+int64 FontCacheEntry::sGlyphHits = 0;
+int64 FontCacheEntry::sGlyphMisses = 0;
+int64 FontCacheEntry::sGlyphRunHits = 0;
+int64 FontCacheEntry::sGlyphRunMisses = 0;
+
+
+// The glyph data is packed into atlas blocks, one chain for each type of
+// glyph data. Blocks start small, since most entries only ever see a few
+// dozen glyphs, and grow up to kMaxAtlasBlockSize.
+static const size_t kMinAtlasBlockSize = 4 * 1024;
+static const size_t kMaxAtlasBlockSize = 64 * 1024;
+static const size_t kAtlasAlignment = 8;
+
+static const int32 kMaxGlyphRunCount = 64;
 
 
 class FontCacheEntry::GlyphCachePool {
@@ -69,9 +84,29 @@ class FontCacheEntry::GlyphCachePool {
 			return value->hash_link;
 		}
 	};
+
+	struct AtlasBlock {
+		AtlasBlock*	next;
+		size_t		size;
+		size_t		used;
+
+		uint8* Data()
+		{
+			return (uint8*)this + sizeof(AtlasBlock);
+		}
+	};
+
+	enum {
+		kAtlasCount = glyph_data_subpix + 1
+	};
+
 public:
 	GlyphCachePool()
+		:
+		fMemoryUsage(0)
 	{
+		for (int32 i = 0; i < kAtlasCount; i++)
+			fAtlas[i] = NULL;
 	}
 
 	~GlyphCachePool()
@@ -82,6 +117,17 @@ public:
 			delete glyph;
 			glyph = next;
 		}
+
+		for (int32 i = 0; i < kAtlasCount; i++) {
+			AtlasBlock* block = fAtlas[i];
+			while (block != NULL) {
+				AtlasBlock* next = block->next;
+				free(block);
+				block = next;
+			}
+		}
+
+		atomic_add64(&FontCacheEntry::sTotalMemoryUsage, -fMemoryUsage);
 	}
 
 	status_t Init()
@@ -103,29 +149,295 @@ public:
 		if (glyph != NULL)
 			return NULL;
 
-		glyph = new(std::nothrow) GlyphCache(glyphIndex, dataSize, dataType,
-			bounds, advanceX, advanceY, preciseAdvanceX, preciseAdvanceY,
-			insetLeft, insetRight);
-		if (glyph == NULL || glyph->data == NULL) {
-			delete glyph;
-			return NULL;
+		uint8* data = NULL;
+		if (dataSize > 0) {
+			data = _AllocateData(dataType, dataSize);
+			if (data == NULL)
+				return NULL;
 		}
 
+		glyph = new(std::nothrow) GlyphCache(glyphIndex, data, dataSize,
+			dataType, bounds, advanceX, advanceY, preciseAdvanceX,
+			preciseAdvanceY, insetLeft, insetRight);
+		if (glyph == NULL)
+			return NULL;
+				// the atlas space is lost, but that's not worth handling
+
 		// TODO: The HashTable grows without bounds. We should cleanup
 		// older entries from time to time.
 
 		fGlyphTable.Insert(glyph);
+		_AddMemoryUsage(sizeof(GlyphCache));
 
 		return glyph;
 	}
 
+	size_t MemoryUsage() const
+	{
+		return (size_t)atomic_get64((int64*)&fMemoryUsage);
+	}
+
+private:
+	uint8* _AllocateData(glyph_data_type dataType, size_t size)
+	{
+		if ((int32)dataType < 0 || (int32)dataType >= kAtlasCount)
+			return NULL;
+
+		size = (size + kAtlasAlignment - 1) & ~(kAtlasAlignment - 1);
+
+		AtlasBlock* block = fAtlas[dataType];
+		if (block == NULL || block->size - block->used < size) {
+			size_t blockSize = block != NULL
+				? min_c(block->size * 2, kMaxAtlasBlockSize)
+				: kMinAtlasBlockSize;
+			if (blockSize < size)
+				blockSize = size;
+
+			AtlasBlock* newBlock = (AtlasBlock*)malloc(sizeof(AtlasBlock)
+				+ blockSize);
+			if (newBlock == NULL)
+				return NULL;
+
+			newBlock->next = block;
+			newBlock->size = blockSize;
+			newBlock->used = 0;
+			fAtlas[dataType] = block = newBlock;
+
+			_AddMemoryUsage(sizeof(AtlasBlock) + blockSize);
+		}
+
+		uint8* data = block->Data() + block->used;
+		block->used += size;
+		return data;
+	}
+
+	void _AddMemoryUsage(int64 size)
+	{
+		atomic_add64(&fMemoryUsage, size);
+		atomic_add64(&FontCacheEntry::sTotalMemoryUsage, size);
+	}
+
 private:
 	typedef BOpenHashTable<GlyphHashTableDefinition> GlyphTable;
 
 	GlyphTable	fGlyphTable;
+	AtlasBlock*	fAtlas[kAtlasCount];
+	int64		fMemoryUsage;
 };
 
 
+class FontCacheEntry::GlyphRunCache {
+	struct GlyphRunHashTableDefinition {
+		typedef uint32		KeyType;
+		typedef	GlyphRun	ValueType;
+
+		size_t HashKey(uint32 key) const
+		{
+			return key;
+		}
+
+		size_t Hash(GlyphRun* value) const
+		{
+			return value->Hash();
+		}
+
+		bool Compare(uint32 key, GlyphRun* value) const
+		{
+			return value->Hash() == key;
+		}
+
+		GlyphRun*& GetLink(GlyphRun* value) const
+		{
+			return value->fHashLink;
+		}
+	};
+
+public:
+	GlyphRunCache()
+		:
+		fLock("glyph run cache"),
+		fMemoryUsage(0)
+	{
+	}
+
+	~GlyphRunCache()
+	{
+		while (GlyphRun* run = fRuns.RemoveHead())
+			_Remove(run);
+	}
+
+	status_t Init()
+	{
+		return fRunTable.Init();
+	}
+
+	//!	Returns a referenced run, or \c NULL.
+	GlyphRun* Lookup(uint32 hash, const char* string, int32 length,
+		int32 maxChars, uint8 spacing, float size,
+		const escapement_delta* delta)
+	{
+		BAutolock _(fLock);
+
+		GlyphRun* run = fRunTable.Lookup(hash);
+		while (run != NULL && !run->Matches(hash, string, length, maxChars,
+				spacing, size, delta)) {
+			run = run->fHashLink;
+		}
+		if (run == NULL)
+			return NULL;
+
+		// keep the most recently used runs at the head
+		fRuns.Remove(run);
+		fRuns.Add(run, false);
+
+		run->AcquireReference();
+		return run;
+	}
+
+	void Insert(GlyphRun* run)
+	{
+		BAutolock _(fLock);
+
+		run->AcquireReference();
+		fRunTable.Insert(run);
+		fRuns.Add(run, false);
+		_AddMemoryUsage(run->MemoryUsage());
+
+		while (fRunTable.CountElements() > kMaxGlyphRunCount)
+			_Remove(fRuns.RemoveTail());
+	}
+
+	size_t MemoryUsage() const
+	{
+		return (size_t)atomic_get64((int64*)&fMemoryUsage);
+	}
+
+private:
+	void _Remove(GlyphRun* run)
+	{
+		fRunTable.Remove(run);
+		_AddMemoryUsage(-(int64)run->MemoryUsage());
+		run->ReleaseReference();
+	}
+
+	void _AddMemoryUsage(int64 size)
+	{
+		atomic_add64(&fMemoryUsage, size);
+		atomic_add64(&FontCacheEntry::sTotalMemoryUsage, size);
+	}
+
+private:
+	typedef BOpenHashTable<GlyphRunHashTableDefinition> GlyphRunTable;
+
+	BLocker					fLock;
+	GlyphRunTable			fRunTable;
+	DoublyLinkedList<GlyphRun> fRuns;
+	int64					fMemoryUsage;
+};
+
+
+// #pragma mark - GlyphRun
+
+
+GlyphRun::GlyphRun(uint32 hash, const char* string, int32 length,
+	int32 maxChars, uint8 spacing, float size, const escapement_delta* delta)
+	:
+	fHashLink(NULL),
+	fHash(hash),
+	fString((char*)malloc(length)),
+	fLength(length),
+	fMaxChars(maxChars),
+	fSpacing(spacing),
+	fSize(size),
+	fHasDelta(delta != NULL),
+	fGlyphs(NULL),
+	fGlyphCount(0),
+	fGlyphCapacity(length),
+	fEndX(0.0),
+	fEndY(0.0)
+{
+	if (fString != NULL)
+		memcpy(fString, string, length);
+
+	// there can't be more glyphs than bytes
+	if (length > 0) {
+		fGlyphs = (GlyphRunGlyph*)malloc(
+			sizeof(GlyphRunGlyph) * fGlyphCapacity);
+	}
+
+	if (delta != NULL)
+		fDelta = *delta;
+	else {
+		fDelta.space = 0;
+		fDelta.nonspace = 0;
+	}
+}
+
+
+GlyphRun::~GlyphRun()
+{
+	free(fString);
+	free(fGlyphs);
+}
+
+
+bool
+GlyphRun::Matches(uint32 hash, const char* string, int32 length,
+	int32 maxChars, uint8 spacing, float size,
+	const escapement_delta* delta) const
+{
+	if (hash != fHash || length != fLength || maxChars != fMaxChars
+		|| spacing != fSpacing || size != fSize
+		|| (delta != NULL) != fHasDelta) {
+		return false;
+	}
+	if (delta != NULL && (delta->space != fDelta.space
+			|| delta->nonspace != fDelta.nonspace)) {
+		return false;
+	}
+
+	return memcmp(string, fString, length) == 0;
+}
+
+
+void
+GlyphRun::AddGlyph(uint32 charCode, const GlyphCache* glyph, double x,
+	double y, double advanceX, double advanceY)
+{
+	if (fGlyphCount >= fGlyphCapacity)
+		return;
+
+	GlyphRunGlyph& runGlyph = fGlyphs[fGlyphCount++];
+	runGlyph.char_code = charCode;
+	runGlyph.glyph = glyph;
+	runGlyph.x = x;
+	runGlyph.y = y;
+	runGlyph.advance_x = advanceX;
+	runGlyph.advance_y = advanceY;
+}
+
+
+size_t
+GlyphRun::MemoryUsage() const
+{
+	return sizeof(GlyphRun) + fLength
+		+ sizeof(GlyphRunGlyph) * fGlyphCapacity;
+}
+
+
+/*static*/ uint32
+GlyphRun::HashFor(const char* string, int32 length)
+{
+	// FNV-1a
+	uint32 hash = 2166136261U;
+	for (int32 i = 0; i < length; i++) {
+		hash ^= (uint8)string[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+
 // #pragma mark -
 
 
@@ -133,6 +445,7 @@ FontCacheEntry::FontCacheEntry()
 	:
 	MultiLocker("FontCacheEntry lock"),
 	fGlyphCache(new(std::nothrow) GlyphCachePool()),
+	fGlyphRunCache(new(std::nothrow) GlyphRunCache()),
 	fEngine(),
 	fLastUsedTime(LONGLONG_MIN),
 	fUseCounter(0)
@@ -143,6 +456,7 @@ FontCacheEntry::FontCacheEntry()
 FontCacheEntry::~FontCacheEntry()
 {
 //printf("~FontCacheEntry()\n");
+	delete fGlyphRunCache;
 	delete fGlyphCache;
 }
 
@@ -150,7 +464,7 @@ FontCacheEntry::~FontCacheEntry()
 bool
 FontCacheEntry::Init(const ServerFont& font, bool forceVector)
 {
-	if (fGlyphCache == NULL)
+	if (fGlyphCache == NULL || fGlyphRunCache == NULL)
 		return false;
 
 	glyph_rendering renderingType = _RenderTypeFor(font, forceVector);
@@ -165,7 +479,7 @@ FontCacheEntry::Init(const ServerFont& font, bool forceVector)
 			"file %s\n", font.Path());
 		return false;
 	}
-	if (fGlyphCache->Init() != B_OK) {
+	if (fGlyphCache->Init() != B_OK || fGlyphRunCache->Init() != B_OK) {
 		fprintf(stderr, "FontCacheEntry::Init() - failed to allocate "
 			"GlyphCache table for font file %s\n", font.Path());
 		return false;
@@ -262,7 +576,9 @@ const GlyphCache*
 FontCacheEntry::CachedGlyph(uint32 glyphCode)
 {
 	// Only requires a read lock.
-	return fGlyphCache->FindGlyph(glyphCode);
+	const GlyphCache* glyph = fGlyphCache->FindGlyph(glyphCode);
+	atomic_add64(glyph != NULL ? &sGlyphHits : &sGlyphMisses, 1);
+	return glyph;
 }
 
 
@@ -364,6 +680,35 @@ FontCacheEntry::GetKerning(uint32 glyphCode1, uint32 glyphCode2,
 }
 
 
+/*!	Returns a referenced GlyphRun for the given layout parameters, or \c NULL
+	if that string has not been laid out with this entry recently. Only
+	requires a read lock.
+*/
+GlyphRun*
+FontCacheEntry::CachedGlyphRun(const char* utf8String, int32 length,
+	int32 maxChars, uint8 spacing, float size, const escapement_delta* delta)
+{
+	if (length <= 0 || length > GlyphRun::kMaxLength)
+		return NULL;
+
+	GlyphRun* run = fGlyphRunCache->Lookup(
+		GlyphRun::HashFor(utf8String, length), utf8String, length, maxChars,
+		spacing, size, delta);
+	atomic_add64(run != NULL ? &sGlyphRunHits : &sGlyphRunMisses, 1);
+	return run;
+}
+
+
+/*!	Adds a run that has been laid out completely to the cache. The cache
+	acquires its own reference. Only requires a read lock.
+*/
+void
+FontCacheEntry::CacheGlyphRun(GlyphRun* run)
+{
+	fGlyphRunCache->Insert(run);
+}
+
+
 /*static*/ void
 FontCacheEntry::GenerateSignature(char* signature, size_t signatureSize,
 	const ServerFont& font, bool forceVector)
@@ -396,6 +741,31 @@ FontCacheEntry::UpdateUsage()
 }
 
 
+size_t
+FontCacheEntry::MemoryUsage() const
+{
+	return fGlyphCache->MemoryUsage() + fGlyphRunCache->MemoryUsage();
+}
+
+
+/*static*/ int64
+FontCacheEntry::TotalMemoryUsage()
+{
+	return atomic_get64(&sTotalMemoryUsage);
+}
+
+
+/*static*/ void
+FontCacheEntry::GetStatistics(int64& glyphHits, int64& glyphMisses,
+	int64& runHits, int64& runMisses)
+{
+	glyphHits = atomic_get64(&sGlyphHits);
+	glyphMisses = atomic_get64(&sGlyphMisses);
+	runHits = atomic_get64(&sGlyphRunHits);
+	runMisses = atomic_get64(&sGlyphRunMisses);
+}
+
+
 /*static*/ glyph_rendering
 FontCacheEntry::_RenderTypeFor(const ServerFont& font, bool forceVector)
 {
@@ -28,6 +28,7 @@
 
 
 #include <Locker.h>
+#include <util/DoublyLinkedList.h>
 
 #include <agg_conv_curve.h>
 #include <agg_conv_contour.h>
@@ -41,13 +42,14 @@
 
 
 struct GlyphCache {
-	GlyphCache(uint32 glyphIndex, uint32 dataSize, glyph_data_type dataType,
-			const agg::rect_i& bounds, float advanceX, float advanceY,
+	GlyphCache(uint32 glyphIndex, uint8* data, uint32 dataSize,
+			glyph_data_type dataType, const agg::rect_i& bounds,
+			float advanceX, float advanceY,
 			float preciseAdvanceX, float preciseAdvanceY,
 			float insetLeft, float insetRight)
 		:
 		glyph_index(glyphIndex),
-		data((uint8*)malloc(dataSize)),
+		data(data),
 		data_size(dataSize),
 		data_type(dataType),
 		bounds(bounds),
@@ -61,13 +63,9 @@ struct GlyphCache {
 	{
 	}
 
-	~GlyphCache()
-	{
-		free(data);
-	}
-
 	uint32			glyph_index;
 	uint8*			data;
+		// points into the glyph atlas of the FontCacheEntry
 	uint32			data_size;
 	glyph_data_type	data_type;
 	agg::rect_i		bounds;
@@ -81,6 +79,87 @@ struct GlyphCache {
 	GlyphCache*		hash_link;
 };
 
+
+struct GlyphRunGlyph {
+	uint32				char_code;
+	const GlyphCache*	glyph;
+		// NULL for an empty glyph
+	double				x;
+	double				y;
+	double				advance_x;
+	double				advance_y;
+};
+
+
+// The layout of a string in one FontCacheEntry, as computed by the
+// GlyphLayoutEngine, so that it can be replayed without looking up the
+// glyphs and kerning again.
+class GlyphRun : public BReferenceable,
+	public DoublyLinkedListLinkImpl<GlyphRun> {
+public:
+	enum {
+		kMaxLength = 256
+			// longer strings are not cached
+	};
+
+								GlyphRun(uint32 hash, const char* string,
+									int32 length, int32 maxChars,
+									uint8 spacing, float size,
+									const escapement_delta* delta);
+	virtual						~GlyphRun();
+
+			bool				InitCheck() const
+									{ return fString != NULL
+										&& fGlyphs != NULL; }
+
+			bool				Matches(uint32 hash, const char* string,
+									int32 length, int32 maxChars,
+									uint8 spacing, float size,
+									const escapement_delta* delta) const;
+
+			void				AddGlyph(uint32 charCode,
+									const GlyphCache* glyph, double x,
+									double y, double advanceX,
+									double advanceY);
+			void				SetEnd(double x, double y)
+									{ fEndX = x; fEndY = y; }
+
+			int32				CountGlyphs() const
+									{ return fGlyphCount; }
+			const GlyphRunGlyph& GlyphAt(int32 index) const
+									{ return fGlyphs[index]; }
+			double				EndX() const
+									{ return fEndX; }
+			double				EndY() const
+									{ return fEndY; }
+
+			uint32				Hash() const
+									{ return fHash; }
+			size_t				MemoryUsage() const;
+
+	static	uint32				HashFor(const char* string, int32 length);
+
+			GlyphRun*			fHashLink;
+
+private:
+			uint32				fHash;
+			char*				fString;
+			int32				fLength;
+			int32				fMaxChars;
+			uint8				fSpacing;
+			float				fSize;
+				// the exact size, the entry only knows it to a tenth
+			bool				fHasDelta;
+			escapement_delta	fDelta;
+
+			GlyphRunGlyph*		fGlyphs;
+			int32				fGlyphCount;
+			int32				fGlyphCapacity;
+			double				fEndX;
+			double				fEndY;
+};
+
+
 class FontCache;
 
 class FontCacheEntry : public MultiLocker, public BReferenceable {
@@ -123,6 +202,12 @@ class FontCacheEntry : public MultiLocker, public BReferenceable {
 			bool				GetKerning(uint32 glyphCode1,
 									uint32 glyphCode2, double* x, double* y);
 
+			GlyphRun*			CachedGlyphRun(const char* utf8String,
+									int32 length, int32 maxChars,
+									uint8 spacing, float size,
+									const escapement_delta* delta);
+			void				CacheGlyphRun(GlyphRun* run);
+
 	static	void				GenerateSignature(char* signature,
 									size_t signatureSize,
 									const ServerFont& font, bool forceVector);
@@ -133,6 +218,12 @@ class FontCacheEntry : public MultiLocker, public BReferenceable {
 									{ return fLastUsedTime; }
 			uint64				UsedCount() const
 									{ return fUseCounter; }
+			size_t				MemoryUsage() const;
+
+	static	int64				TotalMemoryUsage();
+	static	void				GetStatistics(int64& glyphHits,
+									int64& glyphMisses, int64& runHits,
+									int64& runMisses);
 
  private:
 								FontCacheEntry(const FontCacheEntry&);
@@ -142,13 +233,21 @@ class FontCacheEntry : public MultiLocker, public BReferenceable {
 									bool forceVector);
 
 			class GlyphCachePool;
+			class GlyphRunCache;
 
 			GlyphCachePool*		fGlyphCache;
+			GlyphRunCache*		fGlyphRunCache;
 			FontEngine			fEngine;
 
 	static	BLocker				sUsageUpdateLock;
 			bigtime_t			fLastUsedTime;
 			uint64				fUseCounter;
+
+	static	int64				sTotalMemoryUsage;
+	static	int64				sGlyphHits;
+	static	int64				sGlyphMisses;
+	static	int64				sGlyphRunHits;
+	static	int64				sGlyphRunMisses;
 };
 
 #endif // FONT_CACHE_ENTRY_H
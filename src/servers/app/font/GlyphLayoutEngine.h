@@ -19,6 +19,7 @@
 #include <Debug.h>
 
 #include <ctype.h>
+#include <new>
 
 class FontCacheReference {
 public:
@@ -97,6 +98,11 @@ public:
 									FontCacheReference* cacheReference = NULL);
 
 private:
+			template<class GlyphConsumer>
+	static	void				_ReplayGlyphRun(GlyphConsumer& consumer,
+									const GlyphRun* run,
+									FontCacheEntry* entry);
+
 	static	bool				_WriteLockAndAcquireFallbackEntry(
 									FontCacheReference& cacheReference,
 									FontCacheEntry* entry,
@@ -212,78 +218,130 @@ GlyphLayoutEngine::LayoutGlyphs(GlyphConsumer& consumer,
 	double advanceY = 0.0;
 	double size = font.Size();
 
-	uint32 lastCharCode = 0; // Needed for kerning in B_STRING_SPACING mode
-	uint32 charCode;
-	int32 index = 0;
-	bool writeLocked = false;
-	const char* start = utf8String;
-	while (maxChars-- > 0 && (charCode = UTF8ToCharCode(&utf8String)) != 0) {
-
-		if (offsets != NULL) {
-			// Use direct glyph locations instead of calculating them
-			// from the advance values
-			x = offsets[index].x;
-			y = offsets[index].y;
-		} else {
-			if (spacing == B_STRING_SPACING)
-				entry->GetKerning(lastCharCode, charCode, &advanceX, &advanceY);
-
-			x += advanceX;
-			y += advanceY;
-		}
-
-		const GlyphCache* glyph = entry->CachedGlyph(charCode);
-		if (glyph == NULL) {
-			// The glyph has not been cached yet, switch to a write lock,
-			// acquire the fallback entry and create the glyph. Note that
-			// the write lock will persist (in the cacheReference) so that
-			// we only have to do this switch once for the whole string.
-			if (!writeLocked) {
-				writeLocked = _WriteLockAndAcquireFallbackEntry(cacheReference,
-					entry, font, consumer.NeedsVector(), utf8String, length,
-					fallbackCacheReference, fallbackEntry);
+	// Strings are often laid out again and again with the same font, so the
+	// resulting glyph positions are cached, as long as they don't come from
+	// the caller anyway.
+	GlyphRun* run = NULL;
+	GlyphRun* newRun = NULL;
+	if (offsets == NULL) {
+		run = entry->CachedGlyphRun(utf8String, length, maxChars, spacing,
+			size, delta);
+		if (run == NULL && length > 0 && length <= GlyphRun::kMaxLength) {
+			newRun = new(std::nothrow) GlyphRun(
+				GlyphRun::HashFor(utf8String, length), utf8String, length,
+				maxChars, spacing, size, delta);
+			if (newRun != NULL && !newRun->InitCheck()) {
+				newRun->ReleaseReference();
+				newRun = NULL;
 			}
-
-			if (writeLocked)
-				glyph = entry->CreateGlyph(charCode, fallbackEntry);
 		}
+	}
 
-		if (glyph == NULL) {
-			consumer.ConsumeEmptyGlyph(index++, charCode, x, y);
-			advanceX = 0;
-			advanceY = 0;
-		} else {
-			// get next increment for pen position
-			if (spacing == B_CHAR_SPACING) {
-				advanceX = glyph->precise_advance_x * size;
-				advanceY = glyph->precise_advance_y * size;
+	if (run != NULL) {
+		_ReplayGlyphRun(consumer, run, entry);
+		run->ReleaseReference();
+	} else {
+		uint32 lastCharCode = 0;
+			// Needed for kerning in B_STRING_SPACING mode
+		uint32 charCode;
+		int32 index = 0;
+		bool writeLocked = false;
+		const char* start = utf8String;
+		while (maxChars-- > 0
+			&& (charCode = UTF8ToCharCode(&utf8String)) != 0) {
+
+			if (offsets != NULL) {
+				// Use direct glyph locations instead of calculating them
+				// from the advance values
+				x = offsets[index].x;
+				y = offsets[index].y;
 			} else {
-				advanceX = glyph->advance_x;
-				advanceY = glyph->advance_y;
+				if (spacing == B_STRING_SPACING) {
+					entry->GetKerning(lastCharCode, charCode, &advanceX,
+						&advanceY);
+				}
+
+				x += advanceX;
+				y += advanceY;
 			}
 
-			// adjust for custom spacing
-			if (delta != NULL) {
-				advanceX += IsWhiteSpace(charCode)
-					? delta->space : delta->nonspace;
+			const GlyphCache* glyph = entry->CachedGlyph(charCode);
+			if (glyph == NULL) {
+				// The glyph has not been cached yet, switch to a write lock,
+				// acquire the fallback entry and create the glyph. Note that
+				// the write lock will persist (in the cacheReference) so that
+				// we only have to do this switch once for the whole string.
+				if (!writeLocked) {
+					writeLocked = _WriteLockAndAcquireFallbackEntry(
+						cacheReference, entry, font, consumer.NeedsVector(),
+						utf8String, length, fallbackCacheReference,
+						fallbackEntry);
+				}
+
+				if (writeLocked)
+					glyph = entry->CreateGlyph(charCode, fallbackEntry);
+				else if (newRun != NULL) {
+					// the glyph might be there next time
+					newRun->ReleaseReference();
+					newRun = NULL;
+				}
 			}
 
-			if (!consumer.ConsumeGlyph(index++, charCode, glyph, entry, x, y,
-					advanceX, advanceY)) {
-				advanceX = 0.0;
-				advanceY = 0.0;
-				break;
+			if (glyph == NULL) {
+				if (newRun != NULL)
+					newRun->AddGlyph(charCode, NULL, x, y, 0, 0);
+				consumer.ConsumeEmptyGlyph(index++, charCode, x, y);
+				advanceX = 0;
+				advanceY = 0;
+			} else {
+				// get next increment for pen position
+				if (spacing == B_CHAR_SPACING) {
+					advanceX = glyph->precise_advance_x * size;
+					advanceY = glyph->precise_advance_y * size;
+				} else {
+					advanceX = glyph->advance_x;
+					advanceY = glyph->advance_y;
+				}
+
+				// adjust for custom spacing
+				if (delta != NULL) {
+					advanceX += IsWhiteSpace(charCode)
+						? delta->space : delta->nonspace;
+				}
+
+				if (newRun != NULL) {
+					newRun->AddGlyph(charCode, glyph, x, y, advanceX,
+						advanceY);
+				}
+
+				if (!consumer.ConsumeGlyph(index++, charCode, glyph, entry,
+						x, y, advanceX, advanceY)) {
+					advanceX = 0.0;
+					advanceY = 0.0;
+					if (newRun != NULL) {
+						// the run is incomplete
+						newRun->ReleaseReference();
+						newRun = NULL;
+					}
+					break;
+				}
 			}
+
+			lastCharCode = charCode;
+			if (utf8String - start + 1 > length)
+				break;
 		}
 
-		lastCharCode = charCode;
-		if (utf8String - start + 1 > length)
-			break;
-	}
+		x += advanceX;
+		y += advanceY;
+		consumer.Finish(x, y);
 
-	x += advanceX;
-	y += advanceY;
-	consumer.Finish(x, y);
+		if (newRun != NULL) {
+			newRun->SetEnd(x, y);
+			entry->CacheGlyphRun(newRun);
+			newRun->ReleaseReference();
+		}
+	}
 
 	if (_cacheReference != NULL && _cacheReference->Entry() == NULL) {
 		// The caller passed a FontCacheReference, but this is the first
@@ -298,6 +356,37 @@ GlyphLayoutEngine::LayoutGlyphs(GlyphConsumer& consumer,
 }
 
 
+/*!	Feeds the \a consumer with the glyphs of a cached run, exactly like
+	LayoutGlyphs() would have done when laying out the string again.
+*/
+template<class GlyphConsumer>
+inline void
+GlyphLayoutEngine::_ReplayGlyphRun(GlyphConsumer& consumer,
+	const GlyphRun* run, FontCacheEntry* entry)
+{
+	double x = run->EndX();
+	double y = run->EndY();
+
+	int32 count = run->CountGlyphs();
+	for (int32 i = 0; i < count; i++) {
+		const GlyphRunGlyph& glyph = run->GlyphAt(i);
+		if (glyph.glyph == NULL) {
+			consumer.ConsumeEmptyGlyph(i, glyph.char_code, glyph.x, glyph.y);
+			continue;
+		}
+
+		if (!consumer.ConsumeGlyph(i, glyph.char_code, glyph.glyph, entry,
+				glyph.x, glyph.y, glyph.advance_x, glyph.advance_y)) {
+			x = glyph.x;
+			y = glyph.y;
+			break;
+		}
+	}
+
+	consumer.Finish(x, y);
+}
+
+
 inline bool
 GlyphLayoutEngine::_WriteLockAndAcquireFallbackEntry(
 	FontCacheReference& cacheReference, FontCacheEntry* entry,
@@ -9,14 +9,19 @@
 #include <list>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <string>
 
 #include "syscalls.h"
 
+#include "main.h"
+
 
 #define UID_LINE 8
 #define GID_LINE 9
@@ -31,11 +36,100 @@ static std::list<int> gTeams;
 }
 
 
+static inline bigtime_t
+ticks_to_usecs(unsigned long long ticks)
+{
+	static long sTicksPerSecond = sysconf(_SC_CLK_TCK);
+	return (bigtime_t)(ticks * 1000000ULL / sTicksPerSecond);
+}
+
+
+static inline bigtime_t
+timeval_to_usecs(const struct timeval& time)
+{
+	return (bigtime_t)time.tv_sec * 1000000LL + time.tv_usec;
+}
+
+
+//! Reads /proc/<id>/stat, id being either a team or a thread.
 status_t
-_kern_get_team_usage_info(team_id team, int32 who, team_usage_info* info, size_t size)
+read_proc_stat(pid_t id, proc_stat* stat)
 {
-	UNIMPLEMENTED();
-	return B_ERROR;
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)id);
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return B_BAD_VALUE;
+
+	char buffer[1024];
+	ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+	if (length <= 0)
+		return B_BAD_VALUE;
+	buffer[length] = '\0';
+
+	// The name is in parentheses, and can contain about anything
+	char* nameStart = strchr(buffer, '(');
+	char* nameEnd = strrchr(buffer, ')');
+	if (nameStart == NULL || nameEnd == NULL || nameEnd < nameStart)
+		return B_BAD_VALUE;
+
+	size_t nameLength = std::min((size_t)(nameEnd - nameStart - 1),
+		sizeof(stat->name) - 1);
+	memcpy(stat->name, nameStart + 1, nameLength);
+	stat->name[nameLength] = '\0';
+
+	unsigned long long userTicks, kernelTicks;
+	long long childrenUserTicks, childrenKernelTicks;
+	if (sscanf(nameEnd + 2, "%c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+			"%llu %llu %lld %lld", &stat->state, &userTicks, &kernelTicks,
+			&childrenUserTicks, &childrenKernelTicks) != 5) {
+		return B_BAD_VALUE;
+	}
+
+	stat->user_time = ticks_to_usecs(userTicks);
+	stat->kernel_time = ticks_to_usecs(kernelTicks);
+	stat->children_user_time = ticks_to_usecs(childrenUserTicks);
+	stat->children_kernel_time = ticks_to_usecs(childrenKernelTicks);
+	return B_OK;
+}
+
+
+status_t
+_kern_get_team_usage_info(team_id team, int32 who, team_usage_info* info,
+	size_t size)
+{
+	if (info == NULL || size != sizeof(team_usage_info)
+		|| (who != B_TEAM_USAGE_SELF && who != B_TEAM_USAGE_CHILDREN)) {
+		return B_BAD_VALUE;
+	}
+
+	if (team == B_CURRENT_TEAM || team == getpid()) {
+		// getrusage() is finer grained than the clock ticks of /proc
+		struct rusage usage;
+		if (getrusage(who == B_TEAM_USAGE_SELF
+				? RUSAGE_SELF : RUSAGE_CHILDREN, &usage) != 0) {
+			return B_ERROR;
+		}
+
+		info->user_time = timeval_to_usecs(usage.ru_utime);
+		info->kernel_time = timeval_to_usecs(usage.ru_stime);
+		return B_OK;
+	}
+
+	proc_stat stat;
+	if (team < 0 || read_proc_stat(team, &stat) != B_OK)
+		return B_BAD_TEAM_ID;
+
+	if (who == B_TEAM_USAGE_SELF) {
+		info->user_time = stat.user_time;
+		info->kernel_time = stat.kernel_time;
+	} else {
+		info->user_time = stat.children_user_time;
+		info->kernel_time = stat.children_kernel_time;
+	}
+	return B_OK;
 }
 
 
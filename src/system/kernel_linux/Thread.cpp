@@ -5,13 +5,16 @@
 
 #include <OS.h>
 
-#include <Locker.h>
-
+#include <algorithm>
+#include <deque>
 #include <string>
-#include <map>
+#include <unordered_map>
 
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -19,24 +22,27 @@
 
 #include <syscalls.h>
 
+#include "futex.h"
 #include "main.h"
 #include "KernelDebug.h"
 
 
-extern int gLoadImageFD;
-
-
 namespace BKernelPrivate {
 
 
+// Every thread has a small control block, only holding futex words.
+// The data port is created the first time data is sent to the thread or
+// the thread asks for it. The block is refcounted, the thread table holds
+// a reference until the thread exits, and so does anyone waiting on it.
 class Thread {
 public:
-						Thread();
-						~Thread();
-
 	static thread_id	Spawn(thread_func func, const char* name,
 							int32 priority, void* data);
 
+	static Thread*		Current();
+	static Thread*		Get(thread_id id, bool dead = false);
+			void		Put();
+
 	static status_t		WaitForThread(thread_id id, status_t* _returnCode);
 	static status_t		Resume(thread_id id);
 
@@ -49,136 +55,445 @@ public:
 							void* buffer, size_t bufferSize);
 	static bool 		HasData(thread_id thread);
 
+			thread_id	Id() const { return fThread; }
+			int32*		ExitWord() { return &fExited; }
+			void		SetExitStatus(status_t status)
+							{ fExitStatus = status; }
+
+			int32		Priority() const { return fPriority; }
+			void		SetPriority(int32 priority)
+							{ fPriority = priority; }
+
 private:
-	friend class ThreadPool;
+						Thread(thread_id id);
+						~Thread();
+
+	static	void		Init();
+	static	void		ReinitAtFork();
 
 	static void*		thread_run(void* data);
+	static void			thread_exited(void* data);
+
+			port_id		DataPort(bool create);
+			void		Exited();
 
 	thread_id			fThread;
-	sem_id				fThreadBlockSem = -1;
+	int32				fRefCount;
+	int32				fLock;
+
+	// futex words
+	int32				fUnblockCount;
+	int32				fExited;
+	int32				fSuspended;
+
+	status_t			fUnblockStatus;
+	status_t			fExitStatus;
 	port_id				fThreadPort;
+	int32				fPriority;
+		// as set, -1 when we only know the one of the scheduler
 
-	sem_id				fThreadExitSem;
+	thread_func			fFunc;
+	void*				fData;
 };
 
 
-struct data_wrap {
-	thread_func func;
-	void* data;
-	thread_id father;
+// The table is split in shards, each with its own lock, so that threads
+// coming and going don't serialize on a single lock. Exited threads are
+// kept around for a while, so that wait_for_thread() still gets their
+// exit status.
+#define THREAD_TABLE_SHARDS 16
+#define MAX_DEAD_THREADS_PER_SHARD 32
 
-	pid_t tid;
+struct ThreadShard {
+	int32								lock;
+	std::unordered_map<thread_id, Thread*>	threads;
+	std::deque<Thread*>					dead;
 };
 
 
 static __thread Thread* gCurrentThread;
-static __thread sem_id gThreadExitSem;
 
-static BLocker fLock;
-static std::map<thread_id, Thread*> gThreadsMap;
+static ThreadShard sThreadTable[THREAD_TABLE_SHARDS];
+static pthread_key_t sThreadExitKey;
+static pthread_once_t sThreadInitOnce = PTHREAD_ONCE_INIT;
 
-// Static initialization for the main thread
-class ThreadPool {
-public:
 
-	ThreadPool()
-	{
-		fMainThread = new Thread();
-		gThreadsMap.insert(std::make_pair(find_thread(NULL), fMainThread));
-		pthread_atfork(NULL, NULL, &ReinitAtFork);
+static inline ThreadShard&
+thread_shard(thread_id id)
+{
+	return sThreadTable[(uint32)id % THREAD_TABLE_SHARDS];
+}
+
+
+static Thread*
+remove_dead_thread(ThreadShard& shard, thread_id id)
+{
+	for (auto it = shard.dead.begin(); it != shard.dead.end(); it++) {
+		if ((*it)->Id() == id) {
+			Thread* thread = *it;
+			shard.dead.erase(it);
+			return thread;
+		}
 	}
 
-	static thread_id
-	CreateThread()
-	{
-		thread_id id = find_thread(NULL);
-		Thread* thread = new Thread();
+	return NULL;
+}
+
+
+static void
+register_thread(thread_id id, Thread* thread)
+{
+	ThreadShard& shard = thread_shard(id);
 
-		gThreadsMap.insert(std::make_pair(id, thread));
-		return id;
+	futex_lock(&shard.lock);
+	shard.threads[id] = thread;
+	// the id was recycled, nobody can wait for the old thread anymore
+	Thread* dead = remove_dead_thread(shard, id);
+	futex_unlock(&shard.lock);
+
+	if (dead != NULL)
+		dead->Put();
+}
+
+
+//! Moves the thread to the dead threads, along with its reference.
+static void
+unregister_thread(thread_id id, Thread* thread)
+{
+	ThreadShard& shard = thread_shard(id);
+	Thread* expired = NULL;
+
+	futex_lock(&shard.lock);
+	auto elem = shard.threads.find(id);
+	if (elem == shard.threads.end() || elem->second != thread) {
+		futex_unlock(&shard.lock);
+		return;
 	}
 
-	static Thread* Find(thread_id id)
-	{
-		auto elem = gThreadsMap.find(id);
-		if (elem == end(gThreadsMap))
-			return NULL;
+	shard.threads.erase(elem);
+	shard.dead.push_back(thread);
+	if (shard.dead.size() > MAX_DEAD_THREADS_PER_SHARD) {
+		expired = shard.dead.front();
+		shard.dead.pop_front();
+	}
+	futex_unlock(&shard.lock);
 
-		return elem->second;
+	if (expired != NULL)
+		expired->Put();
+}
+
+
+static void
+reap_thread(thread_id id)
+{
+	ThreadShard& shard = thread_shard(id);
+
+	futex_lock(&shard.lock);
+	Thread* thread = remove_dead_thread(shard, id);
+	futex_unlock(&shard.lock);
+
+	if (thread != NULL)
+		thread->Put();
+}
+
+
+// Haiku priorities are mapped onto the Linux scheduling policies:
+//	0			SCHED_IDLE
+//	1 - 9		SCHED_OTHER, nice 19 to 1
+//	10			SCHED_OTHER, nice 0
+//	11 - 30		SCHED_OTHER, nice -1 to -20
+//	31 - 99		SCHED_RR, 1 to 49
+//	100 - 120	SCHED_FIFO, 50 to 99
+// Real-time threads aren't time sliced in Haiku, hence SCHED_FIFO for them.
+#define MAX_PRIORITY			B_REAL_TIME_PRIORITY
+#define FIRST_RR_PRIORITY		31
+#define FIRST_FIFO_PRIORITY		B_FIRST_REAL_TIME_PRIORITY
+#define FIRST_FIFO_SCHED_PRIORITY	50
+
+
+static int
+priority_to_nice(int32 priority)
+{
+	if (priority < B_NORMAL_PRIORITY)
+		return 19 - (priority - 1) * 18 / 8;
+
+	return -std::min(priority - B_NORMAL_PRIORITY, (int32)20);
+}
+
+
+static int32
+nice_to_priority(int nice)
+{
+	if (nice > 0)
+		return 1 + (19 - nice) * 8 / 18;
+
+	return B_NORMAL_PRIORITY - nice;
+}
+
+
+//! Returns the nice value the team is allowed to go down to.
+static int
+lowest_allowed_nice()
+{
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NICE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY)
+		return -20;
+
+	return std::max(-20, std::min(19, 20 - (int)limit.rlim_cur));
+}
+
+
+static status_t
+set_nice(pid_t thread, int nice)
+{
+	struct sched_param param = {};
+	if (sched_getscheduler(thread) != SCHED_OTHER
+		&& sched_setscheduler(thread, SCHED_OTHER, &param) != 0) {
+		return errno == ESRCH ? B_BAD_THREAD_ID : B_NOT_ALLOWED;
 	}
 
-	static void Lock()
-	{
-		fLock.Lock();
+	if (setpriority(PRIO_PROCESS, thread, nice) == 0)
+		return B_OK;
+	if (errno == ESRCH)
+		return B_BAD_THREAD_ID;
+
+	// Without CAP_SYS_NICE, get as close as RLIMIT_NICE lets us
+	if (errno == EACCES || errno == EPERM) {
+		setpriority(PRIO_PROCESS, thread,
+			std::max(nice, lowest_allowed_nice()));
+		return B_OK;
 	}
+	return B_ERROR;
+}
+
+
+/*!	Applies the Haiku priority to the thread, falling back to the closest
+	one the team is allowed when it can't have real-time scheduling.
+*/
+static status_t
+set_scheduling(pid_t thread, int32 priority)
+{
+	struct sched_param param = {};
 
-	static void Unlock()
-	{
-		fLock.Unlock();
+	if (priority <= B_IDLE_PRIORITY) {
+		if (sched_setscheduler(thread, SCHED_IDLE, &param) == 0)
+			return B_OK;
+		return errno == ESRCH ? B_BAD_THREAD_ID : B_NOT_ALLOWED;
 	}
 
-private:
-	static void ReinitAtFork()
-	{
-		TRACE("Process %d reinit thread after fork", getpid());
-		gThreadsMap.clear();
-		ThreadPool::CreateThread();
-		gLoadImageFD = -1;
+	if (priority >= FIRST_RR_PRIORITY) {
+		int policy;
+		if (priority >= FIRST_FIFO_PRIORITY) {
+			policy = SCHED_FIFO;
+			param.sched_priority = FIRST_FIFO_SCHED_PRIORITY
+				+ (priority - FIRST_FIFO_PRIORITY) * 49
+					/ (MAX_PRIORITY - FIRST_FIFO_PRIORITY);
+		} else {
+			policy = SCHED_RR;
+			param.sched_priority = 1 + (priority - FIRST_RR_PRIORITY) * 48
+				/ (FIRST_FIFO_PRIORITY - 1 - FIRST_RR_PRIORITY);
+		}
+
+		if (sched_setscheduler(thread, policy, &param) == 0)
+			return B_OK;
+		if (errno == ESRCH)
+			return B_BAD_THREAD_ID;
 	}
 
-	Thread* fMainThread;
-};
+	return set_nice(thread, priority_to_nice(priority));
+}
+
+
+//! Maps the current scheduling of the thread back to a Haiku priority.
+static int32
+get_scheduling(pid_t thread)
+{
+	int policy = sched_getscheduler(thread);
+	if (policy < 0)
+		return B_BAD_THREAD_ID;
+
+	struct sched_param param;
+	switch (policy) {
+		case SCHED_IDLE:
+			return B_IDLE_PRIORITY;
+
+		case SCHED_FIFO:
+			if (sched_getparam(thread, &param) != 0)
+				return B_BAD_THREAD_ID;
+			return std::max(FIRST_FIFO_PRIORITY, FIRST_FIFO_PRIORITY
+				+ (param.sched_priority - FIRST_FIFO_SCHED_PRIORITY)
+					* (MAX_PRIORITY - FIRST_FIFO_PRIORITY) / 49);
+
+		case SCHED_RR:
+			if (sched_getparam(thread, &param) != 0)
+				return B_BAD_THREAD_ID;
+			return std::min(FIRST_FIFO_PRIORITY - 1, FIRST_RR_PRIORITY
+				+ (param.sched_priority - 1)
+					* (FIRST_FIFO_PRIORITY - 1 - FIRST_RR_PRIORITY) / 48);
+
+		default:
+		{
+			errno = 0;
+			int nice = getpriority(PRIO_PROCESS, thread);
+			if (nice == -1 && errno != 0)
+				return B_BAD_THREAD_ID;
+			return nice_to_priority(nice);
+		}
+	}
+}
+
+
+void
+Thread::Init()
+{
+	// The destructor notifies the exit of every thread having a control
+	// block, not only the spawned ones.
+	pthread_key_create(&sThreadExitKey, &thread_exited);
+	pthread_atfork(NULL, NULL, &ReinitAtFork);
+}
+
+
+Thread::Thread(thread_id id)
+	:
+	fThread(id),
+	fRefCount(1),
+	fLock(0),
+	fUnblockCount(0),
+	fExited(0),
+	fSuspended(0),
+	fUnblockStatus(B_OK),
+	fExitStatus(B_OK),
+	fThreadPort(-1),
+	fPriority(-1),
+	fFunc(NULL),
+	fData(NULL)
+{
+}
 
-static ThreadPool init;
+
+Thread::~Thread()
+{
+}
+
+
+void
+Thread::ReinitAtFork()
+{
+	TRACE("Process %d reinit thread after fork", getpid());
+
+	// Only the forking thread survives, and its id changed
+	for (int32 i = 0; i < THREAD_TABLE_SHARDS; i++) {
+		sThreadTable[i].lock = 0;
+		sThreadTable[i].threads.clear();
+		sThreadTable[i].dead.clear();
+	}
+	gCurrentThread = NULL;
+	pthread_setspecific(sThreadExitKey, NULL);
+}
+
+
+//! Returns the control block of the current thread, creating it if needed.
+Thread*
+Thread::Current()
+{
+	if (gCurrentThread != NULL)
+		return gCurrentThread;
+
+	pthread_once(&sThreadInitOnce, &Init);
+
+	Thread* thread = new(std::nothrow) Thread(find_thread(NULL));
+	if (thread == NULL)
+		return NULL;
+
+	register_thread(thread->fThread, thread);
+	gCurrentThread = thread;
+	pthread_setspecific(sThreadExitKey, thread);
+	return thread;
+}
+
+
+/*!	Returns a reference to the control block of a thread of this team,
+	looking at the exited threads as well if dead is true.
+*/
+Thread*
+Thread::Get(thread_id id, bool dead)
+{
+	ThreadShard& shard = thread_shard(id);
+	Thread* thread = NULL;
+
+	futex_lock(&shard.lock);
+	auto elem = shard.threads.find(id);
+	if (elem != shard.threads.end())
+		thread = elem->second;
+	else if (dead) {
+		for (Thread* deadThread : shard.dead) {
+			if (deadThread->fThread == id)
+				thread = deadThread;
+		}
+	}
+	if (thread != NULL)
+		__atomic_add_fetch(&thread->fRefCount, 1, __ATOMIC_RELAXED);
+	futex_unlock(&shard.lock);
+
+	return thread;
+}
+
+
+void
+Thread::Put()
+{
+	if (__atomic_sub_fetch(&fRefCount, 1, __ATOMIC_ACQ_REL) == 0)
+		delete this;
+}
 
 
 void*
 Thread::thread_run(void* data)
 {
 	CALLED();
-	ThreadPool::Lock();
-	data_wrap* threadData = (data_wrap*)data;
-	threadData->tid = ThreadPool::CreateThread();
-	ThreadPool::Unlock();
+	Thread* thread = (Thread*)data;
 
-	Thread::Unblock(threadData->father, B_OK);
-	gCurrentThread->Block(B_TIMEOUT, B_INFINITE_TIMEOUT);
+	// Publish our id, the father waits for it unless pthread has it
+	__atomic_store_n(&thread->fThread, (thread_id)syscall(SYS_gettid),
+		__ATOMIC_RELEASE);
+	futex_wake(&thread->fThread, 1);
 
-	threadData->func(threadData->data);
+	gCurrentThread = thread;
+	pthread_setspecific(sThreadExitKey, thread);
 
-	ThreadPool::Lock();
-	gThreadsMap.erase(gCurrentThread);
-	delete gCurrentThread;
-	gCurrentThread = NULL;
-	delete threadData;
-	ThreadPool::Unlock();
+	// Threads start suspended, wait for resume_thread()
+	while (__atomic_load_n(&thread->fSuspended, __ATOMIC_ACQUIRE) != 0)
+		futex_wait(&thread->fSuspended, 1, B_INFINITE_TIMEOUT);
 
-	status_t exitStatus = B_OK;
-	delete_sem(gThreadExitSem);
-	pthread_exit(&exitStatus);
+	thread->fExitStatus = thread->fFunc(thread->fData);
 	return NULL;
 }
 
 
-Thread::Thread()
+void
+Thread::thread_exited(void* data)
 {
-	fThread = find_thread(NULL);
+	((Thread*)data)->Exited();
+}
 
-	fThreadPort = create_port(1, std::to_string(fThread).c_str());
-	// TODO: Add thread_id to the name?
-	fThreadBlockSem = create_sem(0, "block_thread_sem");
 
-	fThreadExitSem = create_sem(0, "exit_thread_sem");
-	gThreadExitSem = fThreadExitSem;
+void
+Thread::Exited()
+{
+	if (gCurrentThread == this)
+		gCurrentThread = NULL;
 
-	gCurrentThread = this;
-}
+	if (fThreadPort >= 0)
+		delete_port(fThreadPort);
 
+	// Keep a reference while notifying, we might get reaped meanwhile
+	__atomic_add_fetch(&fRefCount, 1, __ATOMIC_RELAXED);
+	unregister_thread(fThread, this);
 
-Thread::~Thread()
-{
-	delete_sem(fThreadBlockSem);
-	delete_port(fThreadPort);
+	__atomic_store_n(&fExited, 1, __ATOMIC_RELEASE);
+	futex_wake(&fExited, INT_MAX);
+
+	Put();
 }
 
 
@@ -186,41 +501,67 @@ thread_id
 Thread::Spawn(thread_func func, const char* name, int32 priority,
 	void* data)
 {
-	data_wrap* dataWrap = new data_wrap();
-	dataWrap->data = data;
-	dataWrap->func = func;
-	dataWrap->father = find_thread(NULL);
+	pthread_once(&sThreadInitOnce, &Init);
+
+	Thread* thread = new(std::nothrow) Thread(0);
+	if (thread == NULL)
+		return B_NO_MEMORY;
+
+	thread->fFunc = func;
+	thread->fData = data;
+	thread->fSuspended = 1;
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
 	pthread_t pThread;
-	int32 ret = pthread_create(&pThread, NULL, Thread::thread_run, dataWrap);
-	if (ret < 0)
-		return B_ERROR;
+	int ret = pthread_create(&pThread, &attr, Thread::thread_run, thread);
+	pthread_attr_destroy(&attr);
+	if (ret != 0) {
+		delete thread;
+		return B_NO_MORE_THREADS;
+	}
+
+	// The child waits for resume_thread() before doing anything, so it
+	// can't exit before it's registered. We only need its id, which newer
+	// glibc versions give us without waiting for the child to be scheduled.
+#if __GLIBC_PREREQ(2, 42)
+	thread_id id = pthread_gettid_np(pThread);
+#else
+	thread_id id;
+	while ((id = __atomic_load_n(&thread->fThread, __ATOMIC_ACQUIRE)) == 0)
+		futex_wait(&thread->fThread, 0, B_INFINITE_TIMEOUT);
+#endif
+
+	__atomic_store_n(&thread->fThread, id, __ATOMIC_RELAXED);
+
+	if (name != NULL) {
+		// The kernel only keeps 15 characters
+		char shortName[16];
+		strlcpy(shortName, name, sizeof(shortName));
+		pthread_setname_np(pThread, shortName);
+	}
 
-	gCurrentThread->Block(B_TIMEOUT, B_INFINITE_TIMEOUT);
-	return dataWrap->tid;
+	// The thread hasn't run yet, so there's no race with set_thread_priority()
+	priority = std::max((int32)B_IDLE_PRIORITY,
+		std::min(priority, (int32)MAX_PRIORITY));
+	if (priority != B_NORMAL_PRIORITY)
+		set_scheduling(id, priority);
+	thread->fPriority = priority;
+
+	register_thread(id, thread);
+	return id;
 }
 
 
 status_t
 Thread::WaitForThread(thread_id id, status_t* _returnCode)
 {
-	ThreadPool::Lock();
-		auto elem = gThreadsMap.find(id);
-		if (elem == end(gThreadsMap))
-			return B_BAD_THREAD_ID;
-		sem_id sem = elem->second->fThreadExitSem;
-	ThreadPool::Unlock();
-
-	status_t ret = acquire_sem(sem);
-
-	if (_returnCode != NULL)
-		*_returnCode = 0;
-
-	if (ret != B_OK && gLoadImageFD != -1) {
-		uint32 value = 1;
-		write(gLoadImageFD, (const void*)&value, sizeof(uint32));
-		close(gLoadImageFD);
-		gLoadImageFD = -1;
+	Thread* thread = Get(id, true);
+	if (thread == NULL) {
+		// It might be a team we loaded, let it run and wait for it
+		resume_loaded_team(id);
 
 		int status;
 		do {
@@ -239,70 +580,161 @@ Thread::WaitForThread(thread_id id, status_t* _returnCode)
 			}
 		} while (!WIFEXITED(status) && !WIFSIGNALED(status));
 
-		// TODO: returncode
+		if (_returnCode != NULL)
+			*_returnCode = WIFEXITED(status) ? WEXITSTATUS(status) : B_ERROR;
 		return B_OK;
 	}
 
-	return ret;
+	while (__atomic_load_n(&thread->fExited, __ATOMIC_ACQUIRE) == 0)
+		futex_wait(&thread->fExited, 0, B_INFINITE_TIMEOUT);
+
+	if (_returnCode != NULL)
+		*_returnCode = thread->fExitStatus;
+
+	thread->Put();
+	reap_thread(id);
+	return B_OK;
 }
 
 
 status_t
 Thread::Resume(thread_id id)
 {
-	return Unblock(id, B_OK);
+	Thread* thread = Get(id);
+	if (thread == NULL) {
+		// It might be a team we loaded
+		return resume_loaded_team(id);
+	}
+
+	// Only a thread that didn't start yet can be resumed, anything else
+	// is left alone
+	int32 suspended = 1;
+	bool resumed = __atomic_compare_exchange_n(&thread->fSuspended,
+		&suspended, 0, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+	if (resumed)
+		futex_wake(&thread->fSuspended, 1);
+
+	thread->Put();
+	return resumed ? B_OK : B_BAD_THREAD_STATE;
 }
 
 
 status_t
 Thread::Block(uint32 flags, bigtime_t timeout)
 {
-	if (fThreadBlockSem == -1)
-		debugger("ThreadBlockSem uninitialized");
+	bigtime_t deadline = futex_deadline(flags, timeout);
+
+	for (;;) {
+		int32 count = __atomic_load_n(&fUnblockCount, __ATOMIC_ACQUIRE);
+		if (count > 0) {
+			if (__atomic_compare_exchange_n(&fUnblockCount, &count,
+					count - 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				return fUnblockStatus;
+			}
+			continue;
+		}
+
+		int error = futex_wait(&fUnblockCount, 0, deadline);
+		if (error == ETIMEDOUT)
+			return deadline == 0 ? B_WOULD_BLOCK : B_TIMED_OUT;
+		if (error == EINTR && (flags & B_CAN_INTERRUPT) != 0)
+			return B_INTERRUPTED;
+	}
+}
+
+
+status_t
+Thread::Unblock(thread_id id, status_t status)
+{
+	Thread* thread = Get(id);
+	if (thread == NULL)
+		return B_BAD_THREAD_ID;
 
-	acquire_sem_etc(fThreadBlockSem, 1, flags, timeout);
+	thread->fUnblockStatus = status;
+	__atomic_add_fetch(&thread->fUnblockCount, 1, __ATOMIC_RELEASE);
+	futex_wake(&thread->fUnblockCount, 1);
+
+	thread->Put();
 	return B_OK;
 }
 
 
-status_t
-Thread::Unblock(thread_id thread, status_t status)
+static team_id
+thread_team(thread_id thread)
 {
-	ThreadPool::Lock();
-	auto elem = gThreadsMap.find(thread);
-	if (elem == end(gThreadsMap)) {
-		ThreadPool::Unlock();
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)thread);
+
+	FILE* file = fopen(path, "r");
+	if (file == NULL)
 		return B_BAD_THREAD_ID;
+
+	team_id team = B_BAD_THREAD_ID;
+	char line[128];
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (sscanf(line, "Tgid:\t%d", &team) == 1)
+			break;
 	}
-	Thread* ret = elem->second;
-	sem_id blockSem = -1;
-	if (ret != NULL)
-		blockSem = ret->fThreadBlockSem;
-	ThreadPool::Unlock();
-
-	if (blockSem != -1) {
-		release_sem(blockSem);
-		return B_OK;
-	}
+	fclose(file);
+	return team;
+}
 
-	return B_ERROR;
+
+//! Returns the data port of the thread, the thread lock must be held.
+port_id
+Thread::DataPort(bool create)
+{
+	if (fThreadPort >= 0 || !create)
+		return fThreadPort;
+
+	// A sender from another team could have created it already
+	std::string name = std::to_string(fThread);
+	fThreadPort = find_port(name.c_str());
+	if (fThreadPort < 0)
+		fThreadPort = create_port(1, name.c_str());
+	else
+		set_port_owner(fThreadPort, getpid());
+
+	return fThreadPort;
 }
 
 
 status_t
-Thread::SendData(thread_id thread, int32 code, const void* buffer,
+Thread::SendData(thread_id id, int32 code, const void* buffer,
 	size_t buffer_size)
 {
 	// Blocks if there's already a message
 	// Otherwise copy the msg and return
-	port_id id = find_port(std::to_string(thread).c_str());
-	if (id < 0) {
-		TRACE("port not found\n");
-		return B_BAD_THREAD_ID;
+	port_id port;
+
+	Thread* thread = Get(id);
+	if (thread != NULL) {
+		futex_lock(&thread->fLock);
+		port = thread->DataPort(true);
+		futex_unlock(&thread->fLock);
+		thread->Put();
+	} else {
+		// The thread is in another team
+		std::string name = std::to_string(id);
+		port = find_port(name.c_str());
+		if (port < 0) {
+			team_id team = thread_team(id);
+			if (team < 0) {
+				TRACE("thread not found\n");
+				return B_BAD_THREAD_ID;
+			}
+			port = create_port(1, name.c_str());
+			if (port >= 0)
+				set_port_owner(port, team);
+		}
 	}
-	size_t s = write_port(id, code, buffer, buffer_size);
-	if (s != buffer_size)
-		return B_ERROR;
+
+	if (port < 0)
+		return port;
+
+	ssize_t s = write_port(port, code, buffer, buffer_size);
+	if (s < B_OK)
+		return s;
 
 	return B_OK;
 }
@@ -312,27 +744,69 @@ status_t
 Thread::ReceiveData(thread_id* sender, void* buffer, size_t bufferSize)
 {
 	// Blocks if there is no message to read
-	port_id port = BKernelPrivate::gCurrentThread->fThreadPort;
+	futex_lock(&fLock);
+	port_id port = DataPort(true);
+	futex_unlock(&fLock);
+
+	if (port < 0)
+		return port;
+
 	int32 code;
-	size_t size = read_port(port,
-		&code, buffer, bufferSize);
-	if (size <= 0)
+	ssize_t size = read_port(port, &code, buffer, bufferSize);
+	if (size < 0)
 		return size;
 
-	return B_OK;
+	return code;
 }
 
 
 bool
-Thread::HasData(thread_id thread)
+Thread::HasData(thread_id id)
 {
 	// Return true if there's a queue and there's a message
 	// False otherwise
-	UNIMPLEMENTED();
-	return false;
+	Thread* thread = Get(id);
+	if (thread == NULL)
+		return false;
+
+	futex_lock(&thread->fLock);
+	port_id port = thread->DataPort(false);
+	futex_unlock(&thread->fLock);
+	thread->Put();
+
+	if (port < 0)
+		port = find_port(std::to_string(id).c_str());
+
+	return port >= 0 && port_count(port) > 0;
+}
+
+
 }
 
 
+using BKernelPrivate::Thread;
+using BKernelPrivate::get_scheduling;
+using BKernelPrivate::set_scheduling;
+using BKernelPrivate::thread_team;
+
+
+status_t
+select_thread(thread_id id, void** _cookie, int32** _exitWord)
+{
+	Thread* thread = Thread::Get(id);
+	if (thread == NULL)
+		return B_BAD_THREAD_ID;
+
+	*_cookie = thread;
+	*_exitWord = thread->ExitWord();
+	return B_OK;
+}
+
+
+void
+deselect_thread(void* cookie)
+{
+	((Thread*)cookie)->Put();
 }
 
 
@@ -340,13 +814,16 @@ thread_id
 _kern_spawn_thread(thread_func func, const char* name, int32 priority, void* data)
 {
 	CALLED();
-	return BKernelPrivate::Thread::Spawn(func, name, priority, data);
+	return Thread::Spawn(func, name, priority, data);
 }
 
 
 status_t
 _kern_kill_thread(thread_id thread)
 {
+	if (kill_loaded_team(thread) == B_OK)
+		return B_OK;
+
 	UNIMPLEMENTED();
 	// pthread_cancel?
 	return B_BAD_THREAD_ID;
@@ -364,7 +841,11 @@ _kern_rename_thread(thread_id thread, const char* newName)
 void
 _kern_exit_thread(status_t status)
 {
-	pthread_exit((void*)&status);
+	Thread* thread = Thread::Current();
+	if (thread != NULL)
+		thread->SetExitStatus(status);
+
+	pthread_exit(NULL);
 }
 
 
@@ -382,7 +863,7 @@ _kern_send_data(thread_id thread, int32 code,
 	const void* buffer, size_t buffer_size)
 {
 	CALLED();
-	return BKernelPrivate::Thread::SendData(thread, code, buffer, buffer_size);
+	return Thread::SendData(thread, code, buffer, buffer_size);
 }
 
 
@@ -390,19 +871,18 @@ status_t
 _kern_receive_data(thread_id* sender, void* buffer, size_t bufferSize)
 {
 	CALLED();
-	if (BKernelPrivate::gCurrentThread == NULL)
-		return B_BAD_THREAD_ID;
+	Thread* thread = Thread::Current();
+	if (thread == NULL)
+		return B_NO_MEMORY;
 
-	status_t ret = BKernelPrivate::gCurrentThread->ReceiveData(sender,
-		buffer, bufferSize);
-	return ret;
+	return thread->ReceiveData(sender, buffer, bufferSize);
 }
 
 
 bool
 _kern_has_data(thread_id thread)
 {
-	return BKernelPrivate::Thread::HasData(thread);
+	return Thread::HasData(thread);
 }
 
 
@@ -411,12 +891,47 @@ _kern_get_thread_info(thread_id id, thread_info* info)
 {
 	CALLED();
 
+	proc_stat stat;
+	if (id <= 0 || read_proc_stat(id, &stat) != B_OK)
+		return B_BAD_THREAD_ID;
+
+	memset(info, 0, sizeof(thread_info));
 	info->thread = id;
-	strncpy (info->name, "Unknown", B_OS_NAME_LENGTH);
-	info->name[B_OS_NAME_LENGTH - 1] = '\0';
-	info->state = B_THREAD_RUNNING;
-	info->priority = 5;
-	info->team = getpid();
+	info->team = thread_team(id);
+	if (info->team < 0)
+		return B_BAD_THREAD_ID;
+
+	strlcpy(info->name, stat.name, B_OS_NAME_LENGTH);
+
+	switch (stat.state) {
+		case 'R':
+			info->state = B_THREAD_RUNNING;
+			break;
+		case 'S':
+		case 'D':
+			info->state = B_THREAD_WAITING;
+			break;
+		case 'T':
+		case 't':
+			info->state = B_THREAD_SUSPENDED;
+			break;
+		default:
+			info->state = B_THREAD_READY;
+			break;
+	}
+
+	Thread* thread = Thread::Get(id);
+	if (thread != NULL) {
+		info->priority = thread->Priority();
+		thread->Put();
+	} else
+		info->priority = -1;
+	if (info->priority < 0)
+		info->priority = get_scheduling(id);
+
+	info->sem = -1;
+	info->user_time = stat.user_time;
+	info->kernel_time = stat.kernel_time;
 	return B_OK;
 }
 
@@ -444,17 +959,79 @@ find_thread(const char* name)
 }
 
 
+//! Returns the previous priority of the thread.
 status_t
 _kern_set_thread_priority(thread_id id, int32 priority)
 {
-	UNIMPLEMENTED();
-	// Mapping:
-	// 0, SCHED_IDLE
-	// 1-9, SCHED_OTHER 19, 1
-	// 10, SCHED_OTHER 0
-	// 11-30, SCHED_OTHER -1,-20
-	// 31-120, SCHED_FIFO, 1,99
-	return B_BAD_THREAD_ID;
+	CALLED();
+
+	if (id == 0)
+		id = find_thread(NULL);
+
+	priority = std::max((int32)B_LOWEST_ACTIVE_PRIORITY,
+		std::min(priority, (int32)MAX_PRIORITY));
+
+	Thread* thread = Thread::Get(id);
+	int32 oldPriority = thread != NULL ? thread->Priority() : -1;
+	if (oldPriority < 0)
+		oldPriority = get_scheduling(id);
+	if (oldPriority < 0) {
+		if (thread != NULL)
+			thread->Put();
+		return B_BAD_THREAD_ID;
+	}
+
+	status_t status = set_scheduling(id, priority);
+	if (thread != NULL) {
+		if (status == B_OK)
+			thread->SetPriority(priority);
+		thread->Put();
+	}
+
+	return status == B_OK ? oldPriority : status;
+}
+
+
+status_t
+_kern_get_thread_affinity(thread_id id, void* mask, size_t maskSize)
+{
+	CALLED();
+
+	if (mask == NULL || maskSize == 0)
+		return B_BAD_VALUE;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(id, sizeof(set), &set) != 0)
+		return errno == ESRCH ? B_BAD_THREAD_ID : B_BAD_VALUE;
+
+	memcpy(mask, &set, std::min(maskSize, sizeof(set)));
+	if (maskSize > sizeof(set))
+		memset((uint8*)mask + sizeof(set), 0, maskSize - sizeof(set));
+	return B_OK;
+}
+
+
+status_t
+_kern_set_thread_affinity(thread_id id, const void* mask, size_t maskSize)
+{
+	CALLED();
+
+	if (mask == NULL || maskSize == 0)
+		return B_BAD_VALUE;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	memcpy(&set, mask, std::min(maskSize, sizeof(set)));
+	if (CPU_COUNT(&set) == 0)
+		return B_BAD_VALUE;
+
+	if (sched_setaffinity(id, sizeof(set), &set) != 0) {
+		if (errno == ESRCH)
+			return B_BAD_THREAD_ID;
+		return errno == EPERM ? B_NOT_ALLOWED : B_BAD_VALUE;
+	}
+	return B_OK;
 }
 
 
@@ -462,7 +1039,7 @@ status_t
 _kern_wait_for_thread(thread_id id, status_t* _returnCode)
 {
 	CALLED();
-	return BKernelPrivate::Thread::WaitForThread(id, _returnCode);
+	return Thread::WaitForThread(id, _returnCode);
 }
 
 
@@ -478,7 +1055,7 @@ status_t
 _kern_resume_thread(thread_id id)
 {
 	CALLED();
-	return BKernelPrivate::Thread::Resume(id);
+	return Thread::Resume(id);
 }
 
 
@@ -486,7 +1063,11 @@ status_t
 _kern_block_thread(uint32 flags, bigtime_t timeout)
 {
 	CALLED();
-	return BKernelPrivate::gCurrentThread->Block(flags, timeout);
+	Thread* thread = Thread::Current();
+	if (thread == NULL)
+		return B_NO_MEMORY;
+
+	return thread->Block(flags, timeout);
 }
 
 
@@ -494,7 +1075,7 @@ status_t
 _kern_unblock_thread(thread_id thread, status_t status)
 {
 	CALLED();
-	return BKernelPrivate::Thread::Unblock(thread, status);
+	return Thread::Unblock(thread, status);
 }
 
 
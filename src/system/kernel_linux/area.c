@@ -1,5 +1,6 @@
 /*------------------------------------------------------------------------------
 //	Copyright (c) 2003, Tom Marshall
+//	Copyright (c) 2020, Dario Casalinuovo
 //
 //	Permission is hereby granted, free of charge, to any person obtaining a
 //	copy of this software and associated documentation files (the "Software"),
@@ -24,6 +25,26 @@
 //----------------------------------------------------------------------------*/
 
 
+/*
+
+All the areas of the system are registered in a table in shared memory,
+and their memory lives in POSIX shared memory objects, the "stores".
+Each area maps a store, clones share the store of their source area.
+The store is named after the area that created it and is refcounted by
+the areas using it, the slot of that area stays reserved until the last
+reference is gone.
+
+Areas are mapped lazily by the team owning them, which is what makes
+transfer_area() zero copy: the sender unmaps the store and hands a new
+area over to the target, which maps it the first time it looks at it.
+
+The id encodes the slot and a per slot serial, and a chained hash
+indexes the areas by name for find_area(). Every process also keeps its
+own mappings sorted by address, for area_for().
+
+*/
+
+
 #include <SupportDefs.h>
 #include <OS.h>
 
@@ -31,12 +52,14 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/shm.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
 
 #include <string.h>
 
+#include "futex.h"
 #include "main.h"
 
 
@@ -51,204 +74,778 @@
 
 #define dprintf printf
 
-// Area IDs
-#define AREA_ID_MAX  256
-#define AREA_ID_FREE 0xFFFFFFFF
-
-
-area_info* g_pAreaMap = NULL;
+#define AREA_TABLE_MAGIC 'aReA'
+
+#define AREA_ID_FREE ((area_id)-1)
+#define AREA_NO_SLOT -1
+
+
+struct area_entry {
+	area_id		id;				// AREA_ID_FREE if unused
+	int32		serial;
+	int32		next_free;
+	int32		next_hash;		// name hash chain
+	int32		store;			// slot holding the store reference count
+	area_id		store_id;		// the store is named after this area
+	int32		store_refs;		// areas using the store created here
+	area_info	info;			// address is only valid in the owner team
+};
+
+// The shared memory segment holds this header, followed by the
+// entries and by the heads of the name hash chains.
+struct area_table {
+	int32		magic;
+	int32		lock;
+	int32		max_areas;
+	int32		free_head;
+	int32		free_tail;
+	int32		used_slots;		// slots above this were never used
+};
+
+struct area_mapping {
+	area_id		area;
+	void*		address;
+	size_t		size;
+	size_t		reserved;		// address space kept for resize_area()
+};
+
+// Mappings reserve this many times their size of address space,
+// so that resize_area() can grow them in place.
+#define AREA_RESERVE_FACTOR 4
+
+// gMaxAreas must be power of 2
+int32 gMaxAreas = 65536;
+
+static struct area_table* sAreaTable = NULL;
+static struct area_entry* sAreas = NULL;
+static int32* sAreaHash = NULL;
+
+// Mappings of this process, by slot
+static struct area_mapping* sAreaMappings = NULL;
+
+// Slots of the mappings of this process, sorted by address
+static int32* sMappedSlots = NULL;
+static int32 sMappedCount = 0;
+static int32 sMappedCapacity = 0;
 
 
 void init_area_map()
 {
 	int shmid;
-	int created = 1;
+	bool created = true;
+	size_t size = sizeof(struct area_table)
+		+ sizeof(struct area_entry) * gMaxAreas + sizeof(int32) * gMaxAreas;
 
-	/* create a unique key for our system-wide sem table */
+	if (sAreaTable != NULL)
+		return;
+
+	/* create a unique key for our system-wide area table */
 	key_t table_key = ftok("/usr/local/bin/", (int)'A');
 
 	TRACE(("Master area table key is 0x%x.\n", table_key));
 
-	/* create and initialize a new area table in shared memory */
-	shmid = shmget(table_key, sizeof(area_info)*AREA_ID_MAX,
-		IPC_CREAT | IPC_EXCL | 0700);
-
+	shmid = shmget(table_key, size, IPC_CREAT | IPC_EXCL | 0700);
 	if (shmid == -1 && errno == EEXIST) {
-		/* grab the existing shared memory semaphore table */
-		shmid = shmget(table_key,
-			sizeof(area_info)*AREA_ID_MAX, IPC_CREAT | 0700);
-
+		shmid = shmget(table_key, size, IPC_CREAT | 0700);
 		TRACE(("Using existing system area table.\n"));
+		created = false;
+	}
 
-		created = 0;
+	if (shmid < 0) {
+		printf("init_area_map(): failed in shmget: %s\n", strerror(errno));
+		return;
 	}
 
-	g_pAreaMap = shmat(shmid, NULL, 0);
-	if (g_pAreaMap == (void*)(-1)) {
+	struct area_table* table = shmat(shmid, NULL, 0);
+	if (table == (void*)(-1)) {
 		printf("init_area_map(): failed in shmat: %s\n",
 			strerror(errno));
-		g_pAreaMap = NULL;
 		return;
 	}
 
-	if (created == 1) {
-		for (uint32 n = 0; n < AREA_ID_MAX; n++) {
-			g_pAreaMap[n].area = AREA_ID_FREE;
+	struct area_entry* areas = (struct area_entry*)(table + 1);
+	int32* hash = (int32*)(areas + gMaxAreas);
+
+	if (created) {
+		// Entries are zero filled and set up when first used
+		table->lock = 0;
+		table->max_areas = gMaxAreas;
+		table->free_head = AREA_NO_SLOT;
+		table->free_tail = AREA_NO_SLOT;
+		table->used_slots = 0;
+		for (int32 i = 0; i < gMaxAreas; i++)
+			hash[i] = AREA_NO_SLOT;
+		__atomic_store_n(&table->magic, AREA_TABLE_MAGIC, __ATOMIC_RELEASE);
+		futex_wake(&table->magic, INT_MAX);
+	} else {
+		int32 magic;
+		while ((magic = __atomic_load_n(&table->magic, __ATOMIC_ACQUIRE))
+				!= AREA_TABLE_MAGIC) {
+			futex_wait(&table->magic, magic, B_INFINITE_TIMEOUT);
 		}
+		if (table->max_areas != gMaxAreas) {
+			printf("init_area_map(): area table size mismatch\n");
+			shmdt(table);
+			return;
+		}
+	}
+
+	sAreaMappings = calloc(gMaxAreas, sizeof(struct area_mapping));
+	if (sAreaMappings == NULL) {
+		shmdt(table);
+		return;
+	}
+
+	sAreas = areas;
+	sAreaHash = hash;
+	sAreaTable = table;
+}
+
+
+#define GRAB_AREA_LOCK() futex_lock(&sAreaTable->lock)
+#define RELEASE_AREA_LOCK() futex_unlock(&sAreaTable->lock)
+
+
+static uint32
+area_name_hash(const char* name)
+{
+	uint32 hash = 2166136261U;
+	for (int32 i = 0; i < B_OS_NAME_LENGTH && name[i] != '\0'; i++) {
+		hash ^= (uint8)name[i];
+		hash *= 16777619U;
+	}
+	return hash & (gMaxAreas - 1);
+}
+
+
+static void
+area_index_insert(int32 slot)
+{
+	int32* head = &sAreaHash[area_name_hash(sAreas[slot].info.name)];
+	sAreas[slot].next_hash = *head;
+	*head = slot;
+}
+
+
+static void
+area_index_remove(int32 slot)
+{
+	int32* link = &sAreaHash[area_name_hash(sAreas[slot].info.name)];
+	while (*link != AREA_NO_SLOT) {
+		if (*link == slot) {
+			*link = sAreas[slot].next_hash;
+			return;
+		}
+		link = &sAreas[*link].next_hash;
+	}
+}
+
+
+/** Returns the slot of a valid area, or AREA_NO_SLOT.
+ *	The area lock must be held when called.
+ */
+
+static int32
+area_slot(area_id id)
+{
+	if (sAreaTable == NULL || id < 0)
+		return AREA_NO_SLOT;
+
+	int32 slot = id % gMaxAreas;
+	if (sAreas[slot].id != id)
+		return AREA_NO_SLOT;
+
+	return slot;
+}
+
+
+static int32
+alloc_area_slot()
+{
+	int32 slot = sAreaTable->free_head;
+	if (slot != AREA_NO_SLOT) {
+		sAreaTable->free_head = sAreas[slot].next_free;
+		if (sAreaTable->free_head == AREA_NO_SLOT)
+			sAreaTable->free_tail = AREA_NO_SLOT;
+	} else if (sAreaTable->used_slots < sAreaTable->max_areas) {
+		slot = sAreaTable->used_slots++;
+	} else
+		return AREA_NO_SLOT;
+
+	struct area_entry* area = &sAreas[slot];
+	// Serials start at 1, ids below gMaxAreas are never valid
+	area->serial = area->serial % (INT32_MAX / gMaxAreas - 1) + 1;
+	area->next_free = AREA_NO_SLOT;
+	area->next_hash = AREA_NO_SLOT;
+	return slot;
+}
+
+
+static void
+free_area_slot(int32 slot)
+{
+	// Reuse the least recently freed slots last, to keep
+	// stale ids invalid for as long as possible.
+	sAreas[slot].id = AREA_ID_FREE;
+	sAreas[slot].next_free = AREA_NO_SLOT;
+	if (sAreaTable->free_tail != AREA_NO_SLOT)
+		sAreas[sAreaTable->free_tail].next_free = slot;
+	else
+		sAreaTable->free_head = slot;
+	sAreaTable->free_tail = slot;
+}
+
+
+static void
+area_store_name(area_id storeID, char* name, size_t size)
+{
+	snprintf(name, size, "/vos-area-%ld", (long)storeID);
+}
+
+
+static int
+area_protection_to_prot(uint32 protection)
+{
+	int prot = 0;
+	if ((protection & B_READ_AREA) != 0)
+		prot |= PROT_READ;
+	if ((protection & B_WRITE_AREA) != 0)
+		prot |= PROT_WRITE;
+	if ((protection & B_EXECUTE_AREA) != 0)
+		prot |= PROT_EXEC;
+
+	// Kernel only protections, that's what the old backend gave them
+	if ((protection & (B_READ_AREA | B_WRITE_AREA | B_EXECUTE_AREA)) == 0)
+		prot = PROT_READ | PROT_WRITE;
+
+	return prot;
+}
+
+
+/** Maps the store of the area in the current process.
+ *	The area lock must be held when called.
+ */
+
+/** Returns the index in sMappedSlots of the first mapping that starts
+ *	above address.
+ *	The area lock must be held when called.
+ */
+
+static int32
+mapped_slot_index(const void* address)
+{
+	int32 lower = 0;
+	int32 upper = sMappedCount;
+
+	while (lower < upper) {
+		int32 middle = (lower + upper) / 2;
+		if ((const uint8*)sAreaMappings[sMappedSlots[middle]].address
+				<= (const uint8*)address) {
+			lower = middle + 1;
+		} else
+			upper = middle;
+	}
+
+	return lower;
+}
+
+
+static bool
+insert_mapped_slot(int32 slot)
+{
+	if (sMappedCount == sMappedCapacity) {
+		int32 capacity = sMappedCapacity > 0 ? sMappedCapacity * 2 : 64;
+		int32* slots = realloc(sMappedSlots, capacity * sizeof(int32));
+		if (slots == NULL)
+			return false;
+
+		sMappedSlots = slots;
+		sMappedCapacity = capacity;
 	}
+
+	int32 index = mapped_slot_index(sAreaMappings[slot].address);
+	memmove(sMappedSlots + index + 1, sMappedSlots + index,
+		(sMappedCount - index) * sizeof(int32));
+	sMappedSlots[index] = slot;
+	sMappedCount++;
+	return true;
+}
+
+
+static void
+remove_mapped_slot(int32 slot)
+{
+	int32 index = mapped_slot_index(sAreaMappings[slot].address) - 1;
+	if (index < 0 || sMappedSlots[index] != slot)
+		return;
+
+	sMappedCount--;
+	memmove(sMappedSlots + index, sMappedSlots + index + 1,
+		(sMappedCount - index) * sizeof(int32));
+}
+
+
+static void*
+map_area(int32 slot, void* address, uint32 addressSpec)
+{
+	struct area_entry* area = &sAreas[slot];
+	char name[B_OS_NAME_LENGTH];
+	int flags = MAP_SHARED;
+
+	area_store_name(area->store_id, name, sizeof(name));
+
+	int fd = shm_open(name, O_RDWR, 0600);
+	if (fd < 0) {
+		printf("map_area(): shm_open(%s) failed (%s)\n", name,
+			strerror(errno));
+		return NULL;
+	}
+
+	int reserveFlags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+	if (addressSpec == B_EXACT_ADDRESS)
+		reserveFlags |= MAP_FIXED_NOREPLACE;
+	else if (addressSpec != B_BASE_ADDRESS
+			&& addressSpec != B_RANDOMIZED_BASE_ADDRESS)
+		address = NULL;
+
+	if (area->info.lock == B_FULL_LOCK || area->info.lock == B_CONTIGUOUS
+			|| area->info.lock == B_32_BIT_FULL_LOCK
+			|| area->info.lock == B_32_BIT_CONTIGUOUS)
+		flags |= MAP_POPULATE;
+
+	size_t size = area->info.size;
+	size_t reserved = size <= SIZE_MAX / AREA_RESERVE_FACTOR
+		? size * AREA_RESERVE_FACTOR : size;
+
+	void* base = mmap(address, reserved, PROT_NONE, reserveFlags, -1, 0);
+	if (base == MAP_FAILED && reserved != size) {
+		reserved = size;
+		base = mmap(address, reserved, PROT_NONE, reserveFlags, -1, 0);
+	}
+
+	void* mapped = MAP_FAILED;
+	if (base != MAP_FAILED) {
+		mapped = mmap(base, size,
+			area_protection_to_prot(area->info.protection),
+			flags | MAP_FIXED, fd, 0);
+		if (mapped == MAP_FAILED)
+			munmap(base, reserved);
+	}
+	close(fd);
+
+	if (mapped == MAP_FAILED) {
+		printf("map_area(): mmap(%s) failed (%s)\n", name, strerror(errno));
+		return NULL;
+	}
+
+	struct area_mapping* mapping = &sAreaMappings[slot];
+	mapping->area = area->id;
+	mapping->address = mapped;
+	mapping->size = size;
+	mapping->reserved = reserved;
+
+	if (!insert_mapped_slot(slot)) {
+		munmap(mapped, reserved);
+		mapping->area = AREA_ID_FREE;
+		mapping->address = NULL;
+		mapping->size = 0;
+		mapping->reserved = 0;
+		return NULL;
+	}
+
+	area->info.address = mapped;
+	return mapped;
+}
+
+
+static void
+unmap_area(int32 slot)
+{
+	struct area_mapping* mapping = &sAreaMappings[slot];
+
+	if (mapping->address != NULL) {
+		remove_mapped_slot(slot);
+		munmap(mapping->address, mapping->reserved);
+	}
+
+	mapping->area = AREA_ID_FREE;
+	mapping->address = NULL;
+	mapping->size = 0;
+	mapping->reserved = 0;
+}
+
+
+/** Returns the address of the area in the current process, mapping it
+ *	if its owner is the current team and it wasn't mapped yet, which is
+ *	the case for transferred areas. Those are mapped at the address that
+ *	transfer_area() announced, unless that range is in use already.
+ *	The area lock must be held when called.
+ */
+
+static void*
+get_area_address(int32 slot)
+{
+	struct area_entry* area = &sAreas[slot];
+	struct area_mapping* mapping = &sAreaMappings[slot];
+
+	if (mapping->area == area->id && mapping->address != NULL)
+		return mapping->address;
+
+	if (area->info.team != getpid())
+		return area->info.address;
+
+	unmap_area(slot);
+	return map_area(slot, area->info.address, B_BASE_ADDRESS);
+}
+
+
+static void
+setup_area(int32 slot, const char* name, size_t size, uint32 lock,
+	uint32 protection)
+{
+	struct area_entry* area = &sAreas[slot];
+
+	memset(&area->info, 0, sizeof(area_info));
+	if (name == NULL)
+		name = "unnamed area";
+	strncpy(area->info.name, name, B_OS_NAME_LENGTH);
+	area->info.name[B_OS_NAME_LENGTH - 1] = '\0';
+	area->info.size = size;
+	area->info.lock = lock;
+	area->info.protection = protection;
+	area->info.team = getpid();
+	area->info.ram_size = size;
+	area->id = area->serial * gMaxAreas + slot;
+	area->info.area = area->id;
+}
+
+
+static void
+put_area_store(int32 storeSlot)
+{
+	struct area_entry* store = &sAreas[storeSlot];
+
+	if (--store->store_refs > 0)
+		return;
+
+	char name[B_OS_NAME_LENGTH];
+	area_store_name(store->store_id, name, sizeof(name));
+	shm_unlink(name);
+
+	if (store->id == AREA_ID_FREE)
+		free_area_slot(storeSlot);
 }
 
 
-/* TODO: need to sync access to area map with mutex */
 area_id _kern_create_area(const char* name, void** start_addr,
 	uint32 addr_spec, size_t size, uint32 lock, uint32 protection)
 {
-#ifdef DEBUG
-	if (g_pAreaMap == NULL)
-		debugger("area map is null");
-#endif
+	char storeName[B_OS_NAME_LENGTH];
+
+	init_area_map();
+	if (sAreaTable == NULL)
+		return B_NO_MEMORY;
+
+	if (size == 0 || (addr_spec == B_EXACT_ADDRESS && start_addr == NULL))
+		return B_BAD_VALUE;
+
+	size = (size + B_PAGE_SIZE - 1) & ~(size_t)(B_PAGE_SIZE - 1);
+
+	GRAB_AREA_LOCK();
+
+	int32 slot = alloc_area_slot();
+	if (slot == AREA_NO_SLOT) {
+		RELEASE_AREA_LOCK();
+		return B_NO_MEMORY;
+	}
+
+	setup_area(slot, name, size, lock, protection);
 
-	for (uint32 n = 0; n < AREA_ID_MAX; n++) {
-		if (g_pAreaMap[n].area == AREA_ID_FREE) {
-			int iShmID = shmget(n, size, IPC_CREAT | 0700);
-			if (iShmID == -1) {
-				printf("create_area(): shmget(%u,%u) failed (%s)\n",
-					n, size, strerror(errno));
-				return B_NO_MEMORY;
-			}
-			
-			g_pAreaMap[n].address = shmat(iShmID, NULL, 0);
-			if (g_pAreaMap[n].address == (void*)(-1)) {
-				printf("create_area(): shmat(%d) failed (%s)\n",
-					iShmID, strerror(errno));
-				return B_NO_MEMORY;
-			}
-			
-			if (start_addr != NULL) {
-				*start_addr = g_pAreaMap[n].address;
-			}
-			strncpy(g_pAreaMap[n].name, name, B_OS_NAME_LENGTH);
-			g_pAreaMap[n].name[B_OS_NAME_LENGTH -1] = '\0';
-			g_pAreaMap[n].area = iShmID;
-			g_pAreaMap[n].size = size;
-			g_pAreaMap[n].lock = lock;
-			g_pAreaMap[n].protection = protection;
-			g_pAreaMap[n].team = getpid();
-			g_pAreaMap[n].ram_size = size;
-			return n;
+	struct area_entry* area = &sAreas[slot];
+	area->store = slot;
+	area->store_id = area->id;
+	area->store_refs = 1;
+
+	area_store_name(area->store_id, storeName, sizeof(storeName));
+	int fd = shm_open(storeName, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0 || ftruncate(fd, size) != 0) {
+		printf("create_area(): store %s failed (%s)\n", storeName,
+			strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+			shm_unlink(storeName);
 		}
+		free_area_slot(slot);
+		RELEASE_AREA_LOCK();
+		return B_NO_MEMORY;
 	}
-	return B_NO_MEMORY;
+	close(fd);
+
+	void* address = map_area(slot,
+		start_addr != NULL ? *start_addr : NULL, addr_spec);
+	if (address == NULL) {
+		shm_unlink(storeName);
+		free_area_slot(slot);
+		RELEASE_AREA_LOCK();
+		return B_NO_MEMORY;
+	}
+
+	area_index_insert(slot);
+
+	RELEASE_AREA_LOCK();
+
+	if (start_addr != NULL)
+		*start_addr = address;
+
+	return area->id;
 }
 
 
 area_id _kern_clone_area(const char* name, void** dest_addr,
 	uint32 addr_spec, uint32 protection, area_id source)
 {
-	if (source < 0 || source >= AREA_ID_MAX || g_pAreaMap == NULL ||
-		g_pAreaMap[source].area == AREA_ID_FREE) {
-		printf("clone_area(): AREA IS FREE\n");
-		return -EPERM;
-	}
-
-	size_t nSize = g_pAreaMap[source].size;
-	uint32 nProtection = g_pAreaMap[source].protection;
-	uint32 lock = g_pAreaMap[source].lock;
-
-	for (uint32 n = 0; n < AREA_ID_MAX; n++) {
-		if (g_pAreaMap[n].area == AREA_ID_FREE) {
-			int iShmID = shmget(source, nSize, IPC_CREAT | 0700);
-			if (iShmID == -1) {
-				printf("clone_area(): shmget(%u,%u) failed (%s)\n",
-					n, nSize, strerror(errno));
-				return B_NO_MEMORY;
-			}
-
-			g_pAreaMap[n].address = shmat(iShmID, NULL, 0);
-
-			if (g_pAreaMap[n].address == (void*)(-1)) {
-				printf("clone_area(): shmat(%d) failed (%s)\n",
-					iShmID, strerror(errno));
-				return B_NO_MEMORY;
-			}
-
-			if (dest_addr != NULL) {
-				*dest_addr = g_pAreaMap[n].address;
-			}
-			strncpy(g_pAreaMap[n].name, name, B_OS_NAME_LENGTH);
-			g_pAreaMap[n].name[B_OS_NAME_LENGTH -1] = '\0';
-			g_pAreaMap[n].area = iShmID;
-			g_pAreaMap[n].size = nSize;
-			g_pAreaMap[n].lock = lock;
-			g_pAreaMap[n].protection = nProtection;
-			g_pAreaMap[n].team = getpid();
-			g_pAreaMap[n].ram_size = nSize;
-			return n;
-		}
+	init_area_map();
+	if (sAreaTable == NULL)
+		return B_NO_MEMORY;
+
+	if (addr_spec == B_EXACT_ADDRESS && dest_addr == NULL)
+		return B_BAD_VALUE;
+
+	GRAB_AREA_LOCK();
+
+	int32 sourceSlot = area_slot(source);
+	if (sourceSlot == AREA_NO_SLOT) {
+		RELEASE_AREA_LOCK();
+		TRACE(("clone_area(): invalid area %ld\n", source));
+		return B_BAD_VALUE;
 	}
 
-	return B_NO_MEMORY;
+	int32 slot = alloc_area_slot();
+	if (slot == AREA_NO_SLOT) {
+		RELEASE_AREA_LOCK();
+		return B_NO_MEMORY;
+	}
+
+	struct area_entry* sourceArea = &sAreas[sourceSlot];
+	struct area_entry* area = &sAreas[slot];
+
+	setup_area(slot, name, sourceArea->info.size, sourceArea->info.lock,
+		protection);
+	area->store = sourceArea->store;
+	area->store_id = sourceArea->store_id;
+	area->store_refs = 0;
+	sAreas[area->store].store_refs++;
+
+	void* address = map_area(slot,
+		dest_addr != NULL ? *dest_addr : NULL, addr_spec);
+	if (address == NULL) {
+		put_area_store(area->store);
+		free_area_slot(slot);
+		RELEASE_AREA_LOCK();
+		return B_NO_MEMORY;
+	}
+
+	area_index_insert(slot);
+
+	RELEASE_AREA_LOCK();
+
+	if (dest_addr != NULL)
+		*dest_addr = address;
+
+	return area->id;
 }
 
 
 area_id
 _kern_find_area(const char *name)
 {
-	for (uint32 n = 0; n < AREA_ID_MAX; n++) {
-		if (g_pAreaMap[n].area != AREA_ID_FREE
-				&& strcmp(name, g_pAreaMap[n].name) == 0) {
-			return n;
+	area_id id = B_NAME_NOT_FOUND;
+
+	init_area_map();
+	if (sAreaTable == NULL || name == NULL)
+		return B_BAD_VALUE;
+
+	GRAB_AREA_LOCK();
+
+	for (int32 slot = sAreaHash[area_name_hash(name)];
+			slot != AREA_NO_SLOT; slot = sAreas[slot].next_hash) {
+		if (strncmp(name, sAreas[slot].info.name, B_OS_NAME_LENGTH) == 0) {
+			id = sAreas[slot].id;
+			break;
 		}
 	}
 
-	return B_ERROR;
+	RELEASE_AREA_LOCK();
+	return id;
 }
 
 
 area_id
 _kern_area_for (void *address)
 {
-	for (uint32 n = 0; n < AREA_ID_MAX; n++) {
-		if (g_pAreaMap[n].area != AREA_ID_FREE) {
-			if ((address >= g_pAreaMap[n].address)
-				&& (address < g_pAreaMap[n].address + g_pAreaMap[n].size)) {
-				return n;
-			}
+	area_id id = B_ERROR;
+
+	init_area_map();
+	if (sAreaTable == NULL)
+		return B_ERROR;
+
+	GRAB_AREA_LOCK();
+
+	// the mappings don't overlap, only the last one starting at or below
+	// the address can contain it
+	int32 index = mapped_slot_index(address) - 1;
+	if (index >= 0) {
+		int32 slot = sMappedSlots[index];
+		struct area_mapping* mapping = &sAreaMappings[slot];
+		if (mapping->area == sAreas[slot].id
+				&& (uint8*)address < (uint8*)mapping->address
+					+ mapping->size) {
+			id = mapping->area;
 		}
 	}
 
-	return B_ERROR;
+	RELEASE_AREA_LOCK();
+	return id;
 }
 
 
 status_t _kern_delete_area(area_id hArea)
 {
-	if (hArea < 0 || hArea >= AREA_ID_MAX || g_pAreaMap == NULL ||
-			g_pAreaMap[hArea].area == AREA_ID_FREE) {
+	init_area_map();
+	if (sAreaTable == NULL)
+		return B_ERROR;
+
+	GRAB_AREA_LOCK();
+
+	int32 slot = area_slot(hArea);
+	if (slot == AREA_NO_SLOT) {
+		RELEASE_AREA_LOCK();
 		return B_ERROR;
 	}
-	/* FIXME: refcount the shmseg and shmdt() when zero */
-	g_pAreaMap[hArea].area = AREA_ID_FREE;
 
-	return 0;
+	// Other teams' mappings go away with them
+	if (sAreas[slot].info.team == getpid())
+		unmap_area(slot);
+
+	area_index_remove(slot);
+
+	int32 store = sAreas[slot].store;
+	sAreas[slot].id = AREA_ID_FREE;
+	if (store != slot)
+		free_area_slot(slot);
+
+	// The slot holding the store is freed with the last reference
+	put_area_store(store);
+
+	RELEASE_AREA_LOCK();
+	return B_OK;
 }
 
 
+/** Resizes the store and the area in place, within the address space
+ *	reserved by the mapping. Clones keep their mapping, they see the new
+ *	size once they map the store again.
+ */
+
 status_t _kern_resize_area(area_id id, size_t new_size)
 {
-	UNIMPLEMENTED();
-	return B_ERROR;
+	char name[B_OS_NAME_LENGTH];
+
+	init_area_map();
+	if (sAreaTable == NULL)
+		return B_BAD_VALUE;
+
+	if (new_size == 0)
+		return B_BAD_VALUE;
+
+	new_size = (new_size + B_PAGE_SIZE - 1) & ~(size_t)(B_PAGE_SIZE - 1);
+
+	GRAB_AREA_LOCK();
+
+	int32 slot = area_slot(id);
+	if (slot == AREA_NO_SLOT) {
+		RELEASE_AREA_LOCK();
+		return B_BAD_VALUE;
+	}
+
+	struct area_entry* area = &sAreas[slot];
+	size_t oldSize = area->info.size;
+	if (new_size == oldSize) {
+		RELEASE_AREA_LOCK();
+		return B_OK;
+	}
+
+	area_store_name(area->store_id, name, sizeof(name));
+	int fd = shm_open(name, O_RDWR, 0600);
+	if (fd < 0) {
+		RELEASE_AREA_LOCK();
+		return B_ERROR;
+	}
+
+	// Grow the store before the mapping, shrink it after
+	status_t status = B_OK;
+	if (new_size > oldSize && ftruncate(fd, new_size) != 0)
+		status = B_NO_MEMORY;
+
+	struct area_mapping* mapping = &sAreaMappings[slot];
+	if (status == B_OK && area->info.team == getpid()
+			&& mapping->area == id && mapping->address != NULL) {
+		uint8* address = (uint8*)mapping->address;
+		void* result;
+		if (new_size > mapping->reserved)
+			result = MAP_FAILED;
+		else if (new_size > oldSize) {
+			result = mmap(address + oldSize, new_size - oldSize,
+				area_protection_to_prot(area->info.protection),
+				MAP_SHARED | MAP_FIXED, fd, oldSize);
+		} else {
+			// give the tail back to the reservation
+			result = mmap(address + new_size, oldSize - new_size, PROT_NONE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+				-1, 0);
+		}
+
+		if (result == MAP_FAILED) {
+			if (new_size > oldSize)
+				ftruncate(fd, oldSize);
+			status = B_NO_MEMORY;
+		} else
+			mapping->size = new_size;
+	}
+
+	if (status == B_OK && new_size < oldSize)
+		ftruncate(fd, new_size);
+
+	close(fd);
+
+	if (status == B_OK) {
+		area->info.size = new_size;
+		area->info.ram_size = new_size;
+	}
+
+	RELEASE_AREA_LOCK();
+	return status;
 }
 
 
 status_t _kern_get_area_info(area_id hArea, area_info* psInfo)
 {
-	if (hArea < 0 || hArea >= AREA_ID_MAX || g_pAreaMap == NULL ||
-			g_pAreaMap[hArea].area == AREA_ID_FREE) {
+	init_area_map();
+	if (sAreaTable == NULL || psInfo == NULL)
+		return B_BAD_VALUE;
+
+	GRAB_AREA_LOCK();
+
+	int32 slot = area_slot(hArea);
+	if (slot == AREA_NO_SLOT) {
+		RELEASE_AREA_LOCK();
 		return B_BAD_VALUE;
 	}
-	
-	*psInfo = g_pAreaMap[hArea];
+
+	*psInfo = sAreas[slot].info;
+	psInfo->address = get_area_address(slot);
+
+	RELEASE_AREA_LOCK();
 	return B_OK;
 }
 
@@ -257,25 +854,147 @@ status_t
 _kern_get_next_area_info(team_id team, ssize_t* cookie,
 	area_info* areaInfo)
 {
-	UNIMPLEMENTED();
-	return B_ERROR;
+	init_area_map();
+	if (sAreaTable == NULL || cookie == NULL || areaInfo == NULL)
+		return B_BAD_VALUE;
+
+	if (team == B_CURRENT_TEAM)
+		team = getpid();
+
+	GRAB_AREA_LOCK();
+
+	for (ssize_t slot = *cookie; slot >= 0
+			&& slot < sAreaTable->used_slots; slot++) {
+		struct area_entry* area = &sAreas[slot];
+		if (area->id == AREA_ID_FREE || area->info.team != team)
+			continue;
+
+		*areaInfo = area->info;
+		areaInfo->address = get_area_address(slot);
+		*cookie = slot + 1;
+
+		RELEASE_AREA_LOCK();
+		return B_OK;
+	}
+
+	RELEASE_AREA_LOCK();
+	return B_BAD_VALUE;
 }
 
 
 status_t
 _kern_set_area_protection(area_id id, uint32 protection)
 {
-	UNIMPLEMENTED();
-	return B_ERROR;
+	init_area_map();
+	if (sAreaTable == NULL)
+		return B_BAD_VALUE;
+
+	GRAB_AREA_LOCK();
+
+	int32 slot = area_slot(id);
+	if (slot == AREA_NO_SLOT) {
+		RELEASE_AREA_LOCK();
+		return B_BAD_VALUE;
+	}
+
+	struct area_mapping* mapping = &sAreaMappings[slot];
+	if (mapping->area == id && mapping->address != NULL
+			&& mprotect(mapping->address, mapping->size,
+				area_protection_to_prot(protection)) != 0) {
+		RELEASE_AREA_LOCK();
+		return B_NOT_ALLOWED;
+	}
+
+	sAreas[slot].info.protection = protection;
+
+	RELEASE_AREA_LOCK();
+	return B_OK;
 }
 
 
+/** Hands the area over to the target team without copying: the current
+ *	team unmaps it, and a new area backed by the same store is created
+ *	for the target, which maps it on first use. A process can't map memory
+ *	into another one, so *_address is where the target is going to map
+ *	it: the address asked for with B_EXACT_ADDRESS or B_BASE_ADDRESS, or
+ *	the one the area had in the current team. If that range is in use in
+ *	the target, it will be mapped elsewhere.
+ */
+
 area_id
 _kern_transfer_area(area_id area, void **_address, uint32 addressSpec,
 	team_id target)
 {
-	UNIMPLEMENTED();
-	return -1;
+	init_area_map();
+	if (sAreaTable == NULL)
+		return B_BAD_VALUE;
+
+	if (target < 0)
+		return B_BAD_TEAM_ID;
+
+	GRAB_AREA_LOCK();
+
+	int32 slot = area_slot(area);
+	if (slot == AREA_NO_SLOT) {
+		RELEASE_AREA_LOCK();
+		return B_BAD_VALUE;
+	}
+
+	struct area_entry* source = &sAreas[slot];
+	if (target == source->info.team) {
+		if (_address != NULL)
+			*_address = get_area_address(slot);
+		RELEASE_AREA_LOCK();
+		return area;
+	}
+
+	int32 newSlot = alloc_area_slot();
+	if (newSlot == AREA_NO_SLOT) {
+		RELEASE_AREA_LOCK();
+		return B_NO_MEMORY;
+	}
+
+	void* address = source->info.address;
+	if (sAreaMappings[slot].area == area
+			&& sAreaMappings[slot].address != NULL)
+		address = sAreaMappings[slot].address;
+	if (_address != NULL && *_address != NULL
+			&& (addressSpec == B_EXACT_ADDRESS
+				|| addressSpec == B_BASE_ADDRESS)) {
+		address = *_address;
+	}
+
+	struct area_entry* newArea = &sAreas[newSlot];
+	setup_area(newSlot, source->info.name, source->info.size,
+		source->info.lock, source->info.protection);
+	newArea->info.team = target;
+	newArea->info.address = address;
+	newArea->store = source->store;
+	newArea->store_id = source->store_id;
+	newArea->store_refs = 0;
+	sAreas[newArea->store].store_refs++;
+
+	// the source area goes away, like in delete_area()
+	if (source->info.team == getpid())
+		unmap_area(slot);
+
+	area_index_remove(slot);
+
+	int32 store = source->store;
+	source->id = AREA_ID_FREE;
+	if (store != slot)
+		free_area_slot(slot);
+	put_area_store(store);
+
+	area_index_insert(newSlot);
+	area_id newID = newArea->id;
+
+	RELEASE_AREA_LOCK();
+
+	if (_address != NULL)
+		*_address = address;
+
+	return newID;
 }
 
 
@@ -0,0 +1,1446 @@
+/*
+ *  Copyright 2020, Dario Casalinuovo. All rights reserved.
+ *  Distributed under the terms of the LGPL License.
+ */
+
+#include "IndexStore.h"
+
+#include <TypeConstants.h>
+#include <fs_index.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <new>
+
+#include "../futex.h"
+#include "fs_private.h"
+#include "KernelDebug.h"
+#include "Query.h"
+#include "VirtualDirectory.h"
+#include "util/AutoLock.h"
+
+
+#define STORE_DIRECTORY			".vos-index"
+#define LOG_NAME				"index.log"
+#define LOCK_NAME				"index.lock"
+
+#define LOG_MAGIC				'VIDX'
+#define LOG_VERSION				1
+
+#define READ_CHUNK_SIZE			65536
+#define COMPACTION_MINIMUM		(4 * 1024 * 1024)
+	// don't bother compacting smaller logs
+#define MAX_PATH_DEPTH			256
+
+
+namespace BKernelPrivate {
+
+
+enum {
+	RECORD_CREATE_INDEX = 1,
+	RECORD_REMOVE_INDEX,
+	RECORD_ENTRY,
+	RECORD_SET_KEY,
+	RECORD_REMOVE_KEY,
+	RECORD_REMOVE_NODE
+};
+
+
+// The node field of a RECORD_CREATE_INDEX record holds these.
+enum {
+	INDEX_POPULATED = 0x01
+		// it was filled with the attributes already on the volume
+};
+
+
+struct log_header {
+	uint32	magic;
+	uint32	version;
+	int64	root;
+		// the root node of the volume, to tell a reused device number
+};
+
+
+// The records are 8 byte aligned, the name is followed by the key.
+struct index_record {
+	uint32	op;
+	uint32	size;
+	int64	node;
+		// or the flags of an index
+	int64	value;
+		// the parent of an entry, or the creation time of an index
+	uint32	type;
+	uint32	nameLength;
+	char	data[];
+};
+
+
+struct default_index {
+	const char*	name;
+	uint32		type;
+};
+
+
+static const default_index kDefaultIndices[] = {
+	{ "name", B_STRING_TYPE },
+	{ "size", B_INT64_TYPE },
+	{ "last_modified", B_INT64_TYPE },
+	{ "BEOS:TYPE", B_MIME_STRING_TYPE },
+	{ "BEOS:APP_SIG", B_MIME_STRING_TYPE }
+};
+
+
+static inline bool
+is_stat_index(const char* name)
+{
+	return strcmp(name, "name") == 0 || strcmp(name, "size") == 0
+		|| strcmp(name, "last_modified") == 0;
+}
+
+
+static inline size_t
+record_size(size_t nameLength, size_t keyLength)
+{
+	return (sizeof(index_record) + nameLength + keyLength + 7) & ~(size_t)7;
+}
+
+
+class RecordBuffer {
+public:
+	void Add(uint32 op, int64 node, int64 value, uint32 type,
+		const std::string& name, const std::string& key = std::string())
+	{
+		size_t size = record_size(name.size(), key.size());
+		size_t offset = fBuffer.size();
+		fBuffer.resize(offset + size, '\0');
+
+		index_record* record = (index_record*)&fBuffer[offset];
+		record->op = op;
+		record->size = size;
+		record->node = node;
+		record->value = value;
+		record->type = type;
+		record->nameLength = name.size();
+		memcpy(record->data, name.data(), name.size());
+		memcpy(record->data + name.size(), key.data(), key.size());
+	}
+
+	void Append(const RecordBuffer& other)
+	{
+		fBuffer += other.fBuffer;
+	}
+
+	const char* Data() const { return fBuffer.data(); }
+	size_t Size() const { return fBuffer.size(); }
+	bool IsEmpty() const { return fBuffer.empty(); }
+
+private:
+	std::string	fBuffer;
+};
+
+
+static int32 sStoresLock = 0;
+static std::map<dev_t, IndexStore*> sStores;
+static pthread_once_t sStoresOnce = PTHREAD_ONCE_INIT;
+
+
+static status_t
+make_directories(const std::string& path)
+{
+	size_t slash = 0;
+	while (true) {
+		slash = path.find('/', slash + 1);
+		std::string component = path.substr(0, slash);
+		if (mkdir(component.c_str(), 0755) < 0 && errno != EEXIST)
+			return errno_to_status(errno);
+		if (slash == std::string::npos)
+			return B_OK;
+	}
+}
+
+
+static std::string
+unescape_mount_point(const char* escaped)
+{
+	// spaces and the like come as octal escapes
+	std::string path;
+	for (const char* c = escaped; *c != '\0'; c++) {
+		if (c[0] == '\\' && c[1] >= '0' && c[1] <= '7' && c[2] != '\0'
+				&& c[3] != '\0') {
+			path += (char)strtol(std::string(c + 1, 3).c_str(), NULL, 8);
+			c += 3;
+		} else
+			path += *c;
+	}
+	return path;
+}
+
+
+//! Finds where the volume is mounted, bind mounts of subdirectories aside.
+static status_t
+find_mount_point(dev_t device, std::string& _path)
+{
+	FILE* file = fopen("/proc/self/mountinfo", "re");
+	if (file == NULL)
+		return errno_to_status(errno);
+
+	bool found = false;
+	bool foundRoot = false;
+	char line[4096];
+	while (fgets(line, sizeof(line), file) != NULL) {
+		unsigned int major;
+		unsigned int minor;
+		char root[PATH_MAX];
+		char mountPoint[PATH_MAX];
+		if (sscanf(line, "%*d %*d %u:%u %4095s %4095s", &major, &minor, root,
+				mountPoint) != 4 || makedev(major, minor) != device) {
+			continue;
+		}
+
+		std::string path = unescape_mount_point(mountPoint);
+		bool isRoot = strcmp(root, "/") == 0;
+		if (!found || (isRoot && !foundRoot)
+			|| (isRoot == foundRoot && path.size() < _path.size())) {
+			_path = path;
+			found = true;
+			foundRoot = isRoot;
+		}
+	}
+	fclose(file);
+
+	return found ? B_OK : B_ENTRY_NOT_FOUND;
+}
+
+
+static inline void
+append_big_endian(std::string& key, uint64 value)
+{
+	for (int shift = 56; shift >= 0; shift -= 8)
+		key += (char)(value >> shift);
+}
+
+
+IndexStore::IndexStore(dev_t device)
+	:
+	fDevice(device),
+	fRootNode(-1),
+	fLogFD(-1),
+	fLockFD(-1),
+	fLockMode(0),
+	fLogNode(-1),
+	fLogOffset(0),
+	fCompactionCheck(COMPACTION_MINIMUM),
+	fWatchFD(-1),
+	fWatcher(-1),
+	fLock("index store")
+{
+}
+
+
+void
+IndexStore::_ReinitAtFork()
+{
+	// the watcher threads are gone
+	sStoresLock = 0;
+	for (auto& elem : sStores) {
+		IndexStore* store = elem.second;
+		if (store == NULL)
+			continue;
+		if (store->fWatchFD >= 0)
+			close(store->fWatchFD);
+		store->fWatchFD = -1;
+		store->fWatcher = -1;
+		store->fLiveQueries.clear();
+	}
+}
+
+
+static void
+init_stores()
+{
+	pthread_atfork(NULL, NULL, &IndexStore::_ReinitAtFork);
+}
+
+
+status_t
+IndexStore::Get(dev_t device, IndexStore*& _store, bool create)
+{
+	pthread_once(&sStoresOnce, &init_stores);
+
+	futex_lock(&sStoresLock);
+
+	auto elem = sStores.find(device);
+	if (elem != sStores.end()) {
+		_store = elem->second;
+		futex_unlock(&sStoresLock);
+		return _store != NULL ? B_OK : B_NOT_SUPPORTED;
+	}
+
+	if (!create) {
+		futex_unlock(&sStoresLock);
+		return B_ENTRY_NOT_FOUND;
+	}
+
+	IndexStore* store = new(std::nothrow) IndexStore(device);
+	if (store == NULL) {
+		futex_unlock(&sStoresLock);
+		return B_NO_MEMORY;
+	}
+
+	status_t error = store->_Init();
+	if (error != B_OK) {
+		TRACE("IndexStore: no store for device %ld\n", (long)device);
+		delete store;
+		// don't try again on every attribute write
+		sStores[device] = NULL;
+		futex_unlock(&sStoresLock);
+		return error;
+	}
+
+	sStores[device] = store;
+	futex_unlock(&sStoresLock);
+
+	_store = store;
+	return B_OK;
+}
+
+
+status_t
+IndexStore::_Init()
+{
+	status_t error = find_mount_point(fDevice, fMountPoint);
+	if (error != B_OK)
+		return error;
+
+	struct stat st;
+	if (stat(fMountPoint.c_str(), &st) < 0)
+		return errno_to_status(errno);
+	if (st.st_dev != fDevice)
+		return B_ENTRY_NOT_FOUND;
+	fRootNode = st.st_ino;
+
+	// Stay on the volume when we can, the user cache is the fallback for
+	// the volumes we can't write to.
+	std::string base = fMountPoint.size() == 1 ? "" : fMountPoint;
+	fStorePath = base + "/" STORE_DIRECTORY;
+	if (access(fMountPoint.c_str(), W_OK) != 0
+		|| make_directories(fStorePath) != B_OK) {
+		const char* cache = getenv("XDG_CACHE_HOME");
+		std::string home = getenv("HOME") != NULL ? getenv("HOME") : "/tmp";
+		char device[32];
+		snprintf(device, sizeof(device), "%llx", (unsigned long long)fDevice);
+
+		fStorePath = (cache != NULL && cache[0] == '/'
+			? std::string(cache) : home + "/.cache")
+			+ "/vos/index/" + device;
+
+		error = make_directories(fStorePath);
+		if (error != B_OK)
+			return error;
+	}
+
+	error = _OpenLog();
+	if (error != B_OK)
+		return error;
+
+	NodeSet touched;
+	return _ReadLog(touched);
+}
+
+
+status_t
+IndexStore::_OpenLog()
+{
+	std::string logPath = fStorePath + "/" LOG_NAME;
+
+	if (fLockFD < 0) {
+		std::string lockPath = fStorePath + "/" LOCK_NAME;
+		fLockFD = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (fLockFD < 0)
+			return errno_to_status(errno);
+	}
+
+	if (fLogFD >= 0)
+		close(fLogFD);
+
+	fLogFD = open(logPath.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+		0644);
+	if (fLogFD < 0)
+		return errno_to_status(errno);
+
+	status_t error = B_OK;
+	if (!_IsLogValid()) {
+		// a new store, or one we can't make sense of
+		int lockMode = fLockMode;
+		if (lockMode != LOCK_EX)
+			_LockLog(LOCK_EX);
+
+		if (!_IsLogValid()) {
+			ftruncate(fLogFD, 0);
+
+			log_header header;
+			header.magic = LOG_MAGIC;
+			header.version = LOG_VERSION;
+			header.root = fRootNode;
+
+			RecordBuffer records;
+			time_t now = time(NULL);
+			for (size_t i = 0; i < B_COUNT_OF(kDefaultIndices); i++) {
+				records.Add(RECORD_CREATE_INDEX, 0, now,
+					kDefaultIndices[i].type, kDefaultIndices[i].name);
+			}
+
+			std::string buffer((const char*)&header, sizeof(header));
+			buffer.append(records.Data(), records.Size());
+			if (write(fLogFD, buffer.data(), buffer.size())
+					!= (ssize_t)buffer.size()) {
+				error = errno_to_status(errno);
+			}
+		}
+
+		if (lockMode == 0)
+			_UnlockLog();
+		else if (lockMode != LOCK_EX)
+			_LockLog(lockMode);
+	}
+
+	struct stat st;
+	if (error == B_OK && fstat(fLogFD, &st) < 0)
+		error = errno_to_status(errno);
+	if (error != B_OK)
+		return error;
+
+	fLogNode = st.st_ino;
+	fLogOffset = sizeof(log_header);
+	return B_OK;
+}
+
+
+bool
+IndexStore::_IsLogValid() const
+{
+	log_header header;
+	return pread(fLogFD, &header, sizeof(header), 0) == sizeof(header)
+		&& header.magic == LOG_MAGIC && header.version == LOG_VERSION
+		&& (ino_t)header.root == fRootNode;
+}
+
+
+void
+IndexStore::_LockLog(int mode)
+{
+	while (flock(fLockFD, mode) < 0 && errno == EINTR)
+		;
+	fLockMode = mode;
+}
+
+
+void
+IndexStore::_UnlockLog()
+{
+	flock(fLockFD, LOCK_UN);
+	fLockMode = 0;
+}
+
+
+void
+IndexStore::_Reset()
+{
+	fIndices.clear();
+	fNodes.clear();
+}
+
+
+status_t
+IndexStore::_ReadLog(NodeSet& touched)
+{
+	std::string logPath = fStorePath + "/" LOG_NAME;
+
+	struct stat st;
+	if (stat(logPath.c_str(), &st) == 0 && st.st_ino != fLogNode) {
+		// compacted by someone else, start over
+		for (auto& elem : fNodes)
+			touched.insert(elem.first);
+		_Reset();
+
+		status_t error = _OpenLog();
+		if (error != B_OK)
+			return error;
+	}
+
+	std::vector<char> buffer(READ_CHUNK_SIZE);
+	while (true) {
+		ssize_t bytes = pread(fLogFD, &buffer[0], buffer.size(), fLogOffset);
+		if (bytes < (ssize_t)sizeof(index_record))
+			break;
+
+		size_t position = 0;
+		const index_record* record = NULL;
+		while (position + sizeof(index_record) <= (size_t)bytes) {
+			record = (const index_record*)&buffer[position];
+			if (record->size < sizeof(index_record) || record->size % 8 != 0
+				|| sizeof(index_record) + record->nameLength > record->size) {
+				ERROR("IndexStore: corrupt log %s\n", logPath.c_str());
+				return B_BAD_DATA;
+			}
+			if (position + record->size > (size_t)bytes)
+				break;
+
+			_Apply(record, touched);
+			position += record->size;
+			record = NULL;
+		}
+
+		if (position == 0) {
+			if (record != NULL && record->size > buffer.size()) {
+				buffer.resize(record->size);
+				continue;
+			}
+			// a record that's still being written
+			break;
+		}
+
+		fLogOffset += position;
+	}
+
+	return B_OK;
+}
+
+
+void
+IndexStore::_Apply(const index_record* record, NodeSet& touched)
+{
+	std::string name(record->data, record->nameLength);
+	ino_t node = record->node;
+
+	switch (record->op) {
+		case RECORD_CREATE_INDEX:
+		{
+			if (fIndices.find(name) != fIndices.end())
+				break;
+
+			Index& index = fIndices[name];
+			index.type = record->type;
+			index.populated = (record->node & INDEX_POPULATED) != 0;
+			index.created = record->value;
+			index.modified = record->value;
+			index.size = 0;
+
+			// the names are known already
+			if (name == "name") {
+				for (auto& elem : fNodes)
+					_SetKey(elem.first, elem.second, name, elem.second.name);
+			}
+			break;
+		}
+
+		case RECORD_REMOVE_INDEX:
+			if (fIndices.erase(name) == 0)
+				break;
+			for (auto& elem : fNodes)
+				elem.second.keys.erase(name);
+			break;
+
+		case RECORD_ENTRY:
+		{
+			IndexedNode& indexed = fNodes[node];
+			indexed.parent = record->value;
+			indexed.name = name;
+			_SetKey(node, indexed, "name", name);
+			touched.insert(node);
+			break;
+		}
+
+		case RECORD_SET_KEY:
+		{
+			std::string key(record->data + record->nameLength,
+				record->size - sizeof(index_record) - record->nameLength);
+			if (record->type < key.size())
+				key.resize(record->type);
+					// the type field holds the key length here
+
+			IndexedNode& indexed = fNodes[node];
+			_SetKey(node, indexed, name, key);
+			touched.insert(node);
+			break;
+		}
+
+		case RECORD_REMOVE_KEY:
+		{
+			auto elem = fNodes.find(node);
+			if (elem != fNodes.end()) {
+				_RemoveKey(node, elem->second, name);
+				touched.insert(node);
+			}
+			break;
+		}
+
+		case RECORD_REMOVE_NODE:
+			_RemoveNode(node);
+			touched.insert(node);
+			break;
+	}
+}
+
+
+void
+IndexStore::_SetKey(ino_t node, IndexedNode& indexed,
+	const std::string& indexName, const std::string& key)
+{
+	auto index = fIndices.find(indexName);
+	if (index == fIndices.end())
+		return;
+
+	auto old = indexed.keys.find(indexName);
+	if (old != indexed.keys.end()) {
+		if (old->second == key)
+			return;
+		index->second.keys.erase(std::make_pair(old->second, node));
+		index->second.size -= old->second.size();
+		old->second = key;
+	} else
+		indexed.keys[indexName] = key;
+
+	index->second.keys.insert(std::make_pair(key, node));
+	index->second.size += key.size();
+	index->second.modified = time(NULL);
+}
+
+
+void
+IndexStore::_RemoveKey(ino_t node, IndexedNode& indexed,
+	const std::string& indexName)
+{
+	auto old = indexed.keys.find(indexName);
+	if (old == indexed.keys.end())
+		return;
+
+	auto index = fIndices.find(indexName);
+	if (index != fIndices.end()) {
+		index->second.keys.erase(std::make_pair(old->second, node));
+		index->second.size -= old->second.size();
+		index->second.modified = time(NULL);
+	}
+	indexed.keys.erase(old);
+}
+
+
+void
+IndexStore::_RemoveNode(ino_t node)
+{
+	auto elem = fNodes.find(node);
+	if (elem == fNodes.end())
+		return;
+
+	while (!elem->second.keys.empty()) {
+		std::string indexName = elem->second.keys.begin()->first;
+		_RemoveKey(node, elem->second, indexName);
+	}
+	fNodes.erase(elem);
+}
+
+
+status_t
+IndexStore::Sync()
+{
+	NodeSet touched;
+	status_t error = _ReadLog(touched);
+	_NotifyLiveQueries(touched);
+	return error;
+}
+
+
+status_t
+IndexStore::_Write(RecordBuffer& records, NodeSet& touched)
+{
+	if (records.IsEmpty()) {
+		_NotifyLiveQueries(touched);
+		return B_OK;
+	}
+
+	// A shared lock is enough, O_APPEND writes don't interleave. It keeps
+	// the log from being compacted under our feet.
+	_LockLog(LOCK_SH);
+
+	status_t error = _ReadLog(touched);
+	if (error == B_OK && write(fLogFD, records.Data(), records.Size())
+			!= (ssize_t)records.Size()) {
+		error = errno_to_status(errno);
+	}
+
+	_UnlockLog();
+
+	// our records come back through the log, along with anyone else's
+	if (error == B_OK)
+		error = _ReadLog(touched);
+
+	_NotifyLiveQueries(touched);
+
+	if (fLogOffset >= fCompactionCheck)
+		_Compact();
+
+	return error;
+}
+
+
+size_t
+IndexStore::_LiveSize() const
+{
+	size_t size = sizeof(log_header);
+	for (auto& elem : fIndices)
+		size += record_size(elem.first.size(), 0);
+
+	for (auto& elem : fNodes) {
+		size += record_size(elem.second.name.size(), 0);
+		for (auto& key : elem.second.keys)
+			size += record_size(key.first.size(), key.second.size());
+	}
+	return size;
+}
+
+
+void
+IndexStore::_WriteSnapshot(RecordBuffer& records) const
+{
+	for (auto& elem : fIndices) {
+		records.Add(RECORD_CREATE_INDEX,
+			elem.second.populated ? INDEX_POPULATED : 0, elem.second.created,
+			elem.second.type, elem.first);
+	}
+
+	for (auto& elem : fNodes) {
+		records.Add(RECORD_ENTRY, elem.first, elem.second.parent, 0,
+			elem.second.name);
+		for (auto& key : elem.second.keys) {
+			// the entry brings its name key along
+			if (key.first != "name") {
+				records.Add(RECORD_SET_KEY, elem.first, 0, key.second.size(),
+					key.first, key.second);
+			}
+		}
+	}
+}
+
+
+void
+IndexStore::_Compact()
+{
+	size_t liveSize = _LiveSize();
+	fCompactionCheck = std::max((off_t)liveSize * 2, fLogOffset)
+		+ COMPACTION_MINIMUM;
+	if (fLogOffset <= (off_t)liveSize * 2)
+		return;
+
+	_LockLog(LOCK_EX);
+
+	NodeSet touched;
+	if (_ReadLog(touched) != B_OK) {
+		_UnlockLog();
+		return;
+	}
+
+	log_header header;
+	header.magic = LOG_MAGIC;
+	header.version = LOG_VERSION;
+	header.root = fRootNode;
+
+	RecordBuffer records;
+	_WriteSnapshot(records);
+
+	std::string logPath = fStorePath + "/" LOG_NAME;
+	std::string newPath = logPath + ".new";
+	int fd = open(newPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		0644);
+	struct stat st;
+	bool written = fd >= 0
+		&& write(fd, &header, sizeof(header)) == sizeof(header)
+		&& write(fd, records.Data(), records.Size())
+			== (ssize_t)records.Size()
+		&& fstat(fd, &st) == 0;
+	if (fd >= 0)
+		close(fd);
+
+	if (written && rename(newPath.c_str(), logPath.c_str()) == 0) {
+		int logFD = open(logPath.c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+		if (logFD >= 0) {
+			close(fLogFD);
+			fLogFD = logFD;
+			fLogNode = st.st_ino;
+			fLogOffset = st.st_size;
+		}
+	} else
+		unlink(newPath.c_str());
+
+	_UnlockLog();
+
+	fCompactionCheck = fLogOffset * 2 + COMPACTION_MINIMUM;
+	_NotifyLiveQueries(touched);
+}
+
+
+const Index*
+IndexStore::FindIndex(const std::string& name) const
+{
+	auto elem = fIndices.find(name);
+	if (elem == fIndices.end())
+		return NULL;
+	return &elem->second;
+}
+
+
+status_t
+IndexStore::GetNodePath(ino_t node, std::string& path, ino_t* _parent,
+	std::string* _name) const
+{
+	if (node == fRootNode) {
+		path = fMountPoint;
+		return B_OK;
+	}
+
+	auto elem = fNodes.find(node);
+	if (elem == fNodes.end())
+		return B_ENTRY_NOT_FOUND;
+
+	if (_parent != NULL)
+		*_parent = elem->second.parent;
+	if (_name != NULL)
+		*_name = elem->second.name;
+
+	// walk up to the root, the leaf comes first
+	std::vector<const std::string*> components;
+	for (int depth = 0; node != fRootNode; depth++) {
+		if (elem == fNodes.end() || depth >= MAX_PATH_DEPTH)
+			return B_ENTRY_NOT_FOUND;
+
+		components.push_back(&elem->second.name);
+		node = elem->second.parent;
+		elem = fNodes.find(node);
+	}
+
+	path = fMountPoint.size() == 1 ? "" : fMountPoint;
+	for (size_t i = components.size(); i-- > 0;) {
+		path += '/';
+		path += *components[i];
+	}
+	return B_OK;
+}
+
+
+//! Returns whether the path we know for the node leads somewhere else now.
+bool
+IndexStore::_IsStale(const struct stat& st) const
+{
+	std::string path;
+	struct stat current;
+	return GetNodePath(st.st_ino, path) != B_OK
+		|| lstat(path.c_str(), &current) < 0
+		|| current.st_ino != st.st_ino || current.st_dev != st.st_dev;
+}
+
+
+//! Adds the entries of the node and its ancestors that we don't know yet.
+void
+IndexStore::_RecordPath(const std::string& path, const struct stat& st,
+	RecordBuffer& records, NodeSet* recorded)
+{
+	if (path.compare(0, fMountPoint.size(), fMountPoint) != 0)
+		return;
+
+	std::string current = path;
+	ino_t node = st.st_ino;
+	for (int depth = 0; node != fRootNode && depth < MAX_PATH_DEPTH;
+			depth++) {
+		size_t slash = current.rfind('/');
+		if (slash == std::string::npos)
+			return;
+
+		std::string name = current.substr(slash + 1);
+		std::string parentPath = slash == 0 ? "/" : current.substr(0, slash);
+
+		struct stat parent;
+		if (lstat(parentPath.c_str(), &parent) < 0
+			|| parent.st_dev != fDevice) {
+			return;
+		}
+
+		auto known = fNodes.find(node);
+		if ((known != fNodes.end() && known->second.parent == parent.st_ino
+				&& known->second.name == name)
+			|| (recorded != NULL && !recorded->insert(node).second)) {
+			// and so are its ancestors
+			return;
+		}
+
+		records.Add(RECORD_ENTRY, node, parent.st_ino, 0, name);
+
+		current = parentPath;
+		node = parent.st_ino;
+	}
+}
+
+
+void
+IndexStore::_RecordStatKeys(const struct stat& st, RecordBuffer& records)
+{
+	auto known = fNodes.find(st.st_ino);
+
+	struct {
+		const char*	name;
+		int64		value;
+	} keys[] = {
+		{ "size", (int64)st.st_size },
+		{ "last_modified", (int64)st.st_mtime }
+	};
+
+	for (size_t i = 0; i < B_COUNT_OF(keys); i++) {
+		auto index = fIndices.find(keys[i].name);
+		if (index == fIndices.end())
+			continue;
+
+		std::string key;
+		EncodeKey(B_INT64_TYPE, &keys[i].value, sizeof(int64), key);
+
+		if (known != fNodes.end()) {
+			auto old = known->second.keys.find(keys[i].name);
+			if (old != known->second.keys.end() && old->second == key)
+				continue;
+		}
+
+		records.Add(RECORD_SET_KEY, st.st_ino, 0, key.size(), keys[i].name,
+			key);
+	}
+}
+
+
+//! Walks the whole volume for the nodes that already have the attribute.
+void
+IndexStore::_RecordAttributes(const char* name, uint32 type,
+	RecordBuffer& records)
+{
+	NodeSet recorded;
+	std::vector<std::string> directories;
+	directories.push_back(fMountPoint);
+
+	while (!directories.empty()) {
+		std::string path = directories.back();
+		directories.pop_back();
+
+		DIR* dir = opendir(path.c_str());
+		if (dir == NULL)
+			continue;
+
+		if (path.size() == 1)
+			path.clear();
+
+		while (struct dirent* dirent = readdir(dir)) {
+			if (strcmp(dirent->d_name, ".") == 0
+				|| strcmp(dirent->d_name, "..") == 0) {
+				continue;
+			}
+
+			std::string childPath = path + '/' + dirent->d_name;
+			struct stat st;
+			if (childPath == fStorePath
+				|| lstat(childPath.c_str(), &st) < 0
+				|| st.st_dev != fDevice) {
+				continue;
+			}
+
+			if (S_ISDIR(st.st_mode))
+				directories.push_back(childPath);
+
+			std::string value;
+			if (read_attribute(-1, childPath.c_str(), name, NULL, value)
+					!= B_OK) {
+				continue;
+			}
+
+			std::string key;
+			EncodeKey(type, value.data(), value.size(), key);
+			_RecordPath(childPath, st, records, &recorded);
+			records.Add(RECORD_SET_KEY, st.st_ino, 0, key.size(), name, key);
+		}
+		closedir(dir);
+	}
+}
+
+
+void
+IndexStore::AttributeChanged(int fd, const char* name)
+{
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		return;
+
+	IndexStore* store;
+	if (Get(st.st_dev, store) == B_OK)
+		store->_AttributeChanged(fd, st, name);
+}
+
+
+void
+IndexStore::EntryMoved(const struct stat& st, const std::string& path)
+{
+	IndexStore* store;
+	if (Get(st.st_dev, store, false) == B_OK)
+		store->_EntryMoved(st, path);
+}
+
+
+void
+IndexStore::NodeRemoved(const struct stat& st)
+{
+	IndexStore* store;
+	if (Get(st.st_dev, store, false) == B_OK)
+		store->_NodeRemoved(st);
+}
+
+
+void
+IndexStore::_AttributeChanged(int fd, const struct stat& st, const char* name)
+{
+	AutoLocker<BLocker> _(&fLock);
+
+	NodeSet touched;
+	_ReadLog(touched);
+
+	auto index = fIndices.find(name);
+	auto known = fNodes.find(st.st_ino);
+	if (known != fNodes.end() && _IsStale(st)) {
+		// The node we know went away behind our back, and its inode was
+		// reused. Forget about it before we look at the new one.
+		RecordBuffer removal;
+		removal.Add(RECORD_REMOVE_NODE, st.st_ino, 0, 0, std::string());
+		_Write(removal, touched);
+		touched.clear();
+		known = fNodes.find(st.st_ino);
+	}
+	if (known != fNodes.end()) {
+		// a live query might look at the attribute, indexed or not
+		touched.insert(st.st_ino);
+	}
+
+	RecordBuffer keys;
+	if (index != fIndices.end()) {
+		uint32 type;
+		std::string value;
+		if (read_attribute(fd, NULL, name, &type, value) == B_OK) {
+			std::string key;
+			EncodeKey(index->second.type, value.data(), value.size(), key);
+			keys.Add(RECORD_SET_KEY, st.st_ino, 0, key.size(), name, key);
+		} else if (known != fNodes.end())
+			keys.Add(RECORD_REMOVE_KEY, st.st_ino, 0, 0, name);
+	}
+
+	if (known == fNodes.end() && keys.IsEmpty()) {
+		_NotifyLiveQueries(touched);
+		return;
+	}
+
+	RecordBuffer records;
+	if (known == fNodes.end()) {
+		// we need to know where the node is first
+		std::string path;
+		if (getFDPath(fd, path) == B_OK)
+			_RecordPath(path, st, records);
+		if (records.IsEmpty() && st.st_ino != fRootNode) {
+			_NotifyLiveQueries(touched);
+			return;
+		}
+	}
+	records.Append(keys);
+	_RecordStatKeys(st, records);
+
+	_Write(records, touched);
+}
+
+
+void
+IndexStore::_EntryMoved(const struct stat& st, const std::string& path)
+{
+	AutoLocker<BLocker> _(&fLock);
+
+	NodeSet touched;
+	_ReadLog(touched);
+
+	// the name index has all the entries we come across
+	bool known = fNodes.find(st.st_ino) != fNodes.end();
+	if (!known && fIndices.find("name") == fIndices.end()) {
+		_NotifyLiveQueries(touched);
+		return;
+	}
+
+	RecordBuffer records;
+	_RecordPath(path, st, records);
+	_RecordStatKeys(st, records);
+	_Write(records, touched);
+}
+
+
+void
+IndexStore::_NodeRemoved(const struct stat& st)
+{
+	AutoLocker<BLocker> _(&fLock);
+
+	NodeSet touched;
+	_ReadLog(touched);
+
+	RecordBuffer records;
+	if (fNodes.find(st.st_ino) != fNodes.end())
+		records.Add(RECORD_REMOVE_NODE, st.st_ino, 0, 0, std::string());
+	_Write(records, touched);
+}
+
+
+status_t
+IndexStore::CreateIndex(const char* name, uint32 type)
+{
+	if (name == NULL || name[0] == '\0')
+		return B_BAD_VALUE;
+	if (strlen(name) >= B_FILE_NAME_LENGTH)
+		return B_NAME_TOO_LONG;
+
+	AutoLocker<BLocker> _(&fLock);
+
+	NodeSet touched;
+	_ReadLog(touched);
+
+	if (fIndices.find(name) != fIndices.end()) {
+		_NotifyLiveQueries(touched);
+		return B_FILE_EXISTS;
+	}
+
+	// The stat indices can't be filled from the attributes, and they can't
+	// keep up with plain writes anyway.
+	bool populate = !is_stat_index(name);
+
+	RecordBuffer records;
+	records.Add(RECORD_CREATE_INDEX, populate ? INDEX_POPULATED : 0,
+		time(NULL), type, name);
+	if (populate)
+		_RecordAttributes(name, type, records);
+	return _Write(records, touched);
+}
+
+
+status_t
+IndexStore::RemoveIndex(const char* name)
+{
+	if (name == NULL)
+		return B_BAD_VALUE;
+
+	AutoLocker<BLocker> _(&fLock);
+
+	NodeSet touched;
+	_ReadLog(touched);
+
+	if (fIndices.find(name) == fIndices.end()) {
+		_NotifyLiveQueries(touched);
+		return B_ENTRY_NOT_FOUND;
+	}
+
+	RecordBuffer records;
+	records.Add(RECORD_REMOVE_INDEX, 0, 0, 0, name);
+	return _Write(records, touched);
+}
+
+
+status_t
+IndexStore::StatIndex(const char* name, struct index_info* info)
+{
+	if (name == NULL || info == NULL)
+		return B_BAD_VALUE;
+
+	AutoLocker<BLocker> _(&fLock);
+	Sync();
+
+	auto index = fIndices.find(name);
+	if (index == fIndices.end())
+		return B_ENTRY_NOT_FOUND;
+
+	struct stat st;
+	if (fstat(fLogFD, &st) < 0)
+		return errno_to_status(errno);
+
+	info->type = index->second.type;
+	info->size = index->second.size;
+	info->modification_time = index->second.modified;
+	info->creation_time = index->second.created;
+	info->uid = st.st_uid;
+	info->gid = st.st_gid;
+	return B_OK;
+}
+
+
+int
+IndexStore::OpenIndexDir()
+{
+	VirtualDirectory* directory = new(std::nothrow) VirtualDirectory;
+	if (directory == NULL)
+		return B_NO_MEMORY;
+
+	AutoLocker<BLocker> _(&fLock);
+	Sync();
+
+	ino_t node = 1;
+	for (auto& elem : fIndices)
+		directory->AddEntry(node++, 0, elem.first.c_str(), DT_REG);
+
+	return VirtualDirectory::Register(directory);
+}
+
+
+void
+IndexStore::AddLiveQuery(Query* query)
+{
+	fLiveQueries.push_back(query);
+
+	// the other teams' changes only show up in the log
+	if (fWatcher < 0)
+		_StartWatching();
+}
+
+
+void
+IndexStore::RemoveLiveQuery(Query* query)
+{
+	auto elem = std::find(fLiveQueries.begin(), fLiveQueries.end(), query);
+	if (elem != fLiveQueries.end())
+		fLiveQueries.erase(elem);
+}
+
+
+void
+IndexStore::_NotifyLiveQueries(const NodeSet& touched)
+{
+	if (touched.empty())
+		return;
+
+	for (size_t i = 0; i < fLiveQueries.size(); i++) {
+		for (ino_t node : touched)
+			fLiveQueries[i]->NodeChanged(this, node);
+	}
+}
+
+
+status_t
+IndexStore::_StartWatching()
+{
+	fWatchFD = inotify_init1(IN_CLOEXEC);
+	if (fWatchFD < 0)
+		return errno_to_status(errno);
+
+	if (inotify_add_watch(fWatchFD, fStorePath.c_str(),
+			IN_MODIFY | IN_MOVED_TO) < 0) {
+		status_t error = errno_to_status(errno);
+		close(fWatchFD);
+		fWatchFD = -1;
+		return error;
+	}
+
+	fWatcher = spawn_thread(_WatchTask, "index watcher", B_LOW_PRIORITY,
+		this);
+	if (fWatcher < 0) {
+		close(fWatchFD);
+		fWatchFD = -1;
+		return fWatcher;
+	}
+
+	return resume_thread(fWatcher);
+}
+
+
+int
+IndexStore::_WatchTask(void* cookie)
+{
+	((IndexStore*)cookie)->_Watch();
+	return 0;
+}
+
+
+void
+IndexStore::_Watch()
+{
+	char buffer[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+
+	while (true) {
+		ssize_t bytes = read(fWatchFD, buffer, sizeof(buffer));
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		fLock.Lock();
+		if (!fLiveQueries.empty())
+			Sync();
+		fLock.Unlock();
+	}
+}
+
+
+bool
+IndexStore::IsStringType(uint32 type)
+{
+	switch (type) {
+		case B_STRING_TYPE:
+		case B_MIME_STRING_TYPE:
+			return true;
+		default:
+			return false;
+	}
+}
+
+
+/*!	Turns an attribute value into a key whose bytes sort like the values
+	do, so that all the indices can share std::string ordering.
+*/
+void
+IndexStore::EncodeKey(uint32 type, const void* data, size_t size,
+	std::string& key)
+{
+	key.clear();
+
+	switch (type) {
+		case B_INT8_TYPE:
+		case B_INT16_TYPE:
+		case B_INT32_TYPE:
+		case B_INT64_TYPE:
+		case B_SSIZE_T_TYPE:
+		case B_OFF_T_TYPE:
+		case B_TIME_TYPE:
+		{
+			int64 value;
+			if (size == sizeof(int8))
+				value = *(const int8*)data;
+			else if (size == sizeof(int16))
+				value = *(const int16*)data;
+			else if (size == sizeof(int32))
+				value = *(const int32*)data;
+			else if (size == sizeof(int64))
+				value = *(const int64*)data;
+			else
+				break;
+			append_big_endian(key, (uint64)value ^ (1ULL << 63));
+			return;
+		}
+
+		case B_UINT8_TYPE:
+		case B_UINT16_TYPE:
+		case B_UINT32_TYPE:
+		case B_UINT64_TYPE:
+		case B_SIZE_T_TYPE:
+		{
+			uint64 value;
+			if (size == sizeof(uint8))
+				value = *(const uint8*)data;
+			else if (size == sizeof(uint16))
+				value = *(const uint16*)data;
+			else if (size == sizeof(uint32))
+				value = *(const uint32*)data;
+			else if (size == sizeof(uint64))
+				value = *(const uint64*)data;
+			else
+				break;
+			append_big_endian(key, value);
+			return;
+		}
+
+		case B_FLOAT_TYPE:
+		case B_DOUBLE_TYPE:
+		{
+			double value;
+			if (size == sizeof(float))
+				value = *(const float*)data;
+			else if (size == sizeof(double))
+				value = *(const double*)data;
+			else
+				break;
+
+			uint64 bits;
+			memcpy(&bits, &value, sizeof(bits));
+			bits = (bits & (1ULL << 63)) != 0 ? ~bits : bits | (1ULL << 63);
+			append_big_endian(key, bits);
+			return;
+		}
+
+		default:
+			break;
+	}
+
+	// strings and everything else compare bytewise, without the
+	// terminating null
+	const char* bytes = (const char*)data;
+	while (size > 0 && bytes[size - 1] == '\0')
+		size--;
+	key.assign(bytes, size);
+}
+
+
+//! Turns the value of a query equation into a key of the index type.
+status_t
+IndexStore::ParseKey(uint32 type, const char* value, std::string& key)
+{
+	char* end;
+	errno = 0;
+
+	switch (type) {
+		case B_INT8_TYPE:
+		case B_INT16_TYPE:
+		case B_INT32_TYPE:
+		case B_INT64_TYPE:
+		case B_SSIZE_T_TYPE:
+		case B_OFF_T_TYPE:
+		case B_TIME_TYPE:
+		{
+			int64 number = strtoll(value, &end, 0);
+			if (end == value || *end != '\0' || errno != 0)
+				return B_BAD_VALUE;
+			EncodeKey(B_INT64_TYPE, &number, sizeof(number), key);
+			return B_OK;
+		}
+
+		case B_UINT8_TYPE:
+		case B_UINT16_TYPE:
+		case B_UINT32_TYPE:
+		case B_UINT64_TYPE:
+		case B_SIZE_T_TYPE:
+		{
+			uint64 number = strtoull(value, &end, 0);
+			if (end == value || *end != '\0' || errno != 0)
+				return B_BAD_VALUE;
+			EncodeKey(B_UINT64_TYPE, &number, sizeof(number), key);
+			return B_OK;
+		}
+
+		case B_FLOAT_TYPE:
+		case B_DOUBLE_TYPE:
+		{
+			double number = strtod(value, &end);
+			if (end == value || *end != '\0')
+				return B_BAD_VALUE;
+			EncodeKey(B_DOUBLE_TYPE, &number, sizeof(number), key);
+			return B_OK;
+		}
+
+		default:
+			EncodeKey(type, value, strlen(value), key);
+			return B_OK;
+	}
+}
+
+
+}
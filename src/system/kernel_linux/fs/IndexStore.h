@@ -0,0 +1,186 @@
+/*
+ *  Copyright 2020, Dario Casalinuovo. All rights reserved.
+ *  Distributed under the terms of the LGPL License.
+ */
+#ifndef _KERNEL_INDEX_STORE_H
+#define _KERNEL_INDEX_STORE_H
+
+#include <Locker.h>
+#include <OS.h>
+
+#include <sys/stat.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+
+struct index_info;
+
+
+namespace BKernelPrivate {
+
+
+class Query;
+class RecordBuffer;
+struct index_record;
+
+
+struct Index {
+	uint32						type;
+	time_t						created;
+	time_t						modified;
+	off_t						size;
+		// the bytes taken by the keys
+	bool						populated;
+		// it has all the nodes with the attribute, not only those that
+		// changed since it was created
+	std::set<std::pair<std::string, ino_t> > keys;
+		// ordered by key, see IndexStore::EncodeKey()
+};
+
+
+struct IndexedNode {
+	ino_t						parent;
+	std::string					name;
+	std::map<std::string, std::string> keys;
+		// index name -> key
+};
+
+
+typedef std::unordered_set<ino_t> NodeSet;
+
+
+// The attribute indices of a volume. The store is an append-only log of
+// index and node changes, kept under the volume root when it's writable,
+// in the user's cache directory otherwise. Every process replays it into
+// ordered in-memory indices, and tails it to pick up the changes done by
+// the others. It's compacted when the dead records take over.
+//
+// The nodes are known by (parent, name), the store keeps the entries of
+// their ancestors too so that it can build their paths.
+//
+// The indices created with the store, and the stat ones, only follow the
+// changes made through us. Queries only take candidates from the indices
+// that were filled with the volume's attributes when they were created.
+class IndexStore {
+public:
+	// Without create, only a store that's already in use is returned.
+	static	status_t			Get(dev_t device, IndexStore*& _store,
+									bool create = true);
+
+	// Hooks for the file system calls.
+	static	void				AttributeChanged(int fd, const char* name);
+	static	void				EntryMoved(const struct stat& st,
+									const std::string& path);
+	static	void				NodeRemoved(const struct stat& st);
+
+			status_t			CreateIndex(const char* name, uint32 type);
+			status_t			RemoveIndex(const char* name);
+			status_t			StatIndex(const char* name,
+									struct index_info* info);
+			int					OpenIndexDir();
+
+			bool				Lock() { return fLock.Lock(); }
+			void				Unlock() { fLock.Unlock(); }
+
+	// The ones below need the lock.
+			status_t			Sync();
+
+			const Index*		FindIndex(const std::string& name) const;
+			status_t			GetNodePath(ino_t node, std::string& path,
+									ino_t* _parent = NULL,
+									std::string* _name = NULL) const;
+
+			void				AddLiveQuery(Query* query);
+			void				RemoveLiveQuery(Query* query);
+
+			dev_t				Device() const { return fDevice; }
+			const std::string&	MountPoint() const { return fMountPoint; }
+			const std::string&	StorePath() const { return fStorePath; }
+
+	static	bool				IsStringType(uint32 type);
+	static	void				EncodeKey(uint32 type, const void* data,
+									size_t size, std::string& key);
+	static	status_t			ParseKey(uint32 type, const char* value,
+									std::string& key);
+
+	static	void				_ReinitAtFork();
+
+private:
+								IndexStore(dev_t device);
+
+			status_t			_Init();
+			status_t			_OpenLog();
+			bool				_IsLogValid() const;
+			void				_LockLog(int mode);
+			void				_UnlockLog();
+			void				_Reset();
+			status_t			_ReadLog(NodeSet& touched);
+			void				_Apply(const index_record* record,
+									NodeSet& touched);
+			void				_SetKey(ino_t node, IndexedNode& indexed,
+									const std::string& index,
+									const std::string& key);
+			void				_RemoveKey(ino_t node, IndexedNode& indexed,
+									const std::string& index);
+			void				_RemoveNode(ino_t node);
+			status_t			_Write(RecordBuffer& records,
+									NodeSet& touched);
+			void				_Compact();
+			size_t				_LiveSize() const;
+			void				_WriteSnapshot(RecordBuffer& records) const;
+
+			bool				_IsStale(const struct stat& st) const;
+			void				_RecordPath(const std::string& path,
+									const struct stat& st,
+									RecordBuffer& records,
+									NodeSet* recorded = NULL);
+			void				_RecordStatKeys(const struct stat& st,
+									RecordBuffer& records);
+			void				_RecordAttributes(const char* name,
+									uint32 type, RecordBuffer& records);
+
+			void				_AttributeChanged(int fd,
+									const struct stat& st, const char* name);
+			void				_EntryMoved(const struct stat& st,
+									const std::string& path);
+			void				_NodeRemoved(const struct stat& st);
+
+			void				_NotifyLiveQueries(const NodeSet& touched);
+			status_t			_StartWatching();
+	static	int					_WatchTask(void* cookie);
+			void				_Watch();
+
+			dev_t				fDevice;
+			std::string			fMountPoint;
+			ino_t				fRootNode;
+			std::string			fStorePath;
+
+			int					fLogFD;
+			int					fLockFD;
+			int					fLockMode;
+				// what we hold of the lock shared with the other teams
+			ino_t				fLogNode;
+			off_t				fLogOffset;
+				// how far we've replayed the log
+			off_t				fCompactionCheck;
+
+			std::map<std::string, Index> fIndices;
+			std::unordered_map<ino_t, IndexedNode> fNodes;
+
+			std::vector<Query*>	fLiveQueries;
+			int					fWatchFD;
+			thread_id			fWatcher;
+
+			BLocker				fLock;
+};
+
+
+}
+
+
+#endif
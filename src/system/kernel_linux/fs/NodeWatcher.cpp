@@ -0,0 +1,1018 @@
+/*
+ *  Copyright 2020, Dario Casalinuovo. All rights reserved.
+ *  Distributed under the terms of the LGPL License.
+ */
+
+#include "NodeWatcher.h"
+
+#include <AppDefs.h>
+#include <NodeMonitor.h>
+
+#include <node_monitor_private.h>
+
+#include <syscalls.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/inotify.h>
+#include <sys/xattr.h>
+
+#include "../futex.h"
+#include "fs_private.h"
+#include "KernelDebug.h"
+#include "util/AutoLock.h"
+#include "util/KMessage.h"
+
+
+// All the node monitoring of a team goes through a single inotify fd,
+// with one inotify watch per watched node. inotify watches the inode and
+// gives out one descriptor per inode, which is how the events find their
+// node. No fd is kept open per node: Tracker watches every icon it shows,
+// and the team would soon run out of fds. The watches count against
+// fs.inotify.max_user_watches instead.
+//
+// We still need a path to stat the node and its children. The path the
+// node was last seen at is checked against (device, node) before use, and
+// looked up in the path cache again once it doesn't match, like after
+// IN_MOVE_SELF. The cache follows the renames done by this team and those
+// seen in watched directories. A node moved elsewhere by another team
+// can't be found anymore. Its listeners get B_ENTRY_REMOVED, and its stat
+// changes are lost until the cache learns the new path.
+//
+// Events come in bursts, after the first one we keep reading for a short
+// while, then stat and attribute changes are folded into one message per
+// node, and identical messages going to the same listener are dropped.
+// This also takes care of the same change being seen through both the
+// node and its parent directory.
+
+#define COALESCE_INTERVAL	10
+	// ms to wait for the next event of a burst
+#define MAX_BURST_TIME		50000
+#define EVENT_BUFFER_SIZE	16384
+
+#define ENTRY_EVENTS \
+	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+#define CHANGE_EVENTS \
+	(IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE)
+
+
+namespace BKernelPrivate {
+
+
+NodeWatcher* NodeWatcher::fInstance = NULL;
+static int32 sInstanceLock = 0;
+
+
+static uint32
+flags_to_mask(uint32 flags, bool isDirectory)
+{
+	// we always need to know where the node went
+	uint32 mask = IN_MOVE_SELF | IN_DELETE_SELF;
+
+	if ((flags & B_WATCH_STAT) != 0)
+		mask |= IN_ATTRIB | IN_CLOSE_WRITE;
+	if ((flags & B_WATCH_INTERIM_STAT) != 0)
+		mask |= IN_MODIFY;
+	if ((flags & B_WATCH_ATTR) != 0)
+		mask |= IN_ATTRIB;
+	if ((flags & B_WATCH_NAME) != 0 && !isDirectory) {
+		// the unlink only shows as a link count change
+		mask |= IN_ATTRIB;
+	}
+
+	if (isDirectory) {
+		if ((flags & B_WATCH_DIRECTORY) != 0)
+			mask |= ENTRY_EVENTS;
+		if ((flags & B_WATCH_CHILDREN) != 0)
+			mask |= IN_ATTRIB | IN_CLOSE_WRITE;
+	}
+
+	return mask;
+}
+
+
+static inline bool
+timespec_equal(const struct timespec& a, const struct timespec& b)
+{
+	return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+
+static uint32
+stat_fields_changed(const struct stat& from, const struct stat& to)
+{
+	uint32 fields = 0;
+	if (from.st_mode != to.st_mode)
+		fields |= B_STAT_MODE;
+	if (from.st_uid != to.st_uid)
+		fields |= B_STAT_UID;
+	if (from.st_gid != to.st_gid)
+		fields |= B_STAT_GID;
+	if (from.st_size != to.st_size)
+		fields |= B_STAT_SIZE;
+	if (!timespec_equal(from.st_atim, to.st_atim))
+		fields |= B_STAT_ACCESS_TIME;
+	if (!timespec_equal(from.st_mtim, to.st_mtim))
+		fields |= B_STAT_MODIFICATION_TIME;
+	if (!timespec_equal(from.st_ctim, to.st_ctim))
+		fields |= B_STAT_CHANGE_TIME;
+	return fields;
+}
+
+
+static uint32
+hash_value(const char* data, size_t size)
+{
+	// FNV-1a
+	uint32 hash = 2166136261U;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= (uint8)data[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+
+//! Returns the node of the directory containing path, or -1.
+static ino_t
+parent_node(const std::string& path)
+{
+	std::string copy(path);
+	struct stat st;
+	if (lstat(dirname(&copy[0]), &st) < 0)
+		return -1;
+	return st.st_ino;
+}
+
+
+static std::string
+leaf_name(const std::string& path)
+{
+	size_t slash = path.rfind('/');
+	if (slash == std::string::npos)
+		return path;
+	return path.substr(slash + 1);
+}
+
+
+NodeWatcher::NodeWatcher()
+	:
+	fFD(-1),
+	fThread(-1),
+	fRunning(false),
+	fLock("node watcher")
+{
+	pthread_atfork(NULL, NULL, &_ReinitAtFork);
+}
+
+
+status_t
+NodeWatcher::Run()
+{
+	CALLED();
+
+	fFD = inotify_init1(IN_CLOEXEC);
+	if (fFD < 0) {
+		TRACE("NodeWatcher: can't create the inotify instance\n");
+		return errno_to_status(errno);
+	}
+
+	fThread = spawn_thread(_WatchTask, "NodeWatcher", B_NORMAL_PRIORITY,
+		NULL);
+	if (fThread <= 0) {
+		close(fFD);
+		fFD = -1;
+		TRACE("NodeWatcher: Can't spawn receiver thread\n");
+		return B_NO_MEMORY;
+	}
+
+	fRunning = true;
+
+	// after a restart, watch the nodes we had again
+	for (auto& elem : fWatches)
+		_UpdateWatch(elem.second);
+
+	return resume_thread(fThread);
+}
+
+
+void
+NodeWatcher::_ReinitAtFork()
+{
+	// The child neither has the watcher thread, nor should it steal the
+	// events of the parent. Start over, the old instance is lost.
+	sInstanceLock = 0;
+	if (fInstance == NULL)
+		return;
+
+	close(fInstance->fFD);
+	fInstance = NULL;
+}
+
+
+int
+NodeWatcher::_WatchTask(void* cookie)
+{
+	if (fInstance == NULL)
+		return -1;
+
+	fInstance->WatchTask();
+	return 0;
+}
+
+
+void
+NodeWatcher::WatchTask()
+{
+	CALLED();
+
+	char buffer[EVENT_BUFFER_SIZE]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+
+	while (true) {
+		ssize_t bytes = read(fFD, buffer, sizeof(buffer));
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		bigtime_t burstEnd = system_time() + MAX_BURST_TIME;
+
+		while (bytes > 0) {
+			fLock.Lock();
+			for (char* position = buffer; position < buffer + bytes;) {
+				const struct inotify_event* event
+					= (const struct inotify_event*)position;
+				_HandleEvent(event);
+				position += sizeof(struct inotify_event) + event->len;
+			}
+			fLock.Unlock();
+
+			bytes = 0;
+			if (system_time() >= burstEnd)
+				break;
+
+			struct pollfd pollFD = { fFD, POLLIN, 0 };
+			if (poll(&pollFD, 1, COALESCE_INTERVAL) > 0)
+				bytes = read(fFD, buffer, sizeof(buffer));
+		}
+
+		fLock.Lock();
+		_Flush();
+		fLock.Unlock();
+	}
+
+	// The watches went with the instance, the next listener starts over
+	fLock.Lock();
+	close(fFD);
+	fFD = -1;
+	fRunning = false;
+	fDescriptors.clear();
+	for (auto& elem : fWatches) {
+		elem.second->descriptor = -1;
+		elem.second->mask = 0;
+	}
+	fLock.Unlock();
+}
+
+
+//! Finds where the node lives now, and its stat on the way.
+status_t
+NodeWatcher::_GetWatchPath(NodeWatch* watch, std::string& path,
+	struct stat* _stat)
+{
+	struct stat st;
+	if (_stat == NULL)
+		_stat = &st;
+
+	if (!watch->path.empty() && lstat(watch->path.c_str(), _stat) == 0
+		&& _stat->st_dev == watch->device && _stat->st_ino == watch->node) {
+		path = watch->path;
+		return B_OK;
+	}
+
+	// it moved, or something else took its place
+	if (getPath(watch->device, watch->node, NULL, path) != B_OK
+		|| lstat(path.c_str(), _stat) != 0
+		|| _stat->st_dev != watch->device || _stat->st_ino != watch->node) {
+		return B_ENTRY_NOT_FOUND;
+	}
+
+	watch->path = path;
+	return B_OK;
+}
+
+
+status_t
+NodeWatcher::_UpdateWatch(NodeWatch* watch)
+{
+	uint32 flags = 0;
+	for (size_t i = 0; i < watch->listeners.size(); i++)
+		flags |= watch->listeners[i].flags;
+
+	uint32 mask = flags_to_mask(flags, S_ISDIR(watch->stat.st_mode));
+	std::string path;
+	if (mask != watch->mask) {
+		status_t error = _GetWatchPath(watch, path);
+		if (error == B_OK) {
+			int descriptor = inotify_add_watch(fFD, path.c_str(),
+				mask | IN_DONT_FOLLOW);
+			if (descriptor < 0)
+				error = errno_to_status(errno);
+			else if (watch->descriptor < 0) {
+				watch->descriptor = descriptor;
+				fDescriptors[descriptor] = watch;
+				fWatches[NodeKey(watch->device, watch->node)] = watch;
+			}
+		}
+
+		// a lost node keeps its old mask, the flags filter the events
+		if (error != B_OK && watch->descriptor < 0)
+			return error;
+		if (error == B_OK)
+			watch->mask = mask;
+	}
+
+	uint32 added = flags & ~watch->flags;
+	watch->flags = flags;
+
+	// take the snapshots the events will be compared against
+	if ((mask & ENTRY_EVENTS) != 0 && (added & B_WATCH_DIRECTORY) != 0)
+		_ReadEntries(watch);
+	if ((added & B_WATCH_ATTR) != 0)
+		_ReadAttributes(watch);
+
+	return B_OK;
+}
+
+
+void
+NodeWatcher::_RemoveWatch(NodeWatch* watch)
+{
+	if (watch->descriptor >= 0) {
+		inotify_rm_watch(fFD, watch->descriptor);
+		fDescriptors.erase(watch->descriptor);
+	}
+	fWatches.erase(NodeKey(watch->device, watch->node));
+
+	for (auto it = fMovedEntries.begin(); it != fMovedEntries.end();) {
+		if (it->second.directory == watch)
+			it = fMovedEntries.erase(it);
+		else
+			++it;
+	}
+	for (auto it = fChangedChildren.begin(); it != fChangedChildren.end();) {
+		if (it->directory == watch)
+			it = fChangedChildren.erase(it);
+		else
+			++it;
+	}
+
+	delete watch;
+}
+
+
+void
+NodeWatcher::_ReadEntries(NodeWatch* watch)
+{
+	watch->entries.clear();
+
+	std::string path;
+	if (_GetWatchPath(watch, path) != B_OK)
+		return;
+
+	int dir = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir < 0)
+		return;
+
+	char buffer[4096];
+	ssize_t count;
+	while ((count = _kern_read_dir(dir, (struct dirent*)buffer,
+			sizeof(buffer), INT_MAX)) > 0) {
+		struct dirent* entry = (struct dirent*)buffer;
+		for (ssize_t i = 0; i < count; i++) {
+			if (strcmp(entry->d_name, ".") != 0
+				&& strcmp(entry->d_name, "..") != 0) {
+				watch->entries[entry->d_name] = entry->d_ino;
+			}
+			entry = (struct dirent*)((char*)entry + entry->d_reclen);
+		}
+	}
+
+	close(dir);
+}
+
+
+void
+NodeWatcher::_ReadAttributes(NodeWatch* watch)
+{
+	watch->attributes.clear();
+
+	std::string path;
+	if (_GetWatchPath(watch, path) != B_OK)
+		return;
+
+	ssize_t size = llistxattr(path.c_str(), NULL, 0);
+	if (size <= 0)
+		return;
+
+	std::vector<char> names(size);
+	size = llistxattr(path.c_str(), &names[0], size);
+	if (size <= 0)
+		return;
+
+	std::vector<char> value;
+	for (ssize_t i = 0; i < size; i += strlen(&names[i]) + 1) {
+		const char* name = &names[i];
+		if (strncmp(name, ATTRIBUTE_PREFIX, ATTRIBUTE_PREFIX_LENGTH) != 0)
+			continue;
+
+		ssize_t valueSize = lgetxattr(path.c_str(), name, NULL, 0);
+		if (valueSize < 0)
+			continue;
+
+		value.resize(valueSize + 1);
+		valueSize = lgetxattr(path.c_str(), name, &value[0], valueSize);
+		if (valueSize < 0)
+			continue;
+
+		watch->attributes[name + ATTRIBUTE_PREFIX_LENGTH]
+			= hash_value(&value[0], valueSize);
+	}
+}
+
+
+void
+NodeWatcher::_HandleEvent(const struct inotify_event* event)
+{
+	if ((event->mask & IN_Q_OVERFLOW) != 0) {
+		TRACE("NodeWatcher: event queue overflow\n");
+		return;
+	}
+
+	auto elem = fDescriptors.find(event->wd);
+	if (elem == fDescriptors.end())
+		return;
+
+	NodeWatch* watch = elem->second;
+
+	if ((event->mask & IN_IGNORED) != 0) {
+		// the node is gone, or its file system was unmounted
+		watch->descriptor = -1;
+		fDescriptors.erase(elem);
+		_RemoveWatch(watch);
+		return;
+	}
+
+	if (event->len > 0) {
+		// an event about an entry of the directory
+		if ((event->mask & ENTRY_EVENTS) != 0) {
+			_HandleEntryEvent(watch, event);
+			return;
+		}
+
+		if ((watch->flags & B_WATCH_CHILDREN) == 0
+			|| (event->mask & CHANGE_EVENTS) == 0) {
+			return;
+		}
+
+		uint32 fields = (event->mask & IN_ATTRIB) != 0
+			? B_STAT_MODE | B_STAT_UID | B_STAT_GID | B_STAT_CHANGE_TIME
+			: B_STAT_SIZE | B_STAT_MODIFICATION_TIME;
+
+		for (size_t i = 0; i < fChangedChildren.size(); i++) {
+			ChangedChild& child = fChangedChildren[i];
+			if (child.directory == watch && child.name == event->name) {
+				child.fields |= fields;
+				return;
+			}
+		}
+
+		ChangedChild child = { watch, event->name, fields };
+		fChangedChildren.push_back(child);
+		return;
+	}
+
+	if ((event->mask & IN_MOVE_SELF) != 0)
+		_HandleSelfMoved(watch);
+	if ((event->mask & IN_DELETE_SELF) != 0)
+		_HandleSelfRemoved(watch);
+
+	if ((event->mask & IN_ATTRIB) != 0 && !S_ISDIR(watch->stat.st_mode)) {
+		// IN_DELETE_SELF waits until the last fd to an unlinked file is
+		// closed, until then the link count drop is all we get.
+		std::string path;
+		if (_GetWatchPath(watch, path) != B_OK)
+			_HandleSelfRemoved(watch);
+	}
+
+	watch->pendingEvents |= event->mask & CHANGE_EVENTS;
+}
+
+
+void
+NodeWatcher::_HandleEntryEvent(NodeWatch* watch,
+	const struct inotify_event* event)
+{
+	const char* name = event->name;
+
+	if ((event->mask & (IN_DELETE | IN_MOVED_FROM)) != 0) {
+		ino_t node = -1;
+		auto entry = watch->entries.find(name);
+		if (entry != watch->entries.end()) {
+			node = entry->second;
+			watch->entries.erase(entry);
+		}
+
+		if ((event->mask & IN_MOVED_FROM) != 0) {
+			// wait for the other half of the move
+			MovedEntry moved = { watch, name, node };
+			fMovedEntries[event->cookie] = moved;
+			return;
+		}
+
+		if (node < 0)
+			return;
+
+		struct stat st;
+		memset(&st, 0, sizeof(st));
+		st.st_dev = watch->device;
+		st.st_ino = node;
+		st.st_mode = (event->mask & IN_ISDIR) != 0 ? S_IFDIR : S_IFREG;
+		removePath(st);
+
+		_NotifyEntry(watch, B_WATCH_DIRECTORY, B_ENTRY_REMOVED, watch->node,
+			node, name);
+		return;
+	}
+
+	// IN_CREATE or IN_MOVED_TO
+	std::string path;
+	if (_GetWatchPath(watch, path) != B_OK)
+		return;
+	if (path.size() != 1)
+		path += '/';
+	path += name;
+
+	struct stat st;
+	if (lstat(path.c_str(), &st) < 0)
+		return;
+
+	watch->entries[name] = st.st_ino;
+
+	if ((event->mask & IN_MOVED_TO) != 0) {
+		auto moved = fMovedEntries.find(event->cookie);
+		if (moved != fMovedEntries.end()) {
+			MovedEntry& from = moved->second;
+
+			// a watched node that moved looks itself up here
+			renamePath(st, path);
+			insertPath(st, path);
+
+			_NotifyMoved(from.directory, B_WATCH_DIRECTORY,
+				from.directory->node, watch->node, st.st_ino,
+				from.name.c_str(), name);
+			_NotifyMoved(watch, B_WATCH_DIRECTORY, from.directory->node,
+				watch->node, st.st_ino, from.name.c_str(), name);
+
+			fMovedEntries.erase(moved);
+			return;
+		}
+	}
+
+	insertPath(st, path);
+
+	_NotifyEntry(watch, B_WATCH_DIRECTORY, B_ENTRY_CREATED, watch->node,
+		st.st_ino, name);
+}
+
+
+void
+NodeWatcher::_HandleSelfMoved(NodeWatch* watch)
+{
+	std::string path;
+	if (_GetWatchPath(watch, path) != B_OK) {
+		// moved out of our sight, see the top of the file
+		_HandleSelfRemoved(watch);
+		return;
+	}
+
+	ino_t toDirectory = parent_node(path);
+	std::string name = leaf_name(path);
+	if (toDirectory == watch->parent && name == watch->name)
+		return;
+
+	ino_t fromDirectory = watch->parent;
+	std::string fromName = watch->name;
+	watch->parent = toDirectory;
+	watch->name = name;
+
+	renamePath(watch->stat, path);
+
+	// When the move was seen in a watched directory too, this is the same
+	// message, and it's dropped for the listeners that got it already.
+	_NotifyMoved(watch, B_WATCH_NAME, fromDirectory, toDirectory,
+		watch->node, fromName.c_str(), name.c_str());
+}
+
+
+void
+NodeWatcher::_HandleSelfRemoved(NodeWatch* watch)
+{
+	// IN_DELETE_SELF follows the link count drop of a file
+	if (watch->path.empty())
+		return;
+	watch->path.clear();
+
+	removePath(watch->stat);
+
+	_NotifyEntry(watch, B_WATCH_NAME, B_ENTRY_REMOVED, watch->parent,
+		watch->node, watch->name.c_str());
+}
+
+
+void
+NodeWatcher::_Flush()
+{
+	// moves whose target is not watched
+	for (auto& elem : fMovedEntries) {
+		MovedEntry& from = elem.second;
+		if (from.node < 0)
+			continue;
+
+		auto moved = fWatches.find(NodeKey(from.directory->device, from.node));
+		if (moved != fWatches.end() && !moved->second->path.empty()) {
+			// the node is watched itself, and we still know where it is
+			NodeWatch* watch = moved->second;
+			_NotifyMoved(from.directory, B_WATCH_DIRECTORY,
+				from.directory->node, watch->parent, watch->node,
+				from.name.c_str(), watch->name.c_str());
+			continue;
+		}
+
+		struct stat st;
+		memset(&st, 0, sizeof(st));
+		st.st_dev = from.directory->device;
+		st.st_ino = from.node;
+		removePath(st);
+
+		_NotifyEntry(from.directory, B_WATCH_DIRECTORY, B_ENTRY_REMOVED,
+			from.directory->node, from.node, from.name.c_str());
+	}
+	fMovedEntries.clear();
+
+	for (auto& elem : fWatches) {
+		if (elem.second->pendingEvents != 0)
+			_FlushWatch(elem.second);
+	}
+
+	for (size_t i = 0; i < fChangedChildren.size(); i++) {
+		ChangedChild& child = fChangedChildren[i];
+
+		std::string path;
+		if (_GetWatchPath(child.directory, path) != B_OK)
+			continue;
+		if (path.size() != 1)
+			path += '/';
+		path += child.name;
+
+		struct stat st;
+		if (lstat(path.c_str(), &st) < 0)
+			continue;
+
+		char buffer[256];
+		KMessage message;
+		message.SetTo(buffer, sizeof(buffer), B_NODE_MONITOR);
+		message.AddInt32("opcode", B_STAT_CHANGED);
+		message.AddInt32("device", st.st_dev);
+		message.AddInt64("node", st.st_ino);
+		message.AddInt32("fields", child.fields);
+		_Send(child.directory, B_WATCH_CHILDREN, message);
+	}
+	fChangedChildren.clear();
+
+	fLastSent.clear();
+
+	// forget about the listeners that went away
+	for (size_t i = 0; i < fDeadPorts.size(); i++) {
+		for (auto it = fWatches.begin(); it != fWatches.end();) {
+			NodeWatch* watch = (it++)->second;
+			std::vector<NodeListener>& listeners = watch->listeners;
+			for (size_t j = listeners.size(); j-- > 0;) {
+				if (listeners[j].port == fDeadPorts[i])
+					listeners.erase(listeners.begin() + j);
+			}
+			if (listeners.empty())
+				_RemoveWatch(watch);
+		}
+	}
+	fDeadPorts.clear();
+}
+
+
+void
+NodeWatcher::_FlushWatch(NodeWatch* watch)
+{
+	uint32 events = watch->pendingEvents;
+	watch->pendingEvents = 0;
+
+	std::string path;
+	struct stat st;
+	if (_GetWatchPath(watch, path, &st) != B_OK)
+		return;
+
+	uint32 fields = stat_fields_changed(watch->stat, st);
+	if ((events & IN_CLOSE_WRITE) != 0)
+		fields |= B_STAT_SIZE | B_STAT_MODIFICATION_TIME;
+
+	bool interim = (events & (IN_CLOSE_WRITE | IN_ATTRIB)) == 0;
+
+	if ((events & IN_ATTRIB) != 0 && (watch->flags & B_WATCH_ATTR) != 0) {
+		std::map<std::string, uint32> previous;
+		previous.swap(watch->attributes);
+		_ReadAttributes(watch);
+
+		bool changed = false;
+		char buffer[512];
+		KMessage message;
+
+		for (auto& attribute : watch->attributes) {
+			auto old = previous.find(attribute.first);
+			int32 cause;
+			if (old == previous.end())
+				cause = B_ATTR_CREATED;
+			else if (old->second != attribute.second)
+				cause = B_ATTR_CHANGED;
+			else
+				continue;
+
+			message.SetTo(buffer, sizeof(buffer), B_NODE_MONITOR);
+			message.AddInt32("opcode", B_ATTR_CHANGED);
+			message.AddInt32("device", watch->device);
+			message.AddInt64("node", watch->node);
+			message.AddString("attr", attribute.first.c_str());
+			message.AddInt32("cause", cause);
+			_Send(watch, B_WATCH_ATTR, message);
+			changed = true;
+		}
+
+		for (auto& attribute : previous) {
+			if (watch->attributes.find(attribute.first)
+					!= watch->attributes.end()) {
+				continue;
+			}
+
+			message.SetTo(buffer, sizeof(buffer), B_NODE_MONITOR);
+			message.AddInt32("opcode", B_ATTR_CHANGED);
+			message.AddInt32("device", watch->device);
+			message.AddInt64("node", watch->node);
+			message.AddString("attr", attribute.first.c_str());
+			message.AddInt32("cause", B_ATTR_REMOVED);
+			_Send(watch, B_WATCH_ATTR, message);
+			changed = true;
+		}
+
+		// writing attributes touches the change time only
+		if (changed)
+			fields &= ~B_STAT_CHANGE_TIME;
+	}
+
+	watch->stat = st;
+
+	if (fields == 0)
+		return;
+
+	char buffer[256];
+	KMessage message;
+	message.SetTo(buffer, sizeof(buffer), B_NODE_MONITOR);
+	message.AddInt32("opcode", B_STAT_CHANGED);
+	message.AddInt32("device", watch->device);
+	message.AddInt64("node", watch->node);
+
+	if (interim) {
+		message.AddInt32("fields", fields | B_STAT_INTERIM_UPDATE);
+		_Send(watch, B_WATCH_STAT | B_WATCH_INTERIM_STAT, message);
+	} else {
+		message.AddInt32("fields", fields);
+		_Send(watch, B_WATCH_STAT, message);
+	}
+}
+
+
+void
+NodeWatcher::_NotifyEntry(NodeWatch* watch, uint32 flags, int32 opcode,
+	ino_t directory, ino_t node, const char* name)
+{
+	// zeroed, the padding is compared too when dropping duplicates
+	char buffer[512];
+	memset(buffer, 0, sizeof(buffer));
+	KMessage message;
+	message.SetTo(buffer, sizeof(buffer), B_NODE_MONITOR);
+	message.AddInt32("opcode", opcode);
+	message.AddInt32("device", watch->device);
+	message.AddInt64("directory", directory);
+	message.AddInt64("node", node);
+	message.AddString("name", name);
+	_Send(watch, flags, message);
+}
+
+
+void
+NodeWatcher::_NotifyMoved(NodeWatch* watch, uint32 flags,
+	ino_t fromDirectory, ino_t toDirectory, ino_t node, const char* fromName,
+	const char* name)
+{
+	// zeroed, the padding is compared too when dropping duplicates
+	char buffer[1024];
+	memset(buffer, 0, sizeof(buffer));
+	KMessage message;
+	message.SetTo(buffer, sizeof(buffer), B_NODE_MONITOR);
+	message.AddInt32("opcode", B_ENTRY_MOVED);
+	message.AddInt32("device", watch->device);
+	message.AddInt64("from directory", fromDirectory);
+	message.AddInt64("to directory", toDirectory);
+	message.AddInt32("node device", watch->device);
+	message.AddInt64("node", node);
+	message.AddString("from name", fromName);
+	message.AddString("name", name);
+	_Send(watch, flags, message);
+}
+
+
+void
+NodeWatcher::_Send(NodeWatch* watch, uint32 flags, KMessage& message)
+{
+	const int32 kPortMessageCode = 'pjpp';
+
+	for (size_t i = 0; i < watch->listeners.size(); i++) {
+		NodeListener& listener = watch->listeners[i];
+		if ((listener.flags & flags) != flags)
+			continue;
+
+		message.SetDeliveryInfo(listener.token, listener.port, -1,
+			find_thread(NULL));
+
+		std::string sent((const char*)message.Buffer(),
+			message.ContentSize());
+		std::string& last
+			= fLastSent[std::make_pair(listener.port, listener.token)];
+		if (last == sent)
+			continue;
+		last.swap(sent);
+
+		// never wait for a listener that doesn't keep up
+		status_t error = write_port_etc(listener.port, kPortMessageCode,
+			message.Buffer(), message.ContentSize(), B_RELATIVE_TIMEOUT, 0);
+		if (error == B_BAD_PORT_ID)
+			fDeadPorts.push_back(listener.port);
+	}
+}
+
+
+status_t
+NodeWatcher::AddListener(dev_t device, ino_t node, uint32 flags,
+	port_id port, uint32 token)
+{
+	if ((flags & (B_WATCH_VOLUME | B_WATCH_MOUNT)) != 0 || node < 0) {
+		// inotify has no notion of volumes
+		return B_NOT_SUPPORTED;
+	}
+
+	futex_lock(&sInstanceLock);
+	if (fInstance == NULL)
+		fInstance = new NodeWatcher();
+	NodeWatcher* watcher = fInstance;
+	futex_unlock(&sInstanceLock);
+
+	AutoLocker<BLocker> _(&watcher->fLock);
+
+	if (!watcher->fRunning) {
+		status_t err = watcher->Run();
+		if (err != B_OK)
+			return err;
+	}
+
+	NodeWatch* watch;
+	auto elem = watcher->fWatches.find(NodeKey(device, node));
+	if (elem != watcher->fWatches.end()) {
+		watch = elem->second;
+	} else {
+		std::string path;
+		status_t error = getPath(device, node, NULL, path);
+		if (error != B_OK)
+			return error;
+
+		struct stat st;
+		if (lstat(path.c_str(), &st) < 0)
+			return errno_to_status(errno);
+		if (st.st_dev != device || st.st_ino != node) {
+			// the cached path is stale
+			return B_ENTRY_NOT_FOUND;
+		}
+
+		watch = new(std::nothrow) NodeWatch;
+		if (watch == NULL)
+			return B_NO_MEMORY;
+
+		watch->device = device;
+		watch->node = node;
+		watch->descriptor = -1;
+		watch->path = path;
+		watch->mask = 0;
+		watch->flags = 0;
+		watch->parent = parent_node(path);
+		watch->name = leaf_name(path);
+		watch->stat = st;
+		watch->pendingEvents = 0;
+	}
+
+	bool found = false;
+	for (size_t i = 0; i < watch->listeners.size(); i++) {
+		NodeListener& listener = watch->listeners[i];
+		if (listener.port == port && listener.token == token) {
+			listener.flags |= flags;
+			found = true;
+			break;
+		}
+	}
+
+	if (!found) {
+		NodeListener listener = { port, token, flags };
+		watch->listeners.push_back(listener);
+	}
+
+	status_t error = watcher->_UpdateWatch(watch);
+	if (error != B_OK && watch->descriptor < 0)
+		delete watch;
+
+	return error;
+}
+
+
+status_t
+NodeWatcher::RemoveListener(dev_t device, ino_t node, port_id port,
+	uint32 token)
+{
+	if (fInstance == NULL || !fInstance->fRunning)
+		return B_BAD_VALUE;
+
+	AutoLocker<BLocker> _(&fInstance->fLock);
+
+	auto elem = fInstance->fWatches.find(NodeKey(device, node));
+	if (elem == fInstance->fWatches.end())
+		return B_BAD_VALUE;
+
+	NodeWatch* watch = elem->second;
+	std::vector<NodeListener>& listeners = watch->listeners;
+	for (size_t i = 0; i < listeners.size(); i++) {
+		if (listeners[i].port == port && listeners[i].token == token) {
+			listeners.erase(listeners.begin() + i);
+
+			if (listeners.empty())
+				fInstance->_RemoveWatch(watch);
+			else
+				fInstance->_UpdateWatch(watch);
+			return B_OK;
+		}
+	}
+
+	return B_BAD_VALUE;
+}
+
+
+status_t
+NodeWatcher::RemoveListener(port_id port, uint32 token)
+{
+	if (fInstance == NULL || !fInstance->fRunning)
+		return B_OK;
+
+	AutoLocker<BLocker> _(&fInstance->fLock);
+
+	for (auto it = fInstance->fWatches.begin();
+			it != fInstance->fWatches.end();) {
+		NodeWatch* watch = (it++)->second;
+		std::vector<NodeListener>& listeners = watch->listeners;
+		for (size_t i = 0; i < listeners.size(); i++) {
+			if (listeners[i].port == port && listeners[i].token == token) {
+				listeners.erase(listeners.begin() + i);
+
+				if (listeners.empty())
+					fInstance->_RemoveWatch(watch);
+				else
+					fInstance->_UpdateWatch(watch);
+				break;
+			}
+		}
+	}
+
+	return B_OK;
+}
+
+
+}
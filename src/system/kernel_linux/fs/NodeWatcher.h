@@ -0,0 +1,148 @@
+/*
+ *  Copyright 2020, Dario Casalinuovo. All rights reserved.
+ *  Distributed under the terms of the LGPL License.
+ */
+#ifndef _KERNEL_NODE_WATCHER_H
+#define _KERNEL_NODE_WATCHER_H
+
+#include <Locker.h>
+#include <OS.h>
+
+#include <sys/stat.h>
+
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+struct inotify_event;
+
+namespace BPrivate {
+	class KMessage;
+}
+using BPrivate::KMessage;
+
+
+namespace BKernelPrivate {
+
+
+struct NodeListener {
+	port_id		port;
+	uint32		token;
+	uint32		flags;
+};
+
+
+struct NodeWatch {
+	dev_t						device;
+	ino_t						node;
+	int							descriptor;
+		// the inotify watch descriptor
+	std::string					path;
+		// where the node was last seen, see _GetWatchPath()
+	uint32						mask;
+	uint32						flags;
+		// all the listener flags together
+
+	ino_t						parent;
+	std::string					name;
+		// where the node lives, kept up to date across moves
+
+	struct stat					stat;
+		// last known stat, to tell what changed
+	std::map<std::string, uint32> attributes;
+		// hashes of the attribute values, with B_WATCH_ATTR
+	std::unordered_map<std::string, ino_t> entries;
+		// the directory contents, with B_WATCH_DIRECTORY
+
+	std::vector<NodeListener>	listeners;
+
+	uint32						pendingEvents;
+		// inotify events seen since the last flush
+};
+
+
+class NodeWatcher {
+public:
+	static status_t				AddListener(dev_t device, ino_t node,
+									uint32 flags, port_id port, uint32 token);
+
+	static status_t				RemoveListener(dev_t device, ino_t node,
+									port_id port, uint32 token);
+	static status_t				RemoveListener(port_id port, uint32 token);
+
+private:
+	typedef std::pair<dev_t, ino_t> NodeKey;
+
+	struct MovedEntry {
+		NodeWatch*				directory;
+		std::string				name;
+		ino_t					node;
+	};
+
+	struct ChangedChild {
+		NodeWatch*				directory;
+		std::string				name;
+		uint32					fields;
+	};
+
+								NodeWatcher();
+
+	status_t					Run();
+
+	static int					_WatchTask(void* cookie);
+	void						WatchTask();
+
+	static void					_ReinitAtFork();
+
+	status_t					_UpdateWatch(NodeWatch* watch);
+	void						_RemoveWatch(NodeWatch* watch);
+	void						_ReadEntries(NodeWatch* watch);
+	void						_ReadAttributes(NodeWatch* watch);
+	status_t					_GetWatchPath(NodeWatch* watch,
+									std::string& path,
+									struct stat* _stat = NULL);
+
+	void						_HandleEvent(const struct inotify_event* event);
+	void						_HandleEntryEvent(NodeWatch* watch,
+									const struct inotify_event* event);
+	void						_HandleSelfMoved(NodeWatch* watch);
+	void						_HandleSelfRemoved(NodeWatch* watch);
+	void						_Flush();
+	void						_FlushWatch(NodeWatch* watch);
+
+	void						_NotifyEntry(NodeWatch* watch, uint32 flags,
+									int32 opcode, ino_t directory, ino_t node,
+									const char* name);
+	void						_NotifyMoved(NodeWatch* watch, uint32 flags,
+									ino_t fromDirectory, ino_t toDirectory,
+									ino_t node, const char* fromName,
+									const char* name);
+	void						_Send(NodeWatch* watch, uint32 flags,
+									KMessage& message);
+
+	std::map<NodeKey, NodeWatch*> fWatches;
+	std::unordered_map<int, NodeWatch*> fDescriptors;
+	std::map<uint32, MovedEntry> fMovedEntries;
+		// IN_MOVED_FROM halves waiting for their IN_MOVED_TO
+	std::vector<ChangedChild>	fChangedChildren;
+		// children changed in directories watched with B_WATCH_CHILDREN
+	std::map<std::pair<port_id, uint32>, std::string> fLastSent;
+		// the last message of each listener, to drop the second report of
+		// a change seen through both the node and its directory
+	std::vector<port_id>		fDeadPorts;
+
+	int							fFD;
+	thread_id					fThread;
+	bool						fRunning;
+
+	BLocker						fLock;
+	static NodeWatcher*			fInstance;
+};
+
+
+}
+
+
+#endif
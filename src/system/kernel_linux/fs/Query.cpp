@@ -0,0 +1,772 @@
+/*
+ *  Copyright 2020, Dario Casalinuovo. All rights reserved.
+ *  Distributed under the terms of the LGPL License.
+ */
+
+#include "Query.h"
+
+#include <AppDefs.h>
+#include <NodeMonitor.h>
+#include <TypeConstants.h>
+#include <fs_query.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <new>
+#include <vector>
+
+#include "fs_private.h"
+#include "IndexStore.h"
+#include "KernelDebug.h"
+#include "VirtualDirectory.h"
+#include "util/KMessage.h"
+
+
+namespace BKernelPrivate {
+
+
+enum {
+	TERM_AND,
+	TERM_OR,
+	TERM_NOT,
+	TERM_EQUATION
+};
+
+enum {
+	OP_EQUAL,
+	OP_UNEQUAL,
+	OP_LESS,
+	OP_LESS_EQUAL,
+	OP_GREATER,
+	OP_GREATER_EQUAL
+};
+
+
+struct QueryTerm {
+	int			type;
+	QueryTerm*	left;
+	QueryTerm*	right;
+
+	// equations only
+	std::string	attribute;
+	int			op;
+	std::string	value;
+	bool		pattern;
+		// the value is a wildcard pattern, and keeps its escapes
+
+	QueryTerm(int type, QueryTerm* left = NULL, QueryTerm* right = NULL)
+		:
+		type(type),
+		left(left),
+		right(right),
+		op(OP_EQUAL),
+		pattern(false)
+	{
+	}
+
+	~QueryTerm()
+	{
+		delete left;
+		delete right;
+	}
+};
+
+
+class QueryParser {
+public:
+	QueryParser(const char* string, size_t length)
+		:
+		fPosition(string),
+		fEnd(string + strnlen(string, length))
+	{
+	}
+
+	QueryTerm* Parse()
+	{
+		QueryTerm* term = _ParseOr();
+		_SkipSpace();
+		if (term != NULL && fPosition != fEnd) {
+			delete term;
+			return NULL;
+		}
+		return term;
+	}
+
+private:
+	void _SkipSpace()
+	{
+		while (fPosition < fEnd && isspace(*fPosition))
+			fPosition++;
+	}
+
+	bool _Consume(const char* token)
+	{
+		_SkipSpace();
+		size_t length = strlen(token);
+		if ((size_t)(fEnd - fPosition) < length
+			|| strncmp(fPosition, token, length) != 0) {
+			return false;
+		}
+		fPosition += length;
+		return true;
+	}
+
+	QueryTerm* _ParseOr()
+	{
+		QueryTerm* term = _ParseAnd();
+		while (term != NULL && _Consume("||")) {
+			QueryTerm* right = _ParseAnd();
+			if (right == NULL) {
+				delete term;
+				return NULL;
+			}
+			term = new QueryTerm(TERM_OR, term, right);
+		}
+		return term;
+	}
+
+	QueryTerm* _ParseAnd()
+	{
+		QueryTerm* term = _ParseUnary();
+		while (term != NULL && _Consume("&&")) {
+			QueryTerm* right = _ParseUnary();
+			if (right == NULL) {
+				delete term;
+				return NULL;
+			}
+			term = new QueryTerm(TERM_AND, term, right);
+		}
+		return term;
+	}
+
+	QueryTerm* _ParseUnary()
+	{
+		if (_Consume("!")) {
+			QueryTerm* term = _ParseUnary();
+			if (term == NULL)
+				return NULL;
+			return new QueryTerm(TERM_NOT, term);
+		}
+
+		if (_Consume("(")) {
+			QueryTerm* term = _ParseOr();
+			if (term != NULL && !_Consume(")")) {
+				delete term;
+				return NULL;
+			}
+			return term;
+		}
+
+		return _ParseEquation();
+	}
+
+	QueryTerm* _ParseEquation()
+	{
+		std::string attribute;
+		bool quoted;
+		if (!_ParseString("=!<>", attribute, quoted) || attribute.empty())
+			return NULL;
+
+		int op;
+		if (_Consume("=="))
+			op = OP_EQUAL;
+		else if (_Consume("!="))
+			op = OP_UNEQUAL;
+		else if (_Consume("<="))
+			op = OP_LESS_EQUAL;
+		else if (_Consume(">="))
+			op = OP_GREATER_EQUAL;
+		else if (_Consume("<"))
+			op = OP_LESS;
+		else if (_Consume(">"))
+			op = OP_GREATER;
+		else
+			return NULL;
+
+		std::string value;
+		if (!_ParseString("", value, quoted))
+			return NULL;
+
+		QueryTerm* term = new QueryTerm(TERM_EQUATION);
+		term->attribute = _Unescape(attribute);
+		term->op = op;
+		term->pattern = _IsPattern(value);
+		term->value = term->pattern ? value : _Unescape(value);
+		return term;
+	}
+
+	//! Reads a quoted or bare string, the escapes are kept.
+	bool _ParseString(const char* stop, std::string& string, bool& quoted)
+	{
+		_SkipSpace();
+		string.clear();
+
+		quoted = fPosition < fEnd && (*fPosition == '"' || *fPosition == '\'');
+		if (quoted) {
+			char quote = *fPosition++;
+			while (fPosition < fEnd && *fPosition != quote) {
+				if (*fPosition == '\\' && fPosition + 1 < fEnd)
+					string += *fPosition++;
+				string += *fPosition++;
+			}
+			if (fPosition == fEnd)
+				return false;
+			fPosition++;
+			return true;
+		}
+
+		while (fPosition < fEnd && !isspace(*fPosition) && *fPosition != ')'
+			&& strchr(stop, *fPosition) == NULL
+			&& strncmp(fPosition, "&&", 2) != 0
+			&& strncmp(fPosition, "||", 2) != 0) {
+			if (*fPosition == '\\' && fPosition + 1 < fEnd)
+				string += *fPosition++;
+			string += *fPosition++;
+		}
+		return !string.empty();
+	}
+
+	static bool _IsPattern(const std::string& value)
+	{
+		for (size_t i = 0; i < value.size(); i++) {
+			if (value[i] == '\\')
+				i++;
+			else if (value[i] == '*' || value[i] == '?' || value[i] == '[')
+				return true;
+		}
+		return false;
+	}
+
+	static std::string _Unescape(const std::string& value)
+	{
+		std::string unescaped;
+		for (size_t i = 0; i < value.size(); i++) {
+			if (value[i] == '\\' && i + 1 < value.size())
+				i++;
+			unescaped += value[i];
+		}
+		return unescaped;
+	}
+
+	const char*	fPosition;
+	const char*	fEnd;
+};
+
+
+//! Matches a character against [set], moving past it.
+static bool
+match_set(const char*& pattern, unsigned char c)
+{
+	const char* position = pattern + 1;
+	bool negate = *position == '^' || *position == '!';
+	if (negate)
+		position++;
+
+	bool matched = false;
+	bool first = true;
+	while (*position != '\0' && (*position != ']' || first)) {
+		first = false;
+
+		unsigned char low = *position;
+		if (low == '\\' && position[1] != '\0')
+			low = *++position;
+		position++;
+
+		unsigned char high = low;
+		if (position[0] == '-' && position[1] != ']' && position[1] != '\0') {
+			high = position[1];
+			if (high == '\\' && position[2] != '\0')
+				high = *++position;
+			position += 2;
+		}
+
+		if (c >= low && c <= high)
+			matched = true;
+	}
+
+	if (*position != ']') {
+		// not a set after all
+		pattern++;
+		return c == '[';
+	}
+
+	pattern = position + 1;
+	return matched != negate;
+}
+
+
+static bool
+match_pattern(const char* pattern, const char* string)
+{
+	const char* starPattern = NULL;
+	const char* starString = NULL;
+
+	while (*string != '\0') {
+		if (*pattern == '*') {
+			starPattern = ++pattern;
+			starString = string;
+			continue;
+		}
+
+		const char* next = pattern;
+		bool matched;
+		switch (*pattern) {
+			case '\0':
+				matched = false;
+				break;
+			case '?':
+				matched = true;
+				next++;
+				break;
+			case '[':
+				matched = match_set(next, *string);
+				break;
+			case '\\':
+				if (pattern[1] != '\0')
+					next++;
+				// supposed to fall through
+			default:
+				matched = *next == *string;
+				next++;
+				break;
+		}
+
+		if (matched) {
+			pattern = next;
+			string++;
+		} else if (starPattern != NULL) {
+			pattern = starPattern;
+			string = ++starString;
+		} else
+			return false;
+	}
+
+	while (*pattern == '*')
+		pattern++;
+	return *pattern == '\0';
+}
+
+
+//! The literal start of a pattern, all the matches share it.
+static std::string
+pattern_prefix(const std::string& pattern)
+{
+	std::string prefix;
+	for (size_t i = 0; i < pattern.size(); i++) {
+		char c = pattern[i];
+		if (c == '*' || c == '?' || c == '[')
+			break;
+		if (c == '\\' && i + 1 < pattern.size())
+			c = pattern[++i];
+		prefix += c;
+	}
+	return prefix;
+}
+
+
+static unsigned char
+stat_to_dirent_type(mode_t mode)
+{
+	if (S_ISDIR(mode))
+		return DT_DIR;
+	if (S_ISLNK(mode))
+		return DT_LNK;
+	if (S_ISREG(mode))
+		return DT_REG;
+	return DT_UNKNOWN;
+}
+
+
+//! Lets the path cache resolve the entry_ref of a result.
+static void
+cache_result(dev_t device, ino_t directory, const std::string& path,
+	const struct stat& st)
+{
+	insertPath(st, path);
+
+	struct stat parent;
+	memset(&parent, 0, sizeof(parent));
+	parent.st_dev = device;
+	parent.st_ino = directory;
+	parent.st_mode = S_IFDIR;
+
+	size_t slash = path.rfind('/');
+	insertPath(parent, slash == 0 ? std::string("/") : path.substr(0, slash));
+}
+
+
+Query::Query(QueryTerm* root)
+	:
+	fRoot(root),
+	fPort(-1),
+	fToken(-1)
+{
+}
+
+
+Query::~Query()
+{
+	delete fRoot;
+}
+
+
+status_t
+Query::Parse(const char* string, size_t length, Query*& _query)
+{
+	if (string == NULL || length == 0)
+		return B_BAD_VALUE;
+
+	QueryParser parser(string, length);
+	QueryTerm* root = parser.Parse();
+	if (root == NULL)
+		return B_BAD_VALUE;
+
+	_query = new(std::nothrow) Query(root);
+	if (_query == NULL) {
+		delete root;
+		return B_NO_MEMORY;
+	}
+	return B_OK;
+}
+
+
+status_t
+Query::Fetch(IndexStore* store, uint32 flags, port_id port, int32 token,
+	VirtualDirectory* directory)
+{
+	bool live = (flags & B_LIVE_QUERY) != 0;
+	if (live) {
+		fPort = port;
+		fToken = token;
+	}
+
+	std::set<ino_t> candidates;
+	if (_Candidates(store, fRoot, candidates) != B_OK) {
+		if ((flags & B_QUERY_NON_INDEXED) == 0) {
+			TRACE("Query: no index to work with\n");
+			return B_BAD_VALUE;
+		}
+		_Crawl(store, directory);
+	} else {
+		for (ino_t node : candidates) {
+			std::string path;
+			Entry entry;
+			struct stat st;
+			if (!_Resolve(store, node, path, entry, st))
+				continue;
+
+			QueryEntry queryEntry = { path.c_str(), entry.second.c_str(), &st };
+			if (!_Match(store, fRoot, queryEntry))
+				continue;
+
+			cache_result(store->Device(), entry.first, path, st);
+			directory->AddEntry(node, entry.first, entry.second.c_str(),
+				stat_to_dirent_type(st.st_mode));
+			if (live)
+				fMatches[node] = entry;
+		}
+	}
+
+	if (live)
+		store->AddLiveQuery(this);
+
+	return B_OK;
+}
+
+
+/*!	Collects the nodes which might match the term, as far as the indices
+	can tell. Fails when the term can't be answered with them.
+*/
+status_t
+Query::_Candidates(IndexStore* store, const QueryTerm* term,
+	std::set<ino_t>& nodes) const
+{
+	switch (term->type) {
+		case TERM_AND:
+		{
+			std::set<ino_t> left;
+			std::set<ino_t> right;
+			bool hasLeft = _Candidates(store, term->left, left) == B_OK;
+			bool hasRight = _Candidates(store, term->right, right) == B_OK;
+			if (hasLeft && hasRight) {
+				std::set_intersection(left.begin(), left.end(), right.begin(),
+					right.end(), std::inserter(nodes, nodes.begin()));
+			} else if (hasLeft)
+				nodes.swap(left);
+			else if (hasRight)
+				nodes.swap(right);
+			else
+				return B_ENTRY_NOT_FOUND;
+			return B_OK;
+		}
+
+		case TERM_OR:
+			if (_Candidates(store, term->left, nodes) != B_OK
+				|| _Candidates(store, term->right, nodes) != B_OK) {
+				return B_ENTRY_NOT_FOUND;
+			}
+			return B_OK;
+
+		case TERM_NOT:
+			return B_ENTRY_NOT_FOUND;
+	}
+
+	// An index that was never filled only knows the nodes that changed
+	// while it was around, it can't tell what doesn't match.
+	const Index* index = store->FindIndex(term->attribute);
+	if (index == NULL || !index->populated)
+		return B_ENTRY_NOT_FOUND;
+
+	typedef std::set<std::pair<std::string, ino_t> > KeySet;
+	const KeySet& keys = index->keys;
+	KeySet::const_iterator begin = keys.begin();
+	KeySet::const_iterator end = keys.end();
+
+	if (term->pattern && IndexStore::IsStringType(index->type)) {
+		if (term->op == OP_EQUAL) {
+			std::string prefix = pattern_prefix(term->value);
+			for (begin = keys.lower_bound(std::make_pair(prefix, (ino_t)0));
+					begin != end
+						&& begin->first.compare(0, prefix.size(), prefix) == 0;
+					begin++) {
+				nodes.insert(begin->second);
+			}
+			return B_OK;
+		}
+	} else {
+		std::string key;
+		if (IndexStore::ParseKey(index->type, term->value.c_str(), key)
+				!= B_OK) {
+			// nothing in this index can match
+			return B_OK;
+		}
+
+		KeySet::const_iterator lower
+			= keys.lower_bound(std::make_pair(key, (ino_t)0));
+		KeySet::const_iterator upper = lower;
+		while (upper != end && upper->first == key)
+			upper++;
+
+		switch (term->op) {
+			case OP_EQUAL:
+				begin = lower;
+				end = upper;
+				break;
+			case OP_LESS:
+				end = lower;
+				break;
+			case OP_LESS_EQUAL:
+				end = upper;
+				break;
+			case OP_GREATER:
+				begin = upper;
+				break;
+			case OP_GREATER_EQUAL:
+				begin = lower;
+				break;
+		}
+	}
+
+	for (; begin != end; begin++)
+		nodes.insert(begin->second);
+	return B_OK;
+}
+
+
+bool
+Query::_Match(IndexStore* store, const QueryTerm* term,
+	const QueryEntry& entry) const
+{
+	switch (term->type) {
+		case TERM_AND:
+			return _Match(store, term->left, entry)
+				&& _Match(store, term->right, entry);
+		case TERM_OR:
+			return _Match(store, term->left, entry)
+				|| _Match(store, term->right, entry);
+		case TERM_NOT:
+			return !_Match(store, term->left, entry);
+	}
+
+	uint32 type = 0;
+	std::string value;
+	if (term->attribute == "name") {
+		type = B_STRING_TYPE;
+		value = entry.name;
+	} else if (term->attribute == "size") {
+		int64 size = entry.stat->st_size;
+		type = B_INT64_TYPE;
+		value.assign((const char*)&size, sizeof(size));
+	} else if (term->attribute == "last_modified") {
+		int64 time = entry.stat->st_mtime;
+		type = B_INT64_TYPE;
+		value.assign((const char*)&time, sizeof(time));
+	} else {
+		if (read_attribute(-1, entry.path, term->attribute.c_str(), &type,
+				value) != B_OK) {
+			return false;
+		}
+
+		// compare the way the index does
+		const Index* index = store->FindIndex(term->attribute);
+		if (index != NULL)
+			type = index->type;
+		else if (type == 0)
+			type = B_STRING_TYPE;
+	}
+
+	if (term->pattern && IndexStore::IsStringType(type)
+		&& (term->op == OP_EQUAL || term->op == OP_UNEQUAL)) {
+		bool matched = match_pattern(term->value.c_str(), value.c_str());
+		return matched == (term->op == OP_EQUAL);
+	}
+
+	std::string key;
+	std::string queryKey;
+	IndexStore::EncodeKey(type, value.data(), value.size(), key);
+	if (IndexStore::ParseKey(type, term->value.c_str(), queryKey) != B_OK)
+		return false;
+
+	int compare = key.compare(queryKey);
+	switch (term->op) {
+		case OP_EQUAL:
+			return compare == 0;
+		case OP_UNEQUAL:
+			return compare != 0;
+		case OP_LESS:
+			return compare < 0;
+		case OP_LESS_EQUAL:
+			return compare <= 0;
+		case OP_GREATER:
+			return compare > 0;
+		case OP_GREATER_EQUAL:
+			return compare >= 0;
+	}
+	return false;
+}
+
+
+//! Checks that the store still knows where the node is.
+bool
+Query::_Resolve(IndexStore* store, ino_t node, std::string& path,
+	Entry& entry, struct stat& st) const
+{
+	if (store->GetNodePath(node, path, &entry.first, &entry.second) != B_OK)
+		return false;
+
+	return lstat(path.c_str(), &st) == 0 && st.st_ino == node
+		&& st.st_dev == store->Device();
+}
+
+
+//! Walks the whole volume, for the B_QUERY_NON_INDEXED queries.
+void
+Query::_Crawl(IndexStore* store, VirtualDirectory* directory)
+{
+	struct stat root;
+	if (lstat(store->MountPoint().c_str(), &root) < 0)
+		return;
+
+	std::vector<std::pair<std::string, ino_t> > directories;
+	directories.push_back(std::make_pair(store->MountPoint(), root.st_ino));
+
+	while (!directories.empty()) {
+		std::string path = directories.back().first;
+		ino_t parent = directories.back().second;
+		directories.pop_back();
+
+		DIR* dir = opendir(path.c_str());
+		if (dir == NULL)
+			continue;
+
+		if (path.size() == 1)
+			path.clear();
+
+		while (struct dirent* dirent = readdir(dir)) {
+			if (strcmp(dirent->d_name, ".") == 0
+				|| strcmp(dirent->d_name, "..") == 0) {
+				continue;
+			}
+
+			std::string childPath = path + '/' + dirent->d_name;
+			struct stat st;
+			if (childPath == store->StorePath()
+				|| lstat(childPath.c_str(), &st) < 0
+				|| st.st_dev != store->Device()) {
+				continue;
+			}
+
+			QueryEntry entry = { childPath.c_str(), dirent->d_name, &st };
+			if (_Match(store, fRoot, entry)) {
+				cache_result(store->Device(), parent, childPath, st);
+				directory->AddEntry(st.st_ino, parent, dirent->d_name,
+					stat_to_dirent_type(st.st_mode));
+				if (fPort >= 0)
+					fMatches[st.st_ino] = Entry(parent, dirent->d_name);
+			}
+
+			if (S_ISDIR(st.st_mode))
+				directories.push_back(std::make_pair(childPath, st.st_ino));
+		}
+		closedir(dir);
+	}
+}
+
+
+void
+Query::NodeChanged(IndexStore* store, ino_t node)
+{
+	std::string path;
+	Entry entry;
+	struct stat st;
+	bool matches = _Resolve(store, node, path, entry, st);
+	if (matches) {
+		QueryEntry queryEntry = { path.c_str(), entry.second.c_str(), &st };
+		matches = _Match(store, fRoot, queryEntry);
+	}
+
+	auto reported = fMatches.find(node);
+	if (reported != fMatches.end()) {
+		if (matches && reported->second == entry)
+			return;
+
+		// gone, or somewhere else now
+		_Notify(store, B_ENTRY_REMOVED, node, reported->second);
+		fMatches.erase(reported);
+	}
+
+	if (matches) {
+		cache_result(store->Device(), entry.first, path, st);
+		_Notify(store, B_ENTRY_CREATED, node, entry);
+		fMatches[node] = entry;
+	}
+}
+
+
+void
+Query::_Notify(IndexStore* store, int32 opcode, ino_t node,
+	const Entry& entry)
+{
+	const int32 kPortMessageCode = 'pjpp';
+
+	char buffer[512];
+	KMessage message;
+	message.SetTo(buffer, sizeof(buffer), B_QUERY_UPDATE);
+	message.AddInt32("opcode", opcode);
+	message.AddInt32("device", store->Device());
+	message.AddInt64("directory", entry.first);
+	message.AddInt64("node", node);
+	message.AddString("name", entry.second.c_str());
+	// nobody waits for a reply to the updates
+	message.SetDeliveryInfo(fToken, -1, -1, find_thread(NULL));
+
+	// never wait for a target that doesn't keep up
+	write_port_etc(fPort, kPortMessageCode, message.Buffer(),
+		message.ContentSize(), B_RELATIVE_TIMEOUT, 0);
+}
+
+
+}
@@ -0,0 +1,90 @@
+/*
+ *  Copyright 2020, Dario Casalinuovo. All rights reserved.
+ *  Distributed under the terms of the LGPL License.
+ */
+#ifndef _KERNEL_QUERY_H
+#define _KERNEL_QUERY_H
+
+#include <OS.h>
+
+#include <sys/stat.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+
+
+namespace BKernelPrivate {
+
+
+class IndexStore;
+class VirtualDirectory;
+struct QueryTerm;
+
+
+struct QueryEntry {
+	const char*			path;
+	const char*			name;
+	const struct stat*	stat;
+};
+
+
+// A parsed query, as it comes from BQuery:
+//
+//	expression	:= and ("||" and)*
+//	and			:= unary ("&&" unary)*
+//	unary		:= "!" unary | "(" expression ")" | attribute op value
+//	op			:= "==" | "!=" | "<" | "<=" | ">" | ">="
+//
+// String values may be quoted, and use the *, ? and [] wildcards.
+//
+// The indices narrow down the candidates, which are then checked against
+// the whole expression with their current stat and attributes.
+class Query {
+public:
+								~Query();
+
+	static	status_t			Parse(const char* string, size_t length,
+									Query*& _query);
+
+	// Fills the directory with the matching entries, the store must be
+	// locked. A live query registers itself with the store.
+			status_t			Fetch(IndexStore* store, uint32 flags,
+									port_id port, int32 token,
+									VirtualDirectory* directory);
+
+	// Sends the live query updates for the node, which changed.
+			void				NodeChanged(IndexStore* store, ino_t node);
+
+private:
+	typedef std::pair<ino_t, std::string> Entry;
+
+								Query(QueryTerm* root);
+
+			status_t			_Candidates(IndexStore* store,
+									const QueryTerm* term,
+									std::set<ino_t>& nodes) const;
+			bool				_Match(IndexStore* store,
+									const QueryTerm* term,
+									const QueryEntry& entry) const;
+			bool				_Resolve(IndexStore* store, ino_t node,
+									std::string& path, Entry& entry,
+									struct stat& st) const;
+			void				_Crawl(IndexStore* store,
+									VirtualDirectory* directory);
+			void				_Notify(IndexStore* store, int32 opcode,
+									ino_t node, const Entry& entry);
+
+			QueryTerm*			fRoot;
+			port_id				fPort;
+			int32				fToken;
+			std::map<ino_t, Entry> fMatches;
+				// what a live query has reported, and where
+};
+
+
+}
+
+
+#endif
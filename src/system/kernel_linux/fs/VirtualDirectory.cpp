@@ -0,0 +1,206 @@
+/*
+ *  Copyright 2020, Dario Casalinuovo. All rights reserved.
+ *  Distributed under the terms of the LGPL License.
+ */
+
+#include "VirtualDirectory.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <unordered_map>
+
+#include "../futex.h"
+#include "fs_private.h"
+
+
+// Every virtual directory sits behind a memfd of its own, which gives it
+// a unique inode. Should the fd get closed behind our back and its number
+// reused, the inode won't match anymore and the stale entry is dropped.
+
+
+namespace BKernelPrivate {
+
+
+struct registered_directory {
+	ino_t				node;
+	VirtualDirectory*	directory;
+};
+
+
+static int32 sRegistryLock = 0;
+static int32 sRegistryCount = 0;
+	// lets the real directories skip the lock
+static std::unordered_map<int, registered_directory> sRegistry;
+
+
+//! Called with the registry lock held.
+static VirtualDirectory*
+lookup_directory_locked(int fd)
+{
+	auto elem = sRegistry.find(fd);
+	if (elem == sRegistry.end())
+		return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_ino == elem->second.node)
+		return elem->second.directory;
+
+	delete elem->second.directory;
+	sRegistry.erase(elem);
+	__atomic_sub_fetch(&sRegistryCount, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+
+VirtualDirectory::VirtualDirectory()
+	:
+	fPosition(0)
+{
+}
+
+
+VirtualDirectory::~VirtualDirectory()
+{
+}
+
+
+void
+VirtualDirectory::AddEntry(ino_t node, ino_t directory, const char* name,
+	unsigned char type)
+{
+	VirtualEntry entry = { node, directory, type, name };
+	fEntries.push_back(entry);
+}
+
+
+ssize_t
+VirtualDirectory::Read(struct dirent* buffer, size_t bufferSize,
+	uint32 maxCount)
+{
+	uint32 count = 0;
+	size_t used = 0;
+	while (fPosition < fEntries.size() && count < maxCount) {
+		const VirtualEntry& entry = fEntries[fPosition];
+		size_t length = (offsetof(struct dirent, d_name) + entry.name.size()
+			+ 1 + 7) & ~(size_t)7;
+		if (used + length > bufferSize)
+			break;
+
+		struct dirent* record = (struct dirent*)((char*)buffer + used);
+		record->d_ino = entry.node;
+		record->d_off = entry.directory;
+		record->d_reclen = length;
+		record->d_type = entry.type;
+		memcpy(record->d_name, entry.name.c_str(), entry.name.size() + 1);
+
+		used += length;
+		fPosition++;
+		count++;
+	}
+
+	if (count == 0 && fPosition < fEntries.size())
+		return B_BUFFER_OVERFLOW;
+
+	return count;
+}
+
+
+void
+VirtualDirectory::Rewind()
+{
+	fPosition = 0;
+}
+
+
+int
+VirtualDirectory::Register(VirtualDirectory* directory)
+{
+	int fd = memfd_create("vos-directory", MFD_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		status_t error = errno_to_status(errno);
+		if (fd >= 0)
+			close(fd);
+		delete directory;
+		return error;
+	}
+
+	registered_directory registered = { st.st_ino, directory };
+
+	futex_lock(&sRegistryLock);
+	auto elem = sRegistry.find(fd);
+	if (elem != sRegistry.end()) {
+		// the last owner of the fd number didn't go through Close()
+		delete elem->second.directory;
+		elem->second = registered;
+	} else {
+		sRegistry[fd] = registered;
+		__atomic_add_fetch(&sRegistryCount, 1, __ATOMIC_RELEASE);
+	}
+	futex_unlock(&sRegistryLock);
+
+	return fd;
+}
+
+
+bool
+VirtualDirectory::Read(int fd, struct dirent* buffer, size_t bufferSize,
+	uint32 maxCount, ssize_t& _count)
+{
+	if (__atomic_load_n(&sRegistryCount, __ATOMIC_ACQUIRE) == 0)
+		return false;
+
+	futex_lock(&sRegistryLock);
+	VirtualDirectory* directory = lookup_directory_locked(fd);
+	if (directory != NULL)
+		_count = directory->Read(buffer, bufferSize, maxCount);
+	futex_unlock(&sRegistryLock);
+
+	return directory != NULL;
+}
+
+
+bool
+VirtualDirectory::Rewind(int fd)
+{
+	if (__atomic_load_n(&sRegistryCount, __ATOMIC_ACQUIRE) == 0)
+		return false;
+
+	futex_lock(&sRegistryLock);
+	VirtualDirectory* directory = lookup_directory_locked(fd);
+	if (directory != NULL)
+		directory->Rewind();
+	futex_unlock(&sRegistryLock);
+
+	return directory != NULL;
+}
+
+
+bool
+VirtualDirectory::Close(int fd)
+{
+	if (__atomic_load_n(&sRegistryCount, __ATOMIC_ACQUIRE) == 0)
+		return false;
+
+	futex_lock(&sRegistryLock);
+	VirtualDirectory* directory = lookup_directory_locked(fd);
+	if (directory != NULL) {
+		sRegistry.erase(fd);
+		__atomic_sub_fetch(&sRegistryCount, 1, __ATOMIC_RELEASE);
+	}
+	futex_unlock(&sRegistryLock);
+
+	if (directory == NULL)
+		return false;
+
+	// outside of the lock, a live query unregisters itself here
+	delete directory;
+	close(fd);
+	return true;
+}
+
+
+}
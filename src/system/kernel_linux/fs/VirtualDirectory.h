@@ -0,0 +1,66 @@
+/*
+ *  Copyright 2020, Dario Casalinuovo. All rights reserved.
+ *  Distributed under the terms of the LGPL License.
+ */
+#ifndef _KERNEL_VIRTUAL_DIRECTORY_H
+#define _KERNEL_VIRTUAL_DIRECTORY_H
+
+#include <OS.h>
+
+#include <dirent.h>
+
+#include <string>
+#include <vector>
+
+
+namespace BKernelPrivate {
+
+
+struct VirtualEntry {
+	ino_t			node;
+	ino_t			directory;
+	unsigned char	type;
+	std::string		name;
+};
+
+
+// A directory whose entries live in memory, like query results or the
+// index directory. It's handed out as a real fd, reads and rewinds on it
+// are served by _kern_read_dir() and _kern_rewind_dir(), and _kern_close()
+// deletes it.
+//
+// Linux' dirent has no room for the parent directory, d_off carries it
+// instead.
+class VirtualDirectory {
+public:
+								VirtualDirectory();
+	virtual						~VirtualDirectory();
+
+			void				AddEntry(ino_t node, ino_t directory,
+									const char* name,
+									unsigned char type = DT_UNKNOWN);
+
+			ssize_t				Read(struct dirent* buffer, size_t bufferSize,
+									uint32 maxCount);
+			void				Rewind();
+
+	// Hands the directory over to a new fd, returns the fd or an error.
+	static	int					Register(VirtualDirectory* directory);
+
+	// These return false when the fd is not a virtual directory.
+	static	bool				Read(int fd, struct dirent* buffer,
+									size_t bufferSize, uint32 maxCount,
+									ssize_t& _count);
+	static	bool				Rewind(int fd);
+	static	bool				Close(int fd);
+
+private:
+			std::vector<VirtualEntry> fEntries;
+			size_t				fPosition;
+};
+
+
+}
+
+
+#endif
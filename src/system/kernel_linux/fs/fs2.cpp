@@ -9,53 +9,416 @@
 
 #include <dirent.h>
 #include <libgen.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <sys/syscall.h>
 
-#include <map>
+#include <list>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "KernelDebug.h"
+#include "IndexStore.h"
+#include "VirtualDirectory.h"
+#include "fs_private.h"
+
+
+// Haiku refers to entries by (device, node, name), Linux can't open a
+// node by its inode number. We remember the path of the nodes we've seen
+// in a size bounded LRU keyed by (device, node), which the rename and
+// unlink calls keep coherent. The paths are normalized before they're
+// cached, and the nodes are also indexed by the path of their directory,
+// so that moving or removing a directory only touches what's below it.
+// Changes done behind our back by other processes aren't noticed.
+//
+// The fd-relative calls otherwise go straight to the *at() syscalls,
+// the path of a directory fd is only needed to fill the cache.
+
+#define PATH_CACHE_SIZE 4096
 
 
 namespace BKernelPrivate {
 
 
-static BLocker fLock;
-static std::map<ino_t, std::string> gMap;
+typedef std::list<std::pair<node_key, std::string> > PathList;
+typedef std::unordered_map<node_key, PathList::iterator, node_key_hash>
+	PathMap;
+typedef std::unordered_set<node_key, node_key_hash> KeySet;
+
+
+struct linux_dirent64 {
+	uint64			d_ino;
+	int64			d_off;
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	char			d_name[];
+};
+
+
+static const bool kDirentIsLinuxDirent64
+	= sizeof(((struct dirent*)NULL)->d_ino) == sizeof(uint64)
+		&& sizeof(((struct dirent*)NULL)->d_off) == sizeof(int64)
+		&& offsetof(struct dirent, d_reclen)
+			== offsetof(linux_dirent64, d_reclen)
+		&& offsetof(struct dirent, d_type) == offsetof(linux_dirent64, d_type)
+		&& offsetof(struct dirent, d_name) == offsetof(linux_dirent64, d_name);
+
+
+static BLocker sPathCacheLock("path cache");
+static PathList sPathList;
+	// most recently used first
+static PathMap sPathCache;
+static std::unordered_map<std::string, KeySet> sChildren;
+	// the cached nodes by the path of their directory
 
 
 status_t
-getPath(int fd, const char* name, std::string& path)
+errno_to_status(int error)
 {
-	if (fd < 0 && name == NULL) {
-		return B_BAD_VALUE;
-	} else if (fd < 0 && name != NULL && name[0] == '/') {
-		path = std::string(name);
-		return B_OK;
-	} 
+	switch (error) {
+		case ENOENT:
+		case ENODATA:
+			return B_ENTRY_NOT_FOUND;
+		case EEXIST:
+			return B_FILE_EXISTS;
+		case ENOTDIR:
+			return B_NOT_A_DIRECTORY;
+		case EISDIR:
+			return B_IS_A_DIRECTORY;
+		case ENOTEMPTY:
+			return B_DIRECTORY_NOT_EMPTY;
+		case ENAMETOOLONG:
+			return B_NAME_TOO_LONG;
+		case EACCES:
+		case EPERM:
+			return B_PERMISSION_DENIED;
+		case EXDEV:
+			return B_CROSS_DEVICE_LINK;
+		case ELOOP:
+			return B_LINK_LIMIT;
+		case ENOSPC:
+			return B_DEVICE_FULL;
+		case EROFS:
+			return B_READ_ONLY_DEVICE;
+		case EMFILE:
+		case ENFILE:
+			return B_NO_MORE_FDS;
+		case EBADF:
+			return B_FILE_ERROR;
+		case ENOMEM:
+			return B_NO_MEMORY;
+		case EINVAL:
+			return B_BAD_VALUE;
+		case EOPNOTSUPP:
+			return B_NOT_SUPPORTED;
+		default:
+			return B_ERROR;
+	}
+}
 
-	// TODO: fd = AT_FDCWD;
 
-	if (fd >= 0) {
-		char buf[PATH_MAX];
-		size_t size = PATH_MAX;
-		std::string proc = "/proc/self/fd/";
-		proc.append(std::to_string(fd));
-		ssize_t bytes = readlink(proc.c_str(), buf, size);
-		if (bytes < 0)
-			return B_ERROR;
+static std::string
+parent_path(const std::string& path)
+{
+	size_t slash = path.rfind('/');
+	if (slash == 0 || slash == std::string::npos)
+		return "/";
+	return path.substr(0, slash);
+}
 
-		path = std::string(buf, bytes);
 
-		if (name != NULL) {
-			path += '/';
-			path += name;
+static void
+unlink_child_locked(const node_key& key, const std::string& path)
+{
+	auto children = sChildren.find(parent_path(path));
+	if (children == sChildren.end())
+		return;
+
+	children->second.erase(key);
+	if (children->second.empty())
+		sChildren.erase(children);
+}
+
+
+static void
+erase_path_locked(PathMap::iterator elem)
+{
+	unlink_child_locked(elem->first, elem->second->second);
+	sPathList.erase(elem->second);
+	sPathCache.erase(elem);
+}
+
+
+static void
+cache_path_locked(const node_key& key, const std::string& path)
+{
+	auto elem = sPathCache.find(key);
+	if (elem != sPathCache.end()) {
+		if (elem->second->second != path) {
+			unlink_child_locked(key, elem->second->second);
+			elem->second->second = path;
+			sChildren[parent_path(path)].insert(key);
 		}
+		sPathList.splice(sPathList.begin(), sPathList, elem->second);
+		return;
+	}
+
+	if (sPathCache.size() >= PATH_CACHE_SIZE)
+		erase_path_locked(sPathCache.find(sPathList.back().first));
+
+	sPathList.push_front(std::make_pair(key, path));
+	sPathCache[key] = sPathList.begin();
+	sChildren[parent_path(path)].insert(key);
+}
+
+
+static bool
+lookup_path_locked(const node_key& key, std::string& path)
+{
+	auto elem = sPathCache.find(key);
+	if (elem == sPathCache.end())
+		return false;
+
+	sPathList.splice(sPathList.begin(), sPathList, elem->second);
+	path = elem->second->second;
+	return true;
+}
+
+
+//! Forgets the cached nodes below \a path, not the directory itself.
+static void
+remove_children_locked(const std::string& path)
+{
+	auto children = sChildren.find(path);
+	if (children == sChildren.end())
+		return;
+
+	KeySet keys;
+	keys.swap(children->second);
+	sChildren.erase(children);
+
+	for (KeySet::iterator it = keys.begin(); it != keys.end(); ++it) {
+		auto elem = sPathCache.find(*it);
+		if (elem == sPathCache.end())
+			continue;
+
+		std::string childPath = elem->second->second;
+		sPathList.erase(elem->second);
+		sPathCache.erase(elem);
+		remove_children_locked(childPath);
+	}
+}
+
+
+//! Moves the cached nodes below \a oldPath to \a newPath.
+static void
+rename_children_locked(const std::string& oldPath, const std::string& newPath)
+{
+	auto children = sChildren.find(oldPath);
+	if (children == sChildren.end())
+		return;
+
+	KeySet keys;
+	keys.swap(children->second);
+	sChildren.erase(children);
+
+	KeySet& newChildren = sChildren[newPath];
+	for (KeySet::iterator it = keys.begin(); it != keys.end(); ++it) {
+		auto elem = sPathCache.find(*it);
+		if (elem == sPathCache.end())
+			continue;
+
+		std::string& path = elem->second->second;
+		std::string childPath = newPath;
+		if (childPath.size() != 1)
+			childPath += '/';
+		childPath.append(path, path.rfind('/') + 1, std::string::npos);
+
+		std::string oldChildPath;
+		oldChildPath.swap(path);
+		path = childPath;
+		newChildren.insert(*it);
+		rename_children_locked(oldChildPath, childPath);
+	}
+}
 
-	} else if (name != NULL) {
-		char buf[B_PATH_NAME_LENGTH];
-		_kern_normalize_path(name, true, buf);
-		path = std::string(buf);
+
+/*!	Makes \a path, which must be absolute, canonical like
+	_kern_normalize_path() does, except for the leaf, so that links are
+	cached as themselves. Only "." and ".." components cost a lookup.
+*/
+static void
+normalize_path(std::string& path)
+{
+	if (path.find("/.") == std::string::npos
+		&& path.find("//") == std::string::npos
+		&& (path.size() == 1 || path[path.size() - 1] != '/')) {
+		return;
+	}
+
+	// resolve everything up to the last "..", it might follow links
+	std::string normalized;
+	size_t start = 0;
+	size_t dotDot = path.rfind("/..");
+	while (dotDot != std::string::npos) {
+		size_t end = dotDot + 3;
+		if (end == path.size() || path[end] == '/') {
+			char* resolved = realpath(path.substr(0, end).c_str(), NULL);
+			if (resolved != NULL) {
+				normalized = resolved;
+				free(resolved);
+				start = end;
+			}
+			break;
+		}
+		dotDot = dotDot == 0 ? std::string::npos
+			: path.rfind("/..", dotDot - 1);
+	}
+
+	// the rest is collapsed as it is
+	while (start < path.size()) {
+		size_t end = path.find('/', start);
+		if (end == std::string::npos)
+			end = path.size();
+
+		size_t length = end - start;
+		if (length == 2 && path.compare(start, 2, "..") == 0) {
+			size_t slash = normalized.rfind('/');
+			normalized.erase(slash == std::string::npos ? 0 : slash);
+		} else if (length != 0
+			&& !(length == 1 && path[start] == '.')) {
+			normalized += '/';
+			normalized.append(path, start, length);
+		}
+		start = end + 1;
+	}
+
+	if (normalized.empty())
+		normalized = "/";
+	path.swap(normalized);
+}
+
+
+void
+insertPath(const struct stat& st, const std::string& path)
+{
+	std::string normalized(path);
+	normalize_path(normalized);
+
+	sPathCacheLock.Lock();
+	cache_path_locked(make_key(st), normalized);
+	sPathCacheLock.Unlock();
+}
+
+
+static bool
+hasPath(const struct stat& st)
+{
+	sPathCacheLock.Lock();
+	bool found = sPathCache.find(make_key(st)) != sPathCache.end();
+	sPathCacheLock.Unlock();
+	return found;
+}
+
+
+//! Forgets the node, and everything below it if it's a directory.
+void
+removePath(const struct stat& st)
+{
+	sPathCacheLock.Lock();
+
+	auto elem = sPathCache.find(make_key(st));
+	if (elem != sPathCache.end()) {
+		std::string path = elem->second->second;
+		erase_path_locked(elem);
+
+		if (S_ISDIR(st.st_mode))
+			remove_children_locked(path);
+	}
+
+	sPathCacheLock.Unlock();
+}
+
+
+//! Moves the node, and everything below it if it's a directory.
+void
+renamePath(const struct stat& st, const std::string& newPath)
+{
+	std::string normalized(newPath);
+	normalize_path(normalized);
+
+	sPathCacheLock.Lock();
+
+	auto elem = sPathCache.find(make_key(st));
+	if (elem != sPathCache.end()) {
+		std::string oldPath = elem->second->second;
+		cache_path_locked(elem->first, normalized);
+
+		if (S_ISDIR(st.st_mode))
+			rename_children_locked(oldPath, normalized);
+	}
+
+	sPathCacheLock.Unlock();
+}
+
+
+//! Returns the absolute path of an open fd, going to /proc on cache misses.
+status_t
+getFDPath(int fd, std::string& path)
+{
+	if (fd == AT_FDCWD) {
+		char buffer[PATH_MAX];
+		if (getcwd(buffer, sizeof(buffer)) == NULL)
+			return errno_to_status(errno);
+		path = buffer;
+		return B_OK;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		return errno_to_status(errno);
+
+	sPathCacheLock.Lock();
+	bool found = lookup_path_locked(make_key(st), path);
+	sPathCacheLock.Unlock();
+	if (found)
+		return B_OK;
+
+	char buffer[PATH_MAX];
+	char proc[32];
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+	ssize_t bytes = readlink(proc, buffer, sizeof(buffer));
+	if (bytes < 0)
+		return B_ERROR;
+
+	path.assign(buffer, bytes);
+	insertPath(st, path);
+	return B_OK;
+}
+
+
+status_t
+getPath(int fd, const char* name, std::string& path)
+{
+	if (fd < 0 && name == NULL)
+		return B_BAD_VALUE;
+
+	if (name != NULL && name[0] == '/') {
+		path = name;
+		normalize_path(path);
+		return B_OK;
+	}
+
+	status_t error = getFDPath(at_fd(fd, name), path);
+	if (error != B_OK)
+		return error;
+
+	if (name != NULL && name[0] != '\0') {
+		if (path.size() != 1)
+			path += '/';
+		path += name;
+		normalize_path(path);
 	}
 
 	TRACE("getPath %s fd %d\n", path.c_str(), fd);
@@ -64,7 +427,7 @@ getPath(int fd, const char* name, std::string& path)
 
 
 status_t
-getPath(ino_t node, const char* name, std::string& path)
+getPath(dev_t device, ino_t node, const char* name, std::string& path)
 {
 	if (node < 0 && name == NULL)
 		return B_BAD_VALUE;
@@ -74,30 +437,21 @@ getPath(ino_t node, const char* name, std::string& path)
 
 	TRACE("getPath %ld %s\n", node, name);
 
-	fLock.Lock();
-	auto elem = gMap.find(node);
-	if (elem != end(gMap)) {
-		TRACE("getPath %d %s %s\n", node, elem->second.c_str(), name);
-		std::string ret(elem->second.c_str());
-		if (name != NULL) {
-			ret += '/';
-			ret += name;
-		}
-		path = ret;
-		fLock.Unlock();
-		return B_OK;
-	}
-	fLock.Unlock();
+	node_key key = { device, node };
 
-	return B_ERROR;
-}
+	sPathCacheLock.Lock();
+	bool found = lookup_path_locked(key, path);
+	sPathCacheLock.Unlock();
 
+	if (!found)
+		return B_ENTRY_NOT_FOUND;
 
-static void
-insertPath(ino_t inode, std::string path) {
-	fLock.Lock();
-	gMap.insert(std::make_pair(inode, path));
-	fLock.Unlock();
+	if (name != NULL) {
+		if (path.size() != 1)
+			path += '/';
+		path += name;
+	}
+	return B_OK;
 }
 
 
@@ -113,24 +467,24 @@ _kern_read_stat(int fd, const char* path, bool traverseLink,
 	if (fd < 0 && path == NULL)
 		return B_FILE_NOT_FOUND;
 
-	if (fd == -1 && path[0] != '/')
-		fd = AT_FDCWD;
-
-	std::string destPath;
-	status_t ret = BKernelPrivate::getPath(fd, path, destPath);
-	if (ret != B_OK)
-		return B_ENTRY_NOT_FOUND;
-
 	int result;
-	if (traverseLink)
-		result = stat(destPath.c_str(), st);
-	else
-		result = lstat(destPath.c_str(), st);
+	if (path == NULL || path[0] == '\0')
+		result = fstat(fd, st);
+	else {
+		result = fstatat(BKernelPrivate::at_fd(fd, path), path, st,
+			traverseLink ? 0 : AT_SYMLINK_NOFOLLOW);
+	}
 
 	if (result < 0)
-		return B_ENTRY_NOT_FOUND;
-	else
-		BKernelPrivate::insertPath(st->st_ino, destPath);
+		return BKernelPrivate::errno_to_status(errno);
+
+	// Remember where the node lives, so that its entry_ref can be
+	// resolved later on. Only new nodes cost a path lookup.
+	if (!BKernelPrivate::hasPath(*st)) {
+		std::string destPath;
+		if (BKernelPrivate::getPath(fd, path, destPath) == B_OK)
+			BKernelPrivate::insertPath(*st, destPath);
+	}
 
 	return B_OK;
 }
@@ -146,22 +500,19 @@ _kern_open(int fd, const char* path, int openMode, int perms)
 
 	// TODO see BNode::_SetTo
 
-	if (fd == -1 && path[0] != '/')
-		fd = AT_FDCWD;
-
-	std::string destPath;
-	status_t ret = BKernelPrivate::getPath(fd, path, destPath);
-
-	if (strlen(path) >= B_FILE_NAME_LENGTH)
+	if (path != NULL && strlen(path) >= B_PATH_NAME_LENGTH)
 		return B_NAME_TOO_LONG;
 
-	struct stat st;
-	if (lstat(destPath.c_str(), &st) < 0) {
-		if (!(openMode & O_CREAT))
-			return B_ENTRY_NOT_FOUND;
-	}
+	int result;
+	if (path == NULL || path[0] == '\0')
+		result = openat(fd, ".", openMode, perms);
+	else
+		result = openat(BKernelPrivate::at_fd(fd, path), path, openMode, perms);
+
+	if (result < 0)
+		return BKernelPrivate::errno_to_status(errno);
 
-	return openat(fd, path, openMode, perms);
+	return result;
 }
 
 
@@ -170,6 +521,13 @@ _kern_close(int fd)
 {
 	CALLED();
 
+	if (BKernelPrivate::VirtualDirectory::Close(fd))
+		return B_OK;
+
+	status_t status;
+	if (BKernelPrivate::close_attribute(fd, status))
+		return status;
+
 	return (close(fd) < 0) ? errno : B_OK;
 }
 
@@ -182,20 +540,19 @@ _kern_open_dir(int fd, const char* path)
 	if (fd < 0 && path == NULL)
 		return B_BAD_VALUE;
 
-	int ret = 0;
-	if (fd == -1 && path[0] != NULL) {
-		DIR* dir = opendir(path);
-		if (dir == NULL)
-			return B_ENTRY_NOT_FOUND;
-
-		ret = dirfd(dir);
-	} else
-		ret = openat(fd, path, O_RDWR);
+	int result = openat(BKernelPrivate::at_fd(fd, path),
+		path != NULL ? path : ".", O_RDONLY | O_DIRECTORY);
+	if (result < 0)
+		return BKernelPrivate::errno_to_status(errno);
 
-	if (ret < 0)
-		return B_ENTRY_NOT_FOUND;
+	// absolute paths come for free
+	if (path != NULL && path[0] == '/') {
+		struct stat st;
+		if (fstat(result, &st) == 0)
+			BKernelPrivate::insertPath(st, path);
+	}
 
-	return ret;
+	return result;
 }
 
 
@@ -253,16 +610,15 @@ _kern_open_dir_entry_ref(dev_t device, ino_t node, const char* name)
 	CALLED();
 
 	std::string path;
-	if (BKernelPrivate::getPath(node, name, path) == B_OK) {
-		DIR* dir = opendir(path.c_str());
-		if (dir != NULL) {
-			int result = dirfd(dir);
-			free(dir);
-			return result;
-		}
-	}
+	status_t error = BKernelPrivate::getPath(device, node, name, path);
+	if (error != B_OK)
+		return error;
 
-	return B_ERROR;
+	int result = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+	if (result < 0)
+		return BKernelPrivate::errno_to_status(errno);
+
+	return result;
 }
 
 
@@ -273,15 +629,15 @@ _kern_open_entry_ref(dev_t device, ino_t node, const char* name,
 	CALLED();
 
 	std::string path;
-	if (BKernelPrivate::getPath(node, name, path) == B_OK) {
-		int ret = open(path.c_str(), openMode, perms);
-		if (ret < 0)
-			return B_ENTRY_NOT_FOUND;
+	status_t error = BKernelPrivate::getPath(device, node, name, path);
+	if (error != B_OK)
+		return error;
 
-		return ret;
-	}
+	int result = open(path.c_str(), openMode, perms);
+	if (result < 0)
+		return BKernelPrivate::errno_to_status(errno);
 
-	return B_ERROR;
+	return result;
 }
 
 
@@ -296,7 +652,7 @@ _kern_entry_ref_to_path(dev_t device, ino_t node, const char* leaf,
 		//return B_ENTRY_NOT_FOUND;
 
 	std::string destPath;
-	status_t ret = BKernelPrivate::getPath(node, leaf, destPath);
+	status_t ret = BKernelPrivate::getPath(device, node, leaf, destPath);
 	if (ret == B_OK) {
 		if (strlcpy(userPath, destPath.c_str(),
 				pathLength) >= pathLength) {
@@ -334,12 +690,10 @@ _kern_read_link(int fd, const char* path, char* buffer, size_t* _bufferSize)
 	if (fd < 0 && path == NULL)
 		return B_FILE_NOT_FOUND;
 
-	if (fd == -1 && path[0] != '/')
-		fd = AT_FDCWD;
-
-	ssize_t size = readlinkat(fd, path, buffer, *_bufferSize);
+	ssize_t size = readlinkat(BKernelPrivate::at_fd(fd, path),
+		path != NULL ? path : "", buffer, *_bufferSize);
 	if (size < 0)
-		return B_ERROR;
+		return BKernelPrivate::errno_to_status(errno);
 
 	*_bufferSize = size;
 	return B_OK;
@@ -377,35 +731,127 @@ _kern_read_dir(int fd, struct dirent* buffer, size_t bufferSize,
 {
 	CALLED();
 
-	if (fd < 0 || buffer == NULL || bufferSize <= 0 || maxCount <= 0)
+	if (fd < 0 || buffer == NULL || bufferSize == 0 || maxCount == 0)
 		return B_BAD_VALUE;
 
-	struct linux_dirent {
-		long           d_ino;
-		off_t          d_off;
-		unsigned short d_reclen;
-		char           d_name[];
-	};
+	// index directories and queries
+	ssize_t virtualCount;
+	if (BKernelPrivate::VirtualDirectory::Read(fd, buffer, bufferSize,
+			maxCount, virtualCount)) {
+		return virtualCount;
+	}
 
-	struct linux_dirent buf[maxCount+1];
-	size_t bufSize = sizeof(struct linux_dirent)*(maxCount+1);
+	// When our dirent matches the kernel record, getdents64() fills the
+	// caller's buffer directly, otherwise we convert from a copy.
+	bool direct = BKernelPrivate::kDirentIsLinuxDirent64;
+
+	char* records = (char*)buffer;
+	off_t lastOffset = 0;
+	if (!direct) {
+		records = (char*)malloc(bufferSize);
+		if (records == NULL)
+			return B_NO_MEMORY;
+		lastOffset = lseek(fd, 0, SEEK_CUR);
+	}
 
-	ssize_t ret = syscall(SYS_getdents, fd, &buf, bufSize);
-	if (ret == 0)
-		return B_OK;
+	ssize_t bytes = syscall(SYS_getdents64, fd, records, bufferSize);
+	if (bytes < 0) {
+		status_t error = errno == EINVAL
+			? B_BUFFER_OVERFLOW : BKernelPrivate::errno_to_status(errno);
+		if (!direct)
+			free(records);
+		return error;
+	}
 
-	if (ret < 0)
-		return B_ERROR;
+	uint32 count = 0;
+	size_t used = 0;
+	ssize_t position = 0;
+	while (position < bytes && count < maxCount) {
+		BKernelPrivate::linux_dirent64* record
+			= (BKernelPrivate::linux_dirent64*)(records + position);
+
+		if (!direct) {
+			size_t nameLength = strlen(record->d_name);
+			size_t length = (offsetof(struct dirent, d_name) + nameLength + 1
+				+ 7) & ~(size_t)7;
+			if (used + length > bufferSize)
+				break;
+
+			struct dirent* entry = (struct dirent*)((char*)buffer + used);
+			entry->d_ino = record->d_ino;
+			entry->d_off = record->d_off;
+			entry->d_reclen = length;
+			entry->d_type = record->d_type;
+			memcpy(entry->d_name, record->d_name, nameLength + 1);
+			used += length;
+		}
+
+		lastOffset = record->d_off;
+		position += record->d_reclen;
+		count++;
+	}
+
+	// give back what didn't fit, the next call will read it again
+	if (position < bytes)
+		lseek(fd, lastOffset, SEEK_SET);
+
+	if (!direct)
+		free(records);
+
+	if (count == 0 && bytes > 0)
+		return B_BUFFER_OVERFLOW;
+
+	return count;
+}
+
+
+ssize_t
+_kern_read_dir_stat(int fd, struct dirent* buffer, size_t bufferSize,
+	uint32 maxCount, struct stat* stats)
+{
+	CALLED();
+
+	// stats holds maxCount elements, which is also the most entries
+	// _kern_read_dir() returns. A negative count wrapped around isn't.
+	if (maxCount > (uint32)INT32_MAX)
+		return B_BAD_VALUE;
+
+	ssize_t count = _kern_read_dir(fd, buffer, bufferSize, maxCount);
+	if (count <= 0 || stats == NULL)
+		return count;
+
+	// Linux has no batched stat, but going relative to the directory fd
+	// saves the path walk, and we get to fill the path cache on the way.
+	std::string dirPath;
+	bool cache = BKernelPrivate::getFDPath(fd, dirPath) == B_OK;
+	if (cache && dirPath.size() != 1)
+		dirPath += '/';
+
+	struct dirent* entry = buffer;
+	for (ssize_t i = 0; i < count; i++) {
+		if (fstatat(fd, entry->d_name, &stats[i],
+				AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT) < 0) {
+			memset(&stats[i], 0, sizeof(struct stat));
+		}
+		entry = (struct dirent*)((char*)entry + entry->d_reclen);
+	}
 
-	ssize_t retCount = ret/sizeof(struct linux_dirent);
-	for (uint32 i = 0; i < maxCount && i < retCount; i++) {
-		buffer[i].d_ino = buf[i].d_ino;
-		buffer[i].d_off = buf[i].d_off;
-		buffer[i].d_reclen = buf[i].d_reclen;
-		strcpy(buffer[i].d_name, buf[i].d_name);
+	if (!cache)
+		return count;
+
+	BKernelPrivate::sPathCacheLock.Lock();
+	entry = buffer;
+	for (ssize_t i = 0; i < count; i++) {
+		if (stats[i].st_ino != 0 && strcmp(entry->d_name, ".") != 0
+				&& strcmp(entry->d_name, "..") != 0) {
+			BKernelPrivate::cache_path_locked(
+				BKernelPrivate::make_key(stats[i]), dirPath + entry->d_name);
+		}
+		entry = (struct dirent*)((char*)entry + entry->d_reclen);
 	}
+	BKernelPrivate::sPathCacheLock.Unlock();
 
-	return retCount;
+	return count;
 }
 
 
@@ -450,12 +896,12 @@ _kern_rewind_dir(int fd)
 	if (fd == -1)
 		return B_BAD_VALUE;
 
-	DIR* dir = fdopendir(dup(fd));
-	if (dir == NULL)
-		return B_BAD_VALUE;
+	if (BKernelPrivate::VirtualDirectory::Rewind(fd))
+		return B_OK;
+
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		return BKernelPrivate::errno_to_status(errno);
 
-	rewinddir(dir);
-	closedir(dir);
 	return B_OK;
 }
 
@@ -468,16 +914,20 @@ _kern_remove_dir(int fd, const char* path)
 	if (fd < 0 && path == NULL)
 		return B_ENTRY_NOT_FOUND;
 
-	if (fd == -1 && path[0] != '/')
-		fd = AT_FDCWD;
+	fd = BKernelPrivate::at_fd(fd, path);
+
+	struct stat st;
+	bool known = fstatat(fd, path, &st, AT_SYMLINK_NOFOLLOW) == 0;
 
-	int ret = unlinkat(fd, path, AT_REMOVEDIR);
+	if (unlinkat(fd, path, AT_REMOVEDIR) < 0)
+		return BKernelPrivate::errno_to_status(errno);
 
-	// TODO: remap errors
-	if (ret < 0 && errno == ENOTEMPTY)
-		return B_DIRECTORY_NOT_EMPTY;
+	if (known) {
+		BKernelPrivate::removePath(st);
+		BKernelPrivate::IndexStore::NodeRemoved(st);
+	}
 
-	return (ret < 0) ? B_ENTRY_NOT_FOUND : B_OK;
+	return B_OK;
 }
 
 
@@ -486,7 +936,40 @@ _kern_rename(int oldDir, const char* oldPath, int newDir, const char* newPath)
 {
 	CALLED();
 
-	return (renameat(oldDir, oldPath, newDir, newPath) < 0) ? B_OK : B_BAD_VALUE;
+	if (oldPath == NULL || newPath == NULL)
+		return B_BAD_VALUE;
+
+	oldDir = BKernelPrivate::at_fd(oldDir, oldPath);
+	newDir = BKernelPrivate::at_fd(newDir, newPath);
+
+	struct stat st;
+	bool moved = fstatat(oldDir, oldPath, &st, AT_SYMLINK_NOFOLLOW) == 0;
+	bool known = moved && BKernelPrivate::hasPath(st);
+
+	struct stat replaced;
+	bool replacing = fstatat(newDir, newPath, &replaced,
+		AT_SYMLINK_NOFOLLOW) == 0;
+
+	if (renameat(oldDir, oldPath, newDir, newPath) < 0)
+		return BKernelPrivate::errno_to_status(errno);
+
+	if (replacing && (replaced.st_dev != st.st_dev
+			|| replaced.st_ino != st.st_ino)) {
+		BKernelPrivate::removePath(replaced);
+		if (replaced.st_nlink <= 1)
+			BKernelPrivate::IndexStore::NodeRemoved(replaced);
+	}
+
+	std::string destPath;
+	if (moved
+		&& BKernelPrivate::getPath(newDir, newPath, destPath) == B_OK) {
+		if (known)
+			BKernelPrivate::renamePath(st, destPath);
+		BKernelPrivate::IndexStore::EntryMoved(st, destPath);
+	} else if (known)
+		BKernelPrivate::removePath(st);
+
+	return B_OK;
 }
 
 
@@ -507,13 +990,10 @@ _kern_create_dir(int fd, const char* path, int perms)
 	if (fd < 0 && path == NULL)
 		return B_FILE_NOT_FOUND;
 
-	if (fd == -1 && path[0] != '/')
-		fd = AT_FDCWD;
-
 	TRACE("create dir %d %s\n", fd, path);
 
-	if (mkdirat(fd, path, perms) < 0)
-		return errno;
+	if (mkdirat(BKernelPrivate::at_fd(fd, path), path, perms) < 0)
+		return BKernelPrivate::errno_to_status(errno);
 
 	return B_OK;
 }
@@ -527,15 +1007,13 @@ _kern_create_symlink(int fd, const char* path, const char* toPath, int mode)
 	if (fd < 0 && path == NULL)
 		return B_FILE_NOT_FOUND;
 
-	if (fd == -1 && path[0] != '/')
-		fd = AT_FDCWD;
+	if (toPath == NULL)
+		return B_BAD_VALUE;
 
-	std::string temp;
-	status_t ret = BKernelPrivate::getPath(fd, path, temp);
-	if (ret != B_OK)
-		return ret;
+	if (symlinkat(toPath, BKernelPrivate::at_fd(fd, path), path) < 0)
+		return BKernelPrivate::errno_to_status(errno);
 
-	return (symlink(temp.c_str(), toPath) < 0) ? errno : B_OK;
+	return B_OK;
 }
 
 
@@ -547,10 +1025,21 @@ _kern_unlink(int fd, const char* path)
 	if (fd < 0 && path == NULL)
 		return B_ENTRY_NOT_FOUND;
 
-	if (fd == -1 && path[0] != '/')
-		fd = AT_FDCWD;
+	fd = BKernelPrivate::at_fd(fd, path);
+
+	struct stat st;
+	bool known = fstatat(fd, path, &st, AT_SYMLINK_NOFOLLOW) == 0;
+
+	if (unlinkat(fd, path, 0) < 0)
+		return BKernelPrivate::errno_to_status(errno);
 
-	return (unlinkat(fd, path, 0) < 0) ? B_ENTRY_NOT_FOUND : B_OK;
+	// other links to the node might still be around
+	if (known && st.st_nlink <= 1) {
+		BKernelPrivate::removePath(st);
+		BKernelPrivate::IndexStore::NodeRemoved(st);
+	}
+
+	return B_OK;
 }
 
 
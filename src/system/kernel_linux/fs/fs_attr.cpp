@@ -5,16 +5,486 @@
 
 #include <syscalls.h>
 
+#include <TypeConstants.h>
+#include <fs_attr.h>
+#include <vfs_defs.h>
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <list>
+#include <new>
+#include <string>
+#include <unordered_map>
 
+#include "../futex.h"
+#include "fs_private.h"
+#include "IndexStore.h"
 #include "KernelDebug.h"
+#include "VirtualDirectory.h"
+
+
+// The attributes are user xattrs, their value starts with a header that
+// keeps the Haiku type. The ones set by other tools come without it, their
+// type isn't known.
+//
+// An attribute fd is a memfd with a copy of the value, written back when
+// it's closed. It keeps an fd to its node, so that the attribute calls
+// work on it too.
+//
+// _kern_read_attrs() reads all the attributes of a node at once. The last
+// nodes read this way are cached, and checked against the change time of
+// the node, which setting an xattr updates.
+
+#define ATTRIBUTE_MAGIC			'VATR'
+#define READ_BUFFER_SIZE		4096
+	// most attributes fit, and take a single call then
+#define ATTRIBUTE_CACHE_SIZE	256
+#define MAX_CACHED_SIZE			(64 * 1024)
+
+
+namespace BKernelPrivate {
+
+
+struct attribute_header {
+	uint32	magic;
+	uint32	type;
+};
+
+
+struct attribute_file {
+	ino_t		node;
+		// of the memfd
+	int			nodeFD;
+	std::string	name;
+	uint32		type;
+	bool		writable;
+};
+
+
+struct cached_attributes {
+	node_key		key;
+	struct timespec	changed;
+	std::string		records;
+};
+
+
+typedef std::list<cached_attributes> AttributeCacheList;
+
+
+static int32 sFilesLock = 0;
+static int32 sFileCount = 0;
+	// lets the other fds skip the lock
+static std::unordered_map<int, attribute_file> sFiles;
+
+static int32 sCacheLock = 0;
+static AttributeCacheList sCacheList;
+static std::unordered_map<node_key, AttributeCacheList::iterator,
+	node_key_hash> sCache;
+
+
+static std::string
+attribute_name(const char* name)
+{
+	return std::string(ATTRIBUTE_PREFIX) + name;
+}
+
+
+// The node an attribute call is about, an fd or a path relative to it.
+class AttributeNode {
+public:
+	AttributeNode(int fd, const char* path, bool traverse)
+		:
+		fFD(fd),
+		fPath(path),
+		fTraverse(traverse),
+		fPathFD(-1)
+	{
+		if (path != NULL && path[0] != '/' && fd >= 0) {
+			// there are no *at() xattr calls
+			fPathFD = openat(fd, path,
+				O_PATH | O_CLOEXEC | (traverse ? 0 : O_NOFOLLOW));
+			if (fPathFD >= 0) {
+				snprintf(fProcPath, sizeof(fProcPath), "/proc/self/fd/%d",
+					fPathFD);
+				fPath = fProcPath;
+				fTraverse = true;
+			}
+		}
+	}
+
+	~AttributeNode()
+	{
+		if (fPathFD >= 0)
+			close(fPathFD);
+	}
+
+	status_t InitCheck() const
+	{
+		if (fPath == NULL)
+			return fFD >= 0 ? B_OK : B_FILE_ERROR;
+		if (fPath[0] != '/' && fFD >= 0 && fPathFD < 0)
+			return errno_to_status(errno);
+		return B_OK;
+	}
+
+	ssize_t Get(const char* name, void* buffer, size_t size) const
+	{
+		if (fPath == NULL)
+			return fgetxattr(fFD, name, buffer, size);
+		return fTraverse ? getxattr(fPath, name, buffer, size)
+			: lgetxattr(fPath, name, buffer, size);
+	}
+
+	ssize_t List(char* buffer, size_t size) const
+	{
+		if (fPath == NULL)
+			return flistxattr(fFD, buffer, size);
+		return fTraverse ? listxattr(fPath, buffer, size)
+			: llistxattr(fPath, buffer, size);
+	}
+
+	int Stat(struct stat& st) const
+	{
+		if (fPath == NULL)
+			return fstat(fFD, &st);
+		return fTraverse ? stat(fPath, &st) : lstat(fPath, &st);
+	}
+
+private:
+	int			fFD;
+	const char*	fPath;
+	bool		fTraverse;
+	int			fPathFD;
+	char		fProcPath[32];
+};
+
+
+//! The node of an attribute fd, or the fd itself.
+static int
+node_fd(int fd)
+{
+	if (__atomic_load_n(&sFileCount, __ATOMIC_ACQUIRE) == 0)
+		return fd;
+
+	futex_lock(&sFilesLock);
+	auto elem = sFiles.find(fd);
+	if (elem != sFiles.end())
+		fd = elem->second.nodeFD;
+	futex_unlock(&sFilesLock);
+
+	return fd;
+}
+
+
+//! Reads the whole xattr as it's stored, header included.
+static status_t
+read_raw_attribute(const AttributeNode& node, const char* name,
+	std::string& raw)
+{
+	char buffer[READ_BUFFER_SIZE];
+	ssize_t size = node.Get(name, buffer, sizeof(buffer));
+	if (size >= 0) {
+		raw.assign(buffer, size);
+		return B_OK;
+	}
+
+	while (errno == ERANGE) {
+		size = node.Get(name, NULL, 0);
+		if (size < 0)
+			break;
+
+		raw.resize(size);
+		size = node.Get(name, &raw[0], raw.size());
+		if (size >= 0) {
+			raw.resize(size);
+			return B_OK;
+		}
+		// ERANGE if it grew in between
+	}
+
+	return errno_to_status(errno);
+}
+
+
+//! Splits the raw value, returns where the data starts.
+static size_t
+decode_attribute(const std::string& raw, uint32* _type)
+{
+	attribute_header header;
+	if (raw.size() >= sizeof(header)) {
+		memcpy(&header, raw.data(), sizeof(header));
+		if (header.magic == ATTRIBUTE_MAGIC) {
+			*_type = header.type;
+			return sizeof(header);
+		}
+	}
+
+	*_type = 0;
+	return 0;
+}
+
+
+static void
+encode_attribute(uint32 type, const void* data, size_t size,
+	std::string& raw)
+{
+	attribute_header header = { ATTRIBUTE_MAGIC, type };
+	raw.assign((const char*)&header, sizeof(header));
+	raw.append((const char*)data, size);
+}
+
+
+status_t
+read_attribute(int fd, const char* path, const char* name, uint32* _type,
+	std::string& value)
+{
+	AttributeNode node(fd, path, false);
+	status_t error = node.InitCheck();
+	if (error != B_OK)
+		return error;
+
+	error = read_raw_attribute(node, attribute_name(name).c_str(), value);
+	if (error != B_OK)
+		return error;
+
+	uint32 type;
+	value.erase(0, decode_attribute(value, &type));
+	if (_type != NULL)
+		*_type = type;
+	return B_OK;
+}
+
+
+//! Appends the attributes of the node as attr_records.
+static status_t
+load_attributes(const AttributeNode& node, std::string& records)
+{
+	std::string names;
+	while (true) {
+		ssize_t size = node.List(NULL, 0);
+		if (size < 0)
+			return errno_to_status(errno);
+
+		names.resize(size);
+		size = node.List(&names[0], names.size());
+		if (size >= 0) {
+			names.resize(size);
+			break;
+		}
+		if (errno != ERANGE)
+			return errno_to_status(errno);
+	}
+
+	std::string raw;
+	for (size_t position = 0; position < names.size();
+			position += strlen(names.c_str() + position) + 1) {
+		const char* name = names.c_str() + position;
+		if (strncmp(name, ATTRIBUTE_PREFIX, ATTRIBUTE_PREFIX_LENGTH) != 0)
+			continue;
+
+		if (read_raw_attribute(node, name, raw) != B_OK) {
+			// removed in the meantime
+			continue;
+		}
+
+		uint32 type;
+		size_t offset = decode_attribute(raw, &type);
+
+		const char* attribute = name + ATTRIBUTE_PREFIX_LENGTH;
+		size_t nameLength = strlen(attribute) + 1;
+		size_t dataSize = raw.size() - offset;
+		size_t recordSize = (offsetof(attr_record, name) + nameLength
+			+ dataSize + 7) & ~(size_t)7;
+
+		size_t start = records.size();
+		records.resize(start + recordSize, '\0');
+
+		attr_record* record = (attr_record*)&records[start];
+		record->record_size = recordSize;
+		record->type = type != 0 ? type : B_RAW_TYPE;
+		record->size = dataSize;
+		record->name_length = nameLength;
+		memcpy(record->name, attribute, nameLength);
+		memcpy(record->name + nameLength, raw.data() + offset, dataSize);
+	}
+
+	return B_OK;
+}
+
+
+static bool
+lookup_cached_attributes(const struct stat& st, std::string& records)
+{
+	futex_lock(&sCacheLock);
+
+	bool found = false;
+	auto elem = sCache.find(make_key(st));
+	if (elem != sCache.end()) {
+		cached_attributes& cached = *elem->second;
+		if (cached.changed.tv_sec == st.st_ctim.tv_sec
+			&& cached.changed.tv_nsec == st.st_ctim.tv_nsec) {
+			records = cached.records;
+			sCacheList.splice(sCacheList.begin(), sCacheList, elem->second);
+			found = true;
+		} else {
+			sCacheList.erase(elem->second);
+			sCache.erase(elem);
+		}
+	}
+
+	futex_unlock(&sCacheLock);
+	return found;
+}
+
+
+static void
+cache_attributes(const struct stat& st, const std::string& records)
+{
+	// A change within the same tick as the stat wouldn't show in the
+	// change time, recently changed nodes have to wait a bit.
+	if (records.size() > MAX_CACHED_SIZE
+		|| st.st_ctim.tv_sec + 1 >= time(NULL)) {
+		return;
+	}
+
+	futex_lock(&sCacheLock);
+
+	node_key key = make_key(st);
+	auto elem = sCache.find(key);
+	if (elem != sCache.end()) {
+		sCacheList.erase(elem->second);
+		sCache.erase(elem);
+	} else if (sCache.size() >= ATTRIBUTE_CACHE_SIZE) {
+		sCache.erase(sCacheList.back().key);
+		sCacheList.pop_back();
+	}
+
+	cached_attributes cached = { key, st.st_ctim, records };
+	sCacheList.push_front(cached);
+	sCache[key] = sCacheList.begin();
+
+	futex_unlock(&sCacheLock);
+}
+
+
+//! Writes the attribute file back, if it was open for writing.
+static status_t
+flush_attribute_file(int fd, const attribute_file& file)
+{
+	if (!file.writable)
+		return B_OK;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		return errno_to_status(errno);
+
+	std::string data(st.st_size, '\0');
+	if (st.st_size > 0 && pread(fd, &data[0], data.size(), 0) < 0)
+		return errno_to_status(errno);
+
+	std::string raw;
+	encode_attribute(file.type, data.data(), data.size(), raw);
+	if (fsetxattr(file.nodeFD, file.name.c_str(), raw.data(), raw.size(),
+			0) < 0) {
+		return errno_to_status(errno);
+	}
+
+	IndexStore::AttributeChanged(file.nodeFD,
+		file.name.c_str() + ATTRIBUTE_PREFIX_LENGTH);
+	return B_OK;
+}
+
+
+bool
+close_attribute(int fd, status_t& _status)
+{
+	if (__atomic_load_n(&sFileCount, __ATOMIC_ACQUIRE) == 0)
+		return false;
+
+	futex_lock(&sFilesLock);
+	auto elem = sFiles.find(fd);
+	if (elem == sFiles.end()) {
+		futex_unlock(&sFilesLock);
+		return false;
+	}
+
+	attribute_file file = elem->second;
+	sFiles.erase(elem);
+	__atomic_sub_fetch(&sFileCount, 1, __ATOMIC_RELEASE);
+	futex_unlock(&sFilesLock);
+
+	// the fd might have been closed behind our back, and reused
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_ino == file.node) {
+		_status = flush_attribute_file(fd, file);
+		close(fd);
+	} else
+		_status = close(fd) < 0 ? errno_to_status(errno) : B_OK;
+
+	close(file.nodeFD);
+	return true;
+}
+
+
+}
+
+
+using namespace BKernelPrivate;
 
 
 int
 _kern_open_attr_dir(int fd, const char* path,
 		bool traverseLeafLink) {
-	UNIMPLEMENTED();
-	return B_ERROR;
+	CALLED();
+
+	if (fd < 0 && path == NULL)
+		return B_BAD_VALUE;
+
+	AttributeNode node(path == NULL ? node_fd(fd) : fd, path,
+		traverseLeafLink);
+	status_t error = node.InitCheck();
+	if (error != B_OK)
+		return error;
+
+	std::string names;
+	while (true) {
+		ssize_t size = node.List(NULL, 0);
+		if (size < 0)
+			return errno_to_status(errno);
+
+		names.resize(size);
+		size = node.List(&names[0], names.size());
+		if (size >= 0) {
+			names.resize(size);
+			break;
+		}
+		if (errno != ERANGE)
+			return errno_to_status(errno);
+	}
+
+	VirtualDirectory* directory = new(std::nothrow) VirtualDirectory;
+	if (directory == NULL)
+		return B_NO_MEMORY;
+
+	ino_t index = 1;
+	for (size_t position = 0; position < names.size();
+			position += strlen(names.c_str() + position) + 1) {
+		const char* name = names.c_str() + position;
+		if (strncmp(name, ATTRIBUTE_PREFIX, ATTRIBUTE_PREFIX_LENGTH) == 0) {
+			directory->AddEntry(index++, 0, name + ATTRIBUTE_PREFIX_LENGTH,
+				DT_REG);
+		}
+	}
+
+	return VirtualDirectory::Register(directory);
 }
 
 
@@ -23,7 +493,25 @@ _kern_read_attr(int fd, const char* attribute, off_t pos,
 		void* buffer, size_t readBytes) {
 	CALLED();
 
-	return fgetxattr(fd, attribute, buffer, readBytes);
+	if (attribute == NULL || pos < 0 || (buffer == NULL && readBytes > 0))
+		return B_BAD_VALUE;
+
+	AttributeNode node(node_fd(fd), NULL, true);
+	std::string raw;
+	status_t error = read_raw_attribute(node,
+		attribute_name(attribute).c_str(), raw);
+	if (error != B_OK)
+		return error;
+
+	uint32 type;
+	size_t offset = decode_attribute(raw, &type);
+	size_t size = raw.size() - offset;
+	if ((size_t)pos >= size)
+		return 0;
+
+	size_t bytesRead = std::min(readBytes, size - (size_t)pos);
+	memcpy(buffer, raw.data() + offset + pos, bytesRead);
+	return bytesRead;
 }
 
 
@@ -32,24 +520,163 @@ _kern_write_attr(int fd, const char* attribute, uint32 type,
 		off_t pos, const void* buffer, size_t readBytes) {
 	CALLED();
 
-	return fsetxattr(fd, attribute, buffer, readBytes, 0);
+	if (attribute == NULL || pos < 0 || (buffer == NULL && readBytes > 0))
+		return B_BAD_VALUE;
+
+	fd = node_fd(fd);
+	std::string name = attribute_name(attribute);
+
+	// Like BeOS, writing at 0 replaces the attribute. The other positions
+	// keep what's there, which lets the callers write in chunks.
+	std::string raw;
+	if (pos == 0)
+		encode_attribute(type, buffer, readBytes, raw);
+	else {
+		AttributeNode node(fd, NULL, true);
+		std::string old;
+		status_t error = read_raw_attribute(node, name.c_str(), old);
+		if (error != B_OK && error != B_ENTRY_NOT_FOUND)
+			return error;
+
+		uint32 oldType;
+		std::string data = old.substr(decode_attribute(old, &oldType));
+		if (data.size() < pos + readBytes)
+			data.resize(pos + readBytes, '\0');
+		data.replace(pos, readBytes, (const char*)buffer, readBytes);
+		encode_attribute(type, data.data(), data.size(), raw);
+	}
+
+	if (fsetxattr(fd, name.c_str(), raw.data(), raw.size(), 0) < 0)
+		return errno_to_status(errno);
+
+	IndexStore::AttributeChanged(fd, attribute);
+	return readBytes;
 }
 
 
 status_t
 _kern_stat_attr(int fd, const char* attribute,
 		struct attr_info* attrInfo) {
-	printf("%s\n", attribute);
-	UNIMPLEMENTED();
-	return B_ERROR;
+	CALLED();
+
+	if (attribute == NULL || attrInfo == NULL)
+		return B_BAD_VALUE;
+
+	AttributeNode node(node_fd(fd), NULL, true);
+	std::string raw;
+	status_t error = read_raw_attribute(node,
+		attribute_name(attribute).c_str(), raw);
+	if (error != B_OK)
+		return error;
+
+	uint32 type;
+	attrInfo->size = raw.size() - decode_attribute(raw, &type);
+	attrInfo->type = type != 0 ? type : B_RAW_TYPE;
+	return B_OK;
 }
 
 
 int
 _kern_open_attr(int fd, const char* path, const char* name,
 		uint32 type, int openMode) {
-	UNIMPLEMENTED();
-	return B_ERROR;
+	CALLED();
+
+	if (name == NULL || (fd < 0 && path == NULL))
+		return B_BAD_VALUE;
+
+	// the node, for the write back
+	int nodeFD;
+	if (path == NULL)
+		nodeFD = fcntl(node_fd(fd), F_DUPFD_CLOEXEC, 0);
+	else {
+		nodeFD = openat(at_fd(fd, path), path, O_RDONLY | O_CLOEXEC
+			| ((openMode & O_NOTRAVERSE) != 0 ? O_NOFOLLOW : 0));
+	}
+	if (nodeFD < 0)
+		return errno_to_status(errno);
+
+	attribute_file file;
+	file.nodeFD = nodeFD;
+	file.name = attribute_name(name);
+	file.type = type;
+	file.writable = (openMode & O_ACCMODE) != O_RDONLY;
+
+	AttributeNode node(nodeFD, NULL, true);
+	std::string raw;
+	status_t error = read_raw_attribute(node, file.name.c_str(), raw);
+	bool created = false;
+	if (error == B_OK) {
+		if ((openMode & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL))
+			error = B_FILE_EXISTS;
+	} else if (error == B_ENTRY_NOT_FOUND && (openMode & O_CREAT) != 0) {
+		created = true;
+		error = B_OK;
+	}
+
+	size_t offset = 0;
+	if (error == B_OK && !created && (openMode & O_TRUNC) == 0) {
+		uint32 storedType;
+		offset = decode_attribute(raw, &storedType);
+		if (storedType != 0)
+			file.type = storedType;
+	} else
+		raw.clear();
+
+	// an empty attribute shows up right away
+	if (error == B_OK && (created || (openMode & O_TRUNC) != 0)) {
+		std::string empty;
+		encode_attribute(file.type, NULL, 0, empty);
+		if (fsetxattr(nodeFD, file.name.c_str(), empty.data(), empty.size(),
+				0) < 0) {
+			error = errno_to_status(errno);
+		} else
+			IndexStore::AttributeChanged(nodeFD, name);
+	}
+
+	int attributeFD = -1;
+	if (error == B_OK) {
+		attributeFD = memfd_create("vos-attribute",
+			MFD_CLOEXEC | MFD_ALLOW_SEALING);
+		if (attributeFD < 0)
+			error = errno_to_status(errno);
+	}
+
+	struct stat st;
+	if (error == B_OK) {
+		size_t size = raw.size() - offset;
+		if ((size > 0 && pwrite(attributeFD, raw.data() + offset, size, 0)
+				!= (ssize_t)size)
+			|| (!file.writable && fcntl(attributeFD, F_ADD_SEALS,
+				F_SEAL_WRITE | F_SEAL_GROW | F_SEAL_SHRINK) < 0)
+			|| ((openMode & O_APPEND) != 0
+				&& fcntl(attributeFD, F_SETFL, O_APPEND) < 0)
+			|| fstat(attributeFD, &st) < 0) {
+			error = errno_to_status(errno);
+		}
+	}
+
+	if (error != B_OK) {
+		if (attributeFD >= 0)
+			close(attributeFD);
+		close(nodeFD);
+		return error;
+	}
+
+	file.node = st.st_ino;
+
+	futex_lock(&sFilesLock);
+	auto elem = sFiles.find(attributeFD);
+	if (elem != sFiles.end()) {
+		// the last owner of the fd number didn't go through _kern_close()
+		close(elem->second.nodeFD);
+		elem->second = file;
+	} else {
+		sFiles[attributeFD] = file;
+		__atomic_add_fetch(&sFileCount, 1, __ATOMIC_RELEASE);
+	}
+	futex_unlock(&sFilesLock);
+
+	return attributeFD;
 }
 
 
@@ -57,13 +684,89 @@ status_t
 _kern_remove_attr(int fd, const char* name) {
 	CALLED();
 
-	return fremovexattr(fd, name);
+	if (name == NULL)
+		return B_BAD_VALUE;
+
+	fd = node_fd(fd);
+	if (fremovexattr(fd, attribute_name(name).c_str()) < 0)
+		return errno_to_status(errno);
+
+	IndexStore::AttributeChanged(fd, name);
+	return B_OK;
 }
 
 
 status_t
 _kern_rename_attr(int fromFile, const char* fromName,
 		int toFile, const char* toName) {
-	UNIMPLEMENTED();
-	return B_ERROR;
+	CALLED();
+
+	if (fromName == NULL || toName == NULL)
+		return B_BAD_VALUE;
+
+	fromFile = node_fd(fromFile);
+	toFile = node_fd(toFile);
+
+	std::string from = attribute_name(fromName);
+	std::string to = attribute_name(toName);
+
+	// the raw value, the type goes along
+	AttributeNode node(fromFile, NULL, true);
+	std::string raw;
+	status_t error = read_raw_attribute(node, from.c_str(), raw);
+	if (error != B_OK)
+		return error;
+
+	if (fsetxattr(toFile, to.c_str(), raw.data(), raw.size(), 0) < 0)
+		return errno_to_status(errno);
+
+	struct stat fromStat;
+	struct stat toStat;
+	bool sameNode = fstat(fromFile, &fromStat) == 0
+		&& fstat(toFile, &toStat) == 0
+		&& fromStat.st_dev == toStat.st_dev
+		&& fromStat.st_ino == toStat.st_ino;
+	if (!sameNode || from != to) {
+		if (fremovexattr(fromFile, from.c_str()) < 0)
+			return errno_to_status(errno);
+		IndexStore::AttributeChanged(fromFile, fromName);
+	}
+
+	IndexStore::AttributeChanged(toFile, toName);
+	return B_OK;
+}
+
+
+ssize_t
+_kern_read_attrs(int fd, const char* path, bool traverseLeafLink,
+	void* buffer, size_t bufferSize)
+{
+	CALLED();
+
+	if ((fd < 0 && path == NULL) || (buffer == NULL && bufferSize > 0))
+		return B_BAD_VALUE;
+
+	AttributeNode node(path == NULL ? node_fd(fd) : fd, path,
+		traverseLeafLink);
+	status_t error = node.InitCheck();
+	if (error != B_OK)
+		return error;
+
+	struct stat st;
+	if (node.Stat(st) < 0)
+		return errno_to_status(errno);
+
+	std::string records;
+	if (!lookup_cached_attributes(st, records)) {
+		error = load_attributes(node, records);
+		if (error != B_OK)
+			return error;
+
+		cache_attributes(st, records);
+	}
+
+	if (records.size() <= bufferSize)
+		memcpy(buffer, records.data(), records.size());
+
+	return records.size();
 }
@@ -5,34 +5,64 @@
 
 #include <syscalls.h>
 
+#include "IndexStore.h"
+#include "KernelDebug.h"
+
+
+using namespace BKernelPrivate;
+
 
 status_t
 _kern_create_index(dev_t device, const char* name, uint32 type, uint32 flags)
 {
-	UNIMPLEMENTED();
-	return B_ERROR;
+	CALLED();
+
+	IndexStore* store;
+	status_t error = IndexStore::Get(device, store);
+	if (error != B_OK)
+		return error;
+
+	return store->CreateIndex(name, type);
 }
 
 
 status_t
 _kern_remove_index(dev_t device, const char* name)
 {
-	UNIMPLEMENTED();
-	return B_ERROR;
+	CALLED();
+
+	IndexStore* store;
+	status_t error = IndexStore::Get(device, store);
+	if (error != B_OK)
+		return error;
+
+	return store->RemoveIndex(name);
 }
 
 
-int
+status_t
 _kern_stat_index(dev_t device, const char* name, struct index_info* indexInfo)
 {
-	UNIMPLEMENTED();
-	return B_ERROR;
+	CALLED();
+
+	IndexStore* store;
+	status_t error = IndexStore::Get(device, store);
+	if (error != B_OK)
+		return error;
+
+	return store->StatIndex(name, indexInfo);
 }
 
 
 int
 _kern_open_index_dir(dev_t device)
 {
-	UNIMPLEMENTED();
-	return 0;
+	CALLED();
+
+	IndexStore* store;
+	status_t error = IndexStore::Get(device, store);
+	if (error != B_OK)
+		return error;
+
+	return store->OpenIndexDir();
 }
@@ -0,0 +1,86 @@
+/*
+ *  Copyright 2020, Dario Casalinuovo. All rights reserved.
+ *  Distributed under the terms of the LGPL License.
+ */
+#ifndef _KERNEL_FS_PRIVATE_H
+#define _KERNEL_FS_PRIVATE_H
+
+#include <OS.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <functional>
+#include <string>
+
+
+// The Haiku attributes live in the user xattr namespace.
+#define ATTRIBUTE_PREFIX		"user."
+#define ATTRIBUTE_PREFIX_LENGTH	5
+
+
+namespace BKernelPrivate {
+
+
+struct node_key {
+	dev_t	device;
+	ino_t	node;
+
+	bool operator==(const node_key& other) const
+	{
+		return device == other.device && node == other.node;
+	}
+};
+
+
+struct node_key_hash {
+	size_t operator()(const node_key& key) const
+	{
+		return std::hash<ino_t>()(key.node) ^ ((size_t)key.device << 7);
+	}
+};
+
+
+static inline node_key
+make_key(const struct stat& st)
+{
+	node_key key = { st.st_dev, st.st_ino };
+	return key;
+}
+
+
+// The fd the *at() calls want for a Haiku (fd, path) pair.
+static inline int
+at_fd(int fd, const char* path)
+{
+	if (fd < 0 && (path == NULL || path[0] != '/'))
+		return AT_FDCWD;
+	return fd;
+}
+
+
+// Maps an errno value to the matching storage error code.
+status_t	errno_to_status(int error);
+
+// The (device, node) -> path cache, see fs2.cpp.
+status_t	getPath(int fd, const char* name, std::string& path);
+status_t	getPath(dev_t device, ino_t node, const char* name,
+				std::string& path);
+status_t	getFDPath(int fd, std::string& path);
+
+void		insertPath(const struct stat& st, const std::string& path);
+void		removePath(const struct stat& st);
+void		renamePath(const struct stat& st, const std::string& newPath);
+
+// Reads a whole attribute, from the fd when there's no path, see
+// fs_attr.cpp. The type is 0 when it isn't known.
+status_t	read_attribute(int fd, const char* path, const char* name,
+				uint32* _type, std::string& value);
+// Closes an attribute fd, writing it back. False for the other fds.
+bool		close_attribute(int fd, status_t& _status);
+
+
+}
+
+
+#endif
@@ -5,12 +5,78 @@
 
 #include <syscalls.h>
 
+#include <new>
 
-int	
-_kern_open_query(dev_t device, const char* query,
+#include "IndexStore.h"
+#include "KernelDebug.h"
+#include "Query.h"
+#include "VirtualDirectory.h"
+#include "util/AutoLock.h"
+
+
+using namespace BKernelPrivate;
+
+
+// The results of a query, a live query goes away with them.
+class QueryDirectory : public VirtualDirectory {
+public:
+	QueryDirectory(IndexStore* store, Query* query)
+		:
+		fStore(store),
+		fQuery(query)
+	{
+	}
+
+	virtual ~QueryDirectory()
+	{
+		fStore->Lock();
+		fStore->RemoveLiveQuery(fQuery);
+		fStore->Unlock();
+
+		delete fQuery;
+	}
+
+private:
+	IndexStore*	fStore;
+	Query*		fQuery;
+};
+
+
+int
+_kern_open_query(dev_t device, const char* queryString,
 	size_t queryLength, uint32 flags, port_id port,
 	int32 token)
 {
-	UNIMPLEMENTED();
-	return 0;
+	CALLED();
+
+	Query* query;
+	status_t error = Query::Parse(queryString, queryLength, query);
+	if (error != B_OK)
+		return error;
+
+	IndexStore* store;
+	error = IndexStore::Get(device, store);
+	if (error != B_OK) {
+		delete query;
+		return error;
+	}
+
+	QueryDirectory* directory = new(std::nothrow) QueryDirectory(store, query);
+	if (directory == NULL) {
+		delete query;
+		return B_NO_MEMORY;
+	}
+
+	AutoLocker<IndexStore> locker(store);
+	store->Sync();
+
+	error = query->Fetch(store, flags, port, token, directory);
+	if (error != B_OK) {
+		locker.Unlock();
+		delete directory;
+		return error;
+	}
+
+	locker.Unlock();
+	return VirtualDirectory::Register(directory);
 }
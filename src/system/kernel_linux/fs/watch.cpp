@@ -5,12 +5,15 @@
 
 #include <syscalls.h>
 
+#include "KernelDebug.h"
+#include "NodeWatcher.h"
+
 
 status_t
 _kern_stop_notifying(port_id port, uint32 token)
 {
-	UNIMPLEMENTED();
-	return B_ERROR;
+	CALLED();
+	return BKernelPrivate::NodeWatcher::RemoveListener(port, token);
 }
 
 
@@ -18,8 +21,9 @@ status_t
 _kern_start_watching(dev_t device, ino_t node, uint32 flags,
 	port_id port, uint32 token)
 {
-	UNIMPLEMENTED();
-	return B_ERROR;
+	CALLED();
+	return BKernelPrivate::NodeWatcher::AddListener(device, node, flags,
+		port, token);
 }
 
 
@@ -27,6 +31,7 @@ status_t
 _kern_stop_watching(dev_t device, ino_t node, port_id port,
 	uint32 token)
 {
-	UNIMPLEMENTED();
-	return B_OK;
+	CALLED();
+	return BKernelPrivate::NodeWatcher::RemoveListener(device, node, port,
+		token);
 }
@@ -0,0 +1,146 @@
+/*
+ * Copyright 2020, Dario Casalinuovo. All rights reserved.
+ * Distributed under the terms of the LGPL License.
+ */
+#ifndef _KERNEL_FUTEX_H
+#define _KERNEL_FUTEX_H
+
+#include <OS.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+
+// Thin wrappers around the futex syscall, shared by the kernel layer
+// primitives. The words may live in shared memory, so we never use the
+// FUTEX_PRIVATE_FLAG variants.
+//
+// Deadlines are absolute and expressed in the system_time() time base,
+// that is CLOCK_MONOTONIC, B_INFINITE_TIMEOUT means no deadline at all.
+
+
+static inline bigtime_t
+futex_deadline(uint32 flags, bigtime_t timeout)
+{
+	if ((flags & (B_RELATIVE_TIMEOUT | B_ABSOLUTE_TIMEOUT)) == 0
+			|| timeout == B_INFINITE_TIMEOUT)
+		return B_INFINITE_TIMEOUT;
+
+	if (flags & B_ABSOLUTE_TIMEOUT) {
+		// A wall clock deadline is converted once, up front
+		if (flags & B_TIMEOUT_REAL_TIME_BASE)
+			return timeout - real_time_clock_usecs() + system_time();
+		return timeout;
+	}
+
+	if (timeout <= 0)
+		return 0;
+
+	bigtime_t now = system_time();
+	if (timeout > B_INFINITE_TIMEOUT - now)
+		return B_INFINITE_TIMEOUT;
+
+	return now + timeout;
+}
+
+
+// Returns 0 when woken up, otherwise the errno value: EAGAIN if *address
+// didn't contain value, ETIMEDOUT or EINTR.
+static inline int
+futex_wait(int32* address, int32 value, bigtime_t deadline)
+{
+	struct timespec ts;
+	struct timespec* tsp = NULL;
+
+	if (deadline != B_INFINITE_TIMEOUT) {
+		if (deadline < 0)
+			deadline = 0;
+		ts.tv_sec = deadline / 1000000LL;
+		ts.tv_nsec = (deadline % 1000000LL) * 1000L;
+		tsp = &ts;
+	}
+
+	if (syscall(SYS_futex, address, FUTEX_WAIT_BITSET, value, tsp, NULL,
+			FUTEX_BITSET_MATCH_ANY) == 0) {
+		return 0;
+	}
+
+	return errno;
+}
+
+
+#ifdef FUTEX_WAITV_MAX
+
+// Waits until any of the words changes, with the same return values
+// as futex_wait(). Returns ENOSYS on kernels older than 5.16.
+static inline int
+futex_wait_multiple(struct futex_waitv* waiters, int32 count,
+	bigtime_t deadline)
+{
+#ifdef SYS_futex_waitv
+	struct timespec ts;
+	struct timespec* tsp = NULL;
+
+	if (deadline != B_INFINITE_TIMEOUT) {
+		if (deadline < 0)
+			deadline = 0;
+		ts.tv_sec = deadline / 1000000LL;
+		ts.tv_nsec = (deadline % 1000000LL) * 1000L;
+		tsp = &ts;
+	}
+
+	if (syscall(SYS_futex_waitv, waiters, count, 0, tsp,
+			CLOCK_MONOTONIC) >= 0) {
+		return 0;
+	}
+
+	return errno;
+#else
+	return ENOSYS;
+#endif
+}
+
+#endif
+
+
+static inline int
+futex_wake(int32* address, int32 count)
+{
+	return syscall(SYS_futex, address, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+
+// Simple three state lock: 0 unlocked, 1 locked, 2 locked with waiters.
+
+static inline void
+futex_lock(int32* lock)
+{
+	int32 value = 0;
+	if (__atomic_compare_exchange_n(lock, &value, 1, false,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	if (value != 2)
+		value = __atomic_exchange_n(lock, 2, __ATOMIC_ACQUIRE);
+
+	while (value != 0) {
+		futex_wait(lock, 2, B_INFINITE_TIMEOUT);
+		value = __atomic_exchange_n(lock, 2, __ATOMIC_ACQUIRE);
+	}
+}
+
+
+static inline void
+futex_unlock(int32* lock)
+{
+	if (__atomic_exchange_n(lock, 0, __ATOMIC_RELEASE) != 1)
+		futex_wake(lock, 1);
+}
+
+
+#endif
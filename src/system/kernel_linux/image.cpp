@@ -8,100 +8,520 @@
 #include <errno.h>
 #include <image.h>
 #include <dlfcn.h>
-
+#include <link.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <algorithm>
 #include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "KernelDebug.h"
+#include "main.h"
 #include "util/AutoLock.h"
 
 
-extern int gLoadImageFD = -1;
+// The loaded teams inherit one end of a socket through this variable, and
+// wait in their kernel layer initialization until it's written to.
+#define LOAD_IMAGE_GATE_VARIABLE "VOS_LOAD_IMAGE_GATE"
+
+
+extern char** environ;
 
 
 namespace BKernelPrivate {
 
 
-class ImagePool {
+// The teams we loaded that weren't resumed yet, each with its gate.
+class LoadedTeams {
 public:
-	static image_id	Load(const char* path) {
-		if (path == NULL)
-			return B_BAD_VALUE;
+	static void		Add(team_id team, int gate);
+	static int		Remove(team_id team);
 
-		AutoLocker<BLocker> _(&fLock);
+private:
+	static void		_ReinitAtFork();
 
-		void* image = dlopen(path, RTLD_LAZY);
+	static std::unordered_map<team_id, int> fGates;
+	static pthread_once_t fInitOnce;
+	static BLocker	fLock;
+};
 
-		if (image == NULL)
-			return B_ERROR;
 
-		fLoadedAddOns.insert(std::make_pair(++fId, image));
+std::unordered_map<team_id, int> LoadedTeams::fGates;
+pthread_once_t LoadedTeams::fInitOnce = PTHREAD_ONCE_INIT;
+BLocker LoadedTeams::fLock("loaded teams");
+
 
-		return fId;
+void
+LoadedTeams::Add(team_id team, int gate)
+{
+	pthread_once(&fInitOnce, []() {
+		pthread_atfork(NULL, NULL, &LoadedTeams::_ReinitAtFork);
+	});
+
+	AutoLocker<BLocker> _(&fLock);
+	fGates[team] = gate;
+}
+
+
+//! Returns the gate of the team, to be closed, or -1 if it isn't ours.
+int
+LoadedTeams::Remove(team_id team)
+{
+	AutoLocker<BLocker> _(&fLock);
+
+	auto gate = fGates.find(team);
+	if (gate == fGates.end())
+		return -1;
+
+	int fd = gate->second;
+	fGates.erase(gate);
+	return fd;
+}
+
+
+void
+LoadedTeams::_ReinitAtFork()
+{
+	// The teams belong to our father
+	for (auto& gate : fGates)
+		close(gate.second);
+	fGates.clear();
+}
+
+
+struct Image {
+	image_info						info;
+	addr_t							base;
+	void*							handle;
+		// for dlsym(), from load_add_on() or opened on demand
+	int32							addOnRefCount;
+	std::unordered_map<std::string, void*> symbols;
+};
+
+
+// Every object mapped in the team gets an image, kept in sync with the
+// dynamic loader, which counts the objects it adds and removes so that we
+// don't need to rescan them when nothing changed. Add-ons are shared and
+// refcounted, loading one twice returns the same image. The symbols are
+// cached per image.
+class ImageRegistry {
+public:
+	static	image_id		LoadAddOn(const char* path);
+	static	status_t		UnloadAddOn(image_id id);
+	static	status_t		FindSymbol(image_id id, const char* name,
+								int32 symbolClass, void** _symbol);
+	static	status_t		GetImageInfo(image_id id, image_info* info);
+	static	status_t		GetNextImageInfo(int32* cookie, image_info* info);
+
+private:
+	struct Object {
+		addr_t				base;
+		std::string			name;
+		addr_t				text;
+		addr_t				textEnd;
+		addr_t				data;
+		addr_t				dataEnd;
+	};
+
+	struct CollectContext {
+		std::vector<Object>* objects;
+		unsigned long long	adds;
+		unsigned long long	subs;
+		bool				changed;
+	};
+
+	static	void			_Sync();
+	static	int				_CollectObject(struct dl_phdr_info* info,
+								size_t size, void* data);
+	static	Image*			_AddImage(const Object& object, bool first);
+	static	void			_RemoveImage(Image* image);
+	static	Image*			_Find(image_id id);
+
+	static	std::map<image_id, Image*> fImages;
+	static	std::unordered_map<addr_t, Image*> fBases;
+	static	unsigned long long fAdds;
+	static	unsigned long long fSubs;
+	static	image_id		fNextID;
+	static	BLocker			fLock;
+};
+
+
+std::map<image_id, Image*> ImageRegistry::fImages;
+std::unordered_map<addr_t, Image*> ImageRegistry::fBases;
+unsigned long long ImageRegistry::fAdds;
+unsigned long long ImageRegistry::fSubs;
+image_id ImageRegistry::fNextID = 1;
+BLocker ImageRegistry::fLock("image registry");
+
+
+int
+ImageRegistry::_CollectObject(struct dl_phdr_info* info, size_t size,
+	void* data)
+{
+	CollectContext* context = (CollectContext*)data;
+
+	if (context->objects->empty()) {
+		context->adds = info->dlpi_adds;
+		context->subs = info->dlpi_subs;
+		if (info->dlpi_adds == fAdds && info->dlpi_subs == fSubs) {
+			context->changed = false;
+			return 1;
+		}
 	}
 
-	static status_t Unload(image_id id) {
-		if (id <= 0)
-			return B_BAD_VALUE;
+	Object object;
+	object.base = info->dlpi_addr;
+	object.name = info->dlpi_name != NULL ? info->dlpi_name : "";
+	object.text = object.data = ~(addr_t)0;
+	object.textEnd = object.dataEnd = 0;
+
+	for (int32 i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr)& header = info->dlpi_phdr[i];
+		if (header.p_type != PT_LOAD)
+			continue;
+
+		addr_t start = info->dlpi_addr + header.p_vaddr;
+		addr_t end = start + header.p_memsz;
+		if ((header.p_flags & PF_EXECUTE) != 0) {
+			object.text = std::min(object.text, start);
+			object.textEnd = std::max(object.textEnd, end);
+		} else if ((header.p_flags & PF_WRITE) != 0) {
+			object.data = std::min(object.data, start);
+			object.dataEnd = std::max(object.dataEnd, end);
+		}
+	}
 
-		AutoLocker<BLocker> _(&fLock);
+	context->objects->push_back(object);
+	return 0;
+}
 
-		void* image = _Find(id);
-		if (image == NULL)
-			return B_ERROR;
 
-		if (dlclose(image) != 0)
-			return B_ERROR;
+//! Rescans the objects of the team if the loader changed them.
+void
+ImageRegistry::_Sync()
+{
+	std::vector<Object> objects;
+	CollectContext context = { &objects, 0, 0, true };
+	dl_iterate_phdr(&_CollectObject, &context);
+	if (!context.changed)
+		return;
+
+	fAdds = context.adds;
+	fSubs = context.subs;
+
+	std::unordered_map<addr_t, Image*> previous;
+	previous.swap(fBases);
+
+	for (size_t i = 0; i < objects.size(); i++) {
+		auto found = previous.find(objects[i].base);
+		if (found != previous.end()) {
+			fBases[objects[i].base] = found->second;
+			previous.erase(found);
+		} else
+			_AddImage(objects[i], i == 0);
+	}
 
-		return B_OK;
+	// What's left was unloaded
+	for (auto& gone : previous)
+		_RemoveImage(gone.second);
+}
+
+
+Image*
+ImageRegistry::_AddImage(const Object& object, bool first)
+{
+	Image* image = new(std::nothrow) Image;
+	if (image == NULL)
+		return NULL;
+
+	image_info& info = image->info;
+	memset(&info, 0, sizeof(image_info));
+
+	// All images take their id from the same counter, the team id could
+	// be anything in a PID namespace and clash with a library
+	info.id = fNextID++;
+
+	// The first object is the program
+	if (first) {
+		info.type = B_APP_IMAGE;
+		ssize_t length = readlink("/proc/self/exe", info.name,
+			sizeof(info.name) - 1);
+		info.name[std::max(length, (ssize_t)0)] = '\0';
+	} else {
+		info.type = object.name.empty()
+				|| object.name.compare(0, 5, "linux") == 0
+			? B_SYSTEM_IMAGE : B_LIBRARY_IMAGE;
+		strlcpy(info.name, object.name.c_str(), sizeof(info.name));
+	}
+
+	info.sequence = info.id;
+	info.init_order = info.id;
+
+	struct stat st;
+	if (info.name[0] != '\0' && stat(info.name, &st) == 0) {
+		info.device = st.st_dev;
+		info.node = st.st_ino;
+	} else {
+		info.device = -1;
+		info.node = -1;
 	}
 
-	static status_t FindSymbol(image_id id, const char* name,
-		int32 sclass, void** pptr) {
+	if (object.textEnd != 0) {
+		info.text = (void*)object.text;
+		info.text_size = object.textEnd - object.text;
+	}
+	if (object.dataEnd != 0) {
+		info.data = (void*)object.data;
+		info.data_size = object.dataEnd - object.data;
+	}
 
-		if (id <= 0 || name == NULL || sclass <= 0 || pptr == NULL)
-			return B_BAD_VALUE;
+	image->base = object.base;
+	image->handle = NULL;
+	image->addOnRefCount = 0;
 
-		AutoLocker<BLocker> _(&fLock);
+	fImages[info.id] = image;
+	fBases[object.base] = image;
+	return image;
+}
 
-		void* image = _Find(id);
-		if (image == NULL)
-			return B_ERROR;
 
-		void* symbol = dlsym(image, name);
-		if (symbol == NULL)
-			return B_ERROR;
+void
+ImageRegistry::_RemoveImage(Image* image)
+{
+	fImages.erase(image->info.id);
+	delete image;
+}
 
-		*pptr = symbol;
 
+Image*
+ImageRegistry::_Find(image_id id)
+{
+	auto image = fImages.find(id);
+	if (image == fImages.end())
+		return NULL;
+
+	return image->second;
+}
+
+
+image_id
+ImageRegistry::LoadAddOn(const char* path)
+{
+	if (path == NULL)
+		return B_BAD_VALUE;
+
+	AutoLocker<BLocker> _(&fLock);
+
+	// An add-on that's already loaded is only referenced again
+	struct stat st;
+	if (stat(path, &st) != 0)
+		return B_ENTRY_NOT_FOUND;
+
+	_Sync();
+	for (auto& entry : fImages) {
+		Image* image = entry.second;
+		if (image->info.device == st.st_dev && image->info.node == st.st_ino
+			&& image->handle != NULL && image->addOnRefCount > 0) {
+			image->addOnRefCount++;
+			return image->info.id;
+		}
+	}
+
+	void* handle = dlopen(path, RTLD_LAZY);
+	if (handle == NULL) {
+		TRACE("load_add_on: %s\n", dlerror());
+		return B_MISSING_LIBRARY;
+	}
+
+	struct link_map* map;
+	if (dlinfo(handle, RTLD_DI_LINKMAP, &map) != 0) {
+		dlclose(handle);
+		return B_ERROR;
+	}
+
+	_Sync();
+	auto found = fBases.find(map->l_addr);
+	if (found == fBases.end()) {
+		dlclose(handle);
+		return B_ERROR;
+	}
+
+	Image* image = found->second;
+	if (image->addOnRefCount == 0 && image->handle == NULL
+		&& image->info.type == B_LIBRARY_IMAGE) {
+		// We just loaded it, otherwise it's a library the team uses already
+		image->info.type = B_ADD_ON_IMAGE;
+	}
+
+	if (image->handle != NULL)
+		dlclose(handle);
+	else
+		image->handle = handle;
+
+	image->addOnRefCount++;
+	return image->info.id;
+}
+
+
+status_t
+ImageRegistry::UnloadAddOn(image_id id)
+{
+	if (id <= 0)
+		return B_BAD_VALUE;
+
+	AutoLocker<BLocker> _(&fLock);
+
+	Image* image = _Find(id);
+	if (image == NULL || image->addOnRefCount == 0)
+		return B_BAD_IMAGE_ID;
+
+	if (--image->addOnRefCount > 0)
+		return B_OK;
+
+	void* handle = image->handle;
+	image->handle = NULL;
+	image->symbols.clear();
+
+	if (dlclose(handle) != 0)
+		return B_ERROR;
+
+	// The loader tells us whether it's gone
+	_Sync();
+	return B_OK;
+}
+
+
+status_t
+ImageRegistry::FindSymbol(image_id id, const char* name, int32 symbolClass,
+	void** _symbol)
+{
+	if (id <= 0 || name == NULL || symbolClass <= 0 || _symbol == NULL)
+		return B_BAD_VALUE;
+
+	AutoLocker<BLocker> _(&fLock);
+
+	Image* image = _Find(id);
+	if (image == NULL) {
+		_Sync();
+		image = _Find(id);
+		if (image == NULL)
+			return B_BAD_IMAGE_ID;
+	}
+
+	auto cached = image->symbols.find(name);
+	if (cached != image->symbols.end()) {
+		if (cached->second == NULL)
+			return B_ENTRY_NOT_FOUND;
+
+		*_symbol = cached->second;
 		return B_OK;
 	}
 
-private:
-	static void* _Find(image_id id) {
-		auto addon = fLoadedAddOns.find(id);
+	if (image->handle == NULL) {
+		// It's mapped already, this only gets us a handle
+		image->handle = dlopen(image->info.type == B_APP_IMAGE
+			? NULL : image->info.name, RTLD_LAZY | RTLD_NOLOAD);
+		if (image->handle == NULL)
+			return B_ERROR;
+	}
+
+	void* symbol = dlsym(image->handle, name);
+	image->symbols[name] = symbol;
+	if (symbol == NULL)
+		return B_ENTRY_NOT_FOUND;
+
+	*_symbol = symbol;
+	return B_OK;
+}
+
+
+status_t
+ImageRegistry::GetImageInfo(image_id id, image_info* info)
+{
+	AutoLocker<BLocker> _(&fLock);
+
+	_Sync();
+	Image* image = _Find(id);
+	if (image == NULL)
+		return B_BAD_IMAGE_ID;
+
+	*info = image->info;
+	return B_OK;
+}
+
+
+//! The cookie is the id of the next image, they're iterated in load order.
+status_t
+ImageRegistry::GetNextImageInfo(int32* cookie, image_info* info)
+{
+	AutoLocker<BLocker> _(&fLock);
 
-		if (addon == end(fLoadedAddOns)) {
-			fLock.Unlock();
-			return NULL;
+	if (*cookie == 0) {
+		_Sync();
+
+		// The program comes first, whatever its id
+		for (auto& entry : fImages) {
+			if (entry.second->info.type == B_APP_IMAGE) {
+				*info = entry.second->info;
+				*cookie = 1;
+				return B_OK;
+			}
 		}
+		*cookie = 1;
+	}
+
+	for (auto image = fImages.lower_bound(*cookie); image != fImages.end();
+			image++) {
+		if (image->second->info.type == B_APP_IMAGE)
+			continue;
 
-		return addon->second;
+		*info = image->second->info;
+		*cookie = image->first + 1;
+		return B_OK;
 	}
 
-	static std::map<image_id, void*> fLoadedAddOns;
-	static image_id fId;
-	static BLocker fLock;
-};
+	return B_BAD_VALUE;
+}
 
 
-std::map<image_id, void*> ImagePool::fLoadedAddOns;
-image_id ImagePool::fId;
-BLocker ImagePool::fLock;
+static status_t
+spawn_error(int error)
+{
+	switch (error) {
+		case ENOENT:
+			return B_ENTRY_NOT_FOUND;
+		case EACCES:
+		case ENOEXEC:
+			return B_NOT_AN_EXECUTABLE;
+		case ENOMEM:
+			return B_NO_MEMORY;
+		case EAGAIN:
+			return B_NO_MORE_TEAMS;
+		default:
+			return B_ERROR;
+	}
+}
 
 
 }
 
 
+using BKernelPrivate::ImageRegistry;
+using BKernelPrivate::LoadedTeams;
+
+
+/*!	Starts the team without copying our address space, posix_spawn() uses
+	a vfork like clone. The team waits to be resumed before running any of
+	its code, as long as it uses the kernel layer.
+*/
 thread_id
 load_image(int32 argc, const char** argv, const char** envp)
 {
@@ -112,48 +532,135 @@ load_image(int32 argc, const char** argv, const char** envp)
 		TRACE("%s\n", argv[i]);
 #endif
 
-	int lockfd[2];
-	if (pipe(lockfd) == -1)
-		return -1;
-
-	pid_t pid = fork();
-	if (pid == 0) {
-		close(lockfd[1]);
+	if (argc <= 0 || argv == NULL || argv[0] == NULL)
+		return B_BAD_VALUE;
 
-		// Wait for the father to unlock us
-		uint32 value;
-		read(lockfd[0], &value, sizeof(value));
+	int gate[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, gate) != 0)
+		return B_NO_MORE_FDS;
 
-		int32 ret = execvpe(argv[0], const_cast<char* const*>(argv),
-			const_cast<char* const*>(envp));
-		if (ret == -1) {
-			TRACE("execv err %s\n", strerror(errno));
-			_exit(1);
+	// The team gets our arguments and environment, plus its gate
+	std::vector<char*> arguments;
+	for (int32 i = 0; i < argc; i++)
+		arguments.push_back(const_cast<char*>(argv[i]));
+	arguments.push_back(NULL);
+
+	char gateVariable[64];
+	snprintf(gateVariable, sizeof(gateVariable), "%s=%d",
+		LOAD_IMAGE_GATE_VARIABLE, gate[1]);
+
+	std::vector<char*> environment;
+	for (const char** variable = envp != NULL ? envp : (const char**)environ;
+			*variable != NULL; variable++) {
+		if (strncmp(*variable, LOAD_IMAGE_GATE_VARIABLE "=",
+				sizeof(LOAD_IMAGE_GATE_VARIABLE)) != 0) {
+			environment.push_back(const_cast<char*>(*variable));
 		}
 	}
-	close(lockfd[0]);
+	environment.push_back(gateVariable);
+	environment.push_back(NULL);
+
+	posix_spawn_file_actions_t fileActions;
+	posix_spawn_file_actions_init(&fileActions);
+	// Dup'ing the descriptor onto itself clears its close-on-exec flag
+	posix_spawn_file_actions_adddup2(&fileActions, gate[1], gate[1]);
+
+	// A new team starts with the default signal handling
+	posix_spawnattr_t attributes;
+	posix_spawnattr_init(&attributes);
+	sigset_t signals;
+	sigemptyset(&signals);
+	posix_spawnattr_setsigmask(&attributes, &signals);
+	sigfillset(&signals);
+	posix_spawnattr_setsigdefault(&attributes, &signals);
+	posix_spawnattr_setflags(&attributes,
+		POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+	pid_t team;
+	int error = posix_spawnp(&team, argv[0], &fileActions, &attributes,
+		arguments.data(), environment.data());
+
+	posix_spawnattr_destroy(&attributes);
+	posix_spawn_file_actions_destroy(&fileActions);
+	close(gate[1]);
+
+	if (error != 0) {
+		TRACE("posix_spawn error %s\n", strerror(error));
+		close(gate[0]);
+		return BKernelPrivate::spawn_error(error);
+	}
+
+	LoadedTeams::Add(team, gate[0]);
+	return team;
+}
+
+
+//! Lets a team started by load_image() run, if it's one of ours.
+status_t
+resume_loaded_team(team_id team)
+{
+	int gate = LoadedTeams::Remove(team);
+	if (gate < 0)
+		return B_BAD_THREAD_ID;
+
+	uint32 value = 1;
+	ssize_t written = send(gate, &value, sizeof(value), MSG_NOSIGNAL);
+	close(gate);
+
+	return written == sizeof(value) ? B_OK : B_BAD_THREAD_ID;
+}
+
+
+//! Kills a team started by load_image() that wasn't resumed yet.
+status_t
+kill_loaded_team(team_id team)
+{
+	int gate = LoadedTeams::Remove(team);
+	if (gate < 0)
+		return B_BAD_THREAD_ID;
+
+	// Closing the gate is enough, but it could take a while to get there
+	kill(team, SIGKILL);
+	close(gate);
+	return B_OK;
+}
 
-	if (pid == -1) {
-		close(lockfd[1]);
-		TRACE("fork error\n");
-	} else
-		gLoadImageFD = lockfd[1];
 
-	return pid;
+//! Called early by a team started by load_image(), until it's resumed.
+void
+wait_for_resume()
+{
+	const char* variable = getenv(LOAD_IMAGE_GATE_VARIABLE);
+	if (variable == NULL)
+		return;
+
+	int gate = atoi(variable);
+	unsetenv(LOAD_IMAGE_GATE_VARIABLE);
+
+	uint32 value;
+	ssize_t bytesRead;
+	do {
+		bytesRead = read(gate, &value, sizeof(value));
+	} while (bytesRead < 0 && errno == EINTR);
+	close(gate);
+
+	// The team that loaded us is gone without resuming us
+	if (bytesRead != sizeof(value))
+		_exit(1);
 }
 
 
 image_id
 load_add_on(const char* path)
 {
-	return BKernelPrivate::ImagePool::Load(path);
+	return ImageRegistry::LoadAddOn(path);
 }
 
 
 status_t
 unload_add_on(image_id id)
 {
-	return BKernelPrivate::ImagePool::Unload(id);
+	return ImageRegistry::UnloadAddOn(id);
 }
 
 
@@ -161,7 +668,7 @@ status_t
 get_image_symbol(image_id id, const char* name,
 	int32 sclass, void** pptr)
 {
-	return BKernelPrivate::ImagePool::FindSymbol(id, name, sclass, pptr);
+	return ImageRegistry::FindSymbol(id, name, sclass, pptr);
 }
 
 
@@ -171,13 +678,7 @@ _get_image_info(image_id id, image_info* info, size_t infoSize)
 	if (id < 0 || info == NULL || infoSize != sizeof(*info))
 		return B_BAD_VALUE;
 
-	if (id == getpid()) {
-		int32 cookie = 0;
-		return _get_next_image_info(getpid(), 
-			&cookie, info, sizeof(*info));
-	}
-
-	return B_ERROR;
+	return ImageRegistry::GetImageInfo(id, info);
 }
 
 
@@ -190,8 +691,8 @@ _get_next_image_info(team_id team, int32* cookie,
 		return B_BAD_VALUE;
 	}
 
-	if (team == 0)
-		team = getpid();
+	if (team == 0 || team == getpid())
+		return ImageRegistry::GetNextImageInfo(cookie, info);
 
 	if (*cookie == 0) {
 		char path[B_PATH_NAME_LENGTH];
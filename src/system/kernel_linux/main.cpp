@@ -26,6 +26,9 @@ init_kernel_layer(int argc, char** argv)
 {
 	TRACE("init_kernel_layer()\n");
 
+	// We might have been started by load_image()
+	wait_for_resume();
+
 	// Init global stuff
 	__gCPUCount = sysconf(_SC_NPROCESSORS_ONLN);
 	__libc_argc = argc;
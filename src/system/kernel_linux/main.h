@@ -5,6 +5,8 @@
 #ifndef KERNEL_MAIN_H
 #define KERNEL_MAIN_H
 
+#include <OS.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -16,6 +18,33 @@ void init_thread();
 void teardown_ports();
 void teardown_threads();
 
+status_t acquire_sem_measured(sem_id id, uint32 flags, bigtime_t timeout,
+	bigtime_t* _blockedTime);
+
+// load_image() support
+status_t resume_loaded_team(team_id team);
+status_t kill_loaded_team(team_id team);
+void wait_for_resume();
+
+// wait_for_objects() support
+status_t select_sem(sem_id id, int32* _count, int32** _wakeSeq, int32* _seq);
+void deselect_sem(sem_id id);
+status_t get_port_sems(port_id id, sem_id* _readSem, sem_id* _writeSem);
+status_t select_thread(thread_id thread, void** _cookie, int32** _exitWord);
+void deselect_thread(void* cookie);
+
+// /proc/<id>/stat of a team or a thread
+typedef struct {
+	char		name[16];
+	char		state;
+	bigtime_t	user_time;
+	bigtime_t	kernel_time;
+	bigtime_t	children_user_time;
+	bigtime_t	children_kernel_time;
+} proc_stat;
+
+status_t read_proc_stat(pid_t id, proc_stat* stat);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,25 +1,216 @@
 /*
- * Copyright 2018-2019, Dario Casalinuovo. All rights reserved.
+ * Copyright 2018-2020, Dario Casalinuovo. All rights reserved.
  * Distributed under the terms of the LGPL License.
  */
 
 #include <syscalls.h>
+#include <user_mutex_defs.h>
+
+#include "futex.h"
+
+
+// This follows the Haiku kernel user mutex semantics, which the libroot
+// locks rely on: B_USER_MUTEX_WAITING is set as long as there are threads
+// blocked here, and unlocking hands the lock over to the first waiter
+// instead of letting the woken up threads race for it.
+//
+// Waiters are queued in a small hash table keyed by the mutex address,
+// and each one sleeps on a futex word of its own which is set on hand off.
+// Mutexes are team local, so the table doesn't need to be shared.
+
+
+#define MUTEX_BUCKET_COUNT 64
+
+
+struct mutex_waiter {
+	int32*			mutex;
+	int32			locked;
+	mutex_waiter*	next;
+};
+
+
+static int32 sUserMutexTableLock = 0;
+static mutex_waiter* sUserMutexTable[MUTEX_BUCKET_COUNT];
+
+
+static inline mutex_waiter**
+mutex_bucket(int32* mutex)
+{
+	addr_t address = (addr_t)mutex;
+	return &sUserMutexTable[((address >> 2) ^ (address >> 12))
+		& (MUTEX_BUCKET_COUNT - 1)];
+}
+
+
+static mutex_waiter*
+dequeue_waiter(int32* mutex)
+{
+	for (mutex_waiter** link = mutex_bucket(mutex); *link != NULL;
+			link = &(*link)->next) {
+		mutex_waiter* waiter = *link;
+		if (waiter->mutex == mutex) {
+			*link = waiter->next;
+			return waiter;
+		}
+	}
+
+	return NULL;
+}
+
+
+static bool
+has_waiters(int32* mutex)
+{
+	for (mutex_waiter* waiter = *mutex_bucket(mutex); waiter != NULL;
+			waiter = waiter->next) {
+		if (waiter->mutex == mutex)
+			return true;
+	}
+
+	return false;
+}
+
+
+static void
+unblock_waiter(mutex_waiter* waiter)
+{
+	// The waiter can't go away before we release the table lock
+	__atomic_store_n(&waiter->locked, 1, __ATOMIC_RELEASE);
+	futex_wake(&waiter->locked, 1);
+}
+
+
+/*!	The table lock must be held, it's temporarily released while waiting.
+*/
+static status_t
+user_mutex_wait_locked(int32* mutex, uint32 flags, bigtime_t deadline)
+{
+	mutex_waiter waiter;
+	waiter.mutex = mutex;
+	waiter.locked = 0;
+	waiter.next = NULL;
+
+	// append, so that the waiters are served in FIFO order
+	mutex_waiter** link = mutex_bucket(mutex);
+	while (*link != NULL)
+		link = &(*link)->next;
+	*link = &waiter;
+
+	futex_unlock(&sUserMutexTableLock);
+
+	status_t error = B_OK;
+	while (__atomic_load_n(&waiter.locked, __ATOMIC_ACQUIRE) == 0) {
+		int result = futex_wait(&waiter.locked, 0, deadline);
+		if (result == ETIMEDOUT) {
+			error = deadline == 0 ? B_WOULD_BLOCK : B_TIMED_OUT;
+			break;
+		}
+		if (result == EINTR && (flags & B_CAN_INTERRUPT) != 0) {
+			error = B_INTERRUPTED;
+			break;
+		}
+	}
+
+	futex_lock(&sUserMutexTableLock);
+
+	// we might have been handed the lock in the meantime
+	if (waiter.locked != 0)
+		return B_OK;
+
+	for (link = mutex_bucket(mutex); *link != &waiter; link = &(*link)->next)
+		;
+	*link = waiter.next;
+
+	if (!has_waiters(mutex))
+		__atomic_fetch_and(mutex, ~(int32)B_USER_MUTEX_WAITING,
+			__ATOMIC_RELAXED);
+
+	return error;
+}
+
+
+static status_t
+user_mutex_lock_locked(int32* mutex, uint32 flags, bigtime_t deadline)
+{
+	// mark the mutex locked + waiting
+	int32 oldValue = __atomic_fetch_or(mutex,
+		B_USER_MUTEX_LOCKED | B_USER_MUTEX_WAITING, __ATOMIC_ACQUIRE);
+
+	if ((oldValue & (B_USER_MUTEX_LOCKED | B_USER_MUTEX_WAITING)) == 0
+			|| (oldValue & B_USER_MUTEX_DISABLED) != 0) {
+		// clear the waiting flag and be done
+		__atomic_fetch_and(mutex, ~(int32)B_USER_MUTEX_WAITING,
+			__ATOMIC_RELAXED);
+		return B_OK;
+	}
+
+	// we have to wait
+	return user_mutex_wait_locked(mutex, flags, deadline);
+}
+
+
+static void
+user_mutex_unlock_locked(int32* mutex, uint32 flags)
+{
+	mutex_waiter* waiter = dequeue_waiter(mutex);
+	if (waiter == NULL) {
+		// no one is waiting -- clear locked flag
+		__atomic_fetch_and(mutex, ~(int32)B_USER_MUTEX_LOCKED,
+			__ATOMIC_RELEASE);
+		return;
+	}
+
+	// Someone is waiting -- set the locked flag. It might still be set,
+	// but when using userland atomic operations, the caller will usually
+	// have cleared it already.
+	int32 oldValue = __atomic_fetch_or(mutex, B_USER_MUTEX_LOCKED,
+		__ATOMIC_ACQ_REL);
+
+	// unblock the first thread
+	unblock_waiter(waiter);
+
+	if ((flags & B_USER_MUTEX_UNBLOCK_ALL) != 0
+			|| (oldValue & B_USER_MUTEX_DISABLED) != 0) {
+		// unblock all the other waiting threads as well
+		while ((waiter = dequeue_waiter(mutex)) != NULL)
+			unblock_waiter(waiter);
+	}
+
+	// mark the mutex uncontended, if there are no more waiters
+	if (!has_waiters(mutex))
+		__atomic_fetch_and(mutex, ~(int32)B_USER_MUTEX_WAITING,
+			__ATOMIC_RELAXED);
+}
 
 
 status_t
 _kern_mutex_lock(int32* mutex, const char* name,
 	uint32 flags, bigtime_t timeout)
 {
-	UNIMPLEMENTED();
-	return B_ERROR;
+	if (mutex == NULL)
+		return B_BAD_ADDRESS;
+
+	bigtime_t deadline = futex_deadline(flags, timeout);
+
+	futex_lock(&sUserMutexTableLock);
+	status_t error = user_mutex_lock_locked(mutex, flags, deadline);
+	futex_unlock(&sUserMutexTableLock);
+
+	return error;
 }
 
 
 status_t
 _kern_mutex_unlock(int32* mutex, uint32 flags)
 {
-	UNIMPLEMENTED();
-	return B_ERROR;
+	if (mutex == NULL)
+		return B_BAD_ADDRESS;
+
+	futex_lock(&sUserMutexTableLock);
+	user_mutex_unlock_locked(mutex, flags);
+	futex_unlock(&sUserMutexTableLock);
+
+	return B_OK;
 }
 
 
@@ -27,6 +218,17 @@ status_t
 _kern_mutex_switch_lock(int32* fromMutex, int32* toMutex,
 	const char* name, uint32 flags, bigtime_t timeout)
 {
-	UNIMPLEMENTED();
-	return B_ERROR;
+	if (fromMutex == NULL || toMutex == NULL)
+		return B_BAD_ADDRESS;
+
+	bigtime_t deadline = futex_deadline(flags, timeout);
+
+	// unlock the first mutex and lock the second one, without
+	// anyone being able to get in between
+	futex_lock(&sUserMutexTableLock);
+	user_mutex_unlock_locked(fromMutex, flags);
+	status_t error = user_mutex_lock_locked(toMutex, flags, deadline);
+	futex_unlock(&sUserMutexTableLock);
+
+	return error;
 }
@@ -14,7 +14,9 @@
 
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/shm.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
 #include <ctype.h>
@@ -22,7 +24,11 @@
 #include <string.h>
 #include <stdlib.h>
 
+#include <object_stats.h>
+#include <port_defs.h>
+
 #include "KernelDebug.h"
+#include "futex.h"
 #include "main.h"
 
 #define dprintf printf
@@ -43,61 +49,131 @@
 #define MAX_QUEUE_LENGTH 4096
 #define PORT_MAX_MESSAGE_SIZE (256 * 1024)
 
+// Queues start small and grow on demand, up to the worst case of
+// capacity * PORT_MAX_MESSAGE_SIZE.
+#define PORT_INITIAL_QUEUE_SIZE B_PAGE_SIZE
 
-typedef struct port_msg {
-	int32		code;
-	char		buffer_chain[PORT_MAX_MESSAGE_SIZE];
-	size_t		size;
-} port_msg;
+
+// Messages are stored as variable length records in a byte ring buffer,
+// laid out like the records _kern_read_port_batch() returns: the header
+// is followed by size bytes of data, see PORT_MESSAGE_RECORD_SIZE().
+typedef struct port_message_record port_msg;
 
 struct port_entry {
 	port_id 	id;
 	team_id 	owner;
 	int32 		capacity;
-	sem_id		lock;
+	int32		lock;			// futex, guards the entry
+	int32		serial;
+	int32		next_free;
 	char		name[B_OS_NAME_LENGTH];
 	sem_id		read_sem;
 	sem_id		write_sem;
 	int32		total_count;
-	int			queue_shm;
-	int32		head;
-	int32		tail;
+	int32		queue_serial;	// bumped every time the queue is replaced
+	size_t		queue_size;
+	size_t		queue_head;
+	size_t		queue_tail;
+	size_t		queue_used;
+
+	// statistics, see port_stats
+	int32		queue_count;
+	int32		queue_high_water;
+	uint64		messages_written;
+	uint64		bytes_written;
+	uint64		messages_read;
+	uint64		bytes_read;
+	bigtime_t	read_blocked_time;
+	bigtime_t	write_blocked_time;
+};
+
+// Queues are POSIX shared memory objects named after the port and the
+// queue serial. Every process maps each queue only once, the mapping is
+// cached by slot and refreshed when the port or its queue changes.
+// The mapped slots are also kept in a list, so that the mappings of
+// ports deleted by other teams can be found without looking at all slots.
+struct port_queue_mapping {
+	port_id		port;
+	int32		serial;
+	uint8*		address;
+	size_t		size;
+	int32		list_index;
 };
 
+// The shared memory segment holds this header, followed by the
+// port entries and by the name hash. The index lock only protects
+// the name hash and the free slot list, entries have their own lock.
+struct port_table {
+	int32		magic;
+	int32		index_lock;
+	int32		max_ports;
+	int32		free_head;
+	int32		free_tail;
+	int32		used_slots;		// slots above this were never used
+	int32		hash_size;
+	int32		hash_deleted;
+	int32		deleted_ports;	// bumped by every delete_port()
+};
+
+#define PORT_TABLE_MAGIC 'pOrT'
+
+#define PORT_NO_SLOT -1
+#define PORT_HASH_EMPTY -1
+#define PORT_HASH_DELETED -2
+
+#define MIN_MAX_PORTS 64
+
 // hidden API
 static int dump_port_list(void);
 static void _dump_port_info(struct port_entry *port);
 
-// gMaxPorts must be power of 2
+// gMaxPorts must be power of 2, it can be raised through the
+// VOS_MAX_PORTS environment variable of the team creating the table
 int32 gMaxPorts = 4096;
 
-/* This implementation is a major memory hog, so let's not
-** make things worse than they already are! A 64k message? */
-/* #define PORT_MAX_MESSAGE_SIZE 65536 */
-
-static int sPortArea = -1;
-static void *sPortMemory = NULL;
-static sem_id sPortSem = -1;
-
+static struct port_table *sPortTable = NULL;
 static struct port_entry *sPorts = NULL;
-static port_id* sNextPort = NULL;
+static int32 *sPortHash = NULL;
+
+static struct port_queue_mapping* sQueueMappings = NULL;
+static int32* sMappedSlots = NULL;
+static int32 sMappedCount = 0;
+static int32 sMappedLock = 0;		// guards sMappedSlots and sMappedCount
+static int32 sSeenDeletedPorts = 0;
 
 static bool sPortsActive = false;
 
-#define GRAB_PORT_LIST_LOCK() do {} while(acquire_sem(sPortSem) == B_INTERRUPTED)
-#define RELEASE_PORT_LIST_LOCK() release_sem(sPortSem);
-#define GRAB_PORT_LOCK(s) if ((s).lock != -1) do {} while(acquire_sem((s).lock) == B_INTERRUPTED)
-#define RELEASE_PORT_LOCK(s) if ((s).lock != -1) release_sem((s).lock)
+#define GRAB_PORT_INDEX_LOCK() futex_lock(&sPortTable->index_lock)
+#define RELEASE_PORT_INDEX_LOCK() futex_unlock(&sPortTable->index_lock)
+#define GRAB_PORT_LOCK(s) futex_lock(&(s).lock)
+#define RELEASE_PORT_LOCK(s) futex_unlock(&(s).lock)
 
 static int delete_owned_ports(team_id owner);
 
 
+static int32
+max_ports_setting()
+{
+	const char* setting = getenv("VOS_MAX_PORTS");
+	int32 maxPorts = setting != NULL ? atoi(setting) : 0;
+	int32 ports = MIN_MAX_PORTS;
+
+	if (maxPorts <= 0)
+		return gMaxPorts;
+
+	while (ports < maxPorts && ports < (1 << 20))
+		ports <<= 1;
+
+	return ports;
+}
+
+
 status_t
 port_init()
 {
-	int size = sizeof(sem_id) + sizeof(port_id) + (sizeof(struct port_entry) * gMaxPorts);
 	key_t table_key;
-	bool created = true;
+	bool created = false;
+	int shmid;
 
 	if (sPorts)
 		return B_OK;
@@ -105,44 +181,89 @@ port_init()
 	/* grab a (hopefully) unique key for our table */
 	table_key = ftok("/usr/local/bin/", (int)'P');
 	TRACE(("Using key %x for the port table\n", (int)table_key));
-	TRACE(("The size of the port table is %ld bytes\n", (long)size));
-
-	// create and initialize ports table in shared memory
-	sPortArea = shmget(table_key, size, IPC_CREAT | IPC_EXCL | 0700);
-	if (sPortArea == -1 && errno == EEXIST) {
-		/* get existing semaphore table in shared memory */
-		sPortArea = shmget(table_key, size, IPC_CREAT | 0700);
-		TRACE(("Using pre-existing master ports table\n"));
-		created = false;
+
+	// attach to the ports table in shared memory, or create it
+	shmid = shmget(table_key, 0, 0700);
+	if (shmid == -1 && errno == ENOENT) {
+		int32 maxPorts = max_ports_setting();
+		size_t size = sizeof(struct port_table)
+			+ sizeof(struct port_entry) * maxPorts
+			+ sizeof(int32) * maxPorts * 2;
+
+		TRACE(("The size of the port table is %ld bytes\n", (long)size));
+
+		shmid = shmget(table_key, size, IPC_CREAT | IPC_EXCL | 0700);
+		if (shmid == -1 && errno == EEXIST) {
+			TRACE(("Using pre-existing master ports table\n"));
+			shmid = shmget(table_key, 0, 0700);
+		} else if (shmid >= 0) {
+			gMaxPorts = maxPorts;
+			created = true;
+		}
 	}
 
-	if (sPortArea < 0) {
+	if (shmid < 0) {
 		TRACE(("FATAL: Couldn't setup port table due to "
 			"error %d (%s)\n", errno, strerror(errno)));
 		return B_ERROR;
 	}
 
 	/* point our local table at the master table */
-	sPortMemory = shmat(sPortArea, NULL, 0);
-	if (sPortMemory == (void *) -1) {
+	sPortTable = shmat(shmid, NULL, 0);
+	if (sPortTable == (void *) -1) {
 		TRACE(("FATAL: Couldn't attach port table: %s\n", strerror (errno)));
+		sPortTable = NULL;
 		return B_ERROR;
 	}
 
-	sNextPort = (port_id *)sPortMemory + sizeof(sem_id);
-	sPorts = (void*)sNextPort + sizeof(port_id);
+	if (created) {
+		sPortTable->index_lock = 0;
+		sPortTable->max_ports = gMaxPorts;
+		sPortTable->free_head = PORT_NO_SLOT;
+		sPortTable->free_tail = PORT_NO_SLOT;
+		sPortTable->used_slots = 0;
+		sPortTable->hash_size = gMaxPorts * 2;
+		sPortTable->hash_deleted = 0;
+		sPortTable->deleted_ports = 0;
+	} else {
+		// wait until whoever created the table is done with it
+		int32 magic;
+		while ((magic = __atomic_load_n(&sPortTable->magic, __ATOMIC_ACQUIRE))
+				!= PORT_TABLE_MAGIC) {
+			futex_wait(&sPortTable->magic, magic, B_INFINITE_TIMEOUT);
+		}
+		gMaxPorts = sPortTable->max_ports;
+	}
+
+	sPorts = (struct port_entry*)(sPortTable + 1);
+	sPortHash = (int32*)(sPorts + gMaxPorts);
 
 	if (created) {
-		memset(sNextPort, 0, size);
-		for (uint32 i = 0; i < gMaxPorts; i++) {
+		for (int32 i = 0; i < gMaxPorts; i++) {
 			sPorts[i].id = -1;
-			sPorts[i].lock = -1;
+			sPorts[i].next_free = PORT_NO_SLOT;
 		}
+		for (int32 i = 0; i < sPortTable->hash_size; i++)
+			sPortHash[i] = PORT_HASH_EMPTY;
+
+		__atomic_store_n(&sPortTable->magic, PORT_TABLE_MAGIC,
+			__ATOMIC_RELEASE);
+		futex_wake(&sPortTable->magic, INT_MAX);
+	}
 
-		sPortSem = create_sem(1, "master port lock");
-		*((sem_id *)sPortMemory) = sPortSem;
-	} else
-		sPortSem = *((sem_id *)sPortMemory);
+	sQueueMappings = calloc(gMaxPorts, sizeof(struct port_queue_mapping));
+	sMappedSlots = malloc(gMaxPorts * sizeof(int32));
+	if (sQueueMappings == NULL || sMappedSlots == NULL) {
+		free(sQueueMappings);
+		free(sMappedSlots);
+		sQueueMappings = NULL;
+		sMappedSlots = NULL;
+		return B_NO_MEMORY;
+	}
+
+	for (int32 i = 0; i < gMaxPorts; i++)
+		sQueueMappings[i].list_index = -1;
+	sSeenDeletedPorts = sPortTable->deleted_ports;
 
 	TRACE(("port_init: exit\n"));
 
@@ -152,6 +273,79 @@ port_init()
 }
 
 
+static uint32
+port_name_hash(const char* name)
+{
+	// FNV-1a
+	uint32 hash = 2166136261U;
+	while (*name != '\0') {
+		hash ^= (uint8)*name++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+
+/** Adds the port in the given slot to the name hash.
+ *	The port index lock must be held when called.
+ */
+
+static void
+port_index_insert(int32 slot)
+{
+	uint32 mask = sPortTable->hash_size - 1;
+	uint32 i = port_name_hash(sPorts[slot].name) & mask;
+
+	while (sPortHash[i] >= 0)
+		i = (i + 1) & mask;
+
+	if (sPortHash[i] == PORT_HASH_DELETED)
+		sPortTable->hash_deleted--;
+
+	sPortHash[i] = slot;
+}
+
+
+/** Rebuilds the name hash to get rid of the deleted markers.
+ *	The port index lock must be held when called.
+ */
+
+static void
+port_index_rehash()
+{
+	for (int32 i = 0; i < sPortTable->hash_size; i++)
+		sPortHash[i] = PORT_HASH_EMPTY;
+	sPortTable->hash_deleted = 0;
+
+	for (int32 slot = 0; slot < sPortTable->used_slots; slot++) {
+		if (sPorts[slot].id >= 0)
+			port_index_insert(slot);
+	}
+}
+
+
+/** Removes the port in the given slot from the name hash.
+ *	The port index lock must be held when called.
+ */
+
+static void
+port_index_remove(int32 slot)
+{
+	uint32 mask = sPortTable->hash_size - 1;
+	uint32 i = port_name_hash(sPorts[slot].name) & mask;
+
+	while (sPortHash[i] != PORT_HASH_EMPTY) {
+		if (sPortHash[i] == slot) {
+			sPortHash[i] = PORT_HASH_DELETED;
+			if (++sPortTable->hash_deleted > sPortTable->hash_size / 4)
+				port_index_rehash();
+			return;
+		}
+		i = (i + 1) & mask;
+	}
+}
+
+
 
 static int
 dump_port_list(void)
@@ -228,46 +422,308 @@ delete_owned_ports(team_id owner)
 	if (!sPortsActive)
 		return B_BAD_PORT_ID;
 
-	GRAB_PORT_LIST_LOCK();
+	for (int32 i = 0; i < sPortTable->used_slots; i++) {
+		port_id id = sPorts[i].id;
 
-	for (uint32 i = 0; i < gMaxPorts; i++) {
-		if (sPorts[i].id != -1 && sPorts[i].owner == owner) {
-			port_id id = sPorts[i].id;
+		// delete_port() checks the id again under the port lock
+		if (id != -1 && sPorts[i].owner == owner && delete_port(id) == B_OK)
+			count++;
+	}
+
+	return count;
+}
 
-			RELEASE_PORT_LIST_LOCK();
 
-			delete_port(id);
-			count++;
+static void
+ring_write(uint8* ring, size_t ringSize, size_t offset, const void* data,
+	size_t size)
+{
+	size_t first = min(size, ringSize - offset);
+
+	memcpy(ring + offset, data, first);
+	if (first < size)
+		memcpy(ring, (const uint8*)data + first, size - first);
+}
+
+
+static void
+ring_read(const uint8* ring, size_t ringSize, size_t offset, void* data,
+	size_t size)
+{
+	size_t first = min(size, ringSize - offset);
+
+	memcpy(data, ring + offset, first);
+	if (first < size)
+		memcpy((uint8*)data + first, ring, size - first);
+}
+
+
+static void
+port_queue_name(port_id id, int32 serial, char* name, size_t size)
+{
+	snprintf(name, size, "/vos-port-%ld-%ld", (long)id, (long)serial);
+}
+
+
+static uint8*
+map_port_queue(port_id id, int32 serial, size_t size, bool create)
+{
+	char name[64];
+	port_queue_name(id, serial, name, sizeof(name));
+
+	int fd = shm_open(name, create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR,
+		0600);
+	if (fd < 0) {
+		TRACE(("map_port_queue: couldn't open %s: %s\n", name,
+			strerror(errno)));
+		return NULL;
+	}
+
+	if (create && ftruncate(fd, size) != 0) {
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
 
-			GRAB_PORT_LIST_LOCK();
+	void* address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		fd, 0);
+	close(fd);
+
+	if (address == MAP_FAILED) {
+		if (create)
+			shm_unlink(name);
+		return NULL;
+	}
+
+	return address;
+}
+
+
+static void
+unlink_port_queue(port_id id, int32 serial)
+{
+	char name[64];
+	port_queue_name(id, serial, name, sizeof(name));
+	shm_unlink(name);
+}
+
+
+/** Drops the local mapping of the port queue in the slot.
+ *	The port lock must be held when called.
+ */
+
+static void
+put_port_queue(int32 slot)
+{
+	struct port_queue_mapping* mapping = &sQueueMappings[slot];
+
+	if (mapping->address != NULL)
+		munmap(mapping->address, mapping->size);
+
+	if (mapping->list_index >= 0) {
+		futex_lock(&sMappedLock);
+
+		int32 last = sMappedSlots[--sMappedCount];
+		sMappedSlots[mapping->list_index] = last;
+		sQueueMappings[last].list_index = mapping->list_index;
+		mapping->list_index = -1;
+
+		futex_unlock(&sMappedLock);
+	}
+
+	mapping->port = -1;
+	mapping->serial = -1;
+	mapping->address = NULL;
+	mapping->size = 0;
+}
+
+
+/** Remembers the local mapping of the port queue in the slot, which
+ *	must not be mapped already.
+ *	The port lock must be held when called.
+ */
+
+static void
+set_port_queue(int32 slot, int32 serial, uint8* address, size_t size)
+{
+	struct port_queue_mapping* mapping = &sQueueMappings[slot];
+
+	mapping->port = sPorts[slot].id;
+	mapping->serial = serial;
+	mapping->address = address;
+	mapping->size = size;
+
+	futex_lock(&sMappedLock);
+	mapping->list_index = sMappedCount;
+	sMappedSlots[sMappedCount++] = slot;
+	futex_unlock(&sMappedLock);
+}
+
+
+/** Unmaps the queues of the ports that other teams deleted, or whose
+ *	queue they replaced, since the last time. Without this, a team would
+ *	keep the queues of every port it ever talked to mapped until it exits.
+ *	No port lock may be held when called.
+ */
+
+static void
+put_stale_port_queues()
+{
+	int32 deletedPorts = atomic_get(&sPortTable->deleted_ports);
+	if (deletedPorts == atomic_get(&sSeenDeletedPorts))
+		return;
+
+	atomic_set(&sSeenDeletedPorts, deletedPorts);
+
+	int32 index = 0;
+	while (true) {
+		bool removed = false;
+		int32 stale[32];
+		int32 count = 0;
+
+		// collect a few candidates, the port locks can't be taken while
+		// the list is locked
+		futex_lock(&sMappedLock);
+		for (; index < sMappedCount && count < 32; index++) {
+			int32 slot = sMappedSlots[index];
+			if (sPorts[slot].id != sQueueMappings[slot].port
+				|| sPorts[slot].queue_serial != sQueueMappings[slot].serial)
+				stale[count++] = slot;
+		}
+		futex_unlock(&sMappedLock);
+
+		if (count == 0)
+			break;
+
+		for (int32 i = 0; i < count; i++) {
+			int32 slot = stale[i];
+			GRAB_PORT_LOCK(sPorts[slot]);
+			if (sQueueMappings[slot].address != NULL
+				&& (sPorts[slot].id != sQueueMappings[slot].port
+					|| sPorts[slot].queue_serial
+						!= sQueueMappings[slot].serial)) {
+				put_port_queue(slot);
+				removed = true;
+			}
+			RELEASE_PORT_LOCK(sPorts[slot]);
 		}
+
+		// removing slots shuffles the list, start over
+		if (removed)
+			index = 0;
 	}
+}
 
-	RELEASE_PORT_LIST_LOCK();
 
-	return count;
+/** Returns the local mapping of the port queue, mapping it if this
+ *	is the first time this process touches it.
+ *	The port lock must be held when called.
+ */
+
+static uint8*
+get_port_queue(int32 slot)
+{
+	struct port_queue_mapping* mapping = &sQueueMappings[slot];
+
+	if (mapping->address != NULL && mapping->port == sPorts[slot].id
+			&& mapping->serial == sPorts[slot].queue_serial)
+		return mapping->address;
+
+	put_port_queue(slot);
+
+	uint8* address = map_port_queue(sPorts[slot].id,
+		sPorts[slot].queue_serial, sPorts[slot].queue_size, false);
+	if (address == NULL)
+		return NULL;
+
+	set_port_queue(slot, sPorts[slot].queue_serial, address,
+		sPorts[slot].queue_size);
+	return address;
+}
+
+
+/** Makes sure the port queue has room for another recordSize bytes,
+ *	moving the pending messages to a larger queue if needed.
+ *	The port lock must be held when called.
+ */
+
+static uint8*
+reserve_port_queue(int32 slot, size_t recordSize)
+{
+	struct port_entry* port = &sPorts[slot];
+	uint8* queue = get_port_queue(slot);
+
+	if (queue == NULL)
+		return NULL;
+
+	if (port->queue_size - port->queue_used >= recordSize)
+		return queue;
+
+	size_t size = port->queue_size;
+	while (size - port->queue_used < recordSize)
+		size *= 2;
+
+	uint8* newQueue = map_port_queue(port->id, port->queue_serial + 1, size,
+		true);
+	if (newQueue == NULL)
+		return NULL;
+
+	TRACE(("port %ld: growing queue from %ld to %ld bytes\n", port->id,
+		(long)port->queue_size, (long)size));
+
+	// Unwrap the pending messages at the start of the new queue
+	ring_read(queue, port->queue_size, port->queue_tail, newQueue,
+		port->queue_used);
+
+	unlink_port_queue(port->id, port->queue_serial);
+	put_port_queue(slot);
+
+	port->queue_serial++;
+	port->queue_size = size;
+	port->queue_tail = 0;
+	port->queue_head = port->queue_used;
+
+	set_port_queue(slot, port->queue_serial, newQueue, size);
+	return newQueue;
 }
 
 
+/** Takes the slot of a dead port out of the index, and makes it
+ *	available to create_port() again.
+ */
+
 static void
-put_port_msg(port_msg *msg)
+free_port_slot(int32 slot)
 {
-	msg->buffer_chain[0] = '\0';
-	msg->code = 0;
-	msg->size = 0;
+	GRAB_PORT_INDEX_LOCK();
+
+	port_index_remove(slot);
+	sPorts[slot].name[0] = '\0';
+
+	if (sPortTable->free_tail != PORT_NO_SLOT)
+		sPorts[sPortTable->free_tail].next_free = slot;
+	else
+		sPortTable->free_head = slot;
+	sPortTable->free_tail = slot;
+
+	RELEASE_PORT_INDEX_LOCK();
 }
 
 
 port_id		
 _kern_create_port(int32 queueLength, const char *name)
 {
-	sem_id readSem, writeSem, portSem;
+	sem_id readSem, writeSem;
 	port_id returnValue;
 	team_id	owner;
+	int32 slot;
+	uint8* queue;
 
 	if (!sPortsActive)
 		return B_BAD_PORT_ID;
 
+	put_stale_port_queues();
+
 	// check queue length
 	if (queueLength < 1
 			|| queueLength > MAX_QUEUE_LENGTH) {
@@ -280,20 +736,11 @@ _kern_create_port(int32 queueLength, const char *name)
 
 	// ToDo: we could save the memory and use the semaphore name only instead
 
-	// create read sem with owner set to -1
-	// ToDo: should be B_SYSTEM_TEAM
-	portSem = create_sem_etc(1, name, -1);
-	if (portSem < B_OK) {
-		// cleanup
-		return portSem;
-	}
-
 	// create read sem with owner set to -1
 	// ToDo: should be B_SYSTEM_TEAM
 	readSem = create_sem_etc(0, name, -1);
 	if (readSem < B_OK) {
 		// cleanup
-		delete_sem(portSem);
 		return readSem;
 	}
 
@@ -302,114 +749,94 @@ _kern_create_port(int32 queueLength, const char *name)
 	if (writeSem < 0) {
 		// cleanup
 		delete_sem(readSem);
-		delete_sem(portSem);
 		return writeSem;
 	}
 
 	owner = team_get_current_team_id();
 
-	GRAB_PORT_LIST_LOCK();
-
-	// find the first empty spot
-	for (uint32 i = 0; i < gMaxPorts; i++) {
-		if (sPorts[i].id == -1) {
-			key_t  port_shm_key;
-			const size_t size = sizeof(port_msg) * queueLength;
-			void* msg_queue;
-
-			// make the port_id be a multiple of the slot it's in
-			if (i >= *sNextPort % gMaxPorts)
-				*sNextPort += i - *sNextPort % gMaxPorts;
-			else
-				*sNextPort += gMaxPorts - (*sNextPort % gMaxPorts - i);
-
-			if (sPorts[i].lock == -1)
-				sPorts[i].lock = create_sem(1, "port lock");
-			GRAB_PORT_LOCK(sPorts[i]);
-			sPorts[i].id = (*sNextPort)++;
-			RELEASE_PORT_LIST_LOCK();
-
-			strncpy(sPorts[i].name, name, B_OS_NAME_LENGTH);
-			sPorts[i].capacity = queueLength;
-			sPorts[i].owner = owner;
-			sPorts[i].name[B_OS_NAME_LENGTH - 1] = '\0';
-
-			// assign sem
-			sPorts[i].read_sem	= readSem;
-			sPorts[i].write_sem	= writeSem;
-			sPorts[i].lock = portSem;
-
-			sPorts[i].total_count = 0;
-
-			sPorts[i].head		= 0;
-			sPorts[i].tail		= 0;
-
-			/* grab a (hopefully) unique key for our port */
-			char path[B_PATH_NAME_LENGTH];
-			static int static_port_count = 0;
-			sprintf(path, "/proc/%d/exe", getpid());
-			port_shm_key = ftok(path, ++static_port_count);	/* HACK ALERT */
-
-			TRACE(("create_port: generated port queue key %d from %s + %d.\n", port_shm_key, path, static_port_count));
-			/* create and initialize a new semaphore table in shared memory */
-			sPorts[i].queue_shm = shmget(port_shm_key, size, IPC_CREAT | IPC_EXCL | 0700);
-			if (sPorts[i].queue_shm == -1 && errno == EEXIST) {
-				/* TODO: this should be FATAL */
-				/* TODO: we don't know if it is large enough */
-				sPorts[i].queue_shm = shmget(port_shm_key, size, IPC_CREAT | 0700);
-				TRACE(("WARNING: Using pre-existing port queue.\n"));
-			}
-
-			if (sPorts[i].queue_shm < 0) {
-				TRACE(("FATAL: Couldn't setup port queue with key %d: %s\n",
-						port_shm_key,
-						strerror(errno)));
-				returnValue = B_NO_MEMORY;
-				sPorts[i].id = -1;
-				goto cleanup;
-			}
-
-			TRACE(("Port %d named %s is using shm key %x\n", i, name, port_shm_key));
-
-			/* point our local table at the master table */
-			msg_queue = shmat(sPorts[i].queue_shm, NULL, 0);
-			if (msg_queue == (void *) -1) {
-				printf("Couldn't attach port queue: %s\n", strerror(errno));
-				returnValue = B_NO_MEMORY;
-				sPorts[i].id = -1;
-				goto cleanup;
-			}
+	GRAB_PORT_INDEX_LOCK();
+
+	// reuse the least recently freed slot, then the never used ones
+	slot = sPortTable->free_head;
+	if (slot != PORT_NO_SLOT) {
+		sPortTable->free_head = sPorts[slot].next_free;
+		if (sPortTable->free_head == PORT_NO_SLOT)
+			sPortTable->free_tail = PORT_NO_SLOT;
+	} else if (sPortTable->used_slots < gMaxPorts) {
+		slot = sPortTable->used_slots++;
+	} else {
+		// not enough gPorts...
+		RELEASE_PORT_INDEX_LOCK();
+		returnValue = B_NO_MORE_PORTS;
+		dprintf("create_port(): B_NO_MORE_PORTS\n");
+		goto cleanup;
+	}
 
-			TRACE(("Port %d is now attached successfully\n", i));
+	GRAB_PORT_LOCK(sPorts[slot]);
 
-			port_msg* p = msg_queue;
-			for (uint32 j = 0; j < queueLength; j++) {
-				p[j].buffer_chain[0] = '\0';
-				p[j].code = 0;
-				p[j].size = 0;
-			}
+	// make the port_id be a multiple of the slot it's in, serials
+	// start at 1 so a never used slot can't match any id
+	sPorts[slot].serial = sPorts[slot].serial % (INT32_MAX / gMaxPorts - 1) + 1;
+	sPorts[slot].id = sPorts[slot].serial * gMaxPorts + slot;
+	sPorts[slot].next_free = PORT_NO_SLOT;
+
+	strncpy(sPorts[slot].name, name, B_OS_NAME_LENGTH);
+	sPorts[slot].capacity = queueLength;
+	sPorts[slot].owner = owner;
+	sPorts[slot].name[B_OS_NAME_LENGTH - 1] = '\0';
+
+	// assign sem
+	sPorts[slot].read_sem	= readSem;
+	sPorts[slot].write_sem	= writeSem;
+
+	sPorts[slot].total_count = 0;
+
+	sPorts[slot].queue_serial = 0;
+	sPorts[slot].queue_size = PORT_INITIAL_QUEUE_SIZE;
+	sPorts[slot].queue_head = 0;
+	sPorts[slot].queue_tail = 0;
+	sPorts[slot].queue_used = 0;
+
+	sPorts[slot].queue_count = 0;
+	sPorts[slot].queue_high_water = 0;
+	sPorts[slot].messages_written = 0;
+	sPorts[slot].bytes_written = 0;
+	sPorts[slot].messages_read = 0;
+	sPorts[slot].bytes_read = 0;
+	sPorts[slot].read_blocked_time = 0;
+	sPorts[slot].write_blocked_time = 0;
+
+	returnValue = sPorts[slot].id;
+
+	port_index_insert(slot);
+
+	RELEASE_PORT_INDEX_LOCK();
+
+	// The port stays locked until its queue exists, so that the
+	// index lock isn't held across the syscalls
+	queue = map_port_queue(returnValue, 0, PORT_INITIAL_QUEUE_SIZE, true);
+	if (queue == NULL) {
+		TRACE(("FATAL: Couldn't setup port queue: %s\n", strerror(errno)));
+		sPorts[slot].id = -1;
+		RELEASE_PORT_LOCK(sPorts[slot]);
+		free_port_slot(slot);
+		returnValue = B_NO_MEMORY;
+		goto cleanup;
+	}
 
-			shmdt(msg_queue);
+	put_port_queue(slot);
+	set_port_queue(slot, 0, queue, PORT_INITIAL_QUEUE_SIZE);
 
-			returnValue = sPorts[i].id;
+	RELEASE_PORT_LOCK(sPorts[slot]);
 
-			RELEASE_PORT_LOCK(sPorts[i]);
-			goto out;
-		}
-	}
+	TRACE(("Port %ld named %s created in slot %ld\n", returnValue, name,
+		slot));
 
-	// not enough gPorts...
-	RELEASE_PORT_LIST_LOCK();
-	returnValue = B_NO_MORE_PORTS;
-	dprintf("create_port(): B_NO_MORE_PORTS\n");
+	return returnValue;
 
-	// cleanup
 cleanup:
 	delete_sem(writeSem);
 	delete_sem(readSem);
-	delete_sem(portSem);
-
-out:
 
 	return returnValue;
 }
@@ -446,7 +873,8 @@ _kern_close_port(port_id id)
 status_t
 _kern_delete_port(port_id id)
 {
-	sem_id readSem, writeSem, portSem;
+	sem_id readSem, writeSem;
+	int32 queueSerial;
 	int slot;
 
 	if (!sPortsActive || id < 0)
@@ -464,26 +892,28 @@ _kern_delete_port(port_id id)
 
 	/* mark port as invalid */
 	sPorts[slot].id	= -1;
+	atomic_add(&sPortTable->deleted_ports, 1);
 	readSem = sPorts[slot].read_sem;
 	writeSem = sPorts[slot].write_sem;
-	sPorts[slot].name[0] = '\0';
-	portSem = sPorts[slot].lock;
+	queueSerial = sPorts[slot].queue_serial;
 
 	RELEASE_PORT_LOCK(sPorts[slot]);
 
-	sPorts[slot].lock = -1;
-
-	// free the queue
-	// Not necessary on Cosmoe since allocation is static
+	// drop our own mapping of the queue, other teams will notice
+	// the port is gone in put_stale_port_queues()
+	GRAB_PORT_LOCK(sPorts[slot]);
+	put_port_queue(slot);
+	RELEASE_PORT_LOCK(sPorts[slot]);
 
 	// release the threads that were blocking on this port by deleting the sem
 	// read_port() will see the B_BAD_SEM_ID acq_sem() return value, and act accordingly
-	delete_sem(portSem);
 	delete_sem(readSem);
 	delete_sem(writeSem);
 
-	/* schedule our port's shared memory segment for deletion */
-	shmctl(sPorts[slot].queue_shm, IPC_RMID, NULL);
+	/* schedule our port's shared memory queue for deletion */
+	unlink_port_queue(id, queueSerial);
+
+	free_port_slot(slot);
 
 	TRACE(("delete_port: removed port_id %ld\n", id));
 
@@ -495,6 +925,8 @@ port_id
 _kern_find_port(const char *name)
 {
 	port_id portFound = B_NAME_NOT_FOUND;
+	char portName[B_OS_NAME_LENGTH];
+	uint32 mask;
 	uint32 i;
 
 	if (!sPortsActive)
@@ -502,22 +934,29 @@ _kern_find_port(const char *name)
 	if (name == NULL)
 		return B_BAD_VALUE;
 
-	// Since we have to check every single port, and we don't
-	// care if it goes away at any point, we're only grabbing
-	// the port lock in question, not the port list lock
+	// port names are truncated the same way when stored
+	strncpy(portName, name, B_OS_NAME_LENGTH);
+	portName[B_OS_NAME_LENGTH - 1] = '\0';
 
-	// loop over list
+	// Names can't change while the port is in the index, so
+	// there's no need to grab the individual port locks
 	TRACE(("find_port(): Looking for port named \"%s\"\n", name));
-	for (i = 0; i < gMaxPorts && portFound < B_OK; i++) {
-		// lock every individual port before comparing
-		GRAB_PORT_LOCK(sPorts[i]);
 
-		if (sPorts[i].id >= 0 && !strcmp(name, sPorts[i].name))
-				portFound = sPorts[i].id;
+	GRAB_PORT_INDEX_LOCK();
 
-		RELEASE_PORT_LOCK(sPorts[i]);
+	mask = sPortTable->hash_size - 1;
+	for (i = port_name_hash(portName) & mask;
+			sPortHash[i] != PORT_HASH_EMPTY; i = (i + 1) & mask) {
+		int32 slot = sPortHash[i];
+		if (slot >= 0 && sPorts[slot].id >= 0
+				&& !strcmp(portName, sPorts[slot].name)) {
+			portFound = sPorts[slot].id;
+			break;
+		}
 	}
 
+	RELEASE_PORT_INDEX_LOCK();
+
 	if (portFound >= 0)
 		TRACE(("find_port(): Port %ld matches search\n", portFound));
 	else
@@ -612,9 +1051,7 @@ _kern_get_next_port_info(team_id team, int32 *_cookie,
 
 	info->port = -1; // used as found flag
 
-	GRAB_PORT_LIST_LOCK();
-
-	while (slot < gMaxPorts) {
+	while (slot < sPortTable->used_slots) {
 		GRAB_PORT_LOCK(sPorts[slot]);
 		if (sPorts[slot].id != -1 && sPorts[slot].capacity != 0 && sPorts[slot].owner == team) {
 			// found one!
@@ -627,7 +1064,6 @@ _kern_get_next_port_info(team_id team, int32 *_cookie,
 		RELEASE_PORT_LOCK(sPorts[slot]);
 		slot++;
 	}
-	RELEASE_PORT_LIST_LOCK();
 
 	if (info->port == -1)
 		return B_BAD_PORT_ID;
@@ -637,16 +1073,58 @@ _kern_get_next_port_info(team_id team, int32 *_cookie,
 }
 
 
+status_t
+_kern_get_next_port_stats(int32 *_cookie, struct port_stats *stats)
+{
+	int32 slot;
+
+	if (stats == NULL || _cookie == NULL)
+		return B_BAD_VALUE;
+
+	if (!sPortsActive)
+		return B_BAD_PORT_ID;
+
+	for (slot = *_cookie; slot >= 0 && slot < sPortTable->used_slots;
+			slot++) {
+		struct port_entry* port = &sPorts[slot];
+
+		GRAB_PORT_LOCK(*port);
+		if (port->id == -1 || port->capacity == 0) {
+			RELEASE_PORT_LOCK(*port);
+			continue;
+		}
+
+		stats->port = port->id;
+		stats->owner = port->owner;
+		strncpy(stats->name, port->name, B_OS_NAME_LENGTH);
+		stats->capacity = port->capacity;
+		stats->queue_count = port->queue_count;
+		stats->queue_high_water = port->queue_high_water;
+		stats->messages_written = port->messages_written;
+		stats->bytes_written = port->bytes_written;
+		stats->messages_read = port->messages_read;
+		stats->bytes_read = port->bytes_read;
+		stats->read_blocked_time = port->read_blocked_time;
+		stats->write_blocked_time = port->write_blocked_time;
+
+		RELEASE_PORT_LOCK(*port);
+
+		*_cookie = slot + 1;
+		return B_OK;
+	}
+
+	return B_BAD_PORT_ID;
+}
+
+
 ssize_t
 _kern_port_buffer_size_etc(port_id id, uint32 flags, bigtime_t timeout)
 {
 	sem_id cachedSem;
 	status_t status;
-	port_msg *msg;
-	ssize_t size;
+	port_msg msg;
 	int slot;
-	int tail;
-	void* msg_queue;
+	uint8* queue;
 
 	TRACE(("port_buffer_size(%" B_PRId64 "): enter\n", (long)id));
 
@@ -686,24 +1164,13 @@ _kern_port_buffer_size_etc(port_id id, uint32 flags, bigtime_t timeout)
 		return B_BAD_PORT_ID;
 	}
 
-	// determine tail & get the length of the message
-	tail = sPorts[slot].tail;
-	if (tail < 0)
-		panic("port %ld: tail < 0", sPorts[slot].id);
-	if (tail > sPorts[slot].capacity)
-		panic("port %ld: tail > cap %ld", sPorts[slot].id, sPorts[slot].capacity);
-
-	msg_queue = shmat(sPorts[slot].queue_shm, NULL, 0);
-	if (msg_queue == (void *) -1)
+	// get the length of the message at the tail of the queue
+	queue = get_port_queue(slot);
+	if (queue == NULL)
 		panic("port %ld: missing queue", sPorts[slot].id);
 
-	msg = msg_queue + (sizeof(port_msg) * tail);
-	if (msg == NULL)
-		panic("port %ld: no messages found", sPorts[slot].id);
-
-	size = msg->size;
-
-	shmdt(msg_queue);
+	ring_read(queue, sPorts[slot].queue_size, sPorts[slot].queue_tail,
+		&msg, sizeof(port_msg));
 
 	RELEASE_PORT_LOCK(sPorts[slot]);
 
@@ -711,7 +1178,7 @@ _kern_port_buffer_size_etc(port_id id, uint32 flags, bigtime_t timeout)
 	release_sem(cachedSem);
 
 	// return length of item at end of queue
-	return size;
+	return msg.size;
 }
 
 
@@ -753,21 +1220,90 @@ _kern_port_count(port_id id)
 }
 
 
+/*!	Returns the semaphores counting the queued messages and the free
+	queue slots, wait_for_objects() watches them for B_EVENT_READ and
+	B_EVENT_WRITE.
+*/
+status_t
+get_port_sems(port_id id, sem_id* _readSem, sem_id* _writeSem)
+{
+	int slot;
+
+	if (!sPortsActive || id < 0)
+		return B_BAD_PORT_ID;
+
+	slot = id % gMaxPorts;
+
+	GRAB_PORT_LOCK(sPorts[slot]);
+
+	if (sPorts[slot].id != id) {
+		RELEASE_PORT_LOCK(sPorts[slot]);
+		return B_BAD_PORT_ID;
+	}
+
+	*_readSem = sPorts[slot].read_sem;
+	*_writeSem = sPorts[slot].write_sem;
+
+	RELEASE_PORT_LOCK(sPorts[slot]);
+	return B_OK;
+}
+
+
+/*!	Reads the header of the oldest message in the queue.
+	The port lock must be held when called.
+*/
+static void
+peek_port_message(int32 slot, const uint8* queue, port_msg* msg)
+{
+	ring_read(queue, sPorts[slot].queue_size, sPorts[slot].queue_tail, msg,
+		sizeof(port_msg));
+}
+
+
+/*!	Copies the first size bytes of the oldest message, whose header was
+	read by peek_port_message(), and removes it from the queue.
+	The port lock must be held when called.
+*/
+static void
+dequeue_port_message(int32 slot, const uint8* queue, const port_msg* msg,
+	void* buffer, size_t size)
+{
+	struct port_entry* port = &sPorts[slot];
+
+	if (size > 0) {
+		ring_read(queue, port->queue_size,
+			(port->queue_tail + sizeof(port_msg)) % port->queue_size,
+			buffer, size);
+	}
+
+	port->queue_tail = (port->queue_tail + PORT_MESSAGE_RECORD_SIZE(msg->size))
+		% port->queue_size;
+	port->queue_used -= PORT_MESSAGE_RECORD_SIZE(msg->size);
+	port->total_count++;
+
+	port->queue_count--;
+	port->messages_read++;
+	port->bytes_read += msg->size;
+}
+
+
 ssize_t
 _kern_read_port_etc(port_id id, int32 *_msgCode, void *msgBuffer,
 	size_t bufferSize, uint32 flags, bigtime_t timeout)
 {
 	sem_id cachedSem;
 	status_t status;
-	port_msg *msg;
+	bigtime_t blocked;
+	port_msg msg;
 	size_t size;
 	int slot;
-	int tail;
-	void* msg_queue;
+	uint8* queue;
 
 	if (!sPortsActive || id < 0)
 		return B_BAD_PORT_ID;
 
+	put_stale_port_queues();
+
 	if (_msgCode == NULL
 		|| (msgBuffer == NULL && bufferSize > 0)
 		|| timeout < 0)
@@ -791,7 +1327,7 @@ _kern_read_port_etc(port_id id, int32 *_msgCode, void *msgBuffer,
 	RELEASE_PORT_LOCK(sPorts[slot]);
 	TRACE(("read_port_etc: about to acquire read sem\n"));
 
-	status = acquire_sem_etc(cachedSem, 1, flags, timeout);
+	status = acquire_sem_measured(cachedSem, flags, timeout, &blocked);
 		// get 1 entry from the queue, block if needed
 
 	if (status == B_BAD_SEM_ID || status == B_INTERRUPTED) {
@@ -810,60 +1346,151 @@ _kern_read_port_etc(port_id id, int32 *_msgCode, void *msgBuffer,
 	GRAB_PORT_LOCK(sPorts[slot]);
 
 	// first, let's check if the port is still alive
-	if (sPorts[slot].id == -1) {
+	if (sPorts[slot].id != id) {
 		// the port has been deleted in the meantime
 		RELEASE_PORT_LOCK(sPorts[slot]);
 		return B_BAD_PORT_ID;
 	}
 
-	tail = sPorts[slot].tail;
-	if (tail < 0)
-		panic("port %ld: tail < 0", sPorts[slot].id);
-	if (tail > sPorts[slot].capacity)
-		panic("port %ld: tail > cap %ld", sPorts[slot].id, sPorts[slot].capacity);
-
 	// TODO: this should mean the port is closed, so we return
 	// check if this behavior is consistent.
-	if (sPorts[slot].capacity == 0)
+	if (sPorts[slot].capacity == 0) {
+		RELEASE_PORT_LOCK(sPorts[slot]);
 		return 0;
+	}
 
-	sPorts[slot].tail = (sPorts[slot].tail + 1) % sPorts[slot].capacity;
-
-	msg_queue = shmat(sPorts[slot].queue_shm, NULL, 0);
-	if (msg_queue == (void *) -1)
+	queue = get_port_queue(slot);
+	if (queue == NULL)
 		panic("port %ld: missing queue", sPorts[slot].id);
 
-	msg = msg_queue + (sizeof(port_msg) * tail);
-	if (msg == NULL)
-		panic("port %ld: no messages found", sPorts[slot].id);
+	peek_port_message(slot, queue, &msg);
+
+	// check output buffer size
+	size = min(bufferSize, msg.size);
 
-	sPorts[slot].total_count++;
+	// copy message
+	*_msgCode = msg.code;
+	dequeue_port_message(slot, queue, &msg, msgBuffer, size);
+	sPorts[slot].read_blocked_time += blocked;
 
 	cachedSem = sPorts[slot].write_sem;
 
 	RELEASE_PORT_LOCK(sPorts[slot]);
 
-	// check output buffer size
-	size = min(bufferSize, msg->size);
-
-	// copy message
-	*_msgCode = msg->code;
-	if (size > 0) {
-		if (msgBuffer)
-			memcpy(msgBuffer, msg->buffer_chain, size);
-	}
-	put_port_msg(msg);
-
 	// make one spot in queue available again for write
 	release_sem(cachedSem);
 		// ToDo: we might think about setting B_NO_RESCHEDULE here
 		//	from time to time (always?)
 
-	TRACE(("read_port_etc(): read %ld bytes from port %ld queue position %d.\n", (long)size, id, tail));
+	TRACE(("read_port_etc(): read %ld bytes from port %ld.\n", (long)size, id));
 	return size;
 }
 
 
+/*!	Reads as many queued messages as fit into \a buffer, as a sequence of
+	port_message_record. Only the first message is waited for, as
+	specified by \a flags and \a timeout.
+	Returns the number of messages read, or B_BUFFER_OVERFLOW if not even
+	the first one fits, in which case it is left in the queue.
+*/
+ssize_t
+_kern_read_port_batch(port_id id, void* buffer, size_t bufferSize,
+	uint32 flags, bigtime_t timeout)
+{
+	sem_id readSem;
+	sem_id writeSem;
+	status_t status;
+	bigtime_t blocked;
+	port_msg msg;
+	size_t offset = 0;
+	ssize_t count = 0;
+	int slot;
+	uint8* queue;
+
+	if (!sPortsActive || id < 0)
+		return B_BAD_PORT_ID;
+
+	put_stale_port_queues();
+
+	if (buffer == NULL || timeout < 0)
+		return B_BAD_VALUE;
+
+	flags = flags & (B_CAN_INTERRUPT | B_TIMEOUT | B_RELATIVE_TIMEOUT |
+		B_ABSOLUTE_TIMEOUT);
+	slot = id % gMaxPorts;
+
+	GRAB_PORT_LOCK(sPorts[slot]);
+
+	if (sPorts[slot].id != id) {
+		RELEASE_PORT_LOCK(sPorts[slot]);
+		return B_BAD_PORT_ID;
+	}
+	readSem = sPorts[slot].read_sem;
+
+	RELEASE_PORT_LOCK(sPorts[slot]);
+
+	status = acquire_sem_measured(readSem, flags, timeout, &blocked);
+	if (status == B_BAD_SEM_ID || status == B_INTERRUPTED)
+		return B_BAD_PORT_ID;
+	if (status != B_OK)
+		return status;
+
+	GRAB_PORT_LOCK(sPorts[slot]);
+
+	if (sPorts[slot].id != id) {
+		RELEASE_PORT_LOCK(sPorts[slot]);
+		return B_BAD_PORT_ID;
+	}
+
+	if (sPorts[slot].capacity == 0) {
+		RELEASE_PORT_LOCK(sPorts[slot]);
+		return 0;
+	}
+
+	queue = get_port_queue(slot);
+	if (queue == NULL)
+		panic("port %ld: missing queue", sPorts[slot].id);
+
+	sPorts[slot].read_blocked_time += blocked;
+
+	// We own one message already, further ones are taken from the
+	// read sem without waiting for as long as they fit.
+	while (true) {
+		struct port_message_record* record;
+
+		peek_port_message(slot, queue, &msg);
+		if (offset + PORT_MESSAGE_RECORD_SIZE(msg.size) > bufferSize) {
+			release_sem(readSem);
+			break;
+		}
+
+		record = (struct port_message_record*)((uint8*)buffer + offset);
+		record->code = msg.code;
+		record->size = msg.size;
+		dequeue_port_message(slot, queue, &msg, record + 1, msg.size);
+
+		offset += PORT_MESSAGE_RECORD_SIZE(msg.size);
+		count++;
+
+		if (offset + sizeof(struct port_message_record) > bufferSize
+			|| acquire_sem_etc(readSem, 1, B_RELATIVE_TIMEOUT, 0) != B_OK)
+			break;
+	}
+
+	writeSem = sPorts[slot].write_sem;
+
+	RELEASE_PORT_LOCK(sPorts[slot]);
+
+	if (count == 0)
+		return B_BUFFER_OVERFLOW;
+
+	// make the slots available again for writers
+	release_sem_etc(writeSem, count, 0);
+
+	return count;
+}
+
+
 ssize_t
 _kern_read_port(port_id port, int32 *msgCode,
 	void *msgBuffer, size_t bufferSize)
@@ -878,14 +1505,17 @@ _kern_write_port_etc(port_id id, int32 msgCode, const void *msgBuffer,
 {
 	sem_id cachedSem;
 	status_t status;
-	port_msg *msg;
-	int head;
+	bigtime_t blocked;
+	port_msg msg;
+	size_t head;
 	int slot;
-	void* msg_queue;
+	uint8* queue;
 
 	if (!sPortsActive || id < 0)
 		return B_BAD_PORT_ID;
 
+	put_stale_port_queues();
+
 	// mask irrelevant flags (for acquire_sem() usage)
 	flags = flags & (B_CAN_INTERRUPT | B_TIMEOUT | B_RELATIVE_TIMEOUT |
 		B_ABSOLUTE_TIMEOUT);
@@ -913,7 +1543,7 @@ _kern_write_port_etc(port_id id, int32 msgCode, const void *msgBuffer,
 
 	RELEASE_PORT_LOCK(sPorts[slot]);
 
-	status = acquire_sem_etc(cachedSem, 1, flags, timeout);
+	status = acquire_sem_measured(cachedSem, flags, timeout, &blocked);
 		// get 1 entry from the queue, block if needed
 
 	if (status == B_BAD_SEM_ID || status == B_INTERRUPTED) {
@@ -929,43 +1559,44 @@ _kern_write_port_etc(port_id id, int32 msgCode, const void *msgBuffer,
 		return status;
 	}
 
-	// Find and sanity-check the head of the queue
-	head = sPorts[slot].head;
-	if (head < 0)
-		panic("port %ld: head < 0", sPorts[slot].id);
-	if (head >= sPorts[slot].capacity)
-		panic("port %ld: head > cap %ld", sPorts[slot].id, sPorts[slot].capacity);
-
-	msg_queue = shmat(sPorts[slot].queue_shm, NULL, 0);
-	if (msg_queue == (void *) -1)
-		panic("port %ld: missing queue", sPorts[slot].id);
-
-	msg = msg_queue + (sizeof(port_msg) * head);
-
-	msg->code = msgCode;
-	msg->size = bufferSize;
-	memcpy(msg->buffer_chain, msgBuffer, bufferSize);
-
-	if (sPorts[slot].capacity == 0)
-		return B_BAD_PORT_ID;
-
-	sPorts[slot].head = (sPorts[slot].head + 1) % sPorts[slot].capacity;
-
-	shmdt(msg_queue);
-
 	// attach message to queue
 	GRAB_PORT_LOCK(sPorts[slot]);
 
 	// first, let's check if the port is still alive
-	if (sPorts[slot].id == -1) {
-		// the port has been deleted in the meantime
+	if (sPorts[slot].id != id || sPorts[slot].capacity == 0) {
+		// the port has been deleted or closed in the meantime
 		RELEASE_PORT_LOCK(sPorts[slot]);
-
-		//put_port_msg(msg);
 		return B_BAD_PORT_ID;
 	}
 
-	// list_add_item not necessary, already done in Cosmoe
+	queue = reserve_port_queue(slot, PORT_MESSAGE_RECORD_SIZE(bufferSize));
+	if (queue == NULL) {
+		cachedSem = sPorts[slot].write_sem;
+		RELEASE_PORT_LOCK(sPorts[slot]);
+		release_sem(cachedSem);
+		return B_NO_MEMORY;
+	}
+
+	msg.code = msgCode;
+	msg.size = bufferSize;
+
+	head = sPorts[slot].queue_head;
+	ring_write(queue, sPorts[slot].queue_size, head, &msg, sizeof(port_msg));
+	if (bufferSize > 0) {
+		ring_write(queue, sPorts[slot].queue_size,
+			(head + sizeof(port_msg)) % sPorts[slot].queue_size,
+			msgBuffer, bufferSize);
+	}
+
+	sPorts[slot].queue_head = (head + PORT_MESSAGE_RECORD_SIZE(bufferSize))
+		% sPorts[slot].queue_size;
+	sPorts[slot].queue_used += PORT_MESSAGE_RECORD_SIZE(bufferSize);
+
+	if (++sPorts[slot].queue_count > sPorts[slot].queue_high_water)
+		sPorts[slot].queue_high_water = sPorts[slot].queue_count;
+	sPorts[slot].messages_written++;
+	sPorts[slot].bytes_written += bufferSize;
+	sPorts[slot].write_blocked_time += blocked;
 
 	// store sem_id in local variable 
 	cachedSem = sPorts[slot].read_sem;
@@ -975,7 +1606,7 @@ _kern_write_port_etc(port_id id, int32 msgCode, const void *msgBuffer,
 	// release sem, allowing read (might reschedule)
 	release_sem(cachedSem);
 
-	TRACE(("write_port_etc(): wrote %ld bytes to port %d queue position %d.\n", (long)bufferSize, slot, head));
+	TRACE(("write_port_etc(): wrote %ld bytes to port %d queue position %ld.\n", (long)bufferSize, slot, (long)head));
 	return B_NO_ERROR;
 }
 
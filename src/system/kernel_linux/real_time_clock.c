@@ -25,6 +25,7 @@
 //------------------------------------------------------------------------------
 
 #include <OS.h>
+#include <time.h>
 #include <sys/time.h>
 
 void
@@ -57,10 +58,8 @@ real_time_clock(void)
 bigtime_t
 real_time_clock_usecs(void)
 {
-	struct timeval tv;
-	struct timezone tz;
-
-	gettimeofday( &tv, &tz ); /* timezone unused but can't pass NULL */
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
 
-	return (bigtime_t)tv.tv_sec * (bigtime_t)(1000*1000) + (bigtime_t)tv.tv_usec;
+	return (bigtime_t)ts.tv_sec * (bigtime_t)(1000*1000) + ts.tv_nsec / 1000;
 }
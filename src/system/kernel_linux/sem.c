@@ -1,6 +1,6 @@
 //------------------------------------------------------------------------------
 //	Copyright (c) 2004, Bill Hayden
-//	Copyright (c) 2018-2019, Dario Casalinuovo
+//	Copyright (c) 2018-2020, Dario Casalinuovo
 //
 //	Permission is hereby granted, free of charge, to any person obtaining a
 //	copy of this software and associated documentation files (the "Software"),
@@ -22,26 +22,29 @@
 //
 //	File Name:		sem.c
 //	Author:			Bill Hayden <hayden@haydentech.com>
-//	Description:	Implements BeOS semaphores code via SysV sem calls
+//	Description:	Implements BeOS semaphores code via futexes
 //
 //------------------------------------------------------------------------------
 
 
 /*
- 
+
 Important concepts:
-SystemV semaphores are allocated in groups of SEMMSL (usually 250).  We
-map the Cosmoe sem_id to a group and group member.  Groups are not created
-until needed, and are currently never deleted until Cosmoe shuts down and
-clean_shm.sh is run.  Each member of the semaphore group is set to an
-initial value of SEMVMX as a marker signifying that it is unused.  When
-it comes into use via a call to create_sem_etc the sem value is changed
-to the specified count.  If by some fluke an active sem achieves a value
-of SEMVMX (usually 32767), it would be considered unused in this scheme.
-
-TODO:
-Add name and owner support using shared memory, locked by a sem
-in the administrative group (ADMIN_AREA_SEM).
+All the semaphores of the system live in a single table in shared memory.
+The sem_id encodes the table slot and a per slot serial number, so that
+stale ids of deleted semaphores are detected even once the slot is reused.
+
+The id and the count of a semaphore are packed in a single 64 bits word,
+which is only ever updated with compare and swap. This gives acquire and
+release a syscall free fast path, and makes the id check and the count
+update a single atomic step.
+
+Blocked threads sleep on the wake_seq futex word, which is bumped by every
+release that finds waiters and by delete_sem. A waiter reads wake_seq
+before checking the state, so it can never miss a wakeup.
+
+wait_for_objects() watches the same word, it registers itself in the
+selecting counter so that releases bump wake_seq for it as well.
 
 */
 
@@ -50,13 +53,13 @@ in the administrative group (ADMIN_AREA_SEM).
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/shm.h>
 
-/* Use GNU extensions to pick up semtimedop() from sem.h */
-#ifndef __USE_GNU
-#define __USE_GNU
-#endif /* __USE_GNU */
-#include <sys/sem.h>
+#include <object_stats.h>
+
+#include "futex.h"
+#include "main.h"
 
 //#define TRACE_SEM 0
 #if TRACE_SEM
@@ -65,102 +68,230 @@ in the administrative group (ADMIN_AREA_SEM).
 #	define TRACE(x) ;
 #endif
 
-#ifndef SEMMSL
-#define SEMMSL 250
-#endif /* SEMMSL */
+#define SEM_TABLE_MAGIC 'sEmT'
+
+#define SEM_FREE_ID ((sem_id)-1)
+#define SEM_NO_SLOT -1
+
+#define SEM_STATE(id, count) \
+	(((uint64)(uint32)(id) << 32) | (uint32)(count))
+#define SEM_STATE_ID(state) ((sem_id)((state) >> 32))
+#define SEM_STATE_COUNT(state) ((int32)(uint32)(state))
+
+
+struct sem_entry {
+	uint64		state;			// id and count, see SEM_STATE()
+	int32		wake_seq;		// futex word waiters block on
+	int32		waiting;		// units requested by blocked threads
+	int32		greedy;			// blocked threads wanting more than 1 unit
+	int32		selecting;		// threads in wait_for_objects()
+	int32		serial;
+	int32		next_free;
+	team_id		owner;
+	thread_id	latest_holder;
+	char		name[B_OS_NAME_LENGTH];
+
+	// statistics, updated with relaxed atomics
+	uint64		acquires;
+	uint64		contentions;		// acquires that had to block
+	bigtime_t	wait_time;
+	uint32		wait_histogram[SEM_WAIT_HISTOGRAM_SIZE];
+};
+
+struct sem_table {
+	int32		magic;
+	int32		lock;			// protects the free list
+	int32		free_head;
+	int32		free_tail;
+	int32		used_slots;		// slots above this were never used
+	int32		max_sems;
+	struct sem_entry sems[0];
+};
+
+// gMaxSems must be power of 2
+int32 gMaxSems = 65536;
 
-#ifndef SEMVMX
-#define SEMVMX 32767
-#endif /* SEMVMX */
+static struct sem_table* sSemTable = NULL;
+static __thread thread_id sCurrentThread = -1;
 
-#if defined(_SEM_SEMUN_UNDEFINED)
-union semun
+
+static status_t
+sem_init()
 {
-	int val;					// value for SETVAL
-	struct semid_ds *buf;		// buffer for IPC_STAT & IPC_SET
-	unsigned short int *array;	// array for GETALL & SETALL
-	struct seminfo *__buf;		// buffer for IPC_INFO
-};
-#endif
+	size_t size = sizeof(struct sem_table)
+		+ sizeof(struct sem_entry) * gMaxSems;
+	bool created = true;
+
+	/* grab a (hopefully) unique key for our table */
+	key_t table_key = ftok("/usr/local/bin/", (int)'S');
+
+	int shmid = shmget(table_key, size, IPC_CREAT | IPC_EXCL | 0700);
+	if (shmid == -1 && errno == EEXIST) {
+		shmid = shmget(table_key, size, IPC_CREAT | 0700);
+		created = false;
+	}
 
-typedef union semun sem_union_t;
+	if (shmid < 0) {
+		printf("FATAL: Couldn't setup sem table due to error %d (%s)\n",
+			errno, strerror(errno));
+		return B_NO_MORE_SEMS;
+	}
 
+	struct sem_table* table = shmat(shmid, NULL, 0);
+	if (table == (void*)-1) {
+		printf("FATAL: Couldn't attach sem table: %s\n", strerror(errno));
+		return B_NO_MORE_SEMS;
+	}
+
+	if (created) {
+		// Fresh segments are zero filled, so only the header needs
+		// to be set. Entries are set up the first time they are used.
+		table->lock = 0;
+		table->free_head = SEM_NO_SLOT;
+		table->free_tail = SEM_NO_SLOT;
+		table->used_slots = 0;
+		table->max_sems = gMaxSems;
+		__atomic_store_n(&table->magic, SEM_TABLE_MAGIC, __ATOMIC_RELEASE);
+		futex_wake(&table->magic, INT_MAX);
+	} else {
+		// Somebody else created it, wait until it's initialized
+		int32 magic;
+		while ((magic = __atomic_load_n(&table->magic, __ATOMIC_ACQUIRE))
+				!= SEM_TABLE_MAGIC) {
+			futex_wait(&table->magic, magic, B_INFINITE_TIMEOUT);
+		}
+		if (table->max_sems != gMaxSems) {
+			printf("FATAL: sem table size mismatch\n");
+			shmdt(table);
+			return B_NO_MORE_SEMS;
+		}
+	}
 
-static int get_sem_id();
-static int get_group(int id);
-static void construct_sem_timeout(struct timespec* tmout,
-								  uint32 flags,
-								  bigtime_t raw_timeout);
+	// Other threads could be racing with us, keep the first attach
+	struct sem_table* expected = NULL;
+	if (!__atomic_compare_exchange_n(&sSemTable, &expected, table, false,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		shmdt(table);
+	}
 
-static int sem_admin_group = -1;
+	TRACE(("sem_init: exit\n"));
+	return B_OK;
+}
+
+
+static inline struct sem_table*
+get_table()
+{
+	struct sem_table* table = __atomic_load_n(&sSemTable, __ATOMIC_ACQUIRE);
+	if (table != NULL)
+		return table;
+
+	if (sem_init() != B_OK)
+		return NULL;
+
+	return sSemTable;
+}
+
+
+static inline struct sem_entry*
+get_sem(sem_id id)
+{
+	if (id < 0)
+		return NULL;
+
+	struct sem_table* table = get_table();
+	if (table == NULL)
+		return NULL;
+
+	return &table->sems[id % gMaxSems];
+}
+
+
+static inline thread_id
+current_thread()
+{
+	if (sCurrentThread < 0)
+		sCurrentThread = find_thread(NULL);
+	return sCurrentThread;
+}
+
+
+static void
+wake_waiters(struct sem_entry* sem, int32 count)
+{
+	int32 selecting = __atomic_load_n(&sem->selecting, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sem->waiting, __ATOMIC_SEQ_CST) == 0
+			&& selecting == 0)
+		return;
+
+	__atomic_add_fetch(&sem->wake_seq, 1, __ATOMIC_SEQ_CST);
+
+	// A thread waiting for more than one unit could eat a wakeup
+	// without being able to proceed, so could wait_for_objects().
+	// Wake up everyone then.
+	if (selecting > 0 || __atomic_load_n(&sem->greedy, __ATOMIC_RELAXED) > 0)
+		count = INT_MAX;
+
+	futex_wake(&sem->wake_seq, count);
+}
 
 
 sem_id
 create_sem_etc(int32 count, const char *name, team_id owner)
 {
-	int id = get_sem_id();
-	sem_union_t semopts;
-	int group;
-	int member = id % SEMMSL;
-	int err;
-	
+	struct sem_table* table = get_table();
+	struct sem_entry* sem;
+	int32 slot;
+
 	TRACE(("create_sem_etc: enter\n"));
-	
-	if ((count < 0) || (count >= SEMVMX))
+
+	if (count < 0)
 		return B_BAD_VALUE;
-	
-	// If member is zero, then we need to make a new group
-	if (member == 0) {
-		// /dev/zero chosen for no particular good reason
-		key_t key = ftok("/dev/zero", id / SEMMSL);
-		unsigned short int array[SEMMSL];
-		
-		TRACE(("create_sem_etc(): creating sem group %d\n", id / SEMMSL));
-		
-		// Fill in the array before we even create the group to narrow
-		// the window between the semget and the semctl
-		for (uint32 x = 0; x < SEMMSL; x++) {
-			// SEMVMX, as a sem value, signifies that it is inactive
-			array[x] = SEMVMX;
-		}
-		semopts.array = array;
-		
-		// Create a new semaphore set
-		group = semget(key, SEMMSL, IPC_CREAT | IPC_EXCL | 0700);
-		if (group == -1) {
-			TRACE(("create_sem_etc(): failed to create new sem group %d!\n", group));
-			return B_NO_MORE_SEMS;
-		}
 
-		err = semctl(group, 0 /* ignored */, SETALL, semopts);
-		if (err < 0) {
-			TRACE(("create_sem_etc(): semctl SETALL returned %d!\n", errno));
-			// We are especially screwed here because we've already
-			// created the sem group, but can't initialize it.
-			// Perhaps we should delete it in this case and return
-			// B_NO_MORE_SEMS?
-		}
+	if (table == NULL)
+		return B_NO_MORE_SEMS;
+
+	futex_lock(&table->lock);
+
+	// Reuse the least recently freed slot first, so that stale ids
+	// stay invalid for as long as possible.
+	slot = table->free_head;
+	if (slot != SEM_NO_SLOT) {
+		table->free_head = table->sems[slot].next_free;
+		if (table->free_head == SEM_NO_SLOT)
+			table->free_tail = SEM_NO_SLOT;
+	} else if (table->used_slots < table->max_sems) {
+		slot = table->used_slots++;
 	} else {
-		group = get_group(id / SEMMSL);
-		if (group == -1)
-			return B_NO_MORE_SEMS;
+		futex_unlock(&table->lock);
+		TRACE(("create_sem_etc(): B_NO_MORE_SEMS\n"));
+		return B_NO_MORE_SEMS;
 	}
 
-#if TRACE_SEM
-	// Check to see if it has the "unused" flag value
-	if (SEMVMX != semctl(group, member, GETVAL, 0)) {
-		TRACE(("create_sem_etc(): using an uninitialized sem!\n"));
-	}
+	sem = &table->sems[slot];
+	// Serials start at 1, ids below gMaxSems are never valid
+	sem->serial = sem->serial % (INT32_MAX / gMaxSems - 1) + 1;
+	sem->next_free = SEM_NO_SLOT;
 
-#endif
+	futex_unlock(&table->lock);
 
-	semopts.val = count;
-	err = semctl(group, member, SETVAL, semopts);
-	if (err < 0) {
-		TRACE(("create_sem_etc(): semctl SETVAL returned %d!\n", errno));
-		return B_NO_MORE_SEMS;
-	}
+	sem_id id = sem->serial * gMaxSems + slot;
+
+	if (name == NULL)
+		name = "unnamed sem";
+	strncpy(sem->name, name, B_OS_NAME_LENGTH);
+	sem->name[B_OS_NAME_LENGTH - 1] = '\0';
+	sem->owner = owner;
+	sem->latest_holder = -1;
+	sem->acquires = 0;
+	sem->contentions = 0;
+	sem->wait_time = 0;
+	memset(sem->wait_histogram, 0, sizeof(sem->wait_histogram));
+
+	// Publishing the state makes the sem usable
+	__atomic_store_n(&sem->state, SEM_STATE(id, count), __ATOMIC_RELEASE);
 
+	TRACE(("create_sem_etc(): created sem %ld in slot %ld\n", id, slot));
 	return id;
 }
 
@@ -175,43 +306,40 @@ _kern_create_sem(int32 count, const char *name)
 status_t
 _kern_delete_sem(sem_id id)
 {
-	int group = get_group(id / SEMMSL);
-	int member = id % SEMMSL;
-	sem_union_t semopts;
-	int err;
-	int count;
+	struct sem_entry* sem = get_sem(id);
+	uint64 state;
 
 	TRACE(("delete_sem_etc(%ld): enter\n", id));
-	
-	// Check for bad sem_id
-	if
-	(
-		(id < 0)		// invalid sem_id
-		||
-		(group == -1)	// non-existant group
-		||
-		(SEMVMX == semctl(group, member, GETVAL, 0)) // sem not inited yet
-	)
+
+	if (sem == NULL)
 		return B_BAD_SEM_ID;
 
 	// FIXME: According to the BeBook, we should also check that the
-	// current thread belongs to the sem's owning team.  Since we
-	// don't yet implement sem ownership, we can't do this yet.
-	// This means that currently you can delete any sem you choose.
-
-	// In case threads were waiting on this sem, it may be
-	// immediately decremented, so reset the sem to SEMVMX
-	do
-	{
-		// SEMVMX, as a sem value, signifies that it is inactive
-		semopts.val = SEMVMX;
-		err = semctl(group, member, SETVAL, semopts);
-		if (err == -1)
+	// current thread belongs to the sem's owning team.
+
+	state = __atomic_load_n(&sem->state, __ATOMIC_ACQUIRE);
+	do {
+		if (SEM_STATE_ID(state) != id)
 			return B_BAD_SEM_ID;
-			
-		count = semctl(group, member, GETVAL, 0);
-	}
-	while (count >= 0 && count != SEMVMX);
+	} while (!__atomic_compare_exchange_n(&sem->state, &state,
+		SEM_STATE(SEM_FREE_ID, 0), true, __ATOMIC_SEQ_CST,
+		__ATOMIC_ACQUIRE));
+
+	// Wake up everybody, they will see the sem is gone
+	// and return B_BAD_SEM_ID.
+	__atomic_add_fetch(&sem->wake_seq, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&sem->wake_seq, INT_MAX);
+
+	struct sem_table* table = sSemTable;
+	int32 slot = id % gMaxSems;
+
+	futex_lock(&table->lock);
+	if (table->free_tail != SEM_NO_SLOT)
+		table->sems[table->free_tail].next_free = slot;
+	else
+		table->free_head = slot;
+	table->free_tail = slot;
+	futex_unlock(&table->lock);
 
 	return B_OK;
 }
@@ -224,58 +352,128 @@ _kern_acquire_sem(sem_id id)
 }
 
 
-status_t
-_kern_acquire_sem_etc(sem_id id, uint32 count, uint32 flags,
-	bigtime_t timeout)
+static void
+record_wait(struct sem_entry* sem, bigtime_t waited)
+{
+	int32 bucket = 0;
+	bigtime_t limit = 10;
+	while (waited >= limit && bucket < SEM_WAIT_HISTOGRAM_SIZE - 1) {
+		limit *= 10;
+		bucket++;
+	}
+
+	__atomic_add_fetch(&sem->contentions, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&sem->wait_time, waited, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&sem->wait_histogram[bucket], 1, __ATOMIC_RELAXED);
+}
+
+
+static status_t
+acquire_sem_internal(sem_id id, uint32 count, uint32 flags,
+	bigtime_t timeout, bigtime_t* _waited)
 {
-	int group = get_group(id / SEMMSL);
-	int member = id % SEMMSL;
-	struct sembuf sem_lock = {member, -count, 0};
-	struct timespec tmout;
-	int err;
+	struct sem_entry* sem = get_sem(id);
+	bigtime_t deadline;
+	bigtime_t start;
+	status_t status = B_OK;
+	uint64 state;
 
 	TRACE(("acquire_sem_etc(%ld): enter\n", id));
 
-	// Check for bad sem_id
-	if
-	(
-		(id < 0)		// invalid sem_id
-		||
-		(group == -1)	// non-existant group
-		||
-		(SEMVMX == semctl(group, member, GETVAL, 0)) // sem not inited yet
-	)
+	if (sem == NULL)
 		return B_BAD_SEM_ID;
-	
-	// Check for invalid count
-	if ((count < 0) || (count >= SEMVMX))
+
+	if ((int32)count <= 0)
 		return B_BAD_VALUE;
-	
-	// If we have a zero timeout, don't wait for success
-	if ((flags & B_TIMEOUT) && (timeout <= 0))
-		sem_lock.sem_flg = IPC_NOWAIT;
-
-	// Acquire the semaphore
-	if (flags & B_TIMEOUT) {
-		construct_sem_timeout(&tmout, flags, timeout);
-		err = semtimedop(group, &sem_lock, 1, &tmout);
-	} else {
-		err = semop(group, &sem_lock, 1);
+
+	// Uncontended fast path
+	state = __atomic_load_n(&sem->state, __ATOMIC_ACQUIRE);
+	for (;;) {
+		if (SEM_STATE_ID(state) != id)
+			return B_BAD_SEM_ID;
+		if (SEM_STATE_COUNT(state) < (int32)count)
+			break;
+		if (__atomic_compare_exchange_n(&sem->state, &state,
+				SEM_STATE(id, SEM_STATE_COUNT(state) - count), true,
+				__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+			sem->latest_holder = current_thread();
+			__atomic_add_fetch(&sem->acquires, 1, __ATOMIC_RELAXED);
+			return B_OK;
+		}
 	}
-	
-	// Convert the POSIX error, if any, to a B_* error
-	if (err < 0) {
-		if ((errno == ETIMEDOUT) || (errno == EAGAIN))
-			err = (sem_lock.sem_flg == IPC_NOWAIT) ? B_WOULD_BLOCK : B_TIMED_OUT;
-		else if (errno == EINTR)
-			err = B_INTERRUPTED;
-		else {
-			TRACE(("acquire_sem_etc(): undefined error %d, errno is %d\n", err, errno));
-			err = B_ERROR;
+
+	deadline = futex_deadline(flags, timeout);
+	if (deadline == 0
+			|| (deadline != B_INFINITE_TIMEOUT && deadline <= system_time()))
+		return B_WOULD_BLOCK;
+
+	start = system_time();
+
+	__atomic_add_fetch(&sem->waiting, count, __ATOMIC_SEQ_CST);
+	if (count > 1)
+		__atomic_add_fetch(&sem->greedy, 1, __ATOMIC_SEQ_CST);
+
+	for (;;) {
+		int32 seq = __atomic_load_n(&sem->wake_seq, __ATOMIC_SEQ_CST);
+
+		state = __atomic_load_n(&sem->state, __ATOMIC_SEQ_CST);
+		if (SEM_STATE_ID(state) != id) {
+			status = B_BAD_SEM_ID;
+			break;
+		}
+		if (SEM_STATE_COUNT(state) >= (int32)count) {
+			if (__atomic_compare_exchange_n(&sem->state, &state,
+					SEM_STATE(id, SEM_STATE_COUNT(state) - count), false,
+					__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+				sem->latest_holder = current_thread();
+				break;
+			}
+			continue;
+		}
+
+		int error = futex_wait(&sem->wake_seq, seq, deadline);
+		if (error == ETIMEDOUT) {
+			status = B_TIMED_OUT;
+			break;
+		} else if (error == EINTR && (flags & B_CAN_INTERRUPT) != 0) {
+			status = B_INTERRUPTED;
+			break;
 		}
 	}
-	
-	return err;
+
+	if (count > 1)
+		__atomic_sub_fetch(&sem->greedy, 1, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&sem->waiting, count, __ATOMIC_SEQ_CST);
+
+	if (status == B_OK) {
+		bigtime_t waited = system_time() - start;
+		__atomic_add_fetch(&sem->acquires, 1, __ATOMIC_RELAXED);
+		record_wait(sem, waited);
+		if (_waited != NULL)
+			*_waited = waited;
+	}
+
+	return status;
+}
+
+
+status_t
+_kern_acquire_sem_etc(sem_id id, uint32 count, uint32 flags,
+	bigtime_t timeout)
+{
+	return acquire_sem_internal(id, count, flags, timeout, NULL);
+}
+
+
+/*!	Like acquire_sem_etc(), but also returns how long the caller was
+	blocked, 0 if it wasn't. Used by ports for their own statistics.
+*/
+status_t
+acquire_sem_measured(sem_id id, uint32 flags, bigtime_t timeout,
+	bigtime_t* _blockedTime)
+{
+	*_blockedTime = 0;
+	return acquire_sem_internal(id, 1, flags, timeout, _blockedTime);
 }
 
 
@@ -289,97 +487,107 @@ _kern_release_sem(sem_id id)
 status_t
 _kern_release_sem_etc(sem_id id, uint32 count, uint32 flags)
 {
-	int group = get_group(id / SEMMSL);
-	int member = id % SEMMSL;
-	struct sembuf sem_lock = {member, count, 0};
-	int err;
+	struct sem_entry* sem = get_sem(id);
+	uint64 state;
 
 	TRACE(("release_sem_etc(%ld): enter\n", id));
 
-	// Check for bad sem_id
-	if
-	(
-		(id < 0)		// invalid sem_id
-		||
-		(group == -1)	// non-existant group
-		||
-		(SEMVMX == semctl(group, member, GETVAL, 0)) // sem not inited yet
-	)
+	if (sem == NULL)
 		return B_BAD_SEM_ID;
 
-	// Check for invalid count
-	if ((count <= 0) || (count >= SEMVMX))
+	if ((int32)count <= 0 && (flags & B_RELEASE_ALL) == 0)
 		return B_BAD_VALUE;
 
-	// Release the semaphore
-	err = semop(group, &sem_lock, 1);
-	if (err == -1)
-		return B_BAD_SEM_ID;
+	if (flags & B_RELEASE_ALL) {
+		count = __atomic_load_n(&sem->waiting, __ATOMIC_SEQ_CST);
+		if (count == 0)
+			return SEM_STATE_ID(__atomic_load_n(&sem->state,
+				__ATOMIC_ACQUIRE)) == id ? B_OK : B_BAD_SEM_ID;
+	} else if ((flags & B_RELEASE_IF_WAITING_ONLY) != 0
+			&& __atomic_load_n(&sem->waiting, __ATOMIC_SEQ_CST) == 0) {
+		return SEM_STATE_ID(__atomic_load_n(&sem->state,
+			__ATOMIC_ACQUIRE)) == id ? B_OK : B_BAD_SEM_ID;
+	}
+
+	state = __atomic_load_n(&sem->state, __ATOMIC_ACQUIRE);
+	do {
+		if (SEM_STATE_ID(state) != id)
+			return B_BAD_SEM_ID;
+		if (SEM_STATE_COUNT(state) > INT32_MAX - (int32)count)
+			return B_BAD_VALUE;
+	} while (!__atomic_compare_exchange_n(&sem->state, &state,
+		SEM_STATE(id, SEM_STATE_COUNT(state) + count), true,
+		__ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE));
 
+	wake_waiters(sem, count);
 	return B_OK;
 }
 
 
+static int32
+sem_thread_count(struct sem_entry* sem, uint64 state)
+{
+	// Haiku reports the number of waiting threads as a negative count
+	int32 count = SEM_STATE_COUNT(state);
+	if (count > 0)
+		return count;
+
+	return -__atomic_load_n(&sem->waiting, __ATOMIC_RELAXED);
+}
+
+
 status_t
 _kern_get_sem_count(sem_id id, int32* thread_count)
 {
-	int group = get_group(id / SEMMSL);
-	int member = id % SEMMSL;
-	int semcount;
-	
+	struct sem_entry* sem = get_sem(id);
+
 	TRACE(("get_sem_count(%ld): enter\n", id));
-	
-	// Check for bad sem_id
-	if
-	(
-		(id < 0)		// invalid sem_id
-		||
-		(group == -1)	// non-existant group
-	)
+
+	if (sem == NULL)
 		return B_BAD_SEM_ID;
-		
-	semcount = semctl(group, member, GETVAL, 0);
-	
-	if (semcount == SEMVMX)
+
+	uint64 state = __atomic_load_n(&sem->state, __ATOMIC_ACQUIRE);
+	if (SEM_STATE_ID(state) != id)
 		return B_BAD_SEM_ID;
 
 	// If thread_count is valid, set it
-	if (thread_count) {
-		*thread_count = semcount;
-	}
+	if (thread_count)
+		*thread_count = sem_thread_count(sem, state);
 
 	return B_OK;
 }
 
 
+static void
+fill_sem_info(struct sem_entry* sem, uint64 state, struct sem_info* info)
+{
+	info->sem = SEM_STATE_ID(state);
+	info->team = sem->owner;
+	strncpy(info->name, sem->name, B_OS_NAME_LENGTH);
+	info->name[B_OS_NAME_LENGTH - 1] = '\0';
+	info->count = sem_thread_count(sem, state);
+	info->latest_holder	= sem->latest_holder;
+}
+
+
 status_t
 _kern_get_sem_info(sem_id id, struct sem_info *info, size_t size)
 {
-	int group = get_group(id / SEMMSL);
-	int member = id % SEMMSL;
-	
+	struct sem_entry* sem = get_sem(id);
+
 	TRACE(("_get_sem_info(%ld): enter\n", id));
 
-	// Check for bad sem_id
-	if
-	(
-		(id < 0)		// invalid sem_id
-		||
-		(group == -1)	// non-existant group
-		||
-		(SEMVMX == semctl(group, member, GETVAL, 0)) // sem not inited yet
-	)
+	if (sem == NULL)
+		return B_BAD_SEM_ID;
+
+	uint64 state = __atomic_load_n(&sem->state, __ATOMIC_ACQUIRE);
+	if (SEM_STATE_ID(state) != id)
 		return B_BAD_SEM_ID;
 
 	if (info == NULL || size != sizeof(sem_info))
 		return B_BAD_VALUE;
 
-	info->sem = id;
-	info->team = getpid();
-	strcpy(info->name, "unnamed sem");
-	info->count = semctl(group, member, GETVAL, 0);
-	info->latest_holder	= 0;
-	
+	fill_sem_info(sem, state, info);
 	return B_OK;
 }
 
@@ -388,227 +596,196 @@ status_t
 _kern_get_next_sem_info(team_id team, int32 *_cookie,
 	struct sem_info *info, size_t size)
 {
+	struct sem_table* table = get_table();
+
 	TRACE(("_get_next_sem_info(): enter\n"));
-	
-	/* no-op */
-	
+
+	if (_cookie == NULL || info == NULL || size != sizeof(sem_info)
+			|| team < 0)
+		return B_BAD_VALUE;
+
+	if (table == NULL)
+		return B_BAD_SEM_ID;
+
+	if (team == B_CURRENT_TEAM)
+		team = getpid();
+
+	int32 used = __atomic_load_n(&table->used_slots, __ATOMIC_ACQUIRE);
+	for (int32 slot = *_cookie; slot >= 0 && slot < used; slot++) {
+		struct sem_entry* sem = &table->sems[slot];
+		uint64 state = __atomic_load_n(&sem->state, __ATOMIC_ACQUIRE);
+
+		if (SEM_STATE_ID(state) == SEM_FREE_ID || sem->owner != team)
+			continue;
+
+		fill_sem_info(sem, state, info);
+		*_cookie = slot + 1;
+		return B_OK;
+	}
+
 	return B_BAD_VALUE;
 }
 
 
 status_t
-_kern_set_sem_owner(sem_id id, team_id team)
+_kern_get_next_sem_stats(int32 *_cookie, struct sem_stats *stats)
 {
-	int group = get_group(id / SEMMSL);
-	int member = id % SEMMSL;
+	struct sem_table* table = get_table();
 
-	TRACE(("set_sem_owner(%ld): enter\n", id));
+	if (_cookie == NULL || stats == NULL)
+		return B_BAD_VALUE;
 
-	// Check for bad sem_id
-	if
-	(
-		(id < 0)		// invalid sem_id
-		||
-		(group == -1)	// non-existant group
-		||
-		(SEMVMX == semctl(group, member, GETVAL, 0)) // sem not inited yet
-	)
+	if (table == NULL)
 		return B_BAD_SEM_ID;
-	
-	/* no-op */
-	
-	return B_OK;
+
+	int32 used = __atomic_load_n(&table->used_slots, __ATOMIC_ACQUIRE);
+	for (int32 slot = *_cookie; slot >= 0 && slot < used; slot++) {
+		struct sem_entry* sem = &table->sems[slot];
+		uint64 state = __atomic_load_n(&sem->state, __ATOMIC_ACQUIRE);
+
+		if (SEM_STATE_ID(state) == SEM_FREE_ID)
+			continue;
+
+		// The counters are sampled without a lock, they may be
+		// slightly inconsistent with each other.
+		stats->sem = SEM_STATE_ID(state);
+		stats->owner = sem->owner;
+		strncpy(stats->name, sem->name, B_OS_NAME_LENGTH);
+		stats->name[B_OS_NAME_LENGTH - 1] = '\0';
+		stats->count = sem_thread_count(sem, state);
+		stats->acquires = __atomic_load_n(&sem->acquires, __ATOMIC_RELAXED);
+		stats->contentions = __atomic_load_n(&sem->contentions,
+			__ATOMIC_RELAXED);
+		stats->wait_time = __atomic_load_n(&sem->wait_time, __ATOMIC_RELAXED);
+		for (int32 i = 0; i < SEM_WAIT_HISTOGRAM_SIZE; i++) {
+			stats->wait_histogram[i] = __atomic_load_n(
+				&sem->wait_histogram[i], __ATOMIC_RELAXED);
+		}
+
+		*_cookie = slot + 1;
+		return B_OK;
+	}
+
+	return B_BAD_VALUE;
 }
 
 
 status_t
-_kern_switch_sem(sem_id releaseSem, sem_id id)
+_kern_set_sem_owner(sem_id id, team_id team)
 {
-	UNIMPLEMENTED();
-	return B_ERROR;
+	struct sem_entry* sem = get_sem(id);
+
+	TRACE(("set_sem_owner(%ld): enter\n", id));
+
+	if (sem == NULL
+		|| SEM_STATE_ID(__atomic_load_n(&sem->state, __ATOMIC_ACQUIRE)) != id)
+		return B_BAD_SEM_ID;
+
+	if (team < 0)
+		return B_BAD_TEAM_ID;
+
+	sem->owner = team;
+	return B_OK;
 }
 
 
+/*!	Registers a wait_for_objects() waiter on the semaphore, and returns its
+	current count along with the futex word to sleep on and its value.
+	Must be balanced by deselect_sem(), unless it fails.
+*/
 status_t
-_kern_switch_sem_etc(sem_id releaseSem, sem_id id, uint32 count, uint32 flags, bigtime_t timeout)
+select_sem(sem_id id, int32* _count, int32** _wakeSeq, int32* _seq)
 {
-	UNIMPLEMENTED();
-	return B_ERROR;
-}
+	struct sem_entry* sem = get_sem(id);
+	if (sem == NULL)
+		return B_BAD_SEM_ID;
 
+	__atomic_add_fetch(&sem->selecting, 1, __ATOMIC_SEQ_CST);
 
-void
-construct_sem_timeout(struct timespec* ts, uint32 flags, bigtime_t timeout)
-{
-	if (flags & B_ABSOLUTE_TIMEOUT) {
-		/* SysV wants a relative timeout value, so we need */
-		/* to turn this absolute time into a relative one  */
-		struct timeval now;
-		gettimeofday(&now, NULL);
-		int64 total_nsec = (timeout * 1000LL) - (now.tv_sec * 1000000000LL) - (now.tv_usec * 1000LL);
-		ts->tv_sec = total_nsec / 1000000000LL;
-		ts->tv_nsec = total_nsec % 1000000000LL;
-	} else /* B_RELATIVE_TIMEOUT */ {
-		/* We already have what we need, just convert it */
-		ts->tv_sec = timeout / 1000000LL;
-		ts->tv_nsec = (timeout % 1000000LL) * 1000L;
-	}
+	*_wakeSeq = &sem->wake_seq;
+	*_seq = __atomic_load_n(&sem->wake_seq, __ATOMIC_SEQ_CST);
 
-	/* If we ended up with an overflow in tv_nsec, spill it into tv_sec */
-	while (ts->tv_nsec >= 1000000000L) {
-		ts->tv_sec++;
-		ts->tv_nsec -= 1000000000L;
+	uint64 state = __atomic_load_n(&sem->state, __ATOMIC_SEQ_CST);
+	if (SEM_STATE_ID(state) != id) {
+		__atomic_sub_fetch(&sem->selecting, 1, __ATOMIC_SEQ_CST);
+		return B_BAD_SEM_ID;
 	}
+
+	*_count = SEM_STATE_COUNT(state);
+	return B_OK;
 }
 
 
-/*
-ADMIN_COUNT_SEM: pseudo-sem that holds the ID of the next sem to create
-ADMIN_SEM_SEM:   sole purpose is to protect the count sem
-*/
-#define ADMIN_COUNT_SEM 0
-#define ADMIN_SEM_SEM   1
-#define ADMIN_AREA_SEM  2
+void
+deselect_sem(sem_id id)
+{
+	// The counter belongs to the slot, so this is fine even if
+	// the semaphore was deleted in the meantime.
+	struct sem_entry* sem = get_sem(id);
+	if (sem != NULL)
+		__atomic_sub_fetch(&sem->selecting, 1, __ATOMIC_SEQ_CST);
+}
 
-int
-get_sem_id()
+
+status_t
+_kern_switch_sem(sem_id releaseSem, sem_id id)
 {
-	int id;
-	int err;
-
-	TRACE(("get_sem_id: enter\n"));
-
-	// See if this app already knows about the administrative sem group
-	if (sem_admin_group == -1) {
-		sem_union_t semopts;
-		key_t key = ftok("/usr/local/bin/", 's');
-		
-		// Try to create a new administrative sem group
-		sem_admin_group = semget(key, 3, IPC_CREAT | IPC_EXCL | 0700);
-		if (sem_admin_group != -1) {
-			// We created a new sem group, so we must initialize it
-			
-			// Initialize count sem to zero
-			semopts.val = 0;
-			err = semctl(sem_admin_group, ADMIN_COUNT_SEM, SETVAL, semopts);
-
-			// Initialize sem sem to one (i.e. unlocked)
-			semopts.val = 1;
-			err = semctl(sem_admin_group, ADMIN_SEM_SEM, SETVAL, semopts);
-
-			// Initialize area sem to one (i.e. unlocked)
-			semopts.val = 1;
-			err = semctl(sem_admin_group, ADMIN_AREA_SEM, SETVAL, semopts);
-		} else {
-			// A sem group already existed, so use that one
-			sem_admin_group = semget(key, 2, IPC_CREAT | 0700);
-		}
-		
-		// If we could neither create a new one, nor attach to an existing one...
-		if (sem_admin_group == -1) {
-			// ...then we are in serious trouble.  The app cannot continue in any
-			// reasonable form at this point.
-			TRACE(("get_sem_id: FATAL: semget failed (%d), abandon all hope\n", errno));
-			return -1;
-		}
-	}
-	
-	// Acquire the sem sem
-	
-	struct sembuf sem_lock = {ADMIN_SEM_SEM, -1, 0};
-	err = semop(sem_admin_group, &sem_lock, 1);
-	if (err == -1) {
-		TRACE(("get_sem_id: semop on ADMIN_SEM_SEM returned %d\n", errno));
-	}
-	
-	// Read the value of the count sem into id
-	
-	id = semctl(sem_admin_group, ADMIN_COUNT_SEM, GETVAL, 0);
-	
-	// Increment the count sem
-	
-	struct sembuf sem_increment = {ADMIN_COUNT_SEM, 1, 0};
-	err = semop(sem_admin_group, &sem_increment, 1);
-	if (err == -1) {
-		TRACE(("get_sem_id: semop on ADMIN_COUNT_SEM returned %d\n", errno));
-	}
-	
-	// Release the sem sem
-	
-	sem_lock.sem_op = 1;
-	err = semop(sem_admin_group, &sem_lock, 1);
-	if (err == -1) {
-		TRACE(("get_sem_id: semop on ADMIN_SEM_SEM returned %d\n", errno));
-	}
-	
-	// Return the read value
-	TRACE(("get_sem_id: returned id %d\n", id));
-	return id;
+	UNIMPLEMENTED();
+	return B_ERROR;
 }
 
 
-static int
-get_group(int id)
+status_t
+_kern_switch_sem_etc(sem_id releaseSem, sem_id id, uint32 count, uint32 flags, bigtime_t timeout)
 {
-	int group;
-	
-	key_t key = ftok("/dev/zero", id);
-	
-	// Create a new semaphore set
-	group = semget(key, SEMMSL, 0700);
-	if (group == -1) {
-		TRACE(("get_group(): failed to find group for group id %d!\n", id));
-	}
+	UNIMPLEMENTED();
+	return B_ERROR;
+}
+
 
-	return group;
+static void
+dump_sem(struct sem_entry* sem, uint64 state)
+{
+	printf("id: %d\t\tcount: %d\twaiting: %d\tname: '%s'\n",
+		SEM_STATE_ID(state), SEM_STATE_COUNT(state), sem->waiting, sem->name);
 }
 
 
 static int
 dump_sem_list(void)
 {
-	int id;
-	int maxsems = semctl(sem_admin_group, ADMIN_COUNT_SEM, GETVAL, 0);
-	int group;
-	int member;
-	int count;
-
-	for (id = 0; id < maxsems; id++) {
-		group = get_group(id / SEMMSL);
-		member = id % SEMMSL;
-		count = semctl(group, member, GETVAL, 0);
-		if ((count != -1) && (count != SEMVMX))
-			printf("id: %d\t\tcount: %d\n", id, count);
+	struct sem_table* table = get_table();
+	if (table == NULL)
+		return 0;
+
+	for (int32 slot = 0; slot < table->used_slots; slot++) {
+		uint64 state = __atomic_load_n(&table->sems[slot].state,
+			__ATOMIC_ACQUIRE);
+		if (SEM_STATE_ID(state) != SEM_FREE_ID)
+			dump_sem(&table->sems[slot], state);
 	}
 	return 0;
 }
 
 
-static void
-dump_sem(int id)
-{
-	int maxsems = semctl(sem_admin_group, ADMIN_COUNT_SEM, GETVAL, 0);
-	
-	if ((id < maxsems) && (id >= 0)) {
-		int group = get_group(id / SEMMSL);
-		int member = id % SEMMSL;
-		int count = semctl(group, member, GETVAL, 0);
-		
-		if ((count != -1) && (count != SEMVMX))
-			printf("id: %d\t\tcount: %d\n", id, count);
-		else
-			printf("There is no active semaphore with that ID.\n");
-	} else
-		printf("A semaphore with that ID has never existed.\n");
-}
-
 int
 dump_sem_info(int argc, char **argv)
 {
 	if (argc < 2)
-		dump_sem_list();
+		return dump_sem_list();
+
+	sem_id id = atoi(argv[1]);
+	struct sem_entry* sem = get_sem(id);
+	if (sem == NULL) {
+		printf("A semaphore with that ID has never existed.\n");
+		return 0;
+	}
+
+	uint64 state = __atomic_load_n(&sem->state, __ATOMIC_ACQUIRE);
+	if (SEM_STATE_ID(state) == id)
+		dump_sem(sem, state);
 	else
-		dump_sem(atoi(argv[1]));
+		printf("There is no active semaphore with that ID.\n");
 
 	return 0;
 }
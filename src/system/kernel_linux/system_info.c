@@ -5,6 +5,12 @@
 
 #include <syscalls.h>
 
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/time.h>
 #include <sys/utsname.h>
 
@@ -19,12 +25,25 @@ _kern_is_computer_on()
 }
 
 
+// The system time base is CLOCK_MONOTONIC, which doesn't jump with the
+// wall clock and is read through the vDSO, without entering the kernel.
+
+
 bigtime_t
 system_time()
 {
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	return (1000000LL * tv.tv_sec) + tv.tv_usec;	
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (1000000LL * ts.tv_sec) + ts.tv_nsec / 1000;
+}
+
+
+nanotime_t
+system_time_nsecs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (1000000000LL * ts.tv_sec) + ts.tv_nsec;
 }
 
 
@@ -32,12 +51,60 @@ status_t
 _kern_snooze_etc(bigtime_t amount, int timeBase, int32 flags,
 	bigtime_t* _remainingTime)
 {
-	// timebase is ignored
+	// Other time bases are clockid_t values
+	clockid_t clock = timeBase;
+	bigtime_t now;
+
+	if (timeBase == B_SYSTEM_TIMEBASE) {
+		clock = (flags & B_TIMEOUT_REAL_TIME_BASE) != 0
+			? CLOCK_REALTIME : CLOCK_MONOTONIC;
+	}
+
+	{
+		struct timespec ts;
+		if (clock_gettime(clock, &ts) != 0)
+			return B_BAD_VALUE;
+		now = (1000000LL * ts.tv_sec) + ts.tv_nsec / 1000;
+	}
+
+	// Sleep to an absolute deadline, so that interruptions and periodic
+	// callers don't accumulate any drift.
+	bigtime_t deadline;
+	if ((flags & B_ABSOLUTE_TIMEOUT) != 0)
+		deadline = amount;
+	else if (amount > B_INFINITE_TIMEOUT - now)
+		deadline = B_INFINITE_TIMEOUT;
+	else
+		deadline = now + (amount > 0 ? amount : 0);
+
+	if (deadline < 0)
+		deadline = 0;
 
 	if (_remainingTime != NULL)
 		*_remainingTime = 0;
 
-	return usleep(amount);
+	struct timespec ts;
+	ts.tv_sec = deadline / 1000000LL;
+	ts.tv_nsec = (deadline % 1000000LL) * 1000L;
+
+	while (true) {
+		int error = clock_nanosleep(clock, TIMER_ABSTIME, &ts, NULL);
+		if (error == 0)
+			return B_OK;
+		if (error != EINTR)
+			return B_BAD_VALUE;
+
+		if ((flags & B_CAN_INTERRUPT) != 0) {
+			if (_remainingTime != NULL) {
+				struct timespec current;
+				clock_gettime(clock, &current);
+				bigtime_t remaining = deadline
+					- ((1000000LL * current.tv_sec) + current.tv_nsec / 1000);
+				*_remainingTime = remaining > 0 ? remaining : 0;
+			}
+			return B_INTERRUPTED;
+		}
+	}
 }
 
 
@@ -71,15 +138,293 @@ _kern_get_system_info(system_info* info)
 status_t
 _kern_get_cpu_info(uint32 firstCPU, uint32 cpuCount, cpu_info* info)
 {
-	UNIMPLEMENTED();
-	return B_ERROR;
+	if (info == NULL || cpuCount == 0)
+		return B_BAD_VALUE;
+
+	uint32 configuredCount = sysconf(_SC_NPROCESSORS_CONF);
+	if (firstCPU >= configuredCount)
+		return B_BAD_VALUE;
+	if (cpuCount > configuredCount - firstCPU)
+		cpuCount = configuredCount - firstCPU;
+
+	memset(info, 0, sizeof(cpu_info) * cpuCount);
+
+	FILE* file = fopen("/proc/stat", "re");
+	if (file == NULL)
+		return B_ERROR;
+
+	// Offline CPUs aren't listed, they stay disabled
+	long ticksPerSecond = sysconf(_SC_CLK_TCK);
+	char line[256];
+	while (fgets(line, sizeof(line), file) != NULL) {
+		uint32 cpu;
+		unsigned long long user, nice, system, idle, ioWait, irq, softIRQ,
+			steal;
+		if (sscanf(line, "cpu%" B_SCNu32 " %llu %llu %llu %llu %llu %llu %llu "
+				"%llu", &cpu, &user, &nice, &system, &idle, &ioWait, &irq,
+				&softIRQ, &steal) != 9) {
+			continue;
+		}
+		if (cpu < firstCPU || cpu - firstCPU >= cpuCount)
+			continue;
+
+		unsigned long long active = user + nice + system + irq + softIRQ
+			+ steal;
+		info[cpu - firstCPU].active_time
+			= (bigtime_t)(active * 1000000ULL / ticksPerSecond);
+		info[cpu - firstCPU].enabled = true;
+	}
+
+	fclose(file);
+	return B_OK;
+}
+
+
+// #pragma mark - topology
+
+
+typedef struct {
+	uint32	package;
+	uint32	core;
+	uint32	cpu;
+} cpu_location;
+
+
+static bool
+read_cpu_value(uint32 cpu, const char* file, uint64* _value)
+{
+	char path[128];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%" B_PRIu32
+		"/%s", cpu, file);
+
+	FILE* stream = fopen(path, "re");
+	if (stream == NULL)
+		return false;
+
+	unsigned long long value;
+	bool success = fscanf(stream, "%llu", &value) == 1;
+	fclose(stream);
+
+	if (success)
+		*_value = value;
+	return success;
+}
+
+
+static int
+compare_cpu_locations(const void* _a, const void* _b)
+{
+	const cpu_location* a = (const cpu_location*)_a;
+	const cpu_location* b = (const cpu_location*)_b;
+
+	if (a->package != b->package)
+		return a->package < b->package ? -1 : 1;
+	if (a->core != b->core)
+		return a->core < b->core ? -1 : 1;
+	if (a->cpu != b->cpu)
+		return a->cpu < b->cpu ? -1 : 1;
+	return 0;
+}
+
+
+//! Returns the online CPUs sorted by package and core, to be freed.
+static cpu_location*
+get_cpu_locations(uint32* _count)
+{
+	uint32 configuredCount = sysconf(_SC_NPROCESSORS_CONF);
+	cpu_location* locations = malloc(sizeof(cpu_location) * configuredCount);
+	if (locations == NULL)
+		return NULL;
+
+	uint32 count = 0;
+	for (uint32 cpu = 0; cpu < configuredCount; cpu++) {
+		uint64 value;
+		if (read_cpu_value(cpu, "online", &value) && value == 0)
+			continue;
+
+		cpu_location* location = &locations[count++];
+		location->cpu = cpu;
+		location->package = read_cpu_value(cpu,
+			"topology/physical_package_id", &value) ? value : 0;
+		location->core = read_cpu_value(cpu, "topology/core_id", &value)
+			? value : cpu;
+	}
+
+	qsort(locations, count, sizeof(cpu_location), &compare_cpu_locations);
+	*_count = count;
+	return locations;
+}
+
+
+static enum cpu_platform
+cpu_platform()
+{
+#if defined(__x86_64__)
+	return B_CPU_x86_64;
+#elif defined(__i386__)
+	return B_CPU_x86;
+#elif defined(__aarch64__)
+	return B_CPU_ARM_64;
+#elif defined(__arm__)
+	return B_CPU_ARM;
+#elif defined(__powerpc64__)
+	return B_CPU_PPC_64;
+#elif defined(__powerpc__)
+	return B_CPU_PPC;
+#else
+	return B_CPU_UNKNOWN;
+#endif
+}
+
+
+//! Reads the vendor and the model of the CPUs, assuming they're all alike.
+static void
+read_cpu_identity(enum cpu_vendor* _vendor, uint32* _model, uint64* _frequency)
+{
+	*_vendor = B_CPU_VENDOR_UNKNOWN;
+	*_model = 0;
+	*_frequency = 0;
+
+	FILE* file = fopen("/proc/cpuinfo", "re");
+	if (file == NULL)
+		return;
+
+	char line[256];
+	double megaHertz = 0;
+	while (fgets(line, sizeof(line), file) != NULL) {
+		char vendor[64];
+		if (sscanf(line, "vendor_id : %63s", vendor) == 1) {
+			if (strcmp(vendor, "GenuineIntel") == 0)
+				*_vendor = B_CPU_VENDOR_INTEL;
+			else if (strcmp(vendor, "AuthenticAMD") == 0)
+				*_vendor = B_CPU_VENDOR_AMD;
+			else if (strcmp(vendor, "CentaurHauls") == 0)
+				*_vendor = B_CPU_VENDOR_VIA;
+			else if (strcmp(vendor, "CyrixInstead") == 0)
+				*_vendor = B_CPU_VENDOR_CYRIX;
+			else if (strcmp(vendor, "GenuineTMx86") == 0)
+				*_vendor = B_CPU_VENDOR_TRANSMETA;
+		} else if (sscanf(line, "model : %" B_SCNu32, _model) == 1
+			|| sscanf(line, "cpu MHz : %lf", &megaHertz) == 1) {
+			continue;
+		} else if (line[0] == '\n')
+			break;
+	}
+	fclose(file);
+
+	// cpufreq knows the nominal frequency, in kHz
+	uint64 kiloHertz;
+	if (read_cpu_value(0, "cpufreq/base_frequency", &kiloHertz)
+		|| read_cpu_value(0, "cpufreq/cpuinfo_max_freq", &kiloHertz)) {
+		*_frequency = kiloHertz * 1000;
+	} else
+		*_frequency = (uint64)(megaHertz * 1000000);
+}
+
+
+static uint32
+cache_line_size()
+{
+	uint64 size;
+	if (read_cpu_value(0, "cache/index0/coherency_line_size", &size))
+		return size;
+
+	long lineSize = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+	return lineSize > 0 ? lineSize : 64;
+}
+
+
+//! Sets _node to the new node, or to NULL if it doesn't fit.
+static void
+add_topology_node(cpu_topology_node_info* infos, uint32 maxCount,
+	uint32* _count, uint32 id, enum topology_level_type type, uint32 level,
+	cpu_topology_node_info** _node)
+{
+	cpu_topology_node_info* node = NULL;
+	if (*_count < maxCount) {
+		node = &infos[*_count];
+		memset(node, 0, sizeof(cpu_topology_node_info));
+		node->id = id;
+		node->type = type;
+		node->level = level;
+	}
+
+	(*_count)++;
+	*_node = node;
 }
 
 
+/*!	Fills in the topology tree depth first: the root, then every package
+	followed by its cores, each followed by its SMT threads. Without a
+	buffer, only the number of nodes is returned.
+*/
 status_t
 _kern_get_cpu_topology_info(cpu_topology_node_info* topologyInfos,
 	uint32* topologyInfoCount)
 {
-	UNIMPLEMENTED();
-	return B_ERROR;
+	if (topologyInfoCount == NULL)
+		return B_BAD_VALUE;
+
+	uint32 cpuCount;
+	cpu_location* locations = get_cpu_locations(&cpuCount);
+	if (locations == NULL)
+		return B_NO_MEMORY;
+
+	uint32 nodeCount = 1 + cpuCount;
+	for (uint32 i = 0; i < cpuCount; i++) {
+		if (i == 0 || locations[i].package != locations[i - 1].package)
+			nodeCount += 2;
+		else if (locations[i].core != locations[i - 1].core)
+			nodeCount++;
+	}
+
+	if (topologyInfos == NULL) {
+		free(locations);
+		*topologyInfoCount = nodeCount;
+		return B_OK;
+	}
+
+	enum cpu_vendor vendor;
+	uint32 model;
+	uint64 frequency;
+	read_cpu_identity(&vendor, &model, &frequency);
+	uint32 lineSize = cache_line_size();
+
+	uint32 maxCount = *topologyInfoCount;
+	uint32 count = 0;
+	cpu_topology_node_info* node;
+
+	add_topology_node(topologyInfos, maxCount, &count, 0, B_TOPOLOGY_ROOT, 3,
+		&node);
+	if (node != NULL)
+		node->data.root.platform = cpu_platform();
+
+	for (uint32 i = 0; i < cpuCount; i++) {
+		bool newPackage = i == 0
+			|| locations[i].package != locations[i - 1].package;
+		if (newPackage) {
+			add_topology_node(topologyInfos, maxCount, &count,
+				locations[i].package, B_TOPOLOGY_PACKAGE, 2, &node);
+			if (node != NULL) {
+				node->data.package.vendor = vendor;
+				node->data.package.cache_line_size = lineSize;
+			}
+		}
+
+		if (newPackage || locations[i].core != locations[i - 1].core) {
+			add_topology_node(topologyInfos, maxCount, &count,
+				locations[i].core, B_TOPOLOGY_CORE, 1, &node);
+			if (node != NULL) {
+				node->data.core.model = model;
+				node->data.core.default_frequency = frequency;
+			}
+		}
+
+		add_topology_node(topologyInfos, maxCount, &count, locations[i].cpu,
+			B_TOPOLOGY_SMT, 0, &node);
+	}
+
+	free(locations);
+	*topologyInfoCount = count < maxCount ? count : maxCount;
+	return B_OK;
 }
@@ -4,6 +4,240 @@
  */
 
 #include <syscalls.h>
+#include <user_timer_defs.h>
+
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+
+#include "futex.h"
+
+
+// User timers are POSIX per-process timers. The predefined ones are
+// created lazily the first time they're set, the user defined ones by
+// _kern_create_timer(). Signals go to the team, or to a single thread
+// when USER_TIMER_SIGNAL_THREAD is passed, by the means of
+// SIGEV_THREAD_ID.
+//
+// Linux timers are not inherited across fork(), so the child starts
+// with an empty table.
+
+#define MAX_USER_TIMERS \
+	(USER_TIMER_FIRST_USER_DEFINED_ID + MAX_USER_TIMERS_PER_TEAM)
+
+// The Linux encoding of the process wide user time only CPU clock,
+// see CPUCLOCK_VIRT in the kernel sources.
+#define CLOCK_PROCESS_VIRTUAL_ID ((clockid_t)(~7 | 1))
+
+#ifndef sigev_notify_thread_id
+#	define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+
+struct user_timer {
+	timer_t		timer;
+	bool		created;
+};
+
+
+static int32 sUserTimersLock = 0;
+static user_timer sUserTimers[MAX_USER_TIMERS];
+static pthread_once_t sUserTimersOnce = PTHREAD_ONCE_INIT;
+
+
+static void
+reinit_timers_at_fork()
+{
+	sUserTimersLock = 0;
+	memset(sUserTimers, 0, sizeof(sUserTimers));
+}
+
+
+static void
+init_timers()
+{
+	pthread_atfork(NULL, NULL, &reinit_timers_at_fork);
+}
+
+
+static inline bigtime_t
+timespec_to_bigtime(const struct timespec& time)
+{
+	return (bigtime_t)time.tv_sec * 1000000LL + time.tv_nsec / 1000;
+}
+
+
+static inline void
+bigtime_to_timespec(bigtime_t time, struct timespec& _time)
+{
+	_time.tv_sec = time / 1000000LL;
+	_time.tv_nsec = (time % 1000000LL) * 1000L;
+}
+
+
+static status_t
+create_timer_locked(int32 id, clockid_t clockID, struct sigevent& event)
+{
+	if (timer_create(clockID, &event, &sUserTimers[id].timer) != 0)
+		return errno == EINVAL ? B_BAD_VALUE : B_NO_MEMORY;
+
+	sUserTimers[id].created = true;
+	return B_OK;
+}
+
+
+//! Creates the predefined timer on first use.
+static status_t
+get_timer_locked(int32 id, timer_t& _timer)
+{
+	if (id < 0 || id >= MAX_USER_TIMERS)
+		return B_BAD_VALUE;
+
+	if (!sUserTimers[id].created) {
+		if (id >= USER_TIMER_FIRST_USER_DEFINED_ID)
+			return B_BAD_VALUE;
+
+		struct sigevent event;
+		memset(&event, 0, sizeof(event));
+		event.sigev_notify = SIGEV_SIGNAL;
+		event.sigev_value.sival_int = id;
+
+		clockid_t clockID;
+		switch (id) {
+			case USER_TIMER_REAL_TIME_ID:
+				clockID = CLOCK_MONOTONIC;
+				event.sigev_signo = SIGALRM;
+				break;
+			case USER_TIMER_TEAM_TOTAL_TIME_ID:
+				clockID = CLOCK_PROCESS_CPUTIME_ID;
+				event.sigev_signo = SIGPROF;
+				break;
+			default:
+				clockID = CLOCK_PROCESS_VIRTUAL_ID;
+				event.sigev_signo = SIGVTALRM;
+				break;
+		}
+
+		status_t error = create_timer_locked(id, clockID, event);
+		if (error != B_OK)
+			return error;
+	}
+
+	_timer = sUserTimers[id].timer;
+	return B_OK;
+}
+
+
+static void
+fill_timer_info(timer_t timer, const struct itimerspec& spec,
+	user_timer_info* info)
+{
+	if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+		info->remaining_time = B_INFINITE_TIMEOUT;
+	else
+		info->remaining_time = timespec_to_bigtime(spec.it_value);
+
+	info->interval = timespec_to_bigtime(spec.it_interval);
+
+	int overruns = timer_getoverrun(timer);
+	info->overrun_count = overruns > 0 ? overruns : 0;
+}
+
+
+int32
+_kern_create_timer(clockid_t clockID, thread_id threadID, uint32 flags,
+	const struct sigevent* event,
+	const struct thread_creation_attributes* threadAttributes)
+{
+	if (clockID == CLOCK_PROCESS_USER_CPUTIME_ID)
+		clockID = CLOCK_PROCESS_VIRTUAL_ID;
+
+	pthread_once(&sUserTimersOnce, &init_timers);
+
+	futex_lock(&sUserTimersLock);
+
+	int32 id = USER_TIMER_FIRST_USER_DEFINED_ID;
+	while (id < MAX_USER_TIMERS && sUserTimers[id].created)
+		id++;
+
+	if (id == MAX_USER_TIMERS) {
+		futex_unlock(&sUserTimersLock);
+		return B_WOULD_BLOCK;
+	}
+
+	struct sigevent timerEvent;
+	if (event != NULL) {
+		timerEvent = *event;
+	} else {
+		memset(&timerEvent, 0, sizeof(timerEvent));
+		timerEvent.sigev_notify = SIGEV_SIGNAL;
+		timerEvent.sigev_signo = SIGALRM;
+		timerEvent.sigev_value.sival_int = id;
+	}
+
+	if ((flags & USER_TIMER_SIGNAL_THREAD) != 0 && threadID > 0
+			&& timerEvent.sigev_notify == SIGEV_SIGNAL) {
+		timerEvent.sigev_notify = SIGEV_THREAD_ID;
+		timerEvent.sigev_notify_thread_id = threadID;
+	}
+
+	status_t error = create_timer_locked(id, clockID, timerEvent);
+
+	futex_unlock(&sUserTimersLock);
+
+	return error == B_OK ? id : error;
+}
+
+
+status_t
+_kern_delete_timer(int32 timerID, thread_id threadID)
+{
+	if (timerID < USER_TIMER_FIRST_USER_DEFINED_ID
+			|| timerID >= MAX_USER_TIMERS) {
+		return B_BAD_VALUE;
+	}
+
+	futex_lock(&sUserTimersLock);
+
+	if (!sUserTimers[timerID].created) {
+		futex_unlock(&sUserTimersLock);
+		return B_BAD_VALUE;
+	}
+
+	timer_delete(sUserTimers[timerID].timer);
+	sUserTimers[timerID].created = false;
+
+	futex_unlock(&sUserTimersLock);
+	return B_OK;
+}
+
+
+status_t
+_kern_get_timer(int32 timerID, thread_id threadID,
+	struct user_timer_info* info)
+{
+	if (info == NULL)
+		return B_BAD_ADDRESS;
+
+	futex_lock(&sUserTimersLock);
+
+	timer_t timer;
+	status_t error = B_OK;
+	if (timerID >= 0 && timerID < USER_TIMER_FIRST_USER_DEFINED_ID
+			&& !sUserTimers[timerID].created) {
+		// a predefined timer that was never set
+		info->remaining_time = B_INFINITE_TIMEOUT;
+		info->interval = 0;
+		info->overrun_count = 0;
+	} else if ((error = get_timer_locked(timerID, timer)) == B_OK) {
+		struct itimerspec spec;
+		timer_gettime(timer, &spec);
+		fill_timer_info(timer, spec, info);
+	}
+
+	futex_unlock(&sUserTimersLock);
+	return error;
+}
 
 
 status_t
@@ -11,6 +245,46 @@ _kern_set_timer(int32 timerID, thread_id threadID,
 	bigtime_t startTime, bigtime_t interval, uint32 flags,
 	struct user_timer_info* oldInfo)
 {
-	UNIMPLEMENTED();
-	return B_ERROR;
+	if (interval < 0)
+		return B_BAD_VALUE;
+
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+
+	if (startTime != B_INFINITE_TIMEOUT) {
+		// The timers are not necessarily on the clock of the requested
+		// time base, make the start time relative.
+		if ((flags & B_ABSOLUTE_TIMEOUT) != 0) {
+			startTime -= (flags & B_TIMEOUT_REAL_TIME_BASE) != 0
+				? real_time_clock_usecs() : system_time();
+		}
+
+		// a zero it_value would disarm the timer
+		if (startTime <= 0)
+			spec.it_value.tv_nsec = 1;
+		else
+			bigtime_to_timespec(startTime, spec.it_value);
+
+		bigtime_to_timespec(interval, spec.it_interval);
+	}
+
+	pthread_once(&sUserTimersOnce, &init_timers);
+
+	futex_lock(&sUserTimersLock);
+
+	timer_t timer;
+	status_t error = get_timer_locked(timerID, timer);
+	if (error != B_OK) {
+		futex_unlock(&sUserTimersLock);
+		return error;
+	}
+
+	struct itimerspec oldSpec;
+	if (timer_settime(timer, 0, &spec, &oldSpec) != 0)
+		error = B_BAD_VALUE;
+	else if (oldInfo != NULL)
+		fill_timer_info(timer, oldSpec, oldInfo);
+
+	futex_unlock(&sUserTimersLock);
+	return error;
 }
@@ -1,17 +1,543 @@
 /*
- * Copyright 2018, Dario Casalinuovo.
+ * Copyright 2018-2020, Dario Casalinuovo.
  * Distributed under the terms of the LGPL License.
  */
 
 #include <OS.h>
 
+#include <new>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+
 #include <syscalls.h>
 
+#include "futex.h"
+#include "main.h"
+
+
+// Ports and semaphores boil down to semaphores living in the shared sem
+// table: a port is readable when its read sem can be acquired, and
+// writable when its write sem can be. We register on each of those
+// semaphores, and sleep on all their wake words at once, along with the
+// exit words of the threads.
+//
+// File descriptors can't be part of the same sleep. Sets made of file
+// descriptors only are waited for in poll(). In mixed sets, the thread
+// polls the file descriptors and an eventfd, while a helper thread sleeps
+// on the wake words for it, and writes to the eventfd when one changes.
+//
+// Without futex_waitv() (Linux 5.16, or older kernel headers), only one
+// word can be slept on, and the remaining objects are looked at again
+// every POLL_INTERVAL.
+
+#define POLL_INTERVAL 10000
+
+// the limit of futex_waitv(), FUTEX_WAITV_MAX
+#define MAX_WAIT_WORDS 128
+
+#define ALWAYS_REPORTED_EVENTS \
+	(B_EVENT_INVALID | B_EVENT_ERROR | B_EVENT_DISCONNECTED)
+
+
+struct wait_set {
+	int32*				words[MAX_WAIT_WORDS];
+	int32				values[MAX_WAIT_WORDS];
+	sem_id				sems[MAX_WAIT_WORDS];
+	void*				threads[MAX_WAIT_WORDS];
+	int32				count;
+
+	// the last entry is reserved for the eventfd of the fd_waker
+	struct pollfd		fds[MAX_WAIT_WORDS + 1];
+	int32				fdCount;
+};
+
+
+enum {
+	FD_WAKER_IDLE,
+	FD_WAKER_ARMED,
+	FD_WAKER_QUIT
+};
+
+// The helper thread of a thread that waits on mixed sets. It is created
+// the first time it is needed, and quits along with its thread.
+struct fd_waker {
+	pid_t				team;
+	int					eventFD;
+	int32				state;
+	int32				cancel;
+		// slept on along with the set, to stop the helper early
+	wait_set*			set;
+	bigtime_t			deadline;
+	int					error;
+};
+
+
+static pthread_once_t sFDWakerKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t sFDWakerKey;
+static __thread fd_waker* sFDWaker;
+static bool sNoWaitMultiple = false;
+
+
+static void
+deselect_all(wait_set& set)
+{
+	for (int32 i = 0; i < set.count; i++) {
+		if (set.threads[i] != NULL)
+			deselect_thread(set.threads[i]);
+		else
+			deselect_sem(set.sems[i]);
+	}
+	set.count = 0;
+}
+
+
+//! Sets ready if the semaphore could be acquired right now.
+static status_t
+select_wait_sem(wait_set& set, sem_id sem, bool& ready)
+{
+	if (set.count == MAX_WAIT_WORDS)
+		return B_BAD_VALUE;
+
+	int32 count;
+	int32* word;
+	int32 seq;
+	status_t error = select_sem(sem, &count, &word, &seq);
+	if (error != B_OK)
+		return error;
+
+	set.words[set.count] = word;
+	set.values[set.count] = seq;
+	set.sems[set.count] = sem;
+	set.threads[set.count++] = NULL;
+
+	ready = count > 0;
+	return B_OK;
+}
+
+
+//! Sets gone if the thread exited already.
+static status_t
+select_wait_thread(wait_set& set, thread_id thread, bool& gone)
+{
+	if (set.count == MAX_WAIT_WORDS)
+		return B_BAD_VALUE;
+
+	void* cookie;
+	int32* word;
+	status_t error = select_thread(thread, &cookie, &word);
+	if (error != B_OK)
+		return error;
+
+	set.words[set.count] = word;
+	set.values[set.count] = 0;
+	set.sems[set.count] = -1;
+	set.threads[set.count++] = cookie;
+
+	gone = __atomic_load_n(word, __ATOMIC_ACQUIRE) != 0;
+	return B_OK;
+}
+
+
+//! Sets the events of the file descriptor that already occurred.
+static void
+select_fd(wait_set& set, int fd, uint16 wanted, uint16& events)
+{
+	struct pollfd& pollFD = set.fds[set.fdCount++];
+	pollFD.fd = fd;
+	pollFD.events = 0;
+	if ((wanted & B_EVENT_READ) != 0)
+		pollFD.events |= POLLIN;
+	if ((wanted & B_EVENT_WRITE) != 0)
+		pollFD.events |= POLLOUT;
+	if ((wanted & B_EVENT_PRIORITY_READ) != 0)
+		pollFD.events |= POLLPRI;
+	pollFD.revents = 0;
+
+	if (poll(&pollFD, 1, 0) < 0)
+		return;
+
+	uint16 result = 0;
+	if ((pollFD.revents & POLLIN) != 0)
+		result |= B_EVENT_READ;
+	if ((pollFD.revents & POLLOUT) != 0)
+		result |= B_EVENT_WRITE;
+	if ((pollFD.revents & POLLPRI) != 0)
+		result |= B_EVENT_PRIORITY_READ;
+	if ((pollFD.revents & POLLERR) != 0)
+		result |= B_EVENT_ERROR;
+	if ((pollFD.revents & POLLHUP) != 0)
+		result |= B_EVENT_DISCONNECTED;
+	if ((pollFD.revents & POLLNVAL) != 0)
+		result |= B_EVENT_INVALID;
+	events = result;
+}
+
+
+/*!	Sleeps until one of the words of the set changes, or \a cancel if it
+	is not \c NULL. Returns the same values as futex_wait(), and ENOSYS if
+	the kernel or the headers we were built with can't do that.
+*/
+static int
+wait_words(const wait_set& set, int32* cancel, bigtime_t deadline)
+{
+#ifdef FUTEX_WAITV_MAX
+	struct futex_waitv waiters[MAX_WAIT_WORDS + 1];
+	int32 count = 0;
+
+	for (int32 i = 0; i < set.count; i++) {
+		waiters[count].val = (uint32)set.values[i];
+		waiters[count].uaddr = (uint64)(addr_t)set.words[i];
+		waiters[count].flags = FUTEX_32;
+		waiters[count].__reserved = 0;
+		count++;
+	}
+	if (cancel != NULL) {
+		waiters[count].val = 0;
+		waiters[count].uaddr = (uint64)(addr_t)cancel;
+		waiters[count].flags = FUTEX_32;
+		waiters[count].__reserved = 0;
+		count++;
+	}
+
+	return futex_wait_multiple(waiters, count, deadline);
+#else
+	return ENOSYS;
+#endif
+}
+
+
+//!	Returns the same values as futex_wait().
+static int
+poll_fds(struct pollfd* fds, int32 count, bigtime_t deadline)
+{
+	struct timespec ts;
+	struct timespec* tsp = NULL;
+
+	if (deadline != B_INFINITE_TIMEOUT) {
+		bigtime_t timeout = deadline - system_time();
+		if (timeout < 0)
+			timeout = 0;
+		ts.tv_sec = timeout / 1000000LL;
+		ts.tv_nsec = (timeout % 1000000LL) * 1000L;
+		tsp = &ts;
+	}
+
+	int result = ppoll(fds, count, tsp, NULL);
+	if (result < 0)
+		return errno;
+
+	return result == 0 ? ETIMEDOUT : 0;
+}
+
+
+static void*
+fd_waker_thread(void* data)
+{
+	fd_waker* waker = (fd_waker*)data;
+
+	while (true) {
+		int32 state = __atomic_load_n(&waker->state, __ATOMIC_ACQUIRE);
+		if (state == FD_WAKER_QUIT)
+			break;
+		if (state == FD_WAKER_IDLE) {
+			futex_wait(&waker->state, FD_WAKER_IDLE, B_INFINITE_TIMEOUT);
+			continue;
+		}
+
+		waker->error = wait_words(*waker->set, &waker->cancel,
+			waker->deadline);
+
+		uint64 value = 1;
+		write(waker->eventFD, &value, sizeof(value));
+
+		__atomic_store_n(&waker->state, FD_WAKER_IDLE, __ATOMIC_RELEASE);
+		futex_wake(&waker->state, 1);
+	}
+
+	close(waker->eventFD);
+	delete waker;
+	return NULL;
+}
+
+
+static void
+put_fd_waker(void* data)
+{
+	fd_waker* waker = (fd_waker*)data;
+
+	__atomic_store_n(&waker->state, FD_WAKER_QUIT, __ATOMIC_RELEASE);
+	futex_wake(&waker->state, 1);
+}
+
+
+static void
+init_fd_waker_key()
+{
+	pthread_key_create(&sFDWakerKey, &put_fd_waker);
+}
+
+
+//!	Returns the fd_waker of the calling thread, creating it if needed.
+static fd_waker*
+get_fd_waker()
+{
+	// the helper thread doesn't survive a fork()
+	if (sFDWaker != NULL && sFDWaker->team == getpid())
+		return sFDWaker;
+
+	pthread_once(&sFDWakerKeyOnce, &init_fd_waker_key);
+
+	fd_waker* waker = new(std::nothrow) fd_waker;
+	if (waker == NULL)
+		return NULL;
+
+	waker->team = getpid();
+	waker->state = FD_WAKER_IDLE;
+	waker->cancel = 0;
+	waker->set = NULL;
+	waker->deadline = B_INFINITE_TIMEOUT;
+	waker->error = 0;
+	waker->eventFD = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (waker->eventFD < 0) {
+		delete waker;
+		return NULL;
+	}
+
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attributes, 64 * 1024);
+
+	// signals are meant for the threads of the application
+	sigset_t allSignals;
+	sigset_t oldSignals;
+	sigfillset(&allSignals);
+	pthread_sigmask(SIG_SETMASK, &allSignals, &oldSignals);
+
+	pthread_t thread;
+	int error = pthread_create(&thread, &attributes, &fd_waker_thread,
+		waker);
+
+	pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+	pthread_attr_destroy(&attributes);
+
+	if (error != 0) {
+		close(waker->eventFD);
+		delete waker;
+		return NULL;
+	}
+
+	sFDWaker = waker;
+	pthread_setspecific(sFDWakerKey, waker);
+	return waker;
+}
+
+
+/*!	Waits for the file descriptors of the set in poll(), while the
+	fd_waker waits for the wake words.
+*/
+static int
+wait_fds_and_words(wait_set& set, fd_waker* waker, bigtime_t deadline)
+{
+	waker->set = &set;
+	waker->deadline = deadline;
+	waker->cancel = 0;
+	waker->error = 0;
+	__atomic_store_n(&waker->state, FD_WAKER_ARMED, __ATOMIC_RELEASE);
+	futex_wake(&waker->state, 1);
+
+	struct pollfd& wakeFD = set.fds[set.fdCount];
+	wakeFD.fd = waker->eventFD;
+	wakeFD.events = POLLIN;
+	wakeFD.revents = 0;
+
+	int error = poll_fds(set.fds, set.fdCount + 1, deadline);
+
+	// stop the helper, the set must not be touched after we return
+	__atomic_store_n(&waker->cancel, 1, __ATOMIC_RELEASE);
+	futex_wake(&waker->cancel, 1);
+
+	int32 state;
+	while ((state = __atomic_load_n(&waker->state, __ATOMIC_ACQUIRE))
+			== FD_WAKER_ARMED) {
+		futex_wait(&waker->state, state, B_INFINITE_TIMEOUT);
+	}
+
+	uint64 value;
+	read(waker->eventFD, &value, sizeof(value));
+
+	if (waker->error == ENOSYS)
+		sNoWaitMultiple = true;
+
+	return error;
+}
+
+
+/*!	Waits until something happens to the set, or the deadline passes.
+	Returns the same values as futex_wait(), spurious wake ups included.
+*/
+static int
+wait_set_changed(wait_set& set, bigtime_t deadline)
+{
+	if (set.count == 0) {
+		// nothing but file descriptors
+		return poll_fds(set.fds, set.fdCount, deadline);
+	}
+
+	if (!sNoWaitMultiple) {
+		if (set.fdCount == 0) {
+			int error = wait_words(set, NULL, deadline);
+			if (error != ENOSYS)
+				return error;
+			sNoWaitMultiple = true;
+		} else if (set.count < MAX_WAIT_WORDS) {
+			// there must be room for the cancel word of the helper
+			fd_waker* waker = get_fd_waker();
+			if (waker != NULL)
+				return wait_fds_and_words(set, waker, deadline);
+		}
+	}
+
+	// Look at everything again from time to time, when we can't sleep on
+	// all of it at once
+	if (set.count > 1 || set.fdCount > 0) {
+		bigtime_t wakeUp = system_time() + POLL_INTERVAL;
+		if (deadline == B_INFINITE_TIMEOUT || deadline > wakeUp)
+			deadline = wakeUp;
+	}
+
+	if (set.fdCount > 0)
+		return poll_fds(set.fds, set.fdCount, deadline);
+
+	return futex_wait(set.words[0], set.values[0], deadline);
+}
+
+
+/*!	Returns the events of the object that already occurred, registering
+	it in the wait set on the way.
+*/
+static status_t
+select_object(wait_set& set, const object_wait_info& info, uint16& events)
+{
+	bool ready = false;
+	status_t error = B_OK;
+
+	events = 0;
+
+	switch (info.type) {
+		case B_OBJECT_TYPE_FD:
+			if (set.fdCount == MAX_WAIT_WORDS)
+				return B_BAD_VALUE;
+			select_fd(set, info.object, info.events, events);
+			break;
+
+		case B_OBJECT_TYPE_SEMAPHORE:
+			error = select_wait_sem(set, info.object, ready);
+			if (error == B_OK && ready)
+				events |= B_EVENT_ACQUIRE_SEMAPHORE;
+			break;
+
+		case B_OBJECT_TYPE_PORT:
+		{
+			sem_id readSem;
+			sem_id writeSem;
+			if (get_port_sems(info.object, &readSem, &writeSem) != B_OK) {
+				events = B_EVENT_INVALID;
+				break;
+			}
+
+			if ((info.events & B_EVENT_READ) != 0) {
+				error = select_wait_sem(set, readSem, ready);
+				if (error == B_OK && ready)
+					events |= B_EVENT_READ;
+			}
+			if (error == B_OK && (info.events & B_EVENT_WRITE) != 0) {
+				error = select_wait_sem(set, writeSem, ready);
+				if (error == B_OK && ready)
+					events |= B_EVENT_WRITE;
+			}
+			break;
+		}
+
+		case B_OBJECT_TYPE_THREAD:
+			error = select_wait_thread(set, info.object, ready);
+			if (error == B_OK && ready)
+				events = B_EVENT_INVALID;
+			break;
+
+		default:
+			events = B_EVENT_INVALID;
+			break;
+	}
+
+	if (error == B_BAD_VALUE)
+		return error;
+	if (error != B_OK)
+		events = B_EVENT_INVALID;
+
+	events &= info.events | ALWAYS_REPORTED_EVENTS;
+	return B_OK;
+}
+
 
 ssize_t
 _kern_wait_for_objects(object_wait_info* infos, int numInfos, uint32 flags,
 	bigtime_t timeout)
 {
-	UNIMPLEMENTED();
-	return 0;
+	if (infos == NULL || numInfos <= 0 || numInfos > MAX_WAIT_WORDS)
+		return B_BAD_VALUE;
+
+	bigtime_t deadline = futex_deadline(flags, timeout);
+
+	uint16 wanted[numInfos];
+	for (int i = 0; i < numInfos; i++)
+		wanted[i] = infos[i].events;
+
+	wait_set set;
+	set.count = 0;
+
+	for (;;) {
+		ssize_t count = 0;
+		set.fdCount = 0;
+
+		for (int i = 0; i < numInfos; i++) {
+			object_wait_info info = infos[i];
+			info.events = wanted[i];
+
+			uint16 events;
+			if (select_object(set, info, events) != B_OK) {
+				deselect_all(set);
+				for (int j = 0; j < numInfos; j++)
+					infos[j].events = wanted[j];
+				return B_BAD_VALUE;
+			}
+
+			infos[i].events = events;
+			if (events != 0)
+				count++;
+		}
+
+		if (count > 0) {
+			deselect_all(set);
+			return count;
+		}
+
+		bigtime_t now = system_time();
+		if (deadline != B_INFINITE_TIMEOUT && deadline <= now) {
+			deselect_all(set);
+			return deadline == 0 ? B_WOULD_BLOCK : B_TIMED_OUT;
+		}
+
+		int error = wait_set_changed(set, deadline);
+
+		deselect_all(set);
+
+		if (error == EINTR && (flags & B_CAN_INTERRUPT) != 0) {
+			for (int i = 0; i < numInfos; i++)
+				infos[i].events = wanted[i];
+			return B_INTERRUPTED;
+		}
+	}
 }
@@ -38,22 +38,9 @@ fs_remove_index(dev_t device, const char *name)
 int
 fs_stat_index(dev_t device, const char *name, struct index_info *indexInfo)
 {
-	#if 0
-	struct stat stat;
-
-	status_t status = _kern_read_index_stat(device, name, &stat);
-	if (status == B_OK) {
-		indexInfo->type = stat.st_type;
-		indexInfo->size = stat.st_size;
-		indexInfo->modification_time = stat.st_mtime;
-		indexInfo->creation_time = stat.st_crtime;
-		indexInfo->uid = stat.st_uid;
-		indexInfo->gid = stat.st_gid;
-	}
+	status_t status = _kern_stat_index(device, name, indexInfo);
 
 	RETURN_AND_SET_ERRNO(status);
-	#endif
-	return 0;
 }
 
 
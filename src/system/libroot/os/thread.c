@@ -148,6 +148,20 @@ set_thread_priority(thread_id thread, int32 priority)
 }
 
 
+status_t
+get_thread_affinity(thread_id thread, void *mask, size_t maskSize)
+{
+	return _kern_get_thread_affinity(thread, mask, maskSize);
+}
+
+
+status_t
+set_thread_affinity(thread_id thread, const void *mask, size_t maskSize)
+{
+	return _kern_set_thread_affinity(thread, mask, maskSize);
+}
+
+
 void
 exit_thread(status_t status)
 {
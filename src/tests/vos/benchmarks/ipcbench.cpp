@@ -0,0 +1,838 @@
+/*
+ * Copyright 2019, Dario Casalinuovo. All rights reserved.
+ * Distributed under the terms of the MIT License.
+ */
+
+/*!	Benchmarks for the IPC primitives of the kernel layer: ports,
+	semaphores, object churn, port lookup, and the BMessage and
+	LinkSender paths built on top of them.
+
+	Results are printed as a table, and can be written as JSON with -j.
+	Given a baseline written by an earlier run with -b, every benchmark
+	is compared against it and the exit status is 1 if any of them got
+	slower than the threshold.
+*/
+
+
+#include <OS.h>
+#include <image.h>
+#include <Looper.h>
+#include <Message.h>
+#include <Messenger.h>
+#include <View.h>
+
+#include <LinkReceiver.h>
+#include <LinkSender.h>
+#include <MessagePrivate.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+
+using BPrivate::LinkReceiver;
+using BPrivate::LinkSender;
+
+
+static const size_t kPortMessageSizes[] = {
+	16, 256, 4096, 65536, 262144
+};
+static const int32 kManyToOneWriters = 4;
+static const int32 kFindPortCount = 2000;
+static const int32 kLinkBatchSizes[] = { 1, 32 };
+
+static const int32 kLinkMessageCode = 'lnkm';
+static const int32 kLinkSyncCode = 'lnks';
+static const uint32 kPingCommand = 'ping';
+static const uint32 kPongCommand = 'pong';
+
+extern char** environ;
+
+
+struct benchmark_result {
+	char		name[64];
+	int64		iterations;
+	double		ns_per_op;
+	double		mb_per_s;		// 0 if the benchmark moves no payload
+};
+
+
+static std::vector<benchmark_result> sResults;
+static double sScale = 1.0;
+static const char* sFilter = NULL;
+
+
+static int64
+scaled(int64 iterations)
+{
+	int64 count = (int64)(iterations * sScale);
+	return count > 0 ? count : 1;
+}
+
+
+static bool
+selected(const char* name)
+{
+	return sFilter == NULL || strstr(name, sFilter) != NULL;
+}
+
+
+static void
+add_result(const char* name, int64 iterations, nanotime_t elapsed,
+	size_t bytesPerOp = 0)
+{
+	benchmark_result result;
+	strlcpy(result.name, name, sizeof(result.name));
+	result.iterations = iterations;
+	result.ns_per_op = (double)elapsed / iterations;
+	result.mb_per_s = 0;
+	if (bytesPerOp > 0 && elapsed > 0) {
+		result.mb_per_s = (double)bytesPerOp * iterations
+			/ (1024.0 * 1024.0) / (elapsed / 1000000000.0);
+	}
+
+	sResults.push_back(result);
+
+	printf("%-32s %10" B_PRId64 " %14.1f", result.name, result.iterations,
+		result.ns_per_op);
+	if (result.mb_per_s > 0)
+		printf(" %12.1f", result.mb_per_s);
+	printf("\n");
+	fflush(stdout);
+}
+
+
+static void
+fatal(const char* what, status_t status)
+{
+	fprintf(stderr, "ipcbench: %s: %s\n", what, strerror(status));
+	exit(2);
+}
+
+
+//	#pragma mark - ports
+
+
+struct port_worker {
+	port_id		in;
+	port_id		out;
+	size_t		size;
+	int64		iterations;
+};
+
+
+static status_t
+port_echo_thread(void* _data)
+{
+	port_worker* worker = (port_worker*)_data;
+	void* buffer = malloc(worker->size);
+	int32 code;
+
+	for (int64 i = 0; i < worker->iterations; i++) {
+		ssize_t size = read_port(worker->in, &code, buffer, worker->size);
+		if (size < 0)
+			break;
+		write_port(worker->out, code, buffer, size);
+	}
+
+	free(buffer);
+	return B_OK;
+}
+
+
+static status_t
+port_writer_thread(void* _data)
+{
+	port_worker* worker = (port_worker*)_data;
+	void* buffer = calloc(1, worker->size);
+
+	for (int64 i = 0; i < worker->iterations; i++) {
+		if (write_port(worker->out, i, buffer, worker->size) != B_OK)
+			break;
+	}
+
+	free(buffer);
+	return B_OK;
+}
+
+
+static thread_id
+start_thread(thread_func function, const char* name, void* data)
+{
+	thread_id thread = spawn_thread(function, name, B_NORMAL_PRIORITY,
+		data);
+	if (thread < 0)
+		fatal("spawn_thread", thread);
+
+	resume_thread(thread);
+	return thread;
+}
+
+
+//!	One round trip per operation, the echo thread sends the message back.
+static void
+bench_port_latency(size_t size)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "port_latency/%zu", size);
+	if (!selected(name))
+		return;
+
+	int64 iterations = scaled(size > 4096 ? 2000 : 20000);
+	port_worker worker;
+	worker.in = create_port(1, "ipcbench ping");
+	worker.out = create_port(1, "ipcbench pong");
+	worker.size = size;
+	worker.iterations = iterations;
+	if (worker.in < 0 || worker.out < 0)
+		fatal("create_port", worker.in < 0 ? worker.in : worker.out);
+
+	thread_id thread = start_thread(port_echo_thread, "port echo", &worker);
+
+	void* buffer = calloc(1, size);
+	int32 code;
+
+	nanotime_t start = system_time_nsecs();
+	for (int64 i = 0; i < iterations; i++) {
+		write_port(worker.in, i, buffer, size);
+		read_port(worker.out, &code, buffer, size);
+	}
+	nanotime_t elapsed = system_time_nsecs() - start;
+
+	status_t result;
+	wait_for_thread(thread, &result);
+	delete_port(worker.in);
+	delete_port(worker.out);
+	free(buffer);
+
+	add_result(name, iterations, elapsed, size * 2);
+}
+
+
+//!	Streams messages from one or more writers into a single reader.
+static void
+bench_port_throughput(size_t size, int32 writers)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "port_%s/%zu",
+		writers == 1 ? "throughput" : "many_to_one", size);
+	if (!selected(name))
+		return;
+
+	int64 perWriter = scaled(size > 4096 ? 4000 : 100000) / writers;
+	if (perWriter == 0)
+		perWriter = 1;
+	int64 iterations = perWriter * writers;
+
+	port_id port = create_port(64, "ipcbench stream");
+	if (port < 0)
+		fatal("create_port", port);
+
+	std::vector<port_worker> workers(writers);
+	std::vector<thread_id> threads(writers);
+	void* buffer = malloc(size);
+	int32 code;
+
+	nanotime_t start = system_time_nsecs();
+	for (int32 i = 0; i < writers; i++) {
+		workers[i].in = -1;
+		workers[i].out = port;
+		workers[i].size = size;
+		workers[i].iterations = perWriter;
+		threads[i] = start_thread(port_writer_thread, "port writer",
+			&workers[i]);
+	}
+
+	for (int64 i = 0; i < iterations; i++)
+		read_port(port, &code, buffer, size);
+	nanotime_t elapsed = system_time_nsecs() - start;
+
+	for (int32 i = 0; i < writers; i++) {
+		status_t result;
+		wait_for_thread(threads[i], &result);
+	}
+	delete_port(port);
+	free(buffer);
+
+	add_result(name, iterations, elapsed, size);
+}
+
+
+//!	Looks up names among thousands of ports.
+static void
+bench_find_port()
+{
+	char name[64];
+	snprintf(name, sizeof(name), "find_port/%" B_PRId32, kFindPortCount);
+	if (!selected(name))
+		return;
+
+	std::vector<port_id> ports;
+	for (int32 i = 0; i < kFindPortCount; i++) {
+		char portName[B_OS_NAME_LENGTH];
+		snprintf(portName, sizeof(portName), "ipcbench find %" B_PRId32, i);
+		port_id port = create_port(1, portName);
+		if (port < 0)
+			break;
+		ports.push_back(port);
+	}
+	if (ports.empty())
+		fatal("create_port", B_NO_MORE_PORTS);
+
+	int64 iterations = scaled(200000);
+	uint32 random = 12345;
+
+	nanotime_t start = system_time_nsecs();
+	for (int64 i = 0; i < iterations; i++) {
+		char portName[B_OS_NAME_LENGTH];
+		random = random * 1103515245 + 12345;
+		snprintf(portName, sizeof(portName), "ipcbench find %" B_PRIu32,
+			(random >> 8) % (uint32)ports.size());
+		if (find_port(portName) < 0)
+			fatal("find_port", B_NAME_NOT_FOUND);
+	}
+	nanotime_t elapsed = system_time_nsecs() - start;
+
+	for (size_t i = 0; i < ports.size(); i++)
+		delete_port(ports[i]);
+
+	add_result(name, iterations, elapsed);
+}
+
+
+//	#pragma mark - semaphores
+
+
+struct sem_pair {
+	sem_id		ping;
+	sem_id		pong;
+	int64		iterations;
+};
+
+
+static status_t
+sem_pong_thread(void* _data)
+{
+	sem_pair* pair = (sem_pair*)_data;
+
+	for (int64 i = 0; i < pair->iterations; i++) {
+		if (acquire_sem(pair->ping) != B_OK)
+			break;
+		release_sem(pair->pong);
+	}
+	return B_OK;
+}
+
+
+//!	The other side of bench_sem_pingpong_teams(), in a loaded team.
+static int
+sem_pong_team(int argc, char** argv)
+{
+	if (argc < 5)
+		return 1;
+
+	sem_pair pair;
+	pair.ping = atol(argv[2]);
+	pair.pong = atol(argv[3]);
+	pair.iterations = atoll(argv[4]);
+	sem_pong_thread(&pair);
+	return 0;
+}
+
+
+static void
+sem_pingpong(const char* name, sem_pair& pair)
+{
+	nanotime_t start = system_time_nsecs();
+	for (int64 i = 0; i < pair.iterations; i++) {
+		release_sem(pair.ping);
+		acquire_sem(pair.pong);
+	}
+	nanotime_t elapsed = system_time_nsecs() - start;
+
+	add_result(name, pair.iterations, elapsed);
+}
+
+
+static void
+bench_sem_pingpong_threads()
+{
+	const char* name = "sem_pingpong/threads";
+	if (!selected(name))
+		return;
+
+	sem_pair pair;
+	pair.ping = create_sem(0, "ipcbench ping");
+	pair.pong = create_sem(0, "ipcbench pong");
+	pair.iterations = scaled(50000);
+
+	thread_id thread = start_thread(sem_pong_thread, "sem pong", &pair);
+	sem_pingpong(name, pair);
+
+	status_t result;
+	wait_for_thread(thread, &result);
+	delete_sem(pair.ping);
+	delete_sem(pair.pong);
+}
+
+
+static void
+bench_sem_pingpong_teams()
+{
+	const char* name = "sem_pingpong/teams";
+	if (!selected(name))
+		return;
+
+	image_info info;
+	int32 cookie = 0;
+	while (get_next_image_info(B_CURRENT_TEAM, &cookie, &info) == B_OK) {
+		if (info.type == B_APP_IMAGE)
+			break;
+	}
+	if (info.type != B_APP_IMAGE)
+		fatal("get_next_image_info", B_ENTRY_NOT_FOUND);
+
+	sem_pair pair;
+	pair.ping = create_sem(0, "ipcbench ping");
+	pair.pong = create_sem(0, "ipcbench pong");
+	pair.iterations = scaled(50000);
+
+	char ping[16], pong[16], iterations[24];
+	snprintf(ping, sizeof(ping), "%" B_PRId32, pair.ping);
+	snprintf(pong, sizeof(pong), "%" B_PRId32, pair.pong);
+	snprintf(iterations, sizeof(iterations), "%" B_PRId64, pair.iterations);
+	const char* args[] = { info.name, "--sem-pong", ping, pong, iterations,
+		NULL };
+
+	thread_id team = load_image(5, args, (const char**)environ);
+	if (team < 0)
+		fatal("load_image", team);
+	resume_thread(team);
+
+	sem_pingpong(name, pair);
+
+	status_t result;
+	wait_for_thread(team, &result);
+	delete_sem(pair.ping);
+	delete_sem(pair.pong);
+}
+
+
+//	#pragma mark - object churn
+
+
+static status_t
+empty_thread(void*)
+{
+	return B_OK;
+}
+
+
+static void
+bench_churn()
+{
+	if (selected("churn/port")) {
+		int64 iterations = scaled(20000);
+		nanotime_t start = system_time_nsecs();
+		for (int64 i = 0; i < iterations; i++) {
+			port_id port = create_port(16, "ipcbench churn");
+			if (port < 0)
+				fatal("create_port", port);
+			delete_port(port);
+		}
+		add_result("churn/port", iterations, system_time_nsecs() - start);
+	}
+
+	if (selected("churn/sem")) {
+		int64 iterations = scaled(100000);
+		nanotime_t start = system_time_nsecs();
+		for (int64 i = 0; i < iterations; i++) {
+			sem_id sem = create_sem(0, "ipcbench churn");
+			if (sem < 0)
+				fatal("create_sem", sem);
+			delete_sem(sem);
+		}
+		add_result("churn/sem", iterations, system_time_nsecs() - start);
+	}
+
+	if (selected("churn/thread")) {
+		int64 iterations = scaled(5000);
+		nanotime_t start = system_time_nsecs();
+		for (int64 i = 0; i < iterations; i++) {
+			status_t result;
+			wait_for_thread(start_thread(empty_thread, "ipcbench churn",
+				NULL), &result);
+		}
+		add_result("churn/thread", iterations, system_time_nsecs() - start);
+	}
+}
+
+
+//	#pragma mark - app kit
+
+
+class EchoLooper : public BLooper {
+public:
+	EchoLooper()
+		:
+		BLooper("ipcbench echo")
+	{
+	}
+
+	virtual void MessageReceived(BMessage* message)
+	{
+		if (message->what != kPingCommand) {
+			BLooper::MessageReceived(message);
+			return;
+		}
+
+		BMessage reply(kPongCommand);
+		message->SendReply(&reply);
+	}
+};
+
+
+static void
+bench_message_roundtrip(size_t payload)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "bmessage_roundtrip/%zu", payload);
+	if (!selected(name))
+		return;
+
+	EchoLooper* looper = new EchoLooper();
+	looper->Run();
+
+	BMessenger messenger(looper);
+	BMessage message(kPingCommand);
+	if (payload > 0) {
+		void* data = calloc(1, payload);
+		message.AddData("data", B_RAW_TYPE, data, payload);
+		free(data);
+	}
+
+	int64 iterations = scaled(20000);
+	nanotime_t start = system_time_nsecs();
+	for (int64 i = 0; i < iterations; i++) {
+		BMessage reply;
+		status_t status = messenger.SendMessage(&message, &reply);
+		if (status != B_OK)
+			fatal("SendMessage", status);
+	}
+	nanotime_t elapsed = system_time_nsecs() - start;
+
+	if (looper->Lock())
+		looper->Quit();
+
+	add_result(name, iterations, elapsed, payload);
+}
+
+
+/*!	Builds, copies and deletes messages shaped like a B_MOUSE_MOVED, and
+	reports how many of them still needed the allocator.
+*/
+static void
+bench_message_build()
+{
+	const char* name = "bmessage_build";
+	if (!selected(name))
+		return;
+
+	message_allocation_stats before;
+	BPrivate::get_message_allocation_stats(&before);
+
+	int64 iterations = scaled(200000);
+	nanotime_t start = system_time_nsecs();
+	for (int64 i = 0; i < iterations; i++) {
+		BMessage* message = new BMessage(B_MOUSE_MOVED);
+		message->AddInt64("when", i);
+		message->AddPoint("where", BPoint(i, i));
+		message->AddInt32("buttons", 0);
+		message->AddInt32("modifiers", 0);
+		message->AddInt32("be:transit", B_INSIDE_VIEW);
+		message->AddPoint("be:view_where", BPoint(i, i));
+		message->AddInt32("_view_token", 1);
+
+		BMessage copy(*message);
+		if (copy.GetInt32("_view_token", -1) != 1)
+			fatal("FindInt32", B_ERROR);
+		delete message;
+	}
+	nanotime_t elapsed = system_time_nsecs() - start;
+
+	message_allocation_stats after;
+	BPrivate::get_message_allocation_stats(&after);
+
+	add_result(name, iterations, elapsed);
+
+	int64 allocations = after.objects_allocated - before.objects_allocated
+		+ after.blocks_allocated - before.blocks_allocated
+		+ after.heap_allocations - before.heap_allocations;
+	printf("%-32s %10.3f allocations/op\n", "",
+		(double)allocations / iterations);
+}
+
+
+struct link_worker {
+	port_id		port;
+	sem_id		done;
+};
+
+
+static status_t
+link_reader_thread(void* _data)
+{
+	link_worker* worker = (link_worker*)_data;
+	LinkReceiver receiver(worker->port);
+	int32 code;
+
+	while (receiver.GetNextMessage(code) == B_OK) {
+		if (code == kLinkSyncCode)
+			release_sem(worker->done);
+		else if (code != kLinkMessageCode)
+			break;
+	}
+	return B_OK;
+}
+
+
+/*!	Sends small messages through a LinkSender, flushing every batchSize
+	messages. An operation is a single message.
+*/
+static void
+bench_link_flush(int32 batchSize)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "link_flush/batch_%" B_PRId32, batchSize);
+	if (!selected(name))
+		return;
+
+	link_worker worker;
+	worker.port = create_port(64, "ipcbench link");
+	worker.done = create_sem(0, "ipcbench link done");
+	thread_id thread = start_thread(link_reader_thread, "link reader",
+		&worker);
+
+	LinkSender sender(worker.port);
+	int64 batches = scaled(batchSize == 1 ? 50000 : 5000);
+	int64 iterations = batches * batchSize;
+	int32 data[4] = {};
+
+	nanotime_t start = system_time_nsecs();
+	for (int64 i = 0; i < batches; i++) {
+		for (int32 j = 0; j < batchSize; j++) {
+			sender.StartMessage(kLinkMessageCode);
+			sender.Attach(data, sizeof(data));
+		}
+		sender.Flush();
+	}
+	sender.StartMessage(kLinkSyncCode);
+	sender.Flush();
+	acquire_sem(worker.done);
+	nanotime_t elapsed = system_time_nsecs() - start;
+
+	delete_port(worker.port);
+	status_t result;
+	wait_for_thread(thread, &result);
+	delete_sem(worker.done);
+
+	add_result(name, iterations, elapsed, sizeof(data));
+}
+
+
+//	#pragma mark - results
+
+
+static status_t
+write_results(const char* path)
+{
+	FILE* file = fopen(path, "w");
+	if (file == NULL)
+		return errno;
+
+	// one benchmark per line, read_baseline() depends on it
+	fprintf(file, "{\n\t\"benchmarks\": [\n");
+	for (size_t i = 0; i < sResults.size(); i++) {
+		const benchmark_result& result = sResults[i];
+		fprintf(file, "\t\t{\"name\": \"%s\", \"iterations\": %" B_PRId64
+			", \"ns_per_op\": %.1f, \"mb_per_s\": %.1f}%s\n", result.name,
+			result.iterations, result.ns_per_op, result.mb_per_s,
+			i + 1 < sResults.size() ? "," : "");
+	}
+	fprintf(file, "\t]\n}\n");
+
+	status_t status = ferror(file) ? B_IO_ERROR : B_OK;
+	fclose(file);
+	return status;
+}
+
+
+static status_t
+read_baseline(const char* path, std::vector<benchmark_result>& baseline)
+{
+	FILE* file = fopen(path, "r");
+	if (file == NULL)
+		return errno;
+
+	char line[512];
+	while (fgets(line, sizeof(line), file) != NULL) {
+		const char* name = strstr(line, "\"name\": \"");
+		const char* nsPerOp = strstr(line, "\"ns_per_op\": ");
+		if (name == NULL || nsPerOp == NULL)
+			continue;
+
+		benchmark_result result = {};
+		name += strlen("\"name\": \"");
+		const char* end = strchr(name, '"');
+		if (end == NULL || end - name >= (ssize_t)sizeof(result.name))
+			continue;
+
+		memcpy(result.name, name, end - name);
+		result.ns_per_op = strtod(nsPerOp + strlen("\"ns_per_op\": "),
+			NULL);
+		baseline.push_back(result);
+	}
+
+	fclose(file);
+	return B_OK;
+}
+
+
+//!	Returns the number of benchmarks that are slower than the threshold.
+static int32
+compare_with_baseline(const std::vector<benchmark_result>& baseline,
+	double threshold)
+{
+	int32 regressions = 0;
+
+	printf("\n%-32s %14s %14s %9s\n", "benchmark", "baseline ns",
+		"current ns", "change");
+
+	for (size_t i = 0; i < sResults.size(); i++) {
+		const benchmark_result& result = sResults[i];
+		const benchmark_result* old = NULL;
+		for (size_t j = 0; j < baseline.size(); j++) {
+			if (strcmp(baseline[j].name, result.name) == 0) {
+				old = &baseline[j];
+				break;
+			}
+		}
+
+		if (old == NULL || old->ns_per_op <= 0) {
+			printf("%-32s %14s %14.1f %9s\n", result.name, "-",
+				result.ns_per_op, "new");
+			continue;
+		}
+
+		double change = (result.ns_per_op - old->ns_per_op)
+			/ old->ns_per_op * 100;
+		bool regressed = change > threshold;
+		if (regressed)
+			regressions++;
+
+		printf("%-32s %14.1f %14.1f %+8.1f%%%s\n", result.name,
+			old->ns_per_op, result.ns_per_op, change,
+			regressed ? "  REGRESSION" : "");
+	}
+
+	return regressions;
+}
+
+
+static void
+usage(const char* program)
+{
+	fprintf(stderr, "usage: %s [-f <filter>] [-s <scale>] [-j <results>] "
+		"[-b <baseline>] [-t <percent>]\n"
+		"  -f  only run benchmarks whose name contains <filter>\n"
+		"  -s  multiply the iteration counts by <scale> (default 1)\n"
+		"  -j  write the results as JSON to <results>\n"
+		"  -b  compare against a JSON file written by an earlier run\n"
+		"  -t  slowdown in percent counted as a regression (default 10)\n",
+		program);
+}
+
+
+int
+main(int argc, char** argv)
+{
+	if (argc > 1 && strcmp(argv[1], "--sem-pong") == 0)
+		return sem_pong_team(argc, argv);
+
+	const char* resultsPath = NULL;
+	const char* baselinePath = NULL;
+	double threshold = 10;
+	int option;
+
+	while ((option = getopt(argc, argv, "f:s:j:b:t:h")) != -1) {
+		switch (option) {
+			case 'f':
+				sFilter = optarg;
+				break;
+			case 's':
+				sScale = atof(optarg);
+				break;
+			case 'j':
+				resultsPath = optarg;
+				break;
+			case 'b':
+				baselinePath = optarg;
+				break;
+			case 't':
+				threshold = atof(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return option == 'h' ? 0 : 2;
+		}
+	}
+
+	if (sScale <= 0 || threshold < 0) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	std::vector<benchmark_result> baseline;
+	if (baselinePath != NULL) {
+		status_t status = read_baseline(baselinePath, baseline);
+		if (status != B_OK)
+			fatal(baselinePath, status);
+	}
+
+	printf("%-32s %10s %14s %12s\n", "benchmark", "iterations", "ns/op",
+		"MB/s");
+
+	for (size_t i = 0; i < B_COUNT_OF(kPortMessageSizes); i++)
+		bench_port_latency(kPortMessageSizes[i]);
+	for (size_t i = 0; i < B_COUNT_OF(kPortMessageSizes); i++)
+		bench_port_throughput(kPortMessageSizes[i], 1);
+	for (size_t i = 0; i < B_COUNT_OF(kPortMessageSizes); i++)
+		bench_port_throughput(kPortMessageSizes[i], kManyToOneWriters);
+
+	bench_sem_pingpong_threads();
+	bench_sem_pingpong_teams();
+	bench_churn();
+	bench_find_port();
+
+	bench_message_build();
+	bench_message_roundtrip(0);
+	bench_message_roundtrip(4096);
+	for (size_t i = 0; i < B_COUNT_OF(kLinkBatchSizes); i++)
+		bench_link_flush(kLinkBatchSizes[i]);
+
+	if (resultsPath != NULL) {
+		status_t status = write_results(resultsPath);
+		if (status != B_OK)
+			fatal(resultsPath, status);
+	}
+
+	if (baselinePath != NULL)
+		return compare_with_baseline(baseline, threshold) > 0 ? 1 : 0;
+
+	return 0;
+}
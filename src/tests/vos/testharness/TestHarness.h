@@ -0,0 +1,43 @@
+#ifndef _TEST_HARNESS_H
+#define _TEST_HARNESS_H
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include <SupportDefs.h>
+
+
+// The checks of a test print one "name (pass/FAIL): what" line each, and
+// the test returns test_result() from main(). TEST_NAME must be defined
+// before this header is included.
+
+static bool sTestPassed = true;
+
+
+static void check(bool passed, const char* format, ...) _PRINTFLIKE(2, 3);
+
+
+static void
+check(bool passed, const char* format, ...)
+{
+	printf(TEST_NAME " (%s): ", passed ? "pass" : "FAIL");
+
+	va_list args;
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+
+	printf("\n");
+	if (!passed)
+		sTestPassed = false;
+}
+
+
+static inline int
+test_result()
+{
+	return sTestPassed ? 0 : 1;
+}
+
+
+#endif	// _TEST_HARNESS_H
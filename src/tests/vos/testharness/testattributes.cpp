@@ -0,0 +1,145 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <OS.h>
+#include <TypeConstants.h>
+#include <fs_attr.h>
+
+#include <syscalls.h>
+#include <vfs_defs.h>
+
+
+#define TEST_NAME	"testattributes"
+#include "TestHarness.h"
+
+
+static bool
+has_attribute(int fd, const char* name, uint32 type, off_t size)
+{
+	attr_info info;
+	return fs_stat_attr(fd, name, &info) == 0 && info.type == type
+		&& info.size == size;
+}
+
+
+//! Returns the record of \a name in the _kern_read_attrs() buffer.
+static const attr_record*
+find_record(const char* buffer, ssize_t size, const char* name)
+{
+	for (ssize_t offset = 0; offset < size;) {
+		const attr_record* record = (const attr_record*)(buffer + offset);
+		if (strcmp(record->name, name) == 0)
+			return record;
+		offset += record->record_size;
+	}
+	return NULL;
+}
+
+
+static void
+position_test(int fd)
+{
+	int32 number = 1234;
+	fs_write_attr(fd, "number", B_INT32_TYPE, 0, &number, sizeof(number));
+	check(has_attribute(fd, "number", B_INT32_TYPE, sizeof(number)),
+		"typed attribute");
+
+	const char* text = "hello world";
+	fs_write_attr(fd, "text", B_STRING_TYPE, 0, text, strlen(text) + 1);
+
+	// writes at a position patch the value
+	ssize_t written = fs_write_attr(fd, "text", B_STRING_TYPE, 6, "WORLD", 5);
+	char buffer[64];
+	memset(buffer, 0, sizeof(buffer));
+	ssize_t bytes = fs_read_attr(fd, "text", B_STRING_TYPE, 0, buffer,
+		sizeof(buffer));
+	check(written == 5 && bytes == 12 && strcmp(buffer, "hello WORLD") == 0,
+		"write at a position");
+
+	memset(buffer, 0, sizeof(buffer));
+	bytes = fs_read_attr(fd, "text", B_STRING_TYPE, 6, buffer, 5);
+	check(bytes == 5 && memcmp(buffer, "WORLD", 5) == 0,
+		"read at a position");
+
+	// past the end, the gap is filled with zeros
+	fs_write_attr(fd, "text", B_STRING_TYPE, 14, "XY", 2);
+	memset(buffer, '.', sizeof(buffer));
+	bytes = fs_read_attr(fd, "text", B_STRING_TYPE, 0, buffer,
+		sizeof(buffer));
+	check(bytes == 16 && buffer[12] == '\0' && buffer[13] == '\0'
+		&& memcmp(buffer + 14, "XY", 2) == 0, "write past the end");
+
+	bytes = fs_read_attr(fd, "text", B_STRING_TYPE, 100, buffer, 4);
+	check(bytes == 0, "read past the end");
+
+	// writing at 0 replaces the value, like on BeOS
+	fs_write_attr(fd, "text", B_STRING_TYPE, 0, "new", 4);
+	check(has_attribute(fd, "text", B_STRING_TYPE, 4),
+		"write at 0 replaces the value");
+
+	check(fs_remove_attr(fd, "text") == 0
+		&& fs_read_attr(fd, "text", B_STRING_TYPE, 0, buffer, 4) < 0,
+		"removed attribute");
+}
+
+
+static void
+bulk_test(int fd, const char* path)
+{
+	int32 number = 5678;
+	fs_write_attr(fd, "number", B_INT32_TYPE, 0, &number, sizeof(number));
+	fs_write_attr(fd, "name", B_STRING_TYPE, 0, "bulk", 5);
+
+	// a buffer too small only gets the size needed
+	char small[8];
+	ssize_t size = _kern_read_attrs(-1, path, true, small, sizeof(small));
+	check(size > (ssize_t)sizeof(small), "bulk read size");
+
+	char* buffer = (char*)malloc(size);
+	ssize_t read = _kern_read_attrs(-1, path, true, buffer, size);
+
+	const attr_record* numberRecord = find_record(buffer, read, "number");
+	const attr_record* nameRecord = find_record(buffer, read, "name");
+	check(read == size && numberRecord != NULL
+		&& numberRecord->type == B_INT32_TYPE
+		&& numberRecord->size == sizeof(number)
+		&& memcmp(attr_record_data(numberRecord), &number,
+			sizeof(number)) == 0, "bulk read of a typed attribute");
+	check(nameRecord != NULL && nameRecord->type == B_STRING_TYPE
+		&& strcmp((const char*)attr_record_data(nameRecord), "bulk") == 0,
+		"bulk read of a string attribute");
+
+	// the cached records must follow changes
+	fs_write_attr(fd, "name", B_STRING_TYPE, 0, "changed", 8);
+	size = _kern_read_attrs(-1, path, true, NULL, 0);
+	buffer = (char*)realloc(buffer, size);
+	read = _kern_read_attrs(-1, path, true, buffer, size);
+	nameRecord = find_record(buffer, read, "name");
+	check(nameRecord != NULL
+		&& strcmp((const char*)attr_record_data(nameRecord), "changed") == 0,
+		"bulk read after a change");
+
+	free(buffer);
+}
+
+
+int main()
+{
+	char path[] = "/tmp/testattributesXXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		check(false, "can't create %s", path);
+		return test_result();
+	}
+
+	position_test(fd);
+	bulk_test(fd, path);
+
+	close(fd);
+	unlink(path);
+
+	return test_result();
+}
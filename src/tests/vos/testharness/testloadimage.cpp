@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <OS.h>
+#include <image.h>
+
+
+#define TEST_NAME	"testloadimage"
+#include "TestHarness.h"
+
+
+#define CHILD_EXIT_STATUS	42
+
+
+//! The loaded team leaves a mark, to show it ran.
+static int
+run_child(const char* mark)
+{
+	FILE* file = fopen(mark, "w");
+	if (file == NULL)
+		return 1;
+	fclose(file);
+	return CHILD_EXIT_STATUS;
+}
+
+
+static thread_id
+load_child(const char* program, const char* mark)
+{
+	unlink(mark);
+
+	const char* arguments[] = { program, "--child", mark, NULL };
+	return load_image(3, arguments, (const char**)environ);
+}
+
+
+static bool
+ran(const char* mark)
+{
+	return access(mark, F_OK) == 0;
+}
+
+
+int main(int argc, char** argv)
+{
+	if (argc == 3 && strcmp(argv[1], "--child") == 0)
+		return run_child(argv[2]);
+
+	char mark[] = "/tmp/testloadimageXXXXXX";
+	int fd = mkstemp(mark);
+	if (fd < 0) {
+		check(false, "can't create %s", mark);
+		return test_result();
+	}
+	close(fd);
+
+	// the team waits for resume_thread()
+	thread_id team = load_child(argv[0], mark);
+	check(team > 0, "load_image");
+	snooze(200000);
+	check(!ran(mark), "not running before resume_thread");
+
+	status_t returnCode = B_ERROR;
+	check(resume_thread(team) == B_OK, "resume_thread");
+	check(wait_for_thread(team, &returnCode) == B_OK
+		&& returnCode == CHILD_EXIT_STATUS && ran(mark),
+		"ran after resume_thread");
+
+	// waiting for it lets it run as well
+	team = load_child(argv[0], mark);
+	check(wait_for_thread(team, &returnCode) == B_OK
+		&& returnCode == CHILD_EXIT_STATUS && ran(mark),
+		"ran when waited for");
+
+	// killed before it could run
+	team = load_child(argv[0], mark);
+	check(kill_thread(team) == B_OK, "kill_thread");
+	check(wait_for_thread(team, &returnCode) == B_OK
+		&& returnCode != CHILD_EXIT_STATUS && !ran(mark),
+		"never ran after kill_thread");
+	check(resume_thread(team) != B_OK, "resume_thread after kill_thread");
+
+	const char* missing[] = { "/nonexistent/testloadimage", NULL };
+	check(load_image(1, missing, (const char**)environ) == B_ENTRY_NOT_FOUND,
+		"load_image of a missing program");
+
+	unlink(mark);
+
+	return test_result();
+}
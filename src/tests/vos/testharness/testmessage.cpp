@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <Message.h>
+#include <OS.h>
+
+
+#define TEST_NAME	"testmessage"
+#include "TestHarness.h"
+
+
+// more fields and data than fit into the block a message starts with
+#define GROWN_FIELDS	40
+#define LARGE_DATA_SIZE	4096
+
+
+static void
+fill_data(char* data, char seed)
+{
+	for (int32 i = 0; i < LARGE_DATA_SIZE; i++)
+		data[i] = (char)(seed + i);
+}
+
+
+static void
+build_small(BMessage& message)
+{
+	message.AddInt32("buttons", 1);
+	message.AddPoint("where", BPoint(10, 20));
+	message.AddString("name", "small");
+}
+
+
+static bool
+is_small(const BMessage& message)
+{
+	return message.what == 'smal'
+		&& message.GetInt32("buttons", 0) == 1
+		&& message.GetPoint("where", BPoint()) == BPoint(10, 20)
+		&& strcmp(message.GetString("name", ""), "small") == 0;
+}
+
+
+//! Grows a small message past its block, with many fields and large data.
+static void
+grow(BMessage& message)
+{
+	for (int32 i = 0; i < GROWN_FIELDS; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "field %" B_PRId32, i);
+		message.AddInt32(name, i);
+	}
+
+	char data[LARGE_DATA_SIZE];
+	fill_data(data, 'a');
+	message.AddData("large", B_RAW_TYPE, data, sizeof(data));
+	message.AddString("name", "grown");
+}
+
+
+static bool
+is_grown(const BMessage& message)
+{
+	if (message.GetInt32("buttons", 0) != 1
+		|| message.GetPoint("where", BPoint()) != BPoint(10, 20)) {
+		return false;
+	}
+
+	for (int32 i = 0; i < GROWN_FIELDS; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "field %" B_PRId32, i);
+		if (message.GetInt32(name, -1) != i)
+			return false;
+	}
+
+	char data[LARGE_DATA_SIZE];
+	fill_data(data, 'a');
+	const void* found;
+	ssize_t size;
+	if (message.FindData("large", B_RAW_TYPE, &found, &size) != B_OK
+		|| size != (ssize_t)sizeof(data) || memcmp(found, data, size) != 0) {
+		return false;
+	}
+
+	const char* name;
+	return message.FindString("name", 0, &name) == B_OK
+		&& strcmp(name, "small") == 0
+		&& message.FindString("name", 1, &name) == B_OK
+		&& strcmp(name, "grown") == 0;
+}
+
+
+int main()
+{
+	BMessage message('smal');
+	build_small(message);
+	check(is_small(message), "small message");
+
+	BMessage smallCopy(message);
+	check(is_small(smallCopy), "copy of the small message");
+
+	grow(message);
+	check(is_grown(message), "message grown past its block");
+	check(is_small(smallCopy), "small copy untouched by the growth");
+
+	// the copies must not share storage with the original
+	BMessage grownCopy(message);
+	BMessage assigned;
+	assigned = message;
+	check(is_grown(grownCopy), "copy of the grown message");
+	check(is_grown(assigned), "assignment of the grown message");
+
+	message.ReplaceInt32("field 0", 100);
+	message.RemoveName("large");
+	check(is_grown(grownCopy) && is_grown(assigned),
+		"copies untouched by changes to the original");
+
+	// a copy that grows on its own
+	grow(smallCopy);
+	check(is_grown(smallCopy), "small copy grown on its own");
+
+	ssize_t size = grownCopy.FlattenedSize();
+	char* buffer = new char[size];
+	BMessage unflattened;
+	check(grownCopy.Flatten(buffer, size) == B_OK
+		&& unflattened.Unflatten(buffer) == B_OK
+		&& is_grown(unflattened), "flattened and unflattened");
+	delete[] buffer;
+
+	// emptied messages start over in their block
+	grownCopy.MakeEmpty();
+	grownCopy.what = 'smal';
+	build_small(grownCopy);
+	check(is_small(grownCopy) && grownCopy.CountNames(B_ANY_TYPE) == 3,
+		"emptied and refilled");
+
+	// recycled messages must come back clean
+	bool clean = true;
+	for (int32 i = 0; i < 100 && clean; i++) {
+		BMessage* recycled = new BMessage('smal');
+		clean = recycled->IsEmpty();
+		build_small(*recycled);
+		if (i % 2 == 0)
+			grow(*recycled);
+		clean = clean && (i % 2 == 0 ? is_grown(*recycled)
+			: is_small(*recycled));
+		delete recycled;
+	}
+	check(clean, "recycled messages");
+
+	return test_result();
+}
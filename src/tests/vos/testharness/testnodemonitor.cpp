@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include <Directory.h>
+#include <Entry.h>
+#include <File.h>
+#include <List.h>
+#include <Looper.h>
+#include <NodeMonitor.h>
+#include <OS.h>
+
+
+#define TEST_NAME		"testnodemonitor"
+#include "TestHarness.h"
+
+
+// more than the fd limit set below, in case a watch holds an fd
+#define WATCHED_FILES	300
+#define FD_LIMIT		128
+
+
+class Listener : public BLooper {
+public:
+	Listener()
+		:
+		BLooper("listener"),
+		fReceived(create_sem(0, "node monitor messages"))
+	{
+	}
+
+	~Listener()
+	{
+		delete_sem(fReceived);
+		for (int32 i = 0; i < fMessages.CountItems(); i++)
+			delete (BMessage*)fMessages.ItemAt(i);
+	}
+
+	virtual void MessageReceived(BMessage* message)
+	{
+		if (message->what != B_NODE_MONITOR) {
+			BLooper::MessageReceived(message);
+			return;
+		}
+
+		fMessages.AddItem(new BMessage(*message));
+		release_sem(fReceived);
+	}
+
+	//! Waits for the given opcode, dropping the other messages on the way.
+	bool WaitFor(int32 opcode, const char* name = NULL)
+	{
+		while (acquire_sem_etc(fReceived, 1, B_RELATIVE_TIMEOUT, 1000000)
+				== B_OK) {
+			Lock();
+			BMessage* message = (BMessage*)fMessages.RemoveItem((int32)0);
+			Unlock();
+
+			bool found = message->GetInt32("opcode", -1) == opcode
+				&& (name == NULL
+					|| strcmp(message->GetString("name", ""), name) == 0);
+			delete message;
+			if (found)
+				return true;
+		}
+		return false;
+	}
+
+private:
+	sem_id			fReceived;
+	BList			fMessages;
+};
+
+
+int main()
+{
+	char path[] = "/tmp/testnodemonitorXXXXXX";
+	if (mkdtemp(path) == NULL) {
+		check(false, "can't create %s", path);
+		return test_result();
+	}
+
+	Listener* listener = new Listener;
+	listener->Run();
+
+	BDirectory directory(path);
+	node_ref directoryRef;
+	directory.GetNodeRef(&directoryRef);
+	check(watch_node(&directoryRef, B_WATCH_DIRECTORY, listener) == B_OK,
+		"watch the directory");
+
+	BFile file;
+	directory.CreateFile("a", &file);
+	check(listener->WaitFor(B_ENTRY_CREATED, "a"), "entry created");
+
+	node_ref fileRef;
+	file.GetNodeRef(&fileRef);
+	check(watch_node(&fileRef, B_WATCH_STAT | B_WATCH_NAME, listener)
+		== B_OK, "watch the file");
+
+	file.Write("data", 4);
+	file.Unset();
+	check(listener->WaitFor(B_STAT_CHANGED), "stat changed");
+
+	BEntry entry(&directory, "a");
+	entry.Rename("b");
+	check(listener->WaitFor(B_ENTRY_MOVED, "b"), "entry moved");
+
+	// quick changes to the same name, likely with the same node, all count
+	BFile again;
+	directory.CreateFile("c", &again);
+	again.Unset();
+	BEntry(&directory, "c").Remove();
+	directory.CreateFile("c", &again);
+	again.Unset();
+	check(listener->WaitFor(B_ENTRY_CREATED, "c")
+		&& listener->WaitFor(B_ENTRY_REMOVED, "c")
+		&& listener->WaitFor(B_ENTRY_CREATED, "c"), "entry created again");
+
+	// the watches must not use up the fds of the team
+	struct rlimit limit;
+	getrlimit(RLIMIT_NOFILE, &limit);
+	struct rlimit lowered = limit;
+	lowered.rlim_cur = FD_LIMIT;
+	setrlimit(RLIMIT_NOFILE, &lowered);
+
+	int32 watched = 0;
+	for (int32 i = 0; i < WATCHED_FILES; i++) {
+		char name[B_FILE_NAME_LENGTH];
+		snprintf(name, sizeof(name), "file%" B_PRId32, i);
+
+		BFile other;
+		node_ref ref;
+		if (directory.CreateFile(name, &other) == B_OK
+			&& other.GetNodeRef(&ref) == B_OK
+			&& watch_node(&ref, B_WATCH_STAT, listener) == B_OK) {
+			watched++;
+		}
+	}
+	check(watched == WATCHED_FILES, "watched %" B_PRId32 " of %d files",
+		watched, WATCHED_FILES);
+
+	file.SetTo(&entry, B_READ_ONLY);
+	check(file.InitCheck() == B_OK, "open a file after the watches");
+	file.Unset();
+
+	setrlimit(RLIMIT_NOFILE, &limit);
+
+	entry.Remove();
+	check(listener->WaitFor(B_ENTRY_REMOVED, "b"), "entry removed");
+
+	stop_watching(listener);
+
+	directory.Rewind();
+	BEntry child;
+	while (directory.GetNextEntry(&child) == B_OK)
+		child.Remove();
+	BEntry(path).Remove();
+
+	listener->Lock();
+	listener->Quit();
+
+	return test_result();
+}
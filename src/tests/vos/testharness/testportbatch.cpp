@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <Looper.h>
+#include <Message.h>
+#include <Messenger.h>
+#include <OS.h>
+
+#include <MessagePrivate.h>
+#include <MessengerPrivate.h>
+#include <port_defs.h>
+#include <syscalls.h>
+
+
+#define TEST_NAME	"testportbatch"
+#include "TestHarness.h"
+
+
+//! Checks the record at \a offset, and returns the offset of the next one.
+static size_t
+check_record(const uint8* buffer, size_t offset, int32 code, const char* data)
+{
+	const port_message_record* record
+		= (const port_message_record*)(buffer + offset);
+	size_t size = strlen(data) + 1;
+
+	check(record->code == code && record->size == size
+		&& memcmp(record + 1, data, size) == 0,
+		"record of message %" B_PRId32, code);
+
+	return offset + PORT_MESSAGE_RECORD_SIZE(size);
+}
+
+
+static void
+batch_test()
+{
+	static const char* kData[] = { "one", "twelve bytes", "3" };
+
+	port_id port = create_port(8, "batch test");
+	for (int32 i = 0; i < 3; i++)
+		write_port(port, i + 1, kData[i], strlen(kData[i]) + 1);
+
+	uint8 buffer[256];
+
+	// the buffer ends one byte short of the second record
+	size_t bufferSize = PORT_MESSAGE_RECORD_SIZE(strlen(kData[0]) + 1)
+		+ PORT_MESSAGE_RECORD_SIZE(strlen(kData[1]) + 1) - 1;
+	ssize_t count = _kern_read_port_batch(port, buffer, bufferSize,
+		B_RELATIVE_TIMEOUT, 0);
+	check(count == 1, "short batch read returned %ld", (long)count);
+	check_record(buffer, 0, 1, kData[0]);
+
+	// exactly the two remaining records
+	bufferSize = PORT_MESSAGE_RECORD_SIZE(strlen(kData[1]) + 1)
+		+ PORT_MESSAGE_RECORD_SIZE(strlen(kData[2]) + 1);
+	count = _kern_read_port_batch(port, buffer, bufferSize,
+		B_RELATIVE_TIMEOUT, 0);
+	check(count == 2, "exact batch read returned %ld", (long)count);
+	size_t offset = check_record(buffer, 0, 2, kData[1]);
+	check_record(buffer, offset, 3, kData[2]);
+
+	check(port_count(port) == 0, "port drained");
+
+	// a message larger than the buffer stays queued for read_port()
+	char large[128];
+	memset(large, 'x', sizeof(large));
+	write_port(port, 4, large, sizeof(large));
+
+	count = _kern_read_port_batch(port, buffer, 64, B_RELATIVE_TIMEOUT, 0);
+	check(count == B_BUFFER_OVERFLOW, "batch read of a large message");
+
+	int32 code;
+	char received[sizeof(large)];
+	ssize_t size = read_port_etc(port, &code, received, sizeof(received),
+		B_RELATIVE_TIMEOUT, 0);
+	check(size == (ssize_t)sizeof(large) && code == 4
+		&& memcmp(received, large, sizeof(large)) == 0,
+		"read_port() after the overflow");
+
+	delete_port(port);
+}
+
+
+enum {
+	kBlockLooper	= 'blck',
+	kDone			= 'done'
+};
+
+
+class MouseLooper : public BLooper {
+public:
+	MouseLooper()
+		:
+		BLooper("mouse looper"),
+		fBlock(create_sem(0, "block")),
+		fDone(create_sem(0, "done")),
+		fCount(0)
+	{
+	}
+
+	~MouseLooper()
+	{
+		delete_sem(fBlock);
+		delete_sem(fDone);
+	}
+
+	virtual void MessageReceived(BMessage* message)
+	{
+		switch (message->what) {
+			case kBlockLooper:
+				acquire_sem(fBlock);
+				break;
+			case B_MOUSE_MOVED:
+				if (fCount < 8)
+					fReceived[fCount++] = message->GetInt32("index", -1);
+				break;
+			case kDone:
+				release_sem(fDone);
+				break;
+			default:
+				BLooper::MessageReceived(message);
+				break;
+		}
+	}
+
+	void Unblock()
+	{
+		release_sem(fBlock);
+	}
+
+	bool WaitDone()
+	{
+		return acquire_sem_etc(fDone, 1, B_RELATIVE_TIMEOUT, 1000000)
+			== B_OK;
+	}
+
+	int32 Count() const
+	{
+		return fCount;
+	}
+
+	int32 Received(int32 index) const
+	{
+		return fReceived[index];
+	}
+
+private:
+	sem_id			fBlock;
+	sem_id			fDone;
+	int32			fCount;
+	int32			fReceived[8];
+};
+
+
+/*!	Local messages skip the port and go straight into the looper queue.
+	Sent as if from another team, they go through the port, where the
+	looper coalesces them.
+*/
+static void
+send_through_port(BMessenger& target, BMessage& message)
+{
+	BMessenger::Private messenger(target);
+	BMessenger replyTo;
+	BMessage::Private(message).SendMessage(messenger.Port(), -1,
+		messenger.Token(), B_INFINITE_TIMEOUT, false, replyTo);
+}
+
+
+static void
+coalescing_test()
+{
+	MouseLooper* looper = new MouseLooper;
+	looper->Run();
+
+	// keep the looper busy, so that the moves queue up in its port
+	looper->PostMessage(kBlockLooper);
+	snooze(50000);
+
+	// the moves only coalesce while the buttons stay the same
+	BMessenger target(looper);
+	for (int32 i = 0; i < 8; i++) {
+		BMessage moved(B_MOUSE_MOVED);
+		moved.AddInt32("buttons", i < 5 ? 0 : 1);
+		moved.AddInt32("index", i);
+		send_through_port(target, moved);
+	}
+	BMessage done(kDone);
+	send_through_port(target, done);
+	looper->Unblock();
+
+	check(looper->WaitDone(), "looper done");
+
+	check(looper->Count() == 2 && looper->Received(0) == 4
+		&& looper->Received(1) == 7, "received %" B_PRId32 " mouse moves",
+		looper->Count());
+
+	looper->Lock();
+	looper->Quit();
+}
+
+
+int main()
+{
+	batch_test();
+	coalescing_test();
+
+	return test_result();
+}
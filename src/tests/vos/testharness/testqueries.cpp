@@ -0,0 +1,222 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <AppDefs.h>
+#include <Message.h>
+#include <NodeMonitor.h>
+#include <OS.h>
+#include <TypeConstants.h>
+#include <fs_attr.h>
+#include <fs_index.h>
+#include <fs_query.h>
+
+#include <syscalls.h>
+
+
+#define TEST_NAME	"testqueries"
+#include "TestHarness.h"
+
+
+#define INDEX_NAME	"testqueries:value"
+
+
+static char sDirectory[] = "/tmp/testqueriesXXXXXX";
+static ino_t sDirectoryNode;
+
+
+static void
+create_file(const char* name, int32 value)
+{
+	char path[B_PATH_NAME_LENGTH];
+	snprintf(path, sizeof(path), "%s/%s", sDirectory, name);
+
+	int fd = open(path, O_CREAT | O_WRONLY, 0644);
+	fs_write_attr(fd, INDEX_NAME, B_INT32_TYPE, 0, &value, sizeof(value));
+	close(fd);
+}
+
+
+static void
+set_value(const char* name, int32 value)
+{
+	char path[B_PATH_NAME_LENGTH];
+	snprintf(path, sizeof(path), "%s/%s", sDirectory, name);
+
+	int fd = open(path, O_WRONLY);
+	fs_write_attr(fd, INDEX_NAME, B_INT32_TYPE, 0, &value, sizeof(value));
+	close(fd);
+}
+
+
+/*!	Returns the names the query found in our directory, sorted and separated
+	by spaces. The parent node of an entry is passed in d_off.
+*/
+static void
+run_query(dev_t device, const char* query, char* result, size_t size)
+{
+	result[0] = '\0';
+
+	int fd = _kern_open_query(device, query, strlen(query), 0, -1, -1);
+	if (fd < 0) {
+		snprintf(result, size, "error %" B_PRId32, (int32)fd);
+		return;
+	}
+
+	char names[8][B_FILE_NAME_LENGTH];
+	int32 count = 0;
+
+	char buffer[4096];
+	ssize_t entries;
+	while ((entries = _kern_read_dir(fd, (struct dirent*)buffer,
+			sizeof(buffer), 32)) > 0) {
+		struct dirent* entry = (struct dirent*)buffer;
+		for (ssize_t i = 0; i < entries; i++) {
+			if ((ino_t)entry->d_off == sDirectoryNode && count < 8)
+				strlcpy(names[count++], entry->d_name, B_FILE_NAME_LENGTH);
+			entry = (struct dirent*)((char*)entry + entry->d_reclen);
+		}
+	}
+	_kern_close(fd);
+
+	qsort(names, count, B_FILE_NAME_LENGTH,
+		(int (*)(const void*, const void*))strcmp);
+	for (int32 i = 0; i < count; i++) {
+		if (i > 0)
+			strlcat(result, " ", size);
+		strlcat(result, names[i], size);
+	}
+}
+
+
+static void
+check_query(dev_t device, const char* query, const char* expected)
+{
+	char result[256];
+	run_query(device, query, result, sizeof(result));
+
+	check(strcmp(result, expected) == 0, "%s found \"%s\"", query, result);
+}
+
+
+static bool
+index_listed(dev_t device)
+{
+	int fd = _kern_open_index_dir(device);
+	if (fd < 0)
+		return false;
+
+	bool found = false;
+	char buffer[4096];
+	ssize_t entries;
+	while (!found && (entries = _kern_read_dir(fd, (struct dirent*)buffer,
+			sizeof(buffer), 32)) > 0) {
+		struct dirent* entry = (struct dirent*)buffer;
+		for (ssize_t i = 0; i < entries && !found; i++) {
+			found = strcmp(entry->d_name, INDEX_NAME) == 0;
+			entry = (struct dirent*)((char*)entry + entry->d_reclen);
+		}
+	}
+	_kern_close(fd);
+	return found;
+}
+
+
+static void
+live_query_test(dev_t device)
+{
+	port_id port = create_port(16, "live query");
+	const char* query = INDEX_NAME ">100";
+	int fd = _kern_open_query(device, query, strlen(query), B_LIVE_QUERY,
+		port, 1);
+	check(fd >= 0, "open a live query");
+
+	create_file("live", 200);
+
+	char buffer[1024];
+	int32 code;
+	ssize_t size = read_port_etc(port, &code, buffer, sizeof(buffer),
+		B_RELATIVE_TIMEOUT, 1000000);
+	BMessage update;
+	check(size > 0 && update.Unflatten(buffer) == B_OK
+		&& update.what == B_QUERY_UPDATE
+		&& update.GetInt32("opcode", -1) == B_ENTRY_CREATED
+		&& strcmp(update.GetString("name", ""), "live") == 0,
+		"live query update for a new match");
+
+	_kern_close(fd);
+	delete_port(port);
+}
+
+
+int main()
+{
+	if (mkdtemp(sDirectory) == NULL) {
+		check(false, "can't create %s", sDirectory);
+		return test_result();
+	}
+
+	struct stat st;
+	stat(sDirectory, &st);
+	dev_t device = st.st_dev;
+	sDirectoryNode = st.st_ino;
+
+	fs_remove_index(device, INDEX_NAME);
+		// left over from a failed run
+
+	// the index gets the attributes that were there before it
+	create_file("old", 20);
+	check(fs_create_index(device, INDEX_NAME, B_INT32_TYPE, 0) == 0,
+		"create index");
+	check(fs_create_index(device, INDEX_NAME, B_INT32_TYPE, 0) != 0,
+		"create the index again");
+
+	index_info info;
+	check(fs_stat_index(device, INDEX_NAME, &info) == 0
+		&& info.type == B_INT32_TYPE, "stat index");
+	check(index_listed(device), "index directory");
+
+	create_file("a", 1);
+	create_file("b", 5);
+	create_file("c", 10);
+
+	check_query(device, INDEX_NAME ">3", "b c old");
+	check_query(device, INDEX_NAME "==1", "a");
+	check_query(device, "(" INDEX_NAME ">=5)&&(name==\"c*\")", "c");
+
+	// the index follows changes, renames and removals
+	set_value("a", 7);
+	check_query(device, INDEX_NAME ">3", "a b c old");
+
+	char from[B_PATH_NAME_LENGTH];
+	char to[B_PATH_NAME_LENGTH];
+	snprintf(from, sizeof(from), "%s/b", sDirectory);
+	snprintf(to, sizeof(to), "%s/d", sDirectory);
+	_kern_rename(-1, from, -1, to);
+	snprintf(from, sizeof(from), "%s/c", sDirectory);
+	_kern_unlink(-1, from);
+	check_query(device, INDEX_NAME ">3", "a d old");
+
+	// the name index only knows some of the files
+	const char* query = "name==\"a\"";
+	check(_kern_open_query(device, query, strlen(query), 0, -1, -1) < 0,
+		"name query without B_QUERY_NON_INDEXED");
+
+	live_query_test(device);
+
+	check(fs_remove_index(device, INDEX_NAME) == 0
+		&& fs_stat_index(device, INDEX_NAME, &info) != 0, "remove index");
+
+	const char* names[] = { "a", "d", "live", "old" };
+	for (int32 i = 0; i < 4; i++) {
+		snprintf(from, sizeof(from), "%s/%s", sDirectory, names[i]);
+		_kern_unlink(-1, from);
+	}
+	rmdir(sDirectory);
+
+	return test_result();
+}
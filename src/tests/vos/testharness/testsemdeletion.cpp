@@ -1,7 +1,37 @@
+#include <stdio.h>
+
 #include <OS.h>
 
+
+static status_t sWaiterStatus = B_OK;
+
+
+static int32
+waiter_thread(void* data)
+{
+	sWaiterStatus = acquire_sem(*(sem_id*)data);
+	return 0;
+}
+
+
 int main()
 {
 	sem_id sem = create_sem(0,  "sem");
 	delete_sem(sem);
+
+	// delete_sem() must wake up the waiters with B_BAD_SEM_ID
+	sem = create_sem(0, "sem");
+	thread_id thread = spawn_thread(waiter_thread, "waiter",
+		B_NORMAL_PRIORITY, &sem);
+	resume_thread(thread);
+
+	snooze(100000);
+	delete_sem(sem);
+
+	status_t status;
+	wait_for_thread(thread, &status);
+	bool passed = sWaiterStatus == B_BAD_SEM_ID;
+	printf("testsemdeletion (%s): waiter returned %" B_PRId32 "\n",
+		passed ? "pass" : "FAIL", sWaiterStatus);
+	return passed ? 0 : 1;
 }